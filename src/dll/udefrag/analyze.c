@@ -148,6 +148,9 @@ static int get_volume_information(udefrag_job_parameters *jp)
     /* reset file lists */
     destroy_lists(jp);
     
+    /* the global heap gets used if the arena cannot be created */
+    jp->arena = winx_arena_create();
+    
     /* update global variables holding drive geometry */
     if(winx_get_volume_information(jp->volume_letter,&jp->v_info) < 0)
         return (-1);
@@ -225,7 +228,7 @@ static int get_free_space_layout(udefrag_job_parameters *jp)
 
     jp->free_regions = winx_get_free_volume_regions(jp->volume_letter,
         0,jp->v_info.total_clusters,WINX_GVR_ALLOW_PARTIAL_SCAN,
-        process_free_region,(void *)jp);
+        process_free_region,(void *)jp,jp->arena);
     if(jp->free_regions == NULL) return (-1);
     
     winx_bytes_to_hr(jp->v_info.free_bytes,1,buffer,sizeof(buffer));
@@ -359,10 +362,10 @@ int exclude_by_size(winx_file_info *f,udefrag_job_parameters *jp)
 {
     ULONGLONG filesize;
     
-    f->user_defined_flags &= ~UD_FILE_OVER_LIMIT;
+    clear_file_flags(f,UD_FILE_OVER_LIMIT,jp);
     filesize = f->disp.clusters * jp->v_info.bytes_per_cluster;
     if(filesize > jp->udo.size_limit){
-        f->user_defined_flags |= UD_FILE_OVER_LIMIT;
+        set_file_flags(f,UD_FILE_OVER_LIMIT,jp);
         return 1;
     }
     return 0;
@@ -374,22 +377,424 @@ int exclude_by_size(winx_file_info *f,udefrag_job_parameters *jp)
  */
 int exclude_by_path(winx_file_info *f,udefrag_job_parameters *jp)
 {
+    wchar_t *path = get_file_path(f,0,jp);
+    
     /* note that paths have the \??\ internal prefix while patterns haven't */
-    if(wcslen(f->path) < 0x4)
+    if(path == NULL || wcslen(path) < 0x4)
         return 1; /* the path is invalid */
     
     if(jp->udo.ex_filter.count){
-        if(winx_patcmp(f->path + 0x4,&jp->udo.ex_filter))
+        if(winx_patcmp(path + 0x4,&jp->udo.ex_filter))
             return 1;
     }
     
     if(jp->udo.cut_filter.count){
-        if(!winx_patcmp(f->path + 0x4,&jp->udo.cut_filter))
+        if(!winx_patcmp(path + 0x4,&jp->udo.cut_filter))
             return 1;
     }
 
     if(jp->udo.in_filter.count == 0) return 0;
-    return !winx_patcmp(f->path + 0x4,&jp->udo.in_filter);
+    return !winx_patcmp(path + 0x4,&jp->udo.in_filter);
+}
+
+/**
+ * @internal
+ * @brief Applies filters not depending on paths.
+ * @details Gets called by the progress callback,
+ * so on NTFS files get filtered while the MFT is
+ * being parsed, before their paths are built.
+ * @return Nonzero value indicates that
+ * the file must be excluded.
+ */
+static int exclude_by_disposition(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    /* skip resident streams and files with invalid map */
+    if(f->disp.fragments == 0 || f->disp.blockmap == NULL)
+        return 1;
+
+    /* skip temporary files */
+    if(is_temporary(f))
+        return 1;
+
+    /* filter files by their sizes, number of fragments and fragment sizes */
+    if(exclude_by_size(f,jp))
+        return 1;
+    if(exclude_by_fragments(f,jp))
+        return 1;
+    return exclude_by_fragment_size(f,jp);
+}
+
+/************************************************************/
+/*                    Analysis pipeline                     */
+/************************************************************/
+
+/*
+* Files accepted by the filter get passed
+* to the indexing and colorizing stages
+* running in separate threads, so both
+* work while the scanner keeps reading
+* the disk. Files travel in batches
+* through a queue of a fixed length.
+*/
+#define PIPELINE_BATCH_SIZE 1024
+#define PIPELINE_DEPTH      16
+
+/* the stages */
+#define INDEXING_STAGE      0
+#define COLORIZING_STAGE    1
+#define PIPELINE_STAGES     2
+
+/* initial capacity of the array of file blocks */
+#define INITIAL_BLOCKS_COUNT 0x10000
+
+/* a batch of files passed between the stages */
+typedef struct _file_batch {
+    winx_file_info *files[PIPELINE_BATCH_SIZE];
+    int count;                              /* number of files in the batch */
+    int eof;                                /* nonzero value indicates the last batch */
+    HANDLE hFullEvent[PIPELINE_STAGES];     /* signaled when the batch is ready for the stage */
+    HANDLE hEmptyEvent[PIPELINE_STAGES];    /* signaled when the stage is done with the batch */
+} file_batch;
+
+/* a thread executing a stage */
+typedef struct _analysis_stage {
+    struct _analysis_pipeline *pipeline;    /* the pipeline */
+    int id;                                 /* one of the xxx_STAGE constants */
+    ULONGLONG stall;                        /* time spent waiting for files, in milliseconds */
+    HANDLE hDoneEvent;                      /* signaled when the thread terminates */
+} analysis_stage;
+
+typedef struct _analysis_pipeline {
+    udefrag_job_parameters *jp;             /* job parameters */
+    file_batch *batches;                    /* queue of batches */
+    int current;                            /* the batch being filled by the scanner */
+    int n_stages;                           /* number of stages running */
+    analysis_stage stages[PIPELINE_STAGES]; /* the stages */
+    ULONGLONG scan_stall;                   /* time spent by the scanner waiting for the stages, in milliseconds */
+    winx_bpt_entry *blocks;                 /* file blocks collected by the indexing stage */
+    ULONGLONG n_blocks;                     /* number of collected blocks */
+    ULONGLONG max_blocks;                   /* capacity of the array of blocks */
+    int index_failed;                       /* nonzero value indicates that the tree of blocks must be built again */
+} analysis_pipeline;
+
+/**
+ * @internal
+ * @brief Adds blocks of a file
+ * to the array of file blocks.
+ */
+static void collect_file_blocks(analysis_pipeline *p,winx_file_info *f)
+{
+    winx_bpt_entry *blocks;
+    winx_blockmap *block;
+    ULONGLONG n;
+    
+    for(block = f->disp.blockmap; block; block = block->next){
+        if(p->n_blocks == p->max_blocks){
+            n = p->max_blocks ? p->max_blocks * 2 : INITIAL_BLOCKS_COUNT;
+            blocks = winx_tmalloc((size_t)n * sizeof(winx_bpt_entry));
+            if(blocks == NULL){
+                etrace("cannot allocate %I64u bytes of memory",
+                    n * sizeof(winx_bpt_entry));
+                winx_free(p->blocks);
+                p->blocks = NULL;
+                p->index_failed = 1;
+                return;
+            }
+            if(p->n_blocks) memcpy(blocks,p->blocks,(size_t)p->n_blocks * sizeof(winx_bpt_entry));
+            winx_free(p->blocks);
+            p->blocks = blocks;
+            p->max_blocks = n;
+        }
+        p->blocks[p->n_blocks].key = block->lcn;
+        p->blocks[p->n_blocks].item = block;
+        p->blocks[p->n_blocks].context = f;
+        p->blocks[p->n_blocks].marked = is_surely_unmovable(f) ? 0 : 1;
+        p->n_blocks ++;
+        if(block->next == f->disp.blockmap) break;
+    }
+}
+
+/**
+ * @internal
+ * @brief Counts fragments of a file
+ * and collects its blocks.
+ */
+static void index_file(analysis_pipeline *p,winx_file_info *f)
+{
+    udefrag_job_parameters *jp = p->jp;
+    
+    /* skip excluded files */
+    if(!is_fragmented(f) || is_excluded(f)){
+        jp->pi.fragments ++;
+    } else {
+        jp->pi.fragmented ++;
+        jp->pi.fragments += f->disp.fragments;
+    }
+    
+    if(jp->file_blocks && !p->index_failed)
+        collect_file_blocks(p,f);
+}
+
+/**
+ * @internal
+ * @brief Fills the tree of file blocks
+ * once all the files are indexed.
+ */
+static void finish_indexing(analysis_pipeline *p)
+{
+    udefrag_job_parameters *jp = p->jp;
+    
+    if(jp->file_blocks == NULL || p->index_failed)
+        goto done;
+    
+    if(winx_bpt_build(jp->file_blocks,p->blocks,p->n_blocks) < 0){
+        p->index_failed = 1;
+    } else if(jp->file_blocks->count != p->n_blocks){
+        /*
+        * winx_bpt_build keeps the first of duplicated
+        * blocks, but blocks were collected in the order
+        * the scanner called the filter, which may differ
+        * from the order of the list. Rebuilding the tree
+        * from the list keeps the same blocks as a serial
+        * pass does.
+        */
+        itrace("%I64u duplicates found, the tree will be built from the list",
+            p->n_blocks - jp->file_blocks->count);
+        p->index_failed = 1;
+    }
+    
+done:
+    winx_free(p->blocks);
+    p->blocks = NULL;
+}
+
+/**
+ * @internal
+ * @brief Executes a stage of the pipeline.
+ * @note The colorizing stage may set flags
+ * of files when it detects $Mft; those
+ * are never checked by the indexing stage.
+ */
+static DWORD WINAPI analysis_stage_thread(LPVOID p)
+{
+    analysis_stage *s = (analysis_stage *)p;
+    analysis_pipeline *pipeline = s->pipeline;
+    file_batch *b;
+    ULONGLONG time;
+    int i = 0, j, eof;
+    
+    while(1){
+        b = &pipeline->batches[i];
+        time = winx_xtime();
+        (void)NtWaitForSingleObject(b->hFullEvent[s->id],FALSE,NULL);
+        s->stall += winx_xtime() - time;
+        for(j = 0; j < b->count; j++){
+            if(s->id == INDEXING_STAGE)
+                index_file(pipeline,b->files[j]);
+            else
+                colorize_file(pipeline->jp,b->files[j],SYSTEM_SPACE);
+        }
+        eof = b->eof;
+        (void)NtSetEvent(b->hEmptyEvent[s->id],NULL);
+        if(eof) break;
+        i = (i + 1) % PIPELINE_DEPTH;
+    }
+    
+    if(s->id == INDEXING_STAGE)
+        finish_indexing(pipeline);
+    
+    (void)NtSetEvent(s->hDoneEvent,NULL);
+    winx_exit_thread(0);
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Closes events of the pipeline.
+ */
+static void close_pipeline_events(analysis_pipeline *p)
+{
+    file_batch *b;
+    int i, j;
+    
+    for(i = 0; i < PIPELINE_DEPTH; i++){
+        b = &p->batches[i];
+        for(j = 0; j < PIPELINE_STAGES; j++){
+            if(b->hFullEvent[j]) NtClose(b->hFullEvent[j]);
+            if(b->hEmptyEvent[j]) NtClose(b->hEmptyEvent[j]);
+            b->hFullEvent[j] = b->hEmptyEvent[j] = NULL;
+        }
+    }
+    for(j = 0; j < PIPELINE_STAGES; j++){
+        if(p->stages[j].hDoneEvent) NtClose(p->stages[j].hDoneEvent);
+        p->stages[j].hDoneEvent = NULL;
+    }
+}
+
+/**
+ * @internal
+ * @brief Releases resources allocated
+ * by start_analysis_pipeline.
+ */
+static void destroy_analysis_pipeline(analysis_pipeline *p)
+{
+    close_pipeline_events(p);
+    winx_free(p->blocks);
+    winx_free(p->batches);
+    winx_free(p);
+}
+
+/**
+ * @internal
+ * @brief Starts threads executing
+ * stages of the analysis pipeline.
+ * @details The colorizing stage gets skipped
+ * when cells of the map are smaller than
+ * clusters, because the last file drawn
+ * wins there, so files must be drawn in
+ * the order of the list.
+ * @return The pipeline, NULL indicates
+ * that files must be processed once
+ * the scan completes.
+ */
+static analysis_pipeline *start_analysis_pipeline(udefrag_job_parameters *jp)
+{
+    analysis_pipeline *p;
+    NTSTATUS status;
+    int i, j, n_stages;
+    
+    p = winx_tmalloc(sizeof(analysis_pipeline));
+    if(p == NULL){
+        mtrace();
+        return NULL;
+    }
+    memset(p,0,sizeof(analysis_pipeline));
+    p->jp = jp;
+    p->batches = winx_tmalloc(PIPELINE_DEPTH * sizeof(file_batch));
+    if(p->batches == NULL){
+        mtrace();
+        winx_free(p);
+        return NULL;
+    }
+    memset(p->batches,0,PIPELINE_DEPTH * sizeof(file_batch));
+    
+    n_stages = jp->cluster_map.opposite_order ? 1 : PIPELINE_STAGES;
+    for(i = 0; i < PIPELINE_DEPTH; i++){
+        for(j = 0; j < n_stages; j++){
+            /* all the batches are empty, the first one is being filled already */
+            status = NtCreateEvent(&p->batches[i].hEmptyEvent[j],
+                STANDARD_RIGHTS_ALL | 0x1ff,NULL,SynchronizationEvent,i ? TRUE : FALSE);
+            if(!NT_SUCCESS(status)){
+                p->batches[i].hEmptyEvent[j] = NULL;
+                goto fail;
+            }
+            status = NtCreateEvent(&p->batches[i].hFullEvent[j],
+                STANDARD_RIGHTS_ALL | 0x1ff,NULL,SynchronizationEvent,FALSE);
+            if(!NT_SUCCESS(status)){
+                p->batches[i].hFullEvent[j] = NULL;
+                goto fail;
+            }
+        }
+    }
+    for(j = 0; j < n_stages; j++){
+        status = NtCreateEvent(&p->stages[j].hDoneEvent,
+            STANDARD_RIGHTS_ALL | 0x1ff,NULL,NotificationEvent,FALSE);
+        if(!NT_SUCCESS(status)){
+            p->stages[j].hDoneEvent = NULL;
+            goto fail;
+        }
+    }
+    
+    /* the indexing stage goes first, so colorizing may be done later if needed */
+    for(j = 0; j < n_stages; j++){
+        p->stages[j].pipeline = p;
+        p->stages[j].id = j;
+        if(winx_create_thread(analysis_stage_thread,(PVOID)&p->stages[j]) < 0)
+            break;
+        p->n_stages ++;
+    }
+    if(p->n_stages == 0){
+        destroy_analysis_pipeline(p);
+        return NULL;
+    }
+    return p;
+    
+fail:
+    strace(status,"cannot create event");
+    destroy_analysis_pipeline(p);
+    return NULL;
+}
+
+/**
+ * @internal
+ * @brief Passes the batch being filled
+ * to the stages and waits for the next one.
+ * @param[in] eof nonzero value indicates
+ * that no more files will be passed.
+ */
+static void submit_batch(analysis_pipeline *p,int eof)
+{
+    file_batch *b = &p->batches[p->current];
+    ULONGLONG time;
+    int i;
+    
+    b->eof = eof;
+    for(i = 0; i < p->n_stages; i++)
+        (void)NtSetEvent(b->hFullEvent[i],NULL);
+    if(eof) return;
+    
+    p->current = (p->current + 1) % PIPELINE_DEPTH;
+    b = &p->batches[p->current];
+    time = winx_xtime();
+    for(i = 0; i < p->n_stages; i++)
+        (void)NtWaitForSingleObject(b->hEmptyEvent[i],FALSE,NULL);
+    p->scan_stall += winx_xtime() - time;
+    b->count = 0;
+}
+
+/**
+ * @internal
+ * @brief Passes a file accepted
+ * by the filter to the pipeline.
+ * @note Files the scanner removes from
+ * the list once the scan completes, i.e.
+ * resident streams and streams having no
+ * path, never get there.
+ */
+static void pass_file_to_pipeline(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    analysis_pipeline *p = jp->pipeline;
+    file_batch *b = &p->batches[p->current];
+    
+    if(f->disp.fragments == 0) return;
+    if(f->parent == NULL && (f->path == NULL || f->path[0] == 0)) return;
+    
+    b->files[b->count] = f;
+    b->count ++;
+    if(b->count == PIPELINE_BATCH_SIZE)
+        submit_batch(p,0);
+}
+
+/**
+ * @internal
+ * @brief Waits for the stages
+ * to process all the files.
+ */
+static void stop_analysis_pipeline(analysis_pipeline *p)
+{
+    int i;
+    
+    submit_batch(p,1);
+    for(i = 0; i < p->n_stages; i++)
+        (void)NtWaitForSingleObject(p->stages[i].hDoneEvent,FALSE,NULL);
+    
+    itrace("the scanner waited for the analysis stages for %I64u ms",p->scan_stall);
+    itrace("the indexing stage waited for files for %I64u ms",
+        p->stages[INDEXING_STAGE].stall);
+    if(p->n_stages > COLORIZING_STAGE){
+        itrace("the colorizing stage waited for files for %I64u ms",
+            p->stages[COLORIZING_STAGE].stall);
+    }
 }
 
 /**
@@ -400,24 +805,43 @@ int exclude_by_path(winx_file_info *f,udefrag_job_parameters *jp)
 static int filter(winx_file_info *f,void *user_defined_data)
 {
     udefrag_job_parameters *jp = (udefrag_job_parameters *)user_defined_data;
+    wchar_t *path;
     int length;
     
     /* START OF AUX CODE */
     
+    /*
+    * On NTFS, files excluded by the progress callback
+    * need no paths, except of the root directory losing
+    * its trailing dot below and files counted by the
+    * context menu handler. Children of files aren't
+    * enumerated by the NTFS scanner, so there is
+    * nothing to skip.
+    */
+    if(jp->fs_type == FS_NTFS && is_excluded(f) \
+      && !(jp->udo.job_flags & UD_JOB_CONTEXT_MENU_HANDLER)){
+        if(f->name == NULL || f->name[0] != '.' || f->name[1] != 0)
+            goto skip_file;
+    }
+    
     /* skip entries with empty path, as well as their children */
-    if(f->path == NULL) goto skip_file_and_children;
-    if(f->path[0] == 0) goto skip_file_and_children;
+    path = get_file_path(f,0,jp);
+    if(path == NULL) goto skip_file_and_children;
+    if(path[0] == 0) goto skip_file_and_children;
     
     /*
     * Remove trailing dot from the root
     * directory path, otherwise we'll not
     * be able to defragment it.
     */
-    length = (int)wcslen(f->path);
+    length = (int)wcslen(path);
     if(length >= 2){
-        if(f->path[length - 1] == '.' && f->path[length - 2] == '\\'){
+        if(path[length - 1] == '.' && path[length - 2] == '\\'){
             itrace("root directory detected, its trailing dot will be removed");
-            f->path[length - 1] = 0;
+            /* keep the path of the root directory in f->path */
+            path = winx_file_path(f);
+            if(path == NULL) goto skip_file_and_children;
+            path[length - 1] = 0;
         }
     }
     
@@ -427,14 +851,14 @@ static int filter(winx_file_info *f,void *user_defined_data)
     
     /* show debugging information about interesting cases */
     if(is_sparse(f))
-        dtrace("sparse file found: %ws",f->path);
+        dtrace("sparse file found: %ws",path);
     if(is_reparse_point(f))
-        dtrace("reparse point found: %ws",f->path);
+        dtrace("reparse point found: %ws",path);
     /* comment it out after testing to speed things up */
-    /*if(winx_wcsistr(f->path,L"$BITMAP"))
-        dtrace("bitmap found: %ws",f->path);
-    if(winx_wcsistr(f->path,L"$ATTRIBUTE_LIST"))
-        dtrace("attribute list found: %ws",f->path);
+    /*if(winx_wcsistr(path,L"$BITMAP"))
+        dtrace("bitmap found: %ws",path);
+    if(winx_wcsistr(path,L"$ATTRIBUTE_LIST"))
+        dtrace("attribute list found: %ws",path);
     */
     
     /* START OF FILTERING */
@@ -443,20 +867,8 @@ static int filter(winx_file_info *f,void *user_defined_data)
     if(f->disp.blockmap == NULL)
         goto skip_file;
 
-    /* skip temporary files */
-    if(is_temporary(f))
-        goto skip_file;
-
-    /* filter files by their sizes */
-    if(exclude_by_size(f,jp))
-        goto skip_file;
-
-    /* filter files by their number of fragments */
-    if(exclude_by_fragments(f,jp))
-        goto skip_file;
-
-    /* filter files by their fragment sizes */
-    if(exclude_by_fragment_size(f,jp))
+    /* skip files excluded by the progress callback */
+    if(is_excluded(f))
         goto skip_file;
     
     /* filter files by their paths */
@@ -471,22 +883,25 @@ static int filter(winx_file_info *f,void *user_defined_data)
     goto accept_file;
 
 skip_file:
-    f->user_defined_flags |= UD_FILE_EXCLUDED;
+    set_file_flags(f,UD_FILE_EXCLUDED,jp);
     
 accept_file:
     /* count everything in the context menu handler to avoid ambiguity */
     if(jp->udo.job_flags & UD_JOB_CONTEXT_MENU_HANDLER){
         if(jp->udo.cut_filter.count){
-            if(winx_patcmp(f->path + 0x4,&jp->udo.cut_filter))
+            path = get_file_path(f,0,jp);
+            if(path && winx_patcmp(path + 0x4,&jp->udo.cut_filter))
                 update_progress_counters(f,jp);
         } else {
             update_progress_counters(f,jp);
         }
     }
+    if(jp->pipeline) pass_file_to_pipeline(f,jp);
     return 0;
 
 skip_file_and_children:
-    f->user_defined_flags |= UD_FILE_EXCLUDED;
+    set_file_flags(f,UD_FILE_EXCLUDED,jp);
+    if(jp->pipeline) pass_file_to_pipeline(f,jp);
     return 1;
 }
 
@@ -495,36 +910,48 @@ skip_file_and_children:
  */
 static void update_progress_counters(winx_file_info *f,udefrag_job_parameters *jp)
 {
-    ULONGLONG filesize;
-
     jp->pi.files ++;
     if(is_directory(f)) jp->pi.directories ++;
     if(is_compressed(f)) jp->pi.compressed ++;
     jp->pi.processed_clusters += f->disp.clusters;
 
-    filesize = f->disp.clusters * jp->v_info.bytes_per_cluster;
-    if(filesize >= GIANT_FILE_SIZE)
+    switch(get_size_class(f->disp.clusters,jp)){
+    case GIANT_FILE:
         jp->f_counters.giant_files ++;
-    else if(filesize >= HUGE_FILE_SIZE)
+        break;
+    case HUGE_FILE:
         jp->f_counters.huge_files ++;
-    else if(filesize >= BIG_FILE_SIZE)
+        break;
+    case BIG_FILE:
         jp->f_counters.big_files ++;
-    else if(filesize >= AVERAGE_FILE_SIZE)
+        break;
+    case AVERAGE_FILE:
         jp->f_counters.average_files ++;
-    else if(filesize >= SMALL_FILE_SIZE)
+        break;
+    case SMALL_FILE:
         jp->f_counters.small_files ++;
-    else
+        break;
+    default:
         jp->f_counters.tiny_files ++;
+        break;
+    }
 }
 
 /**
  * @internal
  * @brief find_files helper.
+ * @note Gets called for each file before
+ * the filter, once all the file information
+ * except of its name and path is gathered.
  */
 static void progress_callback(winx_file_info *f,void *user_defined_data)
 {
     udefrag_job_parameters *jp = (udefrag_job_parameters *)user_defined_data;
     
+    /* apply filters not depending on paths as early as possible */
+    if(exclude_by_disposition(f,jp))
+        set_file_flags(f,UD_FILE_EXCLUDED,jp);
+    
     /* don't count excluded files in the context menu handler */
     if(!(jp->udo.job_flags & UD_JOB_CONTEXT_MENU_HANDLER))
         update_progress_counters(f,jp);
@@ -562,6 +989,10 @@ void dbg_print_file_counters(udefrag_job_parameters *jp)
 /**
  * @internal
  * @brief Searches for all files on the disk.
+ * @details Files get indexed and drawn on the
+ * map by the analysis pipeline while the scan
+ * is in progress; whatever the pipeline cannot
+ * do gets done once the scan completes.
  * @return Zero for success, negative value otherwise.
  */
 static int find_files(udefrag_job_parameters *jp)
@@ -572,7 +1003,10 @@ static int find_files(udefrag_job_parameters *jp)
     wchar_t c;
     int flags = 0;
     winx_file_info *f;
-    winx_blockmap *block;
+    int count = 1, colorize = 1, build = 1;
+    
+    /* process files while the scan is in progress */
+    jp->pipeline = start_analysis_pipeline(jp);
     
     /* check for the context menu handler */
     if(jp->udo.job_flags & UD_JOB_CONTEXT_MENU_HANDLER){
@@ -598,40 +1032,61 @@ static int find_files(udefrag_job_parameters *jp)
         if(p) *p = 0;
         if(wcslen(parent_directory) <= wcslen(L"\\??\\C:\\"))
             goto scan_entire_disk;
+        if(jp->udo.compact_paths)
+            flags |= WINX_FTW_COMPACT_PATHS;
         jp->filelist = winx_ftw(parent_directory,
             flags | WINX_FTW_DUMP_FILES | \
-            WINX_FTW_ALLOW_PARTIAL_SCAN | WINX_FTW_SKIP_RESIDENT_STREAMS,
-            filter,progress_callback,terminator,(void *)jp);
+            WINX_FTW_ALLOW_PARTIAL_SCAN | WINX_FTW_SKIP_RESIDENT_STREAMS | \
+            WINX_FTW_THREADS(jp->udo.listing_threads),
+            filter,progress_callback,terminator,(void *)jp,jp->arena);
     } else {
     scan_entire_disk:
+        flags = jp->udo.compact_paths ? WINX_FTW_COMPACT_PATHS : 0;
         jp->filelist = winx_scan_disk(jp->volume_letter,
-            WINX_FTW_DUMP_FILES | WINX_FTW_ALLOW_PARTIAL_SCAN | \
-            WINX_FTW_SKIP_RESIDENT_STREAMS,
-            filter,progress_callback,terminator,(void *)jp);
+            flags | WINX_FTW_DUMP_FILES | WINX_FTW_ALLOW_PARTIAL_SCAN | \
+            WINX_FTW_SKIP_RESIDENT_STREAMS | \
+            WINX_FTW_MFT_QUEUE_DEPTH(jp->udo.mft_queue_depth) | \
+            WINX_FTW_THREADS(jp->udo.listing_threads),
+            filter,progress_callback,terminator,(void *)jp,jp->arena);
     }
+    
+    if(jp->pipeline){
+        stop_analysis_pipeline(jp->pipeline);
+        count = 0;
+        colorize = (jp->pipeline->n_stages > COLORIZING_STAGE) ? 0 : 1;
+        build = jp->pipeline->index_failed;
+        destroy_analysis_pipeline(jp->pipeline);
+        jp->pipeline = NULL;
+    }
+    
     if(jp->filelist == NULL && !jp->termination_router((void *)jp))
         return (-1);
     
     /* calculate number of fragmented files; redraw the map */
-    for(f = jp->filelist; f; f = f->next){
-        /* skip excluded files */
-        if(!is_fragmented(f) || is_excluded(f)){
-            jp->pi.fragments ++;
-        } else {
-            jp->pi.fragmented ++;
-            jp->pi.fragments += f->disp.fragments;
-        }
+    if(count || colorize){
+        for(f = jp->filelist; f; f = f->next){
+            if(count){
+                /* skip excluded files */
+                if(!is_fragmented(f) || is_excluded(f)){
+                    jp->pi.fragments ++;
+                } else {
+                    jp->pi.fragmented ++;
+                    jp->pi.fragments += f->disp.fragments;
+                }
+            }
 
-        /* redraw cluster map */
-        colorize_file(jp,f,SYSTEM_SPACE);
-        
-        /* add file blocks to a binary tree - after winx_scan_disk! */
-        for(block = f->disp.blockmap; block; block = block->next){
-            if(add_block_to_file_blocks_tree(jp,f,block) < 0) break;
-            if(block->next == f->disp.blockmap) break;
+            /* redraw cluster map */
+            if(colorize) colorize_file(jp,f,SYSTEM_SPACE);
+            
+            if(f->next == jp->filelist) break;
         }
-
-        if(f->next == jp->filelist) break;
+    }
+    
+    /* add file blocks to the tree - after winx_scan_disk! */
+    if(jp->file_blocks && build){
+        /* the tree may be filled partially */
+        if(jp->file_blocks->count) (void)create_file_blocks_tree(jp);
+        (void)build_file_blocks_tree(jp);
     }
 
     dbg_print_file_counters(jp);
@@ -661,14 +1116,14 @@ int is_file_locked(winx_file_info *f,udefrag_job_parameters *jp)
     status = winx_defrag_fopen(f,WINX_OPEN_FOR_MOVE,&hFile);
     if(status == STATUS_SUCCESS){
         winx_defrag_fclose(hFile);
-        f->user_defined_flags |= UD_FILE_NOT_LOCKED;
+        set_file_flags(f,UD_FILE_NOT_LOCKED,jp);
         return 0;
     }
 
     /*strace(status,"cannot open %ws",f->path);*/
     /* redraw space */
     old_color = get_file_color(jp,f);
-    f->user_defined_flags |= UD_FILE_LOCKED;
+    set_file_flags(f,UD_FILE_LOCKED,jp);
     colorize_file(jp,f,old_color);
     return 1;
 }
@@ -691,13 +1146,14 @@ static int is_well_known_locked_file(winx_file_info *f,udefrag_job_parameters *j
         L"$Secure",
         NULL
     };
-    int i, length = (int)wcslen(f->path);
+    wchar_t *path = get_file_path(f,0,jp);
+    int i, length = path ? (int)wcslen(path) : 0;
     
     /* search for well known locked NTFS meta files */
     if(length >= 9){ /* ensure that we have at least \??\X:\$x */
-        if(f->path[7] == '$'){
+        if(path[7] == '$'){
             for(i = 0; locked_files[i]; i++){
-                if(winx_wcsistr(f->path,locked_files[i]))
+                if(winx_wcsistr(path,locked_files[i]))
                     return 1;
             }
         }
@@ -731,9 +1187,9 @@ static void redraw_well_known_locked_files(udefrag_job_parameters *jp)
             if(is_well_known_locked_file(f,jp)){
                 if(!is_file_locked(f,jp)){
                     /* possibility of this case should be reduced */
-                    itrace("false detection: %ws",f->path);
+                    itrace("false detection: %ws",winx_file_path(f));
                 } else {
-                    itrace("true detection:  %ws",f->path);
+                    itrace("true detection:  %ws",winx_file_path(f));
                     n ++;
                 }
             }
@@ -753,18 +1209,18 @@ static void redraw_well_known_locked_files(udefrag_job_parameters *jp)
 static int fragmented_files_compare(const void *prb_a, const void *prb_b, void *prb_param)
 {
     winx_file_info *a, *b;
-    //udefrag_job_parameters *jp;
+    udefrag_job_parameters *jp;
     
     a = (winx_file_info *)prb_a;
     b = (winx_file_info *)prb_b;
-    //jp = (udefrag_job_parameters *)prb_param;
+    jp = (udefrag_job_parameters *)prb_param;
 
     /* sort files in descending order by number of fragments */
     if(a->disp.fragments != b->disp.fragments)
         return (a->disp.fragments < b->disp.fragments) ? 1 : (-1);
 
     /* if files have equal number of fragments, sort 'em by path */
-    return winx_wcsicmp(a->path, b->path);
+    return compare_file_paths(a,b,jp);
 }
 
 /**
@@ -779,7 +1235,11 @@ int expand_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp)
     /* don't include filtered out files, for better performance */
     if(!is_excluded(f)){
         p = prb_probe(jp->fragmented_files,(void *)f);
-        if(*p != f) etrace("a duplicate found for %ws",f->path);
+        if(p == NULL){
+            etrace("not enough memory to add %ws",winx_file_path(f));
+            return (-1);
+        }
+        if(*p != f) etrace("a duplicate found for %ws",winx_file_path(f));
     }
     return 0;
 }
@@ -791,30 +1251,36 @@ int expand_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp)
 void truncate_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp)
 {
     if(!prb_delete(jp->fragmented_files,(void *)f))
-        etrace("%ws is not found in the tree",f->path);
+        etrace("%ws is not found in the tree",winx_file_path(f));
 }
 
 /**
  * @internal
  * @brief Produces the list of fragmented files.
+ * @return Zero for success, negative value otherwise.
  */
-static void produce_list_of_fragmented_files(udefrag_job_parameters *jp)
+static int produce_list_of_fragmented_files(udefrag_job_parameters *jp)
 {
-    winx_file_info *f;
+    file_entry *e;
     ULONGLONG bad_fragments = 0;
+    unsigned long i;
     
     itrace("started creation of fragmented files list");
-    jp->fragmented_files = prb_create(fragmented_files_compare,(void *)jp,NULL);
-    for(f = jp->filelist; f; f = f->next){
-        if(is_fragmented(f) && !is_excluded(f)){
-            expand_fragmented_files_list(f,jp);
+    jp->fragmented_files = winx_prb_create_pooled(fragmented_files_compare,(void *)jp,0);
+    if(jp->fragmented_files == NULL)
+        return (-1);
+    for(i = 0; i < jp->catalog_size; i++){
+        e = &jp->catalog[i];
+        if(e->fragments > 1 && !(e->flags & UD_FILE_EXCLUDED)){
+            if(expand_fragmented_files_list(e->file,jp) < 0)
+                return (-1);
             /* more precise calculation seems to be too slow */
-            bad_fragments += f->disp.fragments;
+            bad_fragments += e->fragments;
         }
-        if(f->next == jp->filelist) break;
     }
     jp->pi.bad_fragments = bad_fragments;
     itrace("finished creation of fragmented files list");
+    return 0;
 }
 
 /**
@@ -893,11 +1359,16 @@ int analyze(udefrag_job_parameters *jp)
     if(find_files(jp) < 0)
         return (-1);
     
+    /* collect frequently accessed information */
+    if(build_file_catalog(jp) < 0)
+        return UDEFRAG_NO_MEM;
+    
     /* redraw well known locked files in green */
     redraw_well_known_locked_files(jp);
 
     /* produce a list of fragmented files */
-    produce_list_of_fragmented_files(jp);
+    if(produce_list_of_fragmented_files(jp) < 0)
+        return UDEFRAG_NO_MEM;
     (void)check_fragmentation_level(jp); /* for debugging */
 
     result = check_requested_action(jp);
@@ -950,7 +1421,11 @@ void update_free_space_layout(udefrag_job_parameters *jp,
         itrace("free space layout has to be updated...");
         winx_release_free_volume_regions(jp->free_regions);
         jp->free_regions = winx_get_free_volume_regions(jp->volume_letter,0,
-            jp->v_info.total_clusters,WINX_GVR_ALLOW_PARTIAL_SCAN,cb,(void *)jp);
+            jp->v_info.total_clusters,WINX_GVR_ALLOW_PARTIAL_SCAN,cb,(void *)jp,jp->arena);
+        /* all the released regions are rescanned now */
+        winx_release_free_volume_regions(jp->released_regions);
+        jp->released_regions = NULL;
+        jp->released_regions_lost = 0;
         itrace("free space layout updated");
         return;
     }
@@ -958,7 +1433,7 @@ void update_free_space_layout(udefrag_job_parameters *jp,
     winx_sub_volume_region(jp->free_regions,lcn,length);
     
     regions = winx_get_free_volume_regions(jp->volume_letter,
-        lcn,length,WINX_GVR_ALLOW_PARTIAL_SCAN,cb,(void *)jp);
+        lcn,length,WINX_GVR_ALLOW_PARTIAL_SCAN,cb,(void *)jp,jp->arena);
     if(regions == NULL) return;
     
     rgn = prb_t_first(&t,regions);
@@ -970,4 +1445,77 @@ void update_free_space_layout(udefrag_job_parameters *jp,
     winx_release_free_volume_regions(regions);
 }
 
+/**
+ * @internal
+ * @brief Remembers a region released by a moved file.
+ * @details On NTFS clusters which belonged to moved
+ * files remain in use until they get rescanned. To avoid
+ * rescans of the entire disk all such regions are collected
+ * in a tree; overlapping and adjacent regions get merged.
+ * If the tree cannot be created, the next rescan
+ * covers the entire disk.
+ * @param[in] jp the job parameters.
+ * @param[in] lcn the logical cluster number of the region.
+ * @param[in] length size of the region, in clusters.
+ */
+void remember_released_region(udefrag_job_parameters *jp,
+        ULONGLONG lcn,ULONGLONG length)
+{
+    if(jp->released_regions == NULL){
+        jp->released_regions = winx_create_volume_regions(jp->arena);
+        if(jp->released_regions == NULL){
+            if(!jp->released_regions_lost)
+                etrace("cannot create tree of released regions, the entire disk will be rescanned");
+            jp->released_regions_lost = 1;
+            return;
+        }
+    }
+    (void)winx_add_volume_region(jp->released_regions,lcn,length);
+}
+
+/**
+ * @internal
+ * @brief Forces Windows to release space
+ * which belonged to files moved before.
+ * @details Rescans regions remembered by
+ * remember_released_region. If there are too
+ * many of them or some of them were not remembered,
+ * rescans the entire disk instead.
+ * @param[in] jp the job parameters.
+ */
+void rescan_released_regions(udefrag_job_parameters *jp)
+{
+    struct prb_table *regions;
+    winx_volume_region *rgn;
+    struct prb_traverser t;
+    
+    if(jp->released_regions_lost){
+        itrace("some released regions were not remembered, rescanning the entire disk");
+        update_free_space_layout(jp,0,jp->v_info.total_clusters);
+        return;
+    }
+    
+    if(jp->released_regions == NULL) return;
+    
+    if(jp->released_regions->prb_count > jp->udo.released_regions_limit){
+        itrace("%I64u regions released, rescanning the entire disk",
+            (ULONGLONG)jp->released_regions->prb_count);
+        update_free_space_layout(jp,0,jp->v_info.total_clusters);
+        return;
+    }
+    
+    /* detach the tree to keep it safe while rescanning */
+    regions = jp->released_regions;
+    jp->released_regions = NULL;
+    
+    rgn = prb_t_first(&t,regions);
+    while(rgn){
+        if(jp->termination_router((void *)jp)) break;
+        update_free_space_layout(jp,rgn->lcn,rgn->length);
+        rgn = prb_t_next(&t);
+    }
+    
+    winx_release_free_volume_regions(regions);
+}
+
 /** @} */
@@ -0,0 +1,201 @@
+/*
+ *  UltraDefrag - a powerful defragmentation tool for Windows NT.
+ *  Copyright (c) 2007-2016 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file catalog.c
+ * @brief File catalog.
+ * @details The catalog keeps frequently accessed
+ * information about files in a single array, so
+ * passes over all the files touch just a small
+ * part of memory instead of the entire list.
+ * Names, paths and times remain in the list;
+ * sort keys of the paths get cached though, so
+ * most of the path comparisons don't touch them.
+ * @addtogroup Catalog
+ * @{
+ */
+
+#include "udefrag-internals.h"
+
+/**
+ * @internal
+ * @brief Defines the size class of a file.
+ * @return One of the TINY_FILE ... GIANT_FILE constants.
+ */
+unsigned long get_size_class(ULONGLONG clusters,udefrag_job_parameters *jp)
+{
+    ULONGLONG filesize = clusters * jp->v_info.bytes_per_cluster;
+    
+    if(filesize >= GIANT_FILE_SIZE) return GIANT_FILE;
+    if(filesize >= HUGE_FILE_SIZE) return HUGE_FILE;
+    if(filesize >= BIG_FILE_SIZE) return BIG_FILE;
+    if(filesize >= AVERAGE_FILE_SIZE) return AVERAGE_FILE;
+    if(filesize >= SMALL_FILE_SIZE) return SMALL_FILE;
+    return TINY_FILE;
+}
+
+/**
+ * @internal
+ * @brief Fills a catalog entry.
+ */
+static void fill_file_entry(file_entry *e,winx_file_info *f,udefrag_job_parameters *jp)
+{
+    e->clusters = f->disp.clusters;
+    e->lcn = f->disp.blockmap ? f->disp.blockmap->lcn : 0;
+    e->fragments = (unsigned long)f->disp.fragments;
+    e->flags = f->user_defined_flags;
+    e->attributes = f->flags;
+    e->size_class = get_size_class(f->disp.clusters,jp);
+    e->file = f;
+}
+
+/**
+ * @internal
+ * @brief Calculates the sort key of the path of a file.
+ * @details The root directory prefix, the same for all
+ * the files of the volume, is skipped, so keys hold
+ * the first characters which make a difference.
+ * Paths not starting with the prefix get no key.
+ */
+static void set_path_key(file_entry *e,winx_file_info *f,
+    wchar_t *root,udefrag_job_parameters *jp)
+{
+    wchar_t *path = get_file_path(f,0,jp);
+    int i;
+    
+    e->has_path_key = 0;
+    if(path == NULL) return;
+    for(i = 0; root[i]; i++){
+        if(winx_towlower(path[i]) != winx_towlower(root[i])) return;
+    }
+    e->path_key = winx_wcsi_sort_key(path + i);
+    e->has_path_key = 1;
+}
+
+/**
+ * @internal
+ * @brief Builds the catalog of files.
+ * @details Must be called once the list
+ * of files is complete.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+int build_file_catalog(udefrag_job_parameters *jp)
+{
+    wchar_t root[] = L"\\??\\X:\\";
+    winx_file_info *f;
+    unsigned long n = 0;
+    
+    destroy_file_catalog(jp);
+    root[4] = (wchar_t)jp->volume_letter;
+    
+    for(f = jp->filelist; f; f = f->next){
+        n ++;
+        if(f->next == jp->filelist) break;
+    }
+    if(n == 0) return 0;
+    
+    jp->catalog = winx_tmalloc(n * sizeof(file_entry));
+    if(jp->catalog == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)n * sizeof(file_entry));
+        return (-1);
+    }
+    
+    n = 0;
+    for(f = jp->filelist; f; f = f->next){
+        fill_file_entry(&jp->catalog[n],f,jp);
+        set_path_key(&jp->catalog[n],f,root,jp);
+        f->user_defined_data = &jp->catalog[n];
+        n ++;
+        if(f->next == jp->filelist) break;
+    }
+    jp->catalog_size = n;
+    itrace("%u files cataloged",n);
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Destroys the catalog of files.
+ */
+void destroy_file_catalog(udefrag_job_parameters *jp)
+{
+    winx_file_info *f;
+    
+    if(jp->catalog == NULL) return;
+    
+    /* files may outlive the catalog */
+    for(f = jp->filelist; f; f = f->next){
+        f->user_defined_data = NULL;
+        if(f->next == jp->filelist) break;
+    }
+    winx_free(jp->catalog);
+    jp->catalog = NULL;
+    jp->catalog_size = 0;
+}
+
+/**
+ * @internal
+ * @brief Updates the catalog entry of a file
+ * once disposition of the file gets changed.
+ */
+void update_file_entry(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    if(file_entry_of(f))
+        fill_file_entry(file_entry_of(f),f,jp);
+}
+
+/**
+ * @internal
+ * @brief Sets user defined flags of a file.
+ * @details Keeps the catalog entry and marks
+ * of the file blocks in sync.
+ */
+void set_file_flags(winx_file_info *f,unsigned long flags,udefrag_job_parameters *jp)
+{
+    unsigned long changed = flags & ~f->user_defined_flags;
+    
+    f->user_defined_flags |= flags;
+    if(file_entry_of(f)){
+        file_entry_of(f)->flags |= flags;
+        if(changed & UD_FILE_UNMOVABLE_FLAGS)
+            mark_file_blocks(f,jp);
+    }
+}
+
+/**
+ * @internal
+ * @brief Clears user defined flags of a file.
+ * @details Keeps the catalog entry and marks
+ * of the file blocks in sync.
+ */
+void clear_file_flags(winx_file_info *f,unsigned long flags,udefrag_job_parameters *jp)
+{
+    unsigned long changed = flags & f->user_defined_flags;
+    
+    f->user_defined_flags &= ~flags;
+    if(file_entry_of(f)){
+        file_entry_of(f)->flags &= ~flags;
+        if(changed & UD_FILE_UNMOVABLE_FLAGS)
+            mark_file_blocks(f,jp);
+    }
+}
+
+/** @} */
@@ -53,17 +53,17 @@ void test_move(winx_file_info *f,udefrag_job_parameters *jp)
     ULONGLONG target_lcn;
     
     /* try to move the first cluster to the last free region */
-    target_rgn = find_last_free_region(jp,0,1);
+    target_rgn = find_last_free_region(jp,0,jp->v_info.total_clusters,1);
     if(target_rgn == NULL){
         etrace("no free region found on disk");
         return;
     }
     target_lcn = target_rgn->lcn;
     if(move_file(f,f->disp.blockmap->vcn,1,target_lcn,jp) < 0){
-        etrace("move failed for %ws",f->path);
+        etrace("move failed for %ws",winx_file_path(f));
         return;
     } else {
-        dtrace("move succeeded for %ws",f->path);
+        dtrace("move succeeded for %ws",winx_file_path(f));
     }
 
     /* force Windows to release space */
@@ -72,13 +72,13 @@ void test_move(winx_file_info *f,udefrag_job_parameters *jp)
     /* try to move the first cluster back */
     if(can_move(f,jp)){
         if(move_file(f,f->disp.blockmap->vcn,1,source_lcn,jp) < 0){
-            etrace("move failed for %ws",f->path);
+            etrace("move failed for %ws",winx_file_path(f));
             return;
         } else {
-            dtrace("move succeeded for %ws",f->path);
+            dtrace("move succeeded for %ws",winx_file_path(f));
         }
     } else {
-        etrace("file became unmovable %ws",f->path);
+        etrace("file became unmovable %ws",winx_file_path(f));
     }
     
     /* release target space as well */
@@ -105,16 +105,16 @@ void test_special_files_defrag(udefrag_job_parameters *jp)
         if(can_move(f,jp)){
             special_file = 0;
             if(is_reparse_point(f)){
-                dtrace("reparse point detected: %ws",f->path);
+                dtrace("reparse point detected: %ws",winx_file_path(f));
                 special_file = 1;
             } else if(is_encrypted(f)){
-                dtrace("encrypted file detected: %ws",f->path);
+                dtrace("encrypted file detected: %ws",winx_file_path(f));
                 special_file = 1;
-            } else if(winx_wcsistr(f->path,L"$BITMAP")){
-                dtrace("bitmap detected: %ws",f->path);
+            } else if(winx_wcsistr(winx_file_path(f),L"$BITMAP")){
+                dtrace("bitmap detected: %ws",winx_file_path(f));
                 special_file = 1;
-            } else if(winx_wcsistr(f->path,L"$ATTRIBUTE_LIST")){
-                dtrace("attribute list detected: %ws",f->path);
+            } else if(winx_wcsistr(winx_file_path(f),L"$ATTRIBUTE_LIST")){
+                dtrace("attribute list detected: %ws",winx_file_path(f));
                 special_file = 1;
             }
             if(special_file)
@@ -167,12 +167,13 @@ static int can_defragment(winx_file_info *f,udefrag_job_parameters *jp)
  */
 static winx_blockmap *add_fragment(winx_blockmap **fragments,
     winx_blockmap **prev_fragment, ULONGLONG vcn, ULONGLONG lcn,
-    ULONGLONG length)
+    ULONGLONG length, udefrag_job_parameters *jp)
 {
     winx_blockmap *fragment;
     
-    fragment = (winx_blockmap *)winx_list_insert((list_entry **)(void *)fragments,
-        (list_entry *)*prev_fragment,sizeof(winx_blockmap));
+    fragment = (winx_blockmap *)winx_list_insert_ex((list_entry **)(void *)fragments,
+        (list_entry *)*prev_fragment,sizeof(winx_blockmap),jp->arena);
+    if(fragment == NULL) return NULL;
     fragment->vcn = vcn;
     fragment->lcn = lcn;
     fragment->length = length;
@@ -184,7 +185,8 @@ static winx_blockmap *add_fragment(winx_blockmap **fragments,
  * @internal
  * @brief Enumerates fragments of a file.
  */
-winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments)
+winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments,
+    udefrag_job_parameters *jp)
 {
     winx_blockmap *block, *p = NULL, *fragments = NULL;
     ULONGLONG vcn = 0, lcn = 0, length = 0;
@@ -201,7 +203,7 @@ winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments)
                 length += block->length;
             } else {
                 if(length){
-                    if(!add_fragment(&fragments,&p,vcn,lcn,length))
+                    if(!add_fragment(&fragments,&p,vcn,lcn,length,jp))
                         break;
                     if(n_fragments) (*n_fragments) ++;
                 }
@@ -214,7 +216,7 @@ winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments)
     }
     
     if(length){
-        if(add_fragment(&fragments,&p,vcn,lcn,length)){
+        if(add_fragment(&fragments,&p,vcn,lcn,length,jp)){
             if(n_fragments) (*n_fragments) ++;
         }
     }
@@ -227,9 +229,10 @@ winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments)
  * @internal
  * @brief Releases a list of file fragments.
  */
-void release_fragments_list(winx_blockmap **fragments)
+void release_fragments_list(winx_blockmap **fragments,udefrag_job_parameters *jp)
 {
-    winx_list_destroy((list_entry **)(void *)fragments);
+    winx_list_destroy_ex((list_entry **)(void *)fragments,
+        sizeof(winx_blockmap),jp->arena);
 }
 
 /**
@@ -238,12 +241,157 @@ void release_fragments_list(winx_blockmap **fragments)
  */
 void clear_currently_excluded_flag(udefrag_job_parameters *jp)
 {
+    unsigned long i;
+
+    /* touch only files having the flag set */
+    for(i = 0; i < jp->catalog_size; i++){
+        if(jp->catalog[i].flags & UD_FILE_CURRENTLY_EXCLUDED)
+            clear_file_flags(jp->catalog[i].file,UD_FILE_CURRENTLY_EXCLUDED,jp);
+    }
+}
+
+/**
+ * @internal
+ * @brief Calculates FNV-1a hash of a path
+ * regardless of the characters case.
+ * @param[in] path the path.
+ * @param[in] length length of the path, in characters.
+ */
+static ULONGLONG hash_path(wchar_t *path,size_t length)
+{
+    ULONGLONG hash = 0xcbf29ce484222325LL;
+    size_t i;
+    
+    for(i = 0; i < length; i++){
+        hash ^= (ULONGLONG)winx_towlower(path[i]);
+        hash *= 0x100000001b3LL;
+    }
+    return hash;
+}
+
+/**
+ * @internal
+ * @brief Directory entries are sorted by hashes
+ * of paths, so the parent directory of a file
+ * gets found by a binary search. Coinciding hashes
+ * affect the placement of files only.
+ */
+typedef struct _directory_entry {
+    ULONGLONG hash;             /* hash of the path */
+    winx_file_info *directory;  /* the directory itself */
+} directory_entry;
+
+/**
+ * @internal
+ * @brief Compares hashes of paths of two directories.
+ */
+static int directories_compare(const void *a,const void *b,void *param)
+{
+    ULONGLONG x = ((directory_entry *)a)->hash;
+    ULONGLONG y = ((directory_entry *)b)->hash;
+    
+    if(x == y) return 0;
+    return (x < y) ? (-1) : 1;
+}
+
+/**
+ * @internal
+ * @brief Builds the array of directories having
+ * clusters allocated, sorted by hashes of paths.
+ * @param[out] n number of directories found.
+ * @param[in] jp the job parameters.
+ * @return The array, NULL indicates that
+ * no directories found or failure.
+ */
+static directory_entry *build_directories_list(unsigned long *n,
+    udefrag_job_parameters *jp)
+{
+    directory_entry *directories;
     winx_file_info *f;
+    unsigned long i;
+    wchar_t *path;
+    
+    *n = 0;
+    for(i = 0; i < jp->catalog_size; i++){
+        if(jp->catalog[i].attributes & FILE_ATTRIBUTE_DIRECTORY) (*n) ++;
+    }
+    if(*n == 0) return NULL;
+    
+    directories = winx_tmalloc(*n * sizeof(directory_entry));
+    if(directories == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)*n * sizeof(directory_entry));
+        *n = 0;
+        return NULL;
+    }
+    
+    *n = 0;
+    for(i = 0; i < jp->catalog_size; i++){
+        f = jp->catalog[i].file;
+        if(is_directory(f) && f->disp.blockmap){
+            path = get_file_path(f,0,jp);
+            if(path == NULL) continue;
+            directories[*n].hash = hash_path(path,wcslen(path));
+            directories[*n].directory = f;
+            (*n) ++;
+        }
+    }
+    
+    if(winx_sort(directories,*n,sizeof(directory_entry),
+      directories_compare,NULL,jp->udo.sorting_threads) < 0){
+        winx_free(directories);
+        *n = 0;
+        return NULL;
+    }
+    return directories;
+}
 
-    for(f = jp->filelist; f; f = f->next){
-        f->user_defined_flags &= ~UD_FILE_CURRENTLY_EXCLUDED;
-        if(f->next == jp->filelist) break;
+/**
+ * @internal
+ * @brief Defines the logical cluster number
+ * a file must be placed as close as possible to.
+ * @param[in] f the file.
+ * @param[in] directories the array produced
+ * by build_directories_list.
+ * @param[in] n number of directories in the array.
+ * @param[in] jp the job parameters.
+ * @return The first cluster of the parent directory
+ * if it is known and has clusters allocated, the
+ * first cluster of the file itself otherwise.
+ */
+static ULONGLONG get_placement_lcn(winx_file_info *f,
+    directory_entry *directories,unsigned long n,
+    udefrag_job_parameters *jp)
+{
+    unsigned long lo = 0, hi = n, mid;
+    ULONGLONG hash;
+    wchar_t *path, *p;
+    size_t length;
+    
+    if(directories == NULL) goto done;
+    path = get_file_path(f,0,jp);
+    if(path == NULL) goto done;
+    p = wcsrchr(path,'\\');
+    if(p == NULL) goto done;
+    
+    /* the root directory path ends with a backslash */
+    length = p - path;
+    if(length && path[length - 1] == ':') length ++;
+    hash = hash_path(path,length);
+    
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if(directories[mid].hash < hash) lo = mid + 1;
+        else hi = mid;
+    }
+    if(lo < n && directories[lo].hash == hash){
+        /* the directory may lose its clusters in moves */
+        if(directories[lo].directory->disp.blockmap)
+            return directories[lo].directory->disp.blockmap->lcn;
     }
+
+done:
+    return f->disp.blockmap->lcn;
 }
 
 /**
@@ -286,7 +434,9 @@ static int defrag_routine(udefrag_job_parameters *jp)
     ULONGLONG min_vcn, max_vcn; /* used to avoid infinite loops */
     winx_blockmap *fragments, *fr, *fr2, *next_fr, *head_fr;
     ULONGLONG vcn, length, n, new_min_vcn;
-    ULONGLONG cut_length;
+    ULONGLONG cut_length, target;
+    directory_entry *directories = NULL;
+    unsigned long n_directories = 0;
     int defrag_succeeded;
     char buffer[32];
 
@@ -296,7 +446,7 @@ static int defrag_routine(udefrag_job_parameters *jp)
 
     /* force Windows to release space which belonged to files moved before */
     if(jp->fs_type == FS_NTFS && !jp->udo.dry_run && jp->pi.pass_number > 0)
-        update_free_space_layout(jp,0,jp->v_info.total_clusters);
+        rescan_released_regions(jp);
 
     /* no files are excluded by this task currently */
     clear_currently_excluded_flag(jp);
@@ -311,6 +461,10 @@ static int defrag_routine(udefrag_job_parameters *jp)
     jp->pi.clusters_to_process = \
         jp->pi.processed_clusters + defrag_cc_routine(jp);
         
+    /* directories may be moved by the previous pass */
+    if(jp->udo.placement == UD_PLACE_NEAR_DIRECTORY)
+        directories = build_directories_list(&n_directories,jp);
+        
     /*
     dtrace(">>> %I64u\\%I64u <<<",
         jp->pi.processed_clusters,jp->pi.clusters_to_process);
@@ -332,18 +486,24 @@ static int defrag_routine(udefrag_job_parameters *jp)
               < 2 * jp->udo.fragment_size_threshold) move_entirely = 1;
             if(move_entirely){
                 /* move the entire file */
-                rgn = find_first_free_region(jp,0,file->disp.clusters);
+                if(jp->udo.placement == UD_PLACE_FIRST_FIT){
+                    rgn = find_first_free_region(jp,0,file->disp.clusters);
+                    if(rgn) target = rgn->lcn;
+                } else {
+                    rgn = find_nearest_free_region(jp,get_placement_lcn(file,
+                        directories,n_directories,jp),file->disp.clusters,&target);
+                }
                 if(rgn){
                     x = jp->pi.moved_clusters;
                     if(move_file(file,file->disp.blockmap->vcn,
-                     file->disp.clusters,rgn->lcn,jp) >= 0){
+                     file->disp.clusters,target,jp) >= 0){
                         if(jp->udo.dbgprint_level >= DBG_DETAILED)
-                            itrace("Defrag success for %ws",file->path);
+                            itrace("Defrag success for %ws",winx_file_path(file));
                         defragmented_files ++;
                         defragmented_entirely ++;
                         moved_entirely += (jp->pi.moved_clusters - x);
                     } else {
-                        etrace("Defrag failure for %ws",file->path);
+                        etrace("Defrag failure for %ws",winx_file_path(file));
                     }
                 }
             } else {
@@ -355,7 +515,7 @@ static int defrag_routine(udefrag_job_parameters *jp)
                 x = jp->pi.moved_clusters;
                 while(min_vcn < max_vcn && can_defragment(file,jp)){
                     /* build list of fragments */
-                    fragments = build_fragments_list(file,NULL);
+                    fragments = build_fragments_list(file,NULL,jp);
                     if(fragments == NULL) break;
                     
                     /* cut off already processed fragments and data after max_vcn */
@@ -363,7 +523,8 @@ static int defrag_routine(udefrag_job_parameters *jp)
                         head_fr = fragments;
                         next_fr = fr->next;
                         if(fr->vcn < min_vcn || (fr->vcn + fr->length > max_vcn))
-                            winx_list_remove((list_entry **)(void *)&fragments,(list_entry *)(void *)fr);
+                            winx_list_remove_ex((list_entry **)(void *)&fragments,
+                                (list_entry *)(void *)fr,sizeof(winx_blockmap),jp->arena);
                         if(fragments == NULL) goto completed;
                         if(next_fr == head_fr) break;
                     }
@@ -431,17 +592,17 @@ move_clusters:
                         if(rgn){
                             if(move_file(file,vcn,length,rgn->lcn,jp) >= 0){
                                 if(jp->udo.dbgprint_level >= DBG_DETAILED)
-                                    itrace("Defrag success for %ws",file->path);
+                                    itrace("Defrag success for %ws",winx_file_path(file));
                                 defrag_succeeded = 1;
                             } else {
-                                etrace("Defrag failure for %ws",file->path);
+                                etrace("Defrag failure for %ws",winx_file_path(file));
                             }
                         }
                         min_vcn = new_min_vcn;
                     }
                     
                     /* release list of fragments */
-                    release_fragments_list(&fragments);
+                    release_fragments_list(&fragments,jp);
                 }
                 if(defrag_succeeded){
                     defragmented_files ++;
@@ -451,7 +612,7 @@ move_clusters:
             }
         }
 completed:
-        file->user_defined_flags |= UD_FILE_CURRENTLY_EXCLUDED;
+        set_file_flags(file,UD_FILE_CURRENTLY_EXCLUDED,jp);
         file = next_file;
     }
     
@@ -476,6 +637,7 @@ completed:
     itrace("  %s moved",buffer);
     
     /* cleanup */
+    winx_free(directories);
     clear_currently_excluded_flag(jp);
     winx_fclose(jp->fVolume);
     jp->fVolume = NULL;
@@ -599,7 +761,7 @@ int defragment(udefrag_job_parameters *jp)
         if(jp->termination_router((void *)jp)) break;
         if(is_moving_failed(file)){
             second_attempt = 1;
-            file->user_defined_flags &= ~UD_FILE_MOVING_FAILED;
+            clear_file_flags(file,UD_FILE_MOVING_FAILED,jp);
         }
         file = prb_t_next(&t);
     }
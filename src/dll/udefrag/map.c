@@ -237,15 +237,15 @@ int is_mft(winx_file_info *f,udefrag_job_parameters *jp)
     if(is_not_mft_file(f)) return 0;
     if(is_mft_file(f)) return 1;
     
-    length = (int)wcslen(f->path);
+    length = winx_get_file_path_length(f);
     if(length == 11){
         if(winx_wcsistr(f->name,mft_name)){
-            f->user_defined_flags |= UD_FILE_MFT_FILE;
+            set_file_flags(f,UD_FILE_MFT_FILE,jp);
             return 1;
         }
     }
     
-    f->user_defined_flags |= UD_FILE_NOT_MFT_FILE;
+    set_file_flags(f,UD_FILE_NOT_MFT_FILE,jp);
     return 0;
 }
 
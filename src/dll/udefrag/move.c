@@ -56,6 +56,7 @@ int can_move(winx_file_info *f,udefrag_job_parameters *jp)
         L"*\\bootsqm.dat",   /* part of Windows */
         NULL
     };
+    wchar_t *path;
     int i;
 
     /* skip files already moved to front in optimization */
@@ -74,7 +75,7 @@ int can_move(winx_file_info *f,udefrag_job_parameters *jp)
     if(f->disp.clusters == 0 || \
       (f->disp.blockmap->next == f->disp.blockmap && \
       f->disp.blockmap->length == 0)){
-        f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
+        set_file_flags(f,UD_FILE_IMPROPER_STATE,jp);
         return 0;
     }
 
@@ -89,23 +90,25 @@ int can_move(winx_file_info *f,udefrag_job_parameters *jp)
     /* keep the computer bootable */
     if(is_not_essential_file(f)) return 1;
     if(is_essential_boot_file(f)) return 0;
+    path = get_file_path(f,0,jp);
+    if(path == NULL) return 0;
     if(jp->is_fat && !is_fragmented(f)){
         for(i = 0; dos_files[i]; i++){
-            if(winx_wcsmatch(f->path,dos_files[i],WINX_PAT_ICASE)){
-                itrace("essential dos file detected: %ws",f->path);
-                f->user_defined_flags |= UD_FILE_ESSENTIAL_BOOT_FILE;
+            if(winx_wcsmatch(path,dos_files[i],WINX_PAT_ICASE)){
+                itrace("essential dos file detected: %ws",path);
+                set_file_flags(f,UD_FILE_ESSENTIAL_BOOT_FILE,jp);
                 return 0;
             }
         }
     }
     for(i = 0; boot_files[i]; i++){
-        if(winx_wcsmatch(f->path,boot_files[i],WINX_PAT_ICASE)){
-            itrace("essential boot file detected: %ws",f->path);
-            f->user_defined_flags |= UD_FILE_ESSENTIAL_BOOT_FILE;
+        if(winx_wcsmatch(path,boot_files[i],WINX_PAT_ICASE)){
+            itrace("essential boot file detected: %ws",path);
+            set_file_flags(f,UD_FILE_ESSENTIAL_BOOT_FILE,jp);
             return 0;
         }
     }
-    f->user_defined_flags |= UD_FILE_NOT_ESSENTIAL_FILE;
+    set_file_flags(f,UD_FILE_NOT_ESSENTIAL_FILE,jp);
     return 1;
 }
 
@@ -130,6 +133,37 @@ int can_move_entirely(winx_file_info *f,udefrag_job_parameters *jp)
     return 1;
 }
 
+/**
+ * @internal
+ * @brief Retrieves the map of extents of a file.
+ * @details The map is cached in the job parameters
+ * and gets rebuilt only when another file is requested
+ * or when the map has been invalidated.
+ * @return Pointer to the map, NULL indicates failure.
+ */
+winx_extent_map *get_extent_map(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    if(jp->extent_map_file == f)
+        return &jp->extent_map;
+    
+    jp->extent_map_file = NULL;
+    if(winx_build_extent_map(f->disp.blockmap,&jp->extent_map) < 0)
+        return NULL;
+    jp->extent_map_file = f;
+    return &jp->extent_map;
+}
+
+/**
+ * @internal
+ * @brief Invalidates the cached map of extents.
+ * @note Must be called whenever a map of blocks
+ * of a file gets changed.
+ */
+void invalidate_extent_map(udefrag_job_parameters *jp)
+{
+    jp->extent_map_file = NULL;
+}
+
 /************************************************************/
 /*                    Internal Routines                     */
 /************************************************************/
@@ -139,10 +173,16 @@ int can_move_entirely(winx_file_info *f,udefrag_job_parameters *jp)
  * @brief Returns the first file block
  * belonging to a cluster chain.
  */
-static winx_blockmap *get_first_block_of_cluster_chain(winx_file_info *f,ULONGLONG vcn)
+static winx_blockmap *get_first_block_of_cluster_chain(winx_file_info *f,
+    ULONGLONG vcn,udefrag_job_parameters *jp)
 {
+    winx_extent_map *map;
     winx_blockmap *block;
     
+    map = get_extent_map(f,jp);
+    if(map) return winx_get_block_by_vcn(map,vcn);
+    
+    /* not enough memory, walk through the list */
     for(block = f->disp.blockmap; block; block = block->next){
         if(vcn >= block->vcn && vcn < block->vcn + block->length)
             return block;
@@ -209,7 +249,7 @@ static int move_file_clusters(winx_file_info *f,HANDLE hFile,ULONGLONG startVcn,
         }
         jp->last_move_status = status;
         if(!NT_SUCCESS(status)){
-            strace(status,"cannot move file clusters of %ws",f->path);
+            strace(status,"cannot move file clusters of %ws",winx_file_path(f));
             jp->pi.processed_clusters += n_clusters;
             return (-1);
         }
@@ -241,7 +281,7 @@ static void move_file_helper(HANDLE hFile, winx_file_info *f,
     int result;
     
     /* move blocks of the file */
-    first_block = get_first_block_of_cluster_chain(f,vcn);
+    first_block = get_first_block_of_cluster_chain(f,vcn,jp);
     for(block = first_block; block && length; block = block->next){
         /* move the current block or its part */
         clusters_to_move = min(block->length - (vcn - block->vcn),length);
@@ -283,15 +323,17 @@ static void DbgPrintBlocksOfFile(winx_blockmap *blockmap)
  * @internal
  * @brief Adds a block to a file map.
  */
-static winx_blockmap *add_new_block(winx_blockmap **head,ULONGLONG vcn,ULONGLONG lcn,ULONGLONG length)
+static winx_blockmap *add_new_block(winx_blockmap **head,ULONGLONG vcn,
+    ULONGLONG lcn,ULONGLONG length,udefrag_job_parameters *jp)
 {
     winx_blockmap *block, *last_block = NULL;
     
     if(*head != NULL)
         last_block = (*head)->prev;
     
-    block = (winx_blockmap *)winx_list_insert((list_entry **)head,
-                (list_entry *)last_block,sizeof(winx_blockmap));
+    block = (winx_blockmap *)winx_list_insert_ex((list_entry **)head,
+                (list_entry *)last_block,sizeof(winx_blockmap),jp->arena);
+    if(block == NULL) return NULL;
     block->vcn = vcn;
     block->lcn = lcn;
     block->length = length;
@@ -308,23 +350,26 @@ static winx_blockmap *add_new_block(winx_blockmap **head,ULONGLONG vcn,ULONGLONG
  * @param[in] target the new LCN of the moved cluster chain.
  * @param[out] new_file_info pointer to structure 
  * receiving the updated file information.
+ * @param[in] jp the job parameters.
  */
 static void calculate_file_disposition(winx_file_info *f,ULONGLONG vcn,
-    ULONGLONG length,ULONGLONG target,winx_file_info *new_file_info)
+    ULONGLONG length,ULONGLONG target,winx_file_info *new_file_info,
+    udefrag_job_parameters *jp)
 {
     winx_blockmap *block, *first_block, *fragments;
     ULONGLONG clusters_to_check, curr_vcn, curr_target, n;
     
-    /* duplicate file information */
+    /* duplicate file information; the copy has no catalog entry */
     memcpy(new_file_info,f,sizeof(winx_file_info));
+    new_file_info->user_defined_data = NULL;
     
     /* reset new file disposition */
     new_file_info->disp.blockmap = NULL;
     new_file_info->disp.fragments = 0;
     
-    first_block = get_first_block_of_cluster_chain(f,vcn);
+    first_block = get_first_block_of_cluster_chain(f,vcn,jp);
     if(first_block == NULL){
-        etrace("get_first_block_of_cluster_chain failed for %ws",f->path);
+        etrace("get_first_block_of_cluster_chain failed for %ws",winx_file_path(f));
         new_file_info->disp.clusters = 0;
         return;
     }
@@ -334,7 +379,7 @@ static void calculate_file_disposition(winx_file_info *f,ULONGLONG vcn,
       block && block != first_block;
       block = block->next){
         if(!add_new_block(&new_file_info->disp.blockmap,
-            block->vcn,block->lcn,block->length)) goto fail;
+            block->vcn,block->lcn,block->length,jp)) goto fail;
     }
     
     /* add all remaining blocks */
@@ -344,27 +389,27 @@ static void calculate_file_disposition(winx_file_info *f,ULONGLONG vcn,
     for(block = first_block; block; block = block->next){
         if(!clusters_to_check){
             if(!add_new_block(&new_file_info->disp.blockmap,
-                block->vcn,block->lcn,block->length)) goto fail;
+                block->vcn,block->lcn,block->length,jp)) goto fail;
         } else {
             n = min(block->length - (curr_vcn - block->vcn),clusters_to_check);
             
             if(curr_vcn != block->vcn){
                 /* we have the second part of the block moved */
                 if(!add_new_block(&new_file_info->disp.blockmap,
-                    block->vcn,block->lcn,block->length - n)) goto fail;
+                    block->vcn,block->lcn,block->length - n,jp)) goto fail;
                 if(!add_new_block(&new_file_info->disp.blockmap,
-                    curr_vcn,curr_target,n)) goto fail;
+                    curr_vcn,curr_target,n,jp)) goto fail;
             } else {
                 if(n != block->length){
                     /* we have the first part of the block moved */
                     if(!add_new_block(&new_file_info->disp.blockmap,
-                        curr_vcn,curr_target,n)) goto fail;
+                        curr_vcn,curr_target,n,jp)) goto fail;
                     if(!add_new_block(&new_file_info->disp.blockmap,
-                        block->vcn + n,block->lcn + n,block->length - n)) goto fail;
+                        block->vcn + n,block->lcn + n,block->length - n,jp)) goto fail;
                 } else {
                     /* we have the entire block moved */
                     if(!add_new_block(&new_file_info->disp.blockmap,
-                        block->vcn,curr_target,block->length)) goto fail;
+                        block->vcn,curr_target,block->length,jp)) goto fail;
                 }
             }
             /* XXX: when a middle part of the block moved, the behaviour is 
@@ -379,15 +424,15 @@ static void calculate_file_disposition(winx_file_info *f,ULONGLONG vcn,
     }
     
     /* replace list of blocks by list of fragments */
-    fragments = build_fragments_list(new_file_info,&n);
-    winx_list_destroy((list_entry **)(void *)&new_file_info->disp.blockmap);
+    fragments = build_fragments_list(new_file_info,&n,jp);
+    release_fragments_list(&new_file_info->disp.blockmap,jp);
     new_file_info->disp.blockmap = fragments;
     new_file_info->disp.fragments = n;
     return;
     
 fail:
-    etrace("not enough memory for %ws",f->path);
-    winx_list_destroy((list_entry **)(void *)&new_file_info->disp.blockmap);
+    etrace("not enough memory for %ws",winx_file_path(f));
+    release_fragments_list(&new_file_info->disp.blockmap,jp);
     new_file_info->disp.fragments = 0;
     new_file_info->disp.clusters = 0;
 }
@@ -400,7 +445,8 @@ fail:
  * Negative value indicates that 
  * arguments are invalid.
  */
-static int compare_file_dispositions(winx_file_info *f1, winx_file_info *f2)
+static int compare_file_dispositions(winx_file_info *f1, winx_file_info *f2,
+    udefrag_job_parameters *jp)
 {
     winx_blockmap *map1, *map2, *b1, *b2;
     ULONGLONG n1, n2;
@@ -410,14 +456,14 @@ static int compare_file_dispositions(winx_file_info *f1, winx_file_info *f2)
         return (-1);
     
     /* get lists of fragments */
-    map1 = build_fragments_list(f1,&n1);
-    map2 = build_fragments_list(f2,&n2);
+    map1 = build_fragments_list(f1,&n1,jp);
+    map2 = build_fragments_list(f2,&n2,jp);
     
     /* empty maps are equal */
     if(map1 == NULL && map2 == NULL){
 equal_maps:
-        release_fragments_list(&map1);
-        release_fragments_list(&map2);
+        release_fragments_list(&map1,jp);
+        release_fragments_list(&map2,jp);
         return 0;
     }
     
@@ -436,11 +482,123 @@ equal_maps:
     
 different_maps:
     /* maps are different */
-    release_fragments_list(&map1);
-    release_fragments_list(&map2);
+    release_fragments_list(&map1,jp);
+    release_fragments_list(&map2,jp);
     return 1;
 }
 
+/**
+ * @internal
+ * @brief Appends a block to a circular list.
+ */
+static void append_block(winx_blockmap **head,winx_blockmap *block)
+{
+    if(*head == NULL){
+        block->next = block->prev = block;
+        *head = block;
+    } else {
+        block->prev = (*head)->prev;
+        block->next = *head;
+        (*head)->prev->next = block;
+        (*head)->prev = block;
+    }
+}
+
+/**
+ * @internal
+ * @brief Checks whether two blocks are identical.
+ */
+static int blocks_match(winx_blockmap *a,winx_blockmap *b)
+{
+    return (a->vcn == b->vcn && a->lcn == b->lcn && a->length == b->length);
+}
+
+/**
+ * @internal
+ * @brief Replaces the map of blocks of a file by the new one.
+ * @details Blocks leading and trailing both maps are kept
+ * in place, so only the blocks which have actually been
+ * changed get removed from the binary tree of file blocks
+ * and added there again. The new map gets consumed.
+ */
+static void replace_file_blocks(winx_file_info *f,winx_file_disposition *disp,
+    udefrag_job_parameters *jp)
+{
+    winx_blockmap *block, *next, *old_block, *new_block;
+    winx_blockmap *head = NULL, *tail = NULL, *first_changed = NULL;
+    ULONGLONG n_old = 0, n_new = 0, head_length = 0, tail_length = 0, i;
+    
+    for(block = f->disp.blockmap; block; block = block->next){
+        n_old ++;
+        if(block->next == f->disp.blockmap) break;
+    }
+    for(block = disp->blockmap; block; block = block->next){
+        n_new ++;
+        if(block->next == disp->blockmap) break;
+    }
+    
+    /* find blocks common for both maps */
+    old_block = f->disp.blockmap;
+    new_block = disp->blockmap;
+    while(head_length < n_old && head_length < n_new){
+        if(!blocks_match(old_block,new_block)) break;
+        old_block = old_block->next;
+        new_block = new_block->next;
+        head_length ++;
+    }
+    if(head_length < n_old && head_length < n_new){
+        old_block = f->disp.blockmap->prev;
+        new_block = disp->blockmap->prev;
+        while(tail_length < n_old - head_length && tail_length < n_new - head_length){
+            if(!blocks_match(old_block,new_block)) break;
+            old_block = old_block->prev;
+            new_block = new_block->prev;
+            tail_length ++;
+        }
+    }
+    
+    /* keep the common blocks of the old map, release the rest */
+    for(i = 0, block = f->disp.blockmap; i < n_old; i++, block = next){
+        next = block->next;
+        if(i < head_length){
+            append_block(&head,block);
+        } else if(i >= n_old - tail_length){
+            append_block(&tail,block);
+        } else {
+            (void)remove_block_from_file_blocks_tree(jp,block);
+            winx_arena_free(jp->arena,block,sizeof(winx_blockmap));
+        }
+    }
+    
+    /* take the changed blocks of the new map, release the rest */
+    for(i = 0, block = disp->blockmap; i < n_new; i++, block = next){
+        next = block->next;
+        if(i < head_length || i >= n_new - tail_length){
+            winx_arena_free(jp->arena,block,sizeof(winx_blockmap));
+        } else {
+            if(first_changed == NULL) first_changed = block;
+            append_block(&head,block);
+        }
+    }
+    
+    for(i = 0, block = tail; i < tail_length; i++, block = next){
+        next = block->next;
+        append_block(&head,block);
+    }
+    
+    memcpy(&f->disp,disp,sizeof(winx_file_disposition));
+    f->disp.blockmap = head;
+    disp->blockmap = NULL;
+    invalidate_extent_map(jp);
+    
+    /* add the changed blocks to the binary tree */
+    block = first_changed;
+    for(i = 0; i < n_new - head_length - tail_length; i++){
+        if(add_block_to_file_blocks_tree(jp,f,block) < 0) break;
+        block = block->next;
+    }
+}
+
 /**
  * @internal
  */
@@ -515,12 +673,13 @@ int move_file(winx_file_info *f,
     /* validate parameters */
     if(f == NULL){
         etrace("invalid parameter");
-        f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
+        set_file_flags(f,UD_FILE_IMPROPER_STATE,jp);
         jp->p_counters.moving_time += winx_xtime() - time;
         return (-1);
     }
     
-    path = f->path ? f->path : L"(null)";
+    path = winx_file_path(f);
+    if(path == NULL) path = L"(null)";
     if(jp->udo.dbgprint_level >= DBG_DETAILED){
         itrace("%ws",path);
         itrace("vcn = %I64u, length = %I64u, target = %I64u",vcn,length,target);
@@ -529,13 +688,13 @@ int move_file(winx_file_info *f,
     if(length == 0){
         etrace("move of zero number "
             "of clusters requested for %ws",path);
-        f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
+        set_file_flags(f,UD_FILE_IMPROPER_STATE,jp);
         jp->p_counters.moving_time += winx_xtime() - time;
         return 0; /* nothing to move */
     }
     
     if(f->disp.clusters == 0 || f->disp.fragments == 0 || f->disp.blockmap == NULL){
-        f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
+        set_file_flags(f,UD_FILE_IMPROPER_STATE,jp);
         jp->p_counters.moving_time += winx_xtime() - time;
         return 0; /* nothing to move */
     }
@@ -544,16 +703,16 @@ int move_file(winx_file_info *f,
         etrace("data move behind "
             "the end of the file requested for %ws",path);
         DbgPrintBlocksOfFile(f->disp.blockmap);
-        f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
+        set_file_flags(f,UD_FILE_IMPROPER_STATE,jp);
         jp->p_counters.moving_time += winx_xtime() - time;
         return (-1);
     }
     
-    first_block = get_first_block_of_cluster_chain(f,vcn);
+    first_block = get_first_block_of_cluster_chain(f,vcn,jp);
     if(first_block == NULL){
         etrace("data move out of "
             "file bounds requested for %ws",path);
-        f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
+        set_file_flags(f,UD_FILE_IMPROPER_STATE,jp);
         jp->p_counters.moving_time += winx_xtime() - time;
         return (-1);
     }
@@ -561,7 +720,7 @@ int move_file(winx_file_info *f,
     if(!check_region(jp,target,length)){
         etrace("there is no sufficient "
             "free space available on target block for %ws",path);
-        f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
+        set_file_flags(f,UD_FILE_IMPROPER_STATE,jp);
         jp->p_counters.moving_time += winx_xtime() - time;
         return (-1);
     }
@@ -575,7 +734,7 @@ int move_file(winx_file_info *f,
     status = winx_defrag_fopen(f,WINX_OPEN_FOR_MOVE,&hFile);
     if(status != STATUS_SUCCESS){
         strace(status,"cannot open %ws",path);
-        f->user_defined_flags |= UD_FILE_LOCKED;
+        set_file_flags(f,UD_FILE_LOCKED,jp);
         /* redraw space */
         colorize_file(jp,f,old_color);
         /*jp->pi.processed_clusters += length;*/
@@ -588,13 +747,14 @@ int move_file(winx_file_info *f,
     winx_defrag_fclose(hFile);
     
     /* get file moving result */
-    calculate_file_disposition(f,vcn,length,target,&desired_file_info);
+    calculate_file_disposition(f,vcn,length,target,&desired_file_info,jp);
     if(jp->udo.dry_run){
         dump_result = -1;
     } else {
         memcpy(&new_file_info,f,sizeof(winx_file_info));
         new_file_info.disp.blockmap = NULL;
-        dump_result = winx_ftw_dump_file(&new_file_info,dump_terminator,(void *)jp);
+        new_file_info.user_defined_data = NULL;
+        dump_result = winx_ftw_dump_file(&new_file_info,dump_terminator,(void *)jp,jp->arena);
         if(dump_result < 0)
             etrace("cannot redump the file");
     }
@@ -618,10 +778,10 @@ int move_file(winx_file_info *f,
             if(block->next == new_file_info.disp.blockmap) break;
         }*/
         /* compare file dispositions */
-        if(compare_file_dispositions(&new_file_info,&desired_file_info) == 0){
+        if(compare_file_dispositions(&new_file_info,&desired_file_info,jp) == 0){
             moving_result = DETERMINED_MOVING_SUCCESS;
         } else {
-            if(compare_file_dispositions(&new_file_info,f) == 0){
+            if(compare_file_dispositions(&new_file_info,f,jp) == 0){
                 etrace("nothing has been moved for %ws",path);
                 moving_result = DETERMINED_MOVING_FAILURE;
             } else {
@@ -631,13 +791,13 @@ int move_file(winx_file_info *f,
             }
         }
         /* release calculated disposition */
-        winx_list_destroy((list_entry **)(void *)&desired_file_info.disp.blockmap);
+        release_fragments_list(&desired_file_info.disp.blockmap,jp);
     }
     
     /* handle a case when nothing has been moved */
     if(moving_result == DETERMINED_MOVING_FAILURE){
-        winx_list_destroy((list_entry **)(void *)&new_file_info.disp.blockmap);
-        f->user_defined_flags |= UD_FILE_MOVING_FAILED;
+        release_fragments_list(&new_file_info.disp.blockmap,jp);
+        set_file_flags(f,UD_FILE_MOVING_FAILED,jp);
         /* rescan target space */
         update_free_space_layout(jp,target,length);
         jp->p_counters.moving_time += winx_xtime() - time;
@@ -657,16 +817,16 @@ int move_file(winx_file_info *f,
     * space, update free space pool and adjust statistics.
     */
     if(moving_result == DETERMINED_MOVING_PARTIAL_SUCCESS)
-        f->user_defined_flags |= UD_FILE_MOVING_FAILED;
+        set_file_flags(f,UD_FILE_MOVING_FAILED,jp);
     
     /* reapply filters to the file */
-    f->user_defined_flags &= ~UD_FILE_EXCLUDED;
+    clear_file_flags(f,UD_FILE_EXCLUDED,jp);
     new_file_info.user_defined_flags &= ~UD_FILE_EXCLUDED;
     r1 = exclude_by_fragment_size(&new_file_info,jp);
     r2 = exclude_by_fragments(&new_file_info,jp);
     r3 = exclude_by_size(&new_file_info,jp);
     if(r1 || r2 || r3){
-        f->user_defined_flags |= UD_FILE_EXCLUDED;
+        set_file_flags(f,UD_FILE_EXCLUDED,jp);
         new_file_info.user_defined_flags |= UD_FILE_EXCLUDED;
     }
 
@@ -691,7 +851,7 @@ int move_file(winx_file_info *f,
     
     /* redraw released clusters and add them to the free space pool */
     clusters_to_redraw = length; curr_vcn = vcn;
-    first_block = get_first_block_of_cluster_chain(f,vcn);
+    first_block = get_first_block_of_cluster_chain(f,vcn,jp);
     for(block = first_block; block; block = block->next){
         /* redraw the current block or its part */
         lcn = block->lcn + (curr_vcn - block->vcn);
@@ -715,6 +875,7 @@ int move_file(winx_file_info *f,
                    them all later, between transfers of
                    large portions of data
                 */
+                remember_released_region(jp,lcn,n);
             }
         }
 
@@ -744,17 +905,8 @@ int move_file(winx_file_info *f,
     }
 
     /* new block map is available - use it */
-    for(block = f->disp.blockmap; block; block = block->next){
-        /* all blocks must be removed! */
-        (void)remove_block_from_file_blocks_tree(jp,block);
-        if(block->next == f->disp.blockmap) break;
-    }
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
-    memcpy(&f->disp,&new_file_info.disp,sizeof(winx_file_disposition));
-    for(block = f->disp.blockmap; block; block = block->next){
-        if(add_block_to_file_blocks_tree(jp,f,block) < 0) break;
-        if(block->next == f->disp.blockmap) break;
-    }
+    replace_file_blocks(f,&new_file_info.disp,jp);
+    update_file_entry(f,jp);
 
     /* update the list of fragmented files */
     if(is_fragmented(f) && !is_excluded(f))
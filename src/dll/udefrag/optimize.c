@@ -31,6 +31,28 @@
 
 #include "udefrag-internals.h"
 
+/*
+* Files sorted by the requested criteria.
+* Sort keys get copied from the files, so
+* most of comparisons touch the array only.
+*/
+typedef struct _sorted_file {
+    ULONGLONG key;              /* size or time, depending on the sorting flags */
+    ULONGLONG path_key;         /* sort key of the path, see compare_file_paths */
+    unsigned long has_path_key; /* nonzero value indicates that the path_key is valid */
+    winx_file_info *file;       /* the file itself */
+} sorted_file;
+
+/*
+* Context of a thread sorting files;
+* compact paths are built in its own
+* buffers, not in those of the job.
+*/
+typedef struct _sort_context {
+    udefrag_job_parameters *jp;
+    wchar_t *path_buffers[2];
+} sort_context;
+
 /************************************************************/
 /*                   Auxiliary routines                     */
 /************************************************************/
@@ -59,23 +81,18 @@ static int cleanup_space(udefrag_job_parameters *jp, winx_file_info *file,
 {
     ULONGLONG current_vcn, target, n;
     winx_volume_region *rgn;
-    struct prb_traverser t;
     
     if(clusters_to_cleanup == 0) return 0;
     if(file == NULL || block == NULL) return 0;
     
     current_vcn = block->vcn;
     while(clusters_to_cleanup){
-        /* use the last free region */
+        /* use the last free region outside of the reserved range */
         if(jp->free_regions == NULL) return (-1);
-        rgn = prb_t_last(&t,jp->free_regions);
-        while(rgn){
-            if(jp->termination_router((void *)jp)) return (-1);
-            if(rgn->lcn > reserved_end_lcn || rgn->lcn + \
-                rgn->length <= reserved_start_lcn) break;
-            if(reserved_start_lcn == 0) return (-1);
-            rgn = prb_t_prev(&t);
-        }
+        rgn = find_last_free_region(jp,reserved_end_lcn + 1,
+            jp->v_info.total_clusters,1);
+        if(rgn == NULL && reserved_start_lcn)
+            rgn = find_last_free_region(jp,0,reserved_start_lcn,1);
         if(rgn == NULL) return (-1);
         
         n = min(rgn->length,clusters_to_cleanup);
@@ -93,34 +110,42 @@ static int cleanup_space(udefrag_job_parameters *jp, winx_file_info *file,
  * @brief Advances VCN by the specified number of clusters.
  * @return The advanced VCN; may point beyond the file.
  */
-static ULONGLONG advance_vcn(winx_file_info *f,ULONGLONG vcn,ULONGLONG n)
+static ULONGLONG advance_vcn(winx_file_info *f,ULONGLONG vcn,ULONGLONG n,
+    udefrag_job_parameters *jp)
 {
-    ULONGLONG current_vcn;
-    winx_blockmap *block;
+    winx_extent_map *map;
+    winx_extent *extent;
+    ULONGLONG current_vcn, left;
+    unsigned long i;
     
     if(n == 0)
         return vcn;
     
+    map = get_extent_map(f,jp);
+    if(map == NULL){
+        etrace("cannot build map of extents for %ws",winx_file_path(f));
+        return 0;
+    }
+    
     current_vcn = vcn;
-    for(block = f->disp.blockmap; block && n; block = block->next){
-        if(block->vcn + block->length > vcn){
-            if(n > block->length - (current_vcn - block->vcn)){
-                n -= block->length - (current_vcn - block->vcn);
-                current_vcn = block->next->vcn;
-            } else {
-                if(n == block->length - (current_vcn - block->vcn)){
-                    if(block->next == f->disp.blockmap)
-                        return block->vcn + block->length;
-                    else
-                        return block->next->vcn;
-                } else {
-                    return current_vcn + n;
-                }
-            }
+    for(i = winx_find_extent_by_vcn(map,vcn); i < map->count; i++){
+        extent = &map->extents[i];
+        if(current_vcn < extent->vcn)
+            current_vcn = extent->vcn;
+        left = extent->length - (current_vcn - extent->vcn);
+        if(n > left){
+            n -= left;
+            if(i == map->count - 1) break;
+            current_vcn = map->extents[i + 1].vcn;
+        } else if(n == left){
+            if(i == map->count - 1)
+                return extent->vcn + extent->length;
+            return map->extents[i + 1].vcn;
+        } else {
+            return current_vcn + n;
         }
-        if(block->next == f->disp.blockmap) break;
     }
-    etrace("vcn calculation failed for %ws",f->path);
+    etrace("vcn calculation failed for %ws",winx_file_path(f));
     return 0;
 }
 
@@ -231,7 +256,7 @@ try_again:
             if(result == -1) goto done;
           
             if(first_file != f){
-                first_file->user_defined_flags |= UD_FILE_FRAGMENTED_BY_FILE_OPT;
+                set_file_flags(first_file,UD_FILE_FRAGMENTED_BY_FILE_OPT,jp);
             }
             
             if(result == -2){
@@ -273,14 +298,14 @@ move_the_file:
         
         clusters_to_move = min(clusters_to_process,target_rgn->length);
         target = target_rgn->lcn;
-        next_vcn = advance_vcn(f,start_vcn,clusters_to_move);
+        next_vcn = advance_vcn(f,start_vcn,clusters_to_move,jp);
         if(move_file(f,start_vcn,clusters_to_move,target,jp) < 0){
             if(jp->last_move_status != STATUS_ALREADY_COMMITTED){
                 /* on unrecoverable failures exit */
                 break;
             }
             /* go forward and try to cleanup next blocks */
-            f->user_defined_flags &= ~UD_FILE_MOVING_FAILED;
+            clear_file_flags(f,UD_FILE_MOVING_FAILED,jp);
             start_lcn = target + clusters_to_move;
             continue;
         }
@@ -331,6 +356,8 @@ static int optimize_directories(udefrag_job_parameters *jp)
 {
     struct prb_traverser t;
     winx_file_info *file, *next_file;
+    file_entry *e;
+    unsigned long i;
     ULONGLONG optimized_dirs;
     char buffer[32];
     ULONGLONG time;
@@ -339,11 +366,11 @@ static int optimize_directories(udefrag_job_parameters *jp)
     jp->pi.moved_clusters = 0;
 
     /* exclude not fragmented FAT directories only */
-    for(file = jp->filelist; file; file = file->next){
-        file->user_defined_flags &= ~UD_FILE_CURRENTLY_EXCLUDED;
-        if(jp->is_fat && is_directory(file) && !is_fragmented(file))
-            file->user_defined_flags |= UD_FILE_CURRENTLY_EXCLUDED;
-        if(file->next == jp->filelist) break;
+    clear_currently_excluded_flag(jp);
+    for(i = 0; jp->is_fat && i < jp->catalog_size; i++){
+        e = &jp->catalog[i];
+        if((e->attributes & FILE_ATTRIBUTE_DIRECTORY) && e->fragments <= 1)
+            set_file_flags(e->file,UD_FILE_CURRENTLY_EXCLUDED,jp);
     }
 
     /* open the volume */
@@ -363,7 +390,7 @@ static int optimize_directories(udefrag_job_parameters *jp)
             if(optimize_file(file,jp) > 0)
                 optimized_dirs ++;
         }
-        file->user_defined_flags |= UD_FILE_CURRENTLY_EXCLUDED;
+        set_file_flags(file,UD_FILE_CURRENTLY_EXCLUDED,jp);
         file = next_file;
     }
     
@@ -476,7 +503,7 @@ static int optimize_mft_routine(udefrag_job_parameters *jp)
     
     /* release space which belonged to the master file table */
     if(result != 0 && !jp->udo.dry_run)
-        update_free_space_layout(jp,0,jp->v_info.total_clusters);
+        rescan_released_regions(jp);
 
     /* cleanup */
     clear_currently_excluded_flag(jp);
@@ -485,54 +512,114 @@ static int optimize_mft_routine(udefrag_job_parameters *jp)
     return (result >= 0) ? 0 : (-1);
 }
 
+/**
+ * @internal
+ * @brief Defines the primary sort key of a file.
+ * @details Files of equal keys get sorted by path.
+ */
+static ULONGLONG get_sort_key(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    if(jp->udo.sorting_flags & UD_SORT_BY_SIZE)
+        return f->disp.clusters;
+    if(jp->udo.sorting_flags & UD_SORT_BY_CREATION_TIME)
+        return f->creation_time;
+    if(jp->udo.sorting_flags & UD_SORT_BY_MODIFICATION_TIME)
+        return f->last_modification_time;
+    if(jp->udo.sorting_flags & UD_SORT_BY_ACCESS_TIME)
+        return f->last_access_time;
+    return 0; /* sort by path */
+}
+
 /**
  * @internal
  * @brief Exclusively defines rules for the file sorting on the disk.
+ * @note Gets called by several threads at once.
  */
-static int files_compare(const void *prb_a, const void *prb_b, void *prb_param)
+static int files_compare(const void *p_a, const void *p_b, void *param)
 {
-    winx_file_info *a, *b;
-    udefrag_job_parameters *jp;
+    sorted_file *a, *b;
+    sort_context *sc;
     int result;
     
-    a = (winx_file_info *)prb_a;
-    b = (winx_file_info *)prb_b;
-    jp = (udefrag_job_parameters *)prb_param;
+    a = (sorted_file *)p_a;
+    b = (sorted_file *)p_b;
+    sc = (sort_context *)param;
     
-    if(jp->udo.sorting_flags & UD_SORT_BY_SIZE){
-        /* sort files of equal sizes by path */
-        if(a->disp.clusters == b->disp.clusters) goto paths_compare;
-        result = (a->disp.clusters > b->disp.clusters) ? 1 : (-1);
-        goto done;
+    if(a->key != b->key){
+        result = (a->key > b->key) ? 1 : (-1);
+    } else if(a->has_path_key && b->has_path_key && a->path_key != b->path_key){
+        result = (a->path_key > b->path_key) ? 1 : (-1);
+    } else {
+        result = compare_paths_of_files(a->file,b->file,sc->path_buffers);
     }
     
-    if(jp->udo.sorting_flags & UD_SORT_BY_CREATION_TIME){
-        /* sort files of equal creation times by path */
-        if(a->creation_time == b->creation_time) goto paths_compare;
-        result = (a->creation_time > b->creation_time) ? 1 : (-1);
-        goto done;
-    }
+    if(sc->jp->udo.sorting_flags & UD_SORT_DESCENDING) result *= (-1);
+    return result;
+}
 
-    if(jp->udo.sorting_flags & UD_SORT_BY_MODIFICATION_TIME){
-        /* sort files of equal last modification times by path */
-        if(a->last_modification_time == b->last_modification_time) goto paths_compare;
-        result = (a->last_modification_time > b->last_modification_time) ? 1 : (-1);
-        goto done;
+/**
+ * @internal
+ * @brief Builds an array of files
+ * sorted by the requested criteria.
+ * @param[in] jp the job parameters.
+ * @param[out] n number of files in the array.
+ * @return The array, NULL indicates failure.
+ */
+static sorted_file *sort_files(udefrag_job_parameters *jp,ULONGLONG *n)
+{
+    sort_context contexts[WINX_SORT_MAX_THREADS];
+    void *params[WINX_SORT_MAX_THREADS];
+    sorted_file *files;
+    winx_file_info *f;
+    file_entry *e;
+    unsigned long i;
+    ULONGLONG time;
+    int result;
+    
+    *n = 0;
+    files = winx_tmalloc((jp->catalog_size + 1) * sizeof(sorted_file));
+    if(files == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)(jp->catalog_size + 1) * sizeof(sorted_file));
+        return NULL;
     }
-
-    if(jp->udo.sorting_flags & UD_SORT_BY_ACCESS_TIME){
-        /* sort files of equal last access times by path */
-        if(a->last_access_time == b->last_access_time) goto paths_compare;
-        result = (a->last_access_time > b->last_access_time) ? 1 : (-1);
-        goto done;
+    
+    for(i = 0; i < jp->catalog_size; i++){
+        e = &jp->catalog[i];
+        f = e->file;
+        if(e->clusters * jp->v_info.bytes_per_cluster \
+          < jp->udo.optimizer_size_limit){
+            if(can_move_entirely(f,jp)){
+                files[*n].key = get_sort_key(f,jp);
+                files[*n].path_key = e->path_key;
+                files[*n].has_path_key = e->has_path_key;
+                files[*n].file = f;
+                (*n) ++;
+            }
+        }
     }
-
-paths_compare:    
-    result = winx_wcsicmp(a->path, b->path);
     
-done:
-    if(jp->udo.sorting_flags & UD_SORT_DESCENDING) result *= (-1);
-    return result;
+    time = start_timing("file sorting",jp);
+    for(i = 0; i < WINX_SORT_MAX_THREADS; i++){
+        contexts[i].jp = jp;
+        contexts[i].path_buffers[0] = NULL;
+        contexts[i].path_buffers[1] = NULL;
+        params[i] = &contexts[i];
+    }
+    result = winx_sort(files,*n,sizeof(sorted_file),
+        files_compare,params,jp->udo.sorting_threads);
+    for(i = 0; i < WINX_SORT_MAX_THREADS; i++){
+        winx_free(contexts[i].path_buffers[0]);
+        winx_free(contexts[i].path_buffers[1]);
+    }
+    stop_timing("file sorting",time,jp);
+    
+    if(result < 0){
+        winx_free(files);
+        *n = 0;
+        return NULL;
+    }
+    return files;
 }
 
 /**
@@ -545,11 +632,14 @@ done:
  * @param[in] end_lcn the first LCN beyond
  * of the region intended for placement of
  * sorted out files.
- * @param[in] t pointer to structure
- * used to traverse the tree of files.
+ * @param[in] files the sorted files.
+ * @param[in] n number of the sorted files.
+ * @param[in,out] pos index of the first
+ * file not processed yet.
  */
 static void move_files_to_front(udefrag_job_parameters *jp,
-    ULONGLONG *start_lcn, ULONGLONG end_lcn, struct prb_traverser *t)
+    ULONGLONG *start_lcn, ULONGLONG end_lcn,
+    sorted_file *files, ULONGLONG n, ULONGLONG *pos)
 {
     winx_file_info *file;
     winx_volume_region *rgn;
@@ -565,11 +655,11 @@ static void move_files_to_front(udefrag_job_parameters *jp,
 
     /* force Windows to release space which belonged to files moved before */
     if(jp->fs_type == FS_NTFS && !jp->udo.dry_run)
-        update_free_space_layout(jp,0,jp->v_info.total_clusters);
+        rescan_released_regions(jp);
 
     /* do the job */
-    file = prb_t_cur(t);
-    while(file){
+    for(; *pos < n; (*pos) ++){
+        file = files[*pos].file;
         if(can_move_entirely(file,jp)){
             region_not_found = 1;
             rgn = find_first_free_region(jp,*start_lcn,file->disp.clusters);
@@ -580,17 +670,15 @@ static void move_files_to_front(udefrag_job_parameters *jp,
             if(region_not_found){
                 if(file->user_defined_flags & UD_FILE_REGION_NOT_FOUND){
                     /* whenever it's impossible to find a suitable region twice, skip the file */
-                    file = prb_t_next(t);
                     skipped_files ++;
                     continue;
                 } else {
                     if(skipped_files && !jp->pi.moved_clusters){
                         /* skip all subsequent big files too */
-                        file = prb_t_next(t);
                         skipped_files ++;
                         continue;
                     } else {
-                        file->user_defined_flags |= UD_FILE_REGION_NOT_FOUND;
+                        set_file_flags(file,UD_FILE_REGION_NOT_FOUND,jp);
                         break;
                     }
                 }
@@ -605,9 +693,8 @@ static void move_files_to_front(udefrag_job_parameters *jp,
                     *start_lcn = lcn + 1;
                 }
             }
-            file->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+            set_file_flags(file,UD_FILE_MOVED_TO_FRONT,jp);
         }
-        file = prb_t_next(t);
     }
     
     /* display amount of moved data */
@@ -647,19 +734,19 @@ static int is_block_quite_small(udefrag_job_parameters *jp,
     if(block_size >= jp->udo.fragment_size_threshold) return 0;
 
     /* move small fragments needing defragmentation */
-    fragments = build_fragments_list(file,NULL);
+    fragments = build_fragments_list(file,NULL,jp);
     for(fr = fragments; fr; fr = fr->next){
         if(block->lcn >= fr->lcn && block->lcn < fr->lcn + fr->length){
             fragment_size = fr->length * jp->v_info.bytes_per_cluster;
             if(fragment_size >= jp->udo.fragment_size_threshold){
-                release_fragments_list(&fragments);
+                release_fragments_list(&fragments,jp);
                 return 0;
             }
             break;
         }
         if(fr->next == fragments) break;
     }
-    release_fragments_list(&fragments);
+    release_fragments_list(&fragments,jp);
     return 1;
 }
 
@@ -688,7 +775,7 @@ static void move_files_to_back(udefrag_job_parameters *jp,ULONGLONG *start_lcn)
 
     /* force Windows to release space which belonged to files moved before */
     if(jp->fs_type == FS_NTFS && !jp->udo.dry_run && jp->pi.pass_number > 0)
-        update_free_space_layout(jp,0,jp->v_info.total_clusters);
+        rescan_released_regions(jp);
 
     /* do the job */
     min_lcn = *start_lcn;
@@ -725,14 +812,16 @@ done:
  * @internal
  * @brief Marks a group of
  * files as already optimized.
+ * @param[in] jp the job parameters.
+ * @param[in] files the first file of the group.
+ * @param[in] n number of files in the group.
+ * @param[in] length length of the group, in clusters.
  */
 static void cut_off_group_of_files(udefrag_job_parameters *jp,
-    struct prb_table *pt,winx_file_info *first_file,ULONGLONG n,
-    ULONGLONG length)
+    sorted_file *files,ULONGLONG n,ULONGLONG length)
 {
-    struct prb_traverser t;
-    winx_file_info *file;
     ULONGLONG magic_length;
+    ULONGLONG i;
     
     /* the group should be larger than 20 MB or should contain at least 10 files */
     magic_length = min(OPTIMIZER_MAGIC_CONSTANT,jp->udo.optimizer_size_limit);
@@ -741,16 +830,9 @@ static void cut_off_group_of_files(udefrag_job_parameters *jp,
             return;
     }
     
-    prb_t_init(&t,pt);
-    file = prb_t_find(&t,pt,first_file);
-    while(file && n){
-        file->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
-        n --;
-        jp->already_optimized_clusters += file->disp.clusters;
-        file = prb_t_next(&t);
-    }
-    if(n > 0){
-        etrace("cannot find file in tree");
+    for(i = 0; i < n; i++){
+        set_file_flags(files[i].file,UD_FILE_MOVED_TO_FRONT,jp);
+        jp->already_optimized_clusters += files[i].file->disp.clusters;
     }
 }
 
@@ -759,11 +841,12 @@ static void cut_off_group_of_files(udefrag_job_parameters *jp,
  * @brief Marks all sorted out groups
  * of files as already optimized.
  */
-static void cut_off_sorted_out_files(udefrag_job_parameters *jp,struct prb_table *pt)
+static void cut_off_sorted_out_files(udefrag_job_parameters *jp,
+    sorted_file *files,ULONGLONG n_files)
 {
-    struct prb_traverser t;
     winx_file_info *file;
-    winx_file_info *first_file; /* the first file of the group */
+    ULONGLONG i;                /* index of the current file */
+    ULONGLONG first;            /* index of the first file of the group */
     ULONGLONG n;                /* number of files in the group */
     ULONGLONG length;           /* length of the group, in clusters */
     ULONGLONG pplcn;            /* LCN of the (i - 2)-th file */
@@ -772,6 +855,7 @@ static void cut_off_sorted_out_files(udefrag_job_parameters *jp,struct prb_table
     ULONGLONG distance;
     ULONGLONG file_length;
     winx_file_info *prev_file;
+    file_entry *e;
     #define INVALID_LCN ((ULONGLONG) -1)
     int belongs_to_group;
     ULONGLONG magic_length;
@@ -784,47 +868,46 @@ static void cut_off_sorted_out_files(udefrag_job_parameters *jp,struct prb_table
     magic_length = min(OPTIMIZER_MAGIC_CONSTANT,jp->udo.optimizer_size_limit);
     
     /* select the first not fragmented file */
-    prb_t_init(&t,pt);
-    file = prb_t_first(&t,pt);
-    while(file){
-        if(!is_fragmented(file)) break;
-        file = prb_t_next(&t);
+    for(i = 0; i < n_files; i++){
+        if(file_entry_of(files[i].file)->fragments <= 1) break;
     }
-    if(file == NULL) goto done;
+    if(i == n_files) goto done;
 
     /* initialize the group */
-    first_file = file;
+    file = files[i].file;
+    first = i;
     n = 1;
-    length = file->disp.clusters;
+    length = file_entry_of(file)->clusters;
     pplcn = INVALID_LCN;
-    plcn = file->disp.blockmap->lcn;
+    plcn = file_entry_of(file)->lcn;
     prev_file = file;
     
     /* analyze subsequent files */
-    file = prb_t_next(&t);
-    while(file){
+    for(i ++; i < n_files; i++){
+        file = files[i].file;
+        e = file_entry_of(file);
         /* check whether the file belongs to the group or not */
         belongs_to_group = 1;
         /* 1. the file must be not fragmented */
-        if(is_fragmented(file))
+        if(e->fragments > 1)
             belongs_to_group = 0;
         /* 2. the file must be beyond one of the preceding two files */
         if(belongs_to_group){
             if(pplcn != INVALID_LCN && plcn != INVALID_LCN){
-                lcn = file->disp.blockmap->lcn;
+                lcn = e->lcn;
                 if(lcn < pplcn && lcn < plcn)
                     belongs_to_group = 0;
             }
         }
         /* 3. the file must be close to the preceding one */
         if(belongs_to_group && plcn != INVALID_LCN){
-            lcn = file->disp.blockmap->lcn;
+            lcn = e->lcn;
             if(lcn < plcn){
                 distance = (plcn - lcn) * jp->v_info.bytes_per_cluster;
-                file_length = file->disp.clusters * jp->v_info.bytes_per_cluster;
+                file_length = e->clusters * jp->v_info.bytes_per_cluster;
             } else {
                 distance = (lcn - plcn) * jp->v_info.bytes_per_cluster;
-                file_length = prev_file->disp.clusters * jp->v_info.bytes_per_cluster;
+                file_length = file_entry_of(prev_file)->clusters * jp->v_info.bytes_per_cluster;
             }
             second_magic_length = file_length * OPTIMIZER_MAGIC_CONSTANT_M;
             if(second_magic_length / OPTIMIZER_MAGIC_CONSTANT_M != file_length){
@@ -836,34 +919,33 @@ static void cut_off_sorted_out_files(udefrag_job_parameters *jp,struct prb_table
         }
         if(belongs_to_group){
             n ++;
-            length += file->disp.clusters;
+            length += e->clusters;
             pplcn = plcn;
-            plcn = file->disp.blockmap->lcn;
+            plcn = e->lcn;
             prev_file = file;
         } else {
             if(n > 1){
                 /* remark all files in the previous group */
-                cut_off_group_of_files(jp,pt,first_file,n,length);
+                cut_off_group_of_files(jp,files + first,n,length);
             }
             /* reset the group */
-            while(file){
-                if(!is_fragmented(file)) break;
-                file = prb_t_next(&t);
+            for(; i < n_files; i++){
+                if(file_entry_of(files[i].file)->fragments <= 1) break;
             }
-            if(file == NULL) goto done;
-            first_file = file;
+            if(i == n_files) goto done;
+            file = files[i].file;
+            first = i;
             n = 1;
-            length = file->disp.clusters;
+            length = file_entry_of(file)->clusters;
             pplcn = INVALID_LCN;
-            plcn = file->disp.blockmap->lcn;
+            plcn = file_entry_of(file)->lcn;
             prev_file = file;
         }
-        file = prb_t_next(&t);
     }
     
     if(n > 1){
         /* remark all files in the group */
-        cut_off_group_of_files(jp,pt,first_file,n,length);
+        cut_off_group_of_files(jp,files + first,n,length);
     }
 
 done:
@@ -886,7 +968,7 @@ static ULONGLONG count_clusters(udefrag_job_parameters *jp,ULONGLONG start_lcn)
     
     /* force Windows to release space which belonged to files moved before */
     if(jp->fs_type == FS_NTFS && !jp->udo.dry_run && jp->pi.pass_number > 0)
-        update_free_space_layout(jp,0,jp->v_info.total_clusters);
+        rescan_released_regions(jp);
 
     if(jp->free_regions){
         rgn = find_first_free_region(jp,start_lcn,1);
@@ -917,20 +999,20 @@ static ULONGLONG count_clusters(udefrag_job_parameters *jp,ULONGLONG start_lcn)
  * @internal
  * @brief Calculates number of clusters still needing to be optimized.
  */
-static ULONGLONG clusters_to_optimize(udefrag_job_parameters *jp,struct prb_table *pt)
+static ULONGLONG clusters_to_optimize(udefrag_job_parameters *jp,
+    sorted_file *files,ULONGLONG n_files)
 {
     winx_file_info *f;
-    struct prb_traverser t;
-    ULONGLONG n = 0;
+    file_entry *e;
+    ULONGLONG i, n = 0;
 
-    prb_t_init(&t,pt);
-    f = prb_t_first(&t,pt);
-    while(f){
-        if(!is_moved_to_front(f)){
+    for(i = 0; i < n_files; i++){
+        f = files[i].file;
+        e = file_entry_of(f);
+        if(!(e->flags & UD_FILE_MOVED_TO_FRONT)){
             if(can_move_entirely(f,jp))
-                n += f->disp.clusters;
+                n += e->clusters;
         }
-        f = prb_t_next(&t);
     }
     return n;
 }
@@ -942,11 +1024,9 @@ static ULONGLONG clusters_to_optimize(udefrag_job_parameters *jp,struct prb_tabl
  */
 static int optimize_routine(udefrag_job_parameters *jp)
 {
-    winx_file_info *f;
-    struct prb_table *pt;
-    struct prb_traverser t;
+    sorted_file *files;
+    ULONGLONG n, pos = 0;
     ULONGLONG start_lcn, end_lcn;
-    void **p;
     ULONGLONG time;
     int result = 0;
 
@@ -962,34 +1042,27 @@ static int optimize_routine(udefrag_job_parameters *jp)
     /* no files are excluded by this task currently */
     clear_currently_excluded_flag(jp);
 
-    /* build a tree of files sorted by the requested criteria */
-    pt = prb_create(files_compare,(void *)jp,NULL);
-    for(f = jp->filelist; f; f = f->next){
-        if(f->disp.clusters * jp->v_info.bytes_per_cluster \
-          < jp->udo.optimizer_size_limit){
-            if(can_move_entirely(f,jp)){
-                p = prb_probe(pt,(void *)f);
-                if(*p != f) etrace("a duplicate found for %ws",f->path);
-            }
-        }
-        if(f->next == jp->filelist) break;
+    /* sort files by the requested criteria */
+    files = sort_files(jp,&n);
+    if(files == NULL){
+        result = UDEFRAG_NO_MEM;
+        goto done;
     }
     
     if(jp->job_type == QUICK_OPTIMIZATION_JOB){
         /* cut off already sorted out groups of files */
-        cut_off_sorted_out_files(jp,pt);
+        cut_off_sorted_out_files(jp,files,n);
     }
     
     /* do the job */
-    prb_t_init(&t,pt);
-    if(prb_t_first(&t,pt) == NULL) goto done;
+    if(n == 0) goto done;
     start_lcn = end_lcn = 0;
     while(!jp->termination_router((void *)jp)){
         winx_dbg_print_header(0,0,I"volume optimization pass #%u",jp->pi.pass_number);
         jp->pi.clusters_to_process = \
             jp->pi.processed_clusters \
             + count_clusters(jp,start_lcn) \
-            + clusters_to_optimize(jp,pt);
+            + clusters_to_optimize(jp,files,n);
         
         /* cleanup space in the beginning of the disk */
         move_files_to_back(jp,&end_lcn);
@@ -1000,11 +1073,11 @@ static int optimize_routine(udefrag_job_parameters *jp)
         }
         
         /* move small files back, sorted */
-        move_files_to_front(jp,&start_lcn,end_lcn,&t);
+        move_files_to_front(jp,&start_lcn,end_lcn,files,n,&pos);
         jp->pi.pass_number ++; /* the pass is completed */
         
         /* break if no more files need optimization */
-        if(prb_t_cur(&t) == NULL) break;
+        if(pos == n) break;
         
         /* break if no repeat allowed */
         if(!(jp->udo.job_flags & UD_JOB_REPEAT)) break;
@@ -1017,7 +1090,7 @@ done:
     clear_currently_excluded_flag(jp);
     winx_fclose(jp->fVolume);
     jp->fVolume = NULL;
-    if(pt) prb_destroy(pt,NULL);
+    winx_free(files);
     return result;
 }
 
@@ -45,6 +45,11 @@ int get_options(udefrag_job_parameters *jp)
         "path", "path", "size", "creation time",
         "last modification time", "last access time"
     };
+    char *placements[] = {
+        "in the first free region large enough",
+        "next to their original location",
+        "next to their parent directories"
+    };
 
     /* reset all options */
     memset(&jp->udo,0,sizeof(udefrag_options));
@@ -110,6 +115,56 @@ int get_options(udefrag_job_parameters *jp)
         winx_free(buffer);
     }
     
+    /* set released regions threshold */
+    buffer = winx_getenv(L"UD_RELEASED_REGIONS_THRESHOLD");
+    if(buffer){
+        jp->udo.released_regions_limit = (ULONGLONG)_wtol(buffer);
+        winx_free(buffer);
+    }
+    if(jp->udo.released_regions_limit == 0)
+        jp->udo.released_regions_limit = DEFAULT_RELEASED_REGIONS_THRESHOLD;
+    
+    /* set mft queue depth */
+    buffer = winx_getenv(L"UD_MFT_QUEUE_DEPTH");
+    if(buffer){
+        jp->udo.mft_queue_depth = _wtoi(buffer);
+        winx_free(buffer);
+    }
+    if(jp->udo.mft_queue_depth <= 0)
+        jp->udo.mft_queue_depth = DEFAULT_MFT_QUEUE_DEPTH;
+    if(jp->udo.mft_queue_depth > MAX_MFT_QUEUE_DEPTH)
+        jp->udo.mft_queue_depth = MAX_MFT_QUEUE_DEPTH;
+    
+    /* set number of threads sorting files */
+    buffer = winx_getenv(L"UD_SORTING_THREADS");
+    if(buffer){
+        jp->udo.sorting_threads = _wtoi(buffer);
+        winx_free(buffer);
+    }
+    if(jp->udo.sorting_threads < 0)
+        jp->udo.sorting_threads = 0;
+    if(jp->udo.sorting_threads > WINX_SORT_MAX_THREADS)
+        jp->udo.sorting_threads = WINX_SORT_MAX_THREADS;
+    
+    /* set number of threads listing directories */
+    buffer = winx_getenv(L"UD_LISTING_THREADS");
+    if(buffer){
+        jp->udo.listing_threads = _wtoi(buffer);
+        winx_free(buffer);
+    }
+    if(jp->udo.listing_threads < 0)
+        jp->udo.listing_threads = 0;
+    if(jp->udo.listing_threads > WINX_FTW_MAX_THREADS)
+        jp->udo.listing_threads = WINX_FTW_MAX_THREADS;
+    
+    /* set compact paths flag */
+    buffer = winx_getenv(L"UD_COMPACT_PATHS");
+    if(buffer){
+        if(!wcscmp(buffer,L"1"))
+            jp->udo.compact_paths = 1;
+        winx_free(buffer);
+    }
+    
     /* set file sorting options */
     buffer = winx_getenv(L"UD_SORTING");
     if(buffer){
@@ -134,6 +189,17 @@ int get_options(udefrag_job_parameters *jp)
         winx_free(buffer);
     }
     
+    /* set placement of defragmented files */
+    buffer = winx_getenv(L"UD_PLACEMENT");
+    if(buffer){
+        (void)_wcslwr(buffer);
+        if(!wcscmp(buffer,L"file"))
+            jp->udo.placement = UD_PLACE_NEAR_FILE;
+        else if(!wcscmp(buffer,L"directory"))
+            jp->udo.placement = UD_PLACE_NEAR_DIRECTORY;
+        winx_free(buffer);
+    }
+    
     /* set time limit */
     buffer = winx_getenv(L"UD_TIME_LIMIT");
     if(buffer){
@@ -220,8 +286,18 @@ int get_options(udefrag_job_parameters *jp)
     (void)winx_bytes_to_hr(jp->udo.fragment_size_threshold,1,buf,sizeof(buf));
     itrace("fragment size threshold                   = %s",buf);
     itrace("file fragments threshold                  = %I64u",jp->udo.fragments_limit);
+    itrace("released regions threshold                = %I64u",jp->udo.released_regions_limit);
+    itrace("mft queue depth                           = %u",jp->udo.mft_queue_depth);
+    if(jp->udo.sorting_threads)
+        itrace("sorting threads                           = %u",jp->udo.sorting_threads);
+    else
+        itrace("sorting threads                           = one per processor");
+    itrace("listing threads                           = %u",jp->udo.listing_threads);
+    if(jp->udo.compact_paths)
+        itrace("compact paths will be used");
     itrace("files will be sorted by %s in %s order",methods[index],
         (jp->udo.sorting_flags & UD_SORT_DESCENDING) ? "descending" : "ascending");
+    itrace("defragmented files will be placed %s",placements[jp->udo.placement]);
     itrace("time limit                                = %I64u seconds",jp->udo.time_limit);
     itrace("progress refresh interval                 = %u msec",jp->udo.refresh_interval);
     if(jp->udo.disable_reports) itrace("reports disabled");
@@ -116,6 +116,7 @@ static int save_lua_report(udefrag_job_parameters *jp)
     char buffer[512];
     struct prb_traverser t;
     winx_file_info *file;
+    wchar_t *file_path;
     char *comment;
     char *status;
     int length;
@@ -218,13 +219,14 @@ static int save_lua_report(udefrag_job_parameters *jp)
         buffer[sizeof(buffer) - 1] = 0;
         (void)winx_fwrite(buffer,1,strlen(buffer),f);
 
-        if(file->path != NULL){
+        file_path = get_file_path(file,0,jp);
+        if(file_path != NULL){
             /* skip \??\ sequence in the beginning of the path */
-            length = (int)wcslen(file->path);
+            length = (int)wcslen(file_path);
             if(length > 4){
-                convert_to_utf8_path(utf8_path,MAX_UTF8_PATH_LENGTH,file->path + 4);
+                convert_to_utf8_path(utf8_path,MAX_UTF8_PATH_LENGTH,file_path + 4);
             } else {
-                convert_to_utf8_path(utf8_path,MAX_UTF8_PATH_LENGTH,file->path);
+                convert_to_utf8_path(utf8_path,MAX_UTF8_PATH_LENGTH,file_path);
             }
             (void)winx_fwrite(utf8_path,1,strlen(utf8_path),f);
         }
@@ -46,30 +46,16 @@
 winx_volume_region *find_first_free_region(udefrag_job_parameters *jp,
         ULONGLONG min_lcn,ULONGLONG min_length)
 {
-    winx_volume_region r, *rgn;
-    struct prb_traverser t;
+    winx_volume_region *rgn;
     ULONGLONG time = winx_xtime();
     
     if(jp->free_regions == NULL) return NULL;
+    if(jp->termination_router((void *)jp)) return NULL;
 
-    r.lcn = min_lcn; r.length = 1;
-    rgn = prb_t_insert(&t,jp->free_regions,&r);
-    if(rgn == &r){
-        /* no region starting at min_lcn found */
-        rgn = prb_t_next(&t);
-        prb_delete(jp->free_regions,&r);
-    }
-    
-    while(rgn && !jp->termination_router((void *)jp)){
-        if(rgn->length >= min_length){
-            jp->p_counters.searching_time += winx_xtime() - time;
-            return rgn;
-        }
-        rgn = prb_t_next(&t);
-    }
+    rgn = winx_find_first_volume_region(jp->free_regions,min_lcn,min_length);
     
     jp->p_counters.searching_time += winx_xtime() - time;
-    return NULL;
+    return rgn;
 }
 
 /**
@@ -77,30 +63,63 @@ winx_volume_region *find_first_free_region(udefrag_job_parameters *jp,
  * @brief Searches for the last suitable free space region.
  * @param[in] jp the job parameters.
  * @param[in] min_lcn minimum LCN of the region.
+ * @param[in] max_lcn the region must end at this LCN or before it.
  * @param[in] min_length minimum length of the region, in clusters.
  * @note In case of termination request returns NULL immediately.
  */
 winx_volume_region *find_last_free_region(udefrag_job_parameters *jp,
-        ULONGLONG min_lcn,ULONGLONG min_length)
+        ULONGLONG min_lcn,ULONGLONG max_lcn,ULONGLONG min_length)
 {
     winx_volume_region *rgn;
-    struct prb_traverser t;
     ULONGLONG time = winx_xtime();
     
     if(jp->free_regions == NULL) return NULL;
+    if(jp->termination_router((void *)jp)) return NULL;
 
-    rgn = prb_t_last(&t,jp->free_regions);
-    while(rgn && !jp->termination_router((void *)jp)){
-        if(rgn->lcn < min_lcn) break;
-        if(rgn->length >= min_length){
-            jp->p_counters.searching_time += winx_xtime() - time;
-            return rgn;
-        }
-        rgn = prb_t_prev(&t);
+    rgn = winx_find_last_volume_region(jp->free_regions,
+        min_lcn,max_lcn,min_length);
+
+    jp->p_counters.searching_time += winx_xtime() - time;
+    return rgn;
+}
+
+/**
+ * @internal
+ * @brief Searches for the free space region
+ * where a file may be placed closest to the
+ * specified logical cluster number.
+ * @param[in] jp the job parameters.
+ * @param[in] lcn the logical cluster number
+ * the file must be placed as close as possible to.
+ * @param[in] min_length minimum length of the region, in clusters.
+ * @param[out] target_lcn the logical cluster number
+ * to move the file to. It is the start of the region
+ * following lcn, or the end of the region preceding lcn;
+ * ties are resolved in favor of the following region.
+ * @note In case of termination request returns NULL immediately.
+ */
+winx_volume_region *find_nearest_free_region(udefrag_job_parameters *jp,
+        ULONGLONG lcn,ULONGLONG min_length,ULONGLONG *target_lcn)
+{
+    winx_volume_region *rgn, *prev_rgn;
+    ULONGLONG time = winx_xtime();
+    ULONGLONG prev_lcn = 0;
+    
+    if(jp->free_regions == NULL) return NULL;
+    if(jp->termination_router((void *)jp)) return NULL;
+
+    /* both searches take O(log n) time */
+    rgn = winx_find_first_volume_region(jp->free_regions,lcn,min_length);
+    prev_rgn = winx_find_last_volume_region(jp->free_regions,0,lcn,min_length);
+    if(prev_rgn){
+        prev_lcn = prev_rgn->lcn + prev_rgn->length - min_length;
+        if(rgn == NULL || lcn - prev_lcn < rgn->lcn - lcn)
+            rgn = prev_rgn;
     }
+    if(rgn) *target_lcn = (rgn == prev_rgn) ? prev_lcn : rgn->lcn;
 
     jp->p_counters.searching_time += winx_xtime() - time;
-    return NULL;
+    return rgn;
 }
 
 /**
@@ -111,28 +130,16 @@ winx_volume_region *find_last_free_region(udefrag_job_parameters *jp,
  */
 winx_volume_region *find_largest_free_region(udefrag_job_parameters *jp)
 {
-    winx_volume_region *rgn, *largest_rgn = NULL;
-    struct prb_traverser t;
-    ULONGLONG length = 0;
+    winx_volume_region *rgn;
     ULONGLONG time = winx_xtime();
 
     if(jp->free_regions == NULL) return NULL;
+    if(jp->termination_router((void *)jp)) return NULL;
 
-    rgn = prb_t_first(&t,jp->free_regions);
-    while(rgn){
-        if(jp->termination_router((void *)jp)){
-            jp->p_counters.searching_time += winx_xtime() - time;
-            return NULL;
-        }
-        if(rgn->length > length){
-            largest_rgn = rgn;
-            length = rgn->length;
-        }
-        rgn = prb_t_next(&t);
-    }
+    rgn = winx_find_largest_volume_region(jp->free_regions);
 
     jp->p_counters.searching_time += winx_xtime() - time;
-    return largest_rgn;
+    return rgn;
 }
 
 /************************************************************/
@@ -141,55 +148,93 @@ winx_volume_region *find_largest_free_region(udefrag_job_parameters *jp)
 
 /**
  * @internal
- * @brief An auxiliary structure used to save file blocks in a binary tree.
+ * @brief Creates and initializes a B+ tree
+ * to store all the file blocks into.
+ * @details Blocks are indexed by their LCNs;
+ * files they belong to are kept in the
+ * context member of the tree entries.
+ * Blocks of files which may be moved are
+ * marked, so searches skip the rest quickly.
+ * @return Zero for success, negative value otherwise.
+ * @note jp->file_blocks must be initialized by NULL
+ * or point to a valid tree before this call.
  */
-struct file_block {
-    winx_file_info *file;
-    winx_blockmap *block;
-};
+int create_file_blocks_tree(udefrag_job_parameters *jp)
+{
+    itrace("create_file_blocks_tree called");
+    if(jp->file_blocks) destroy_file_blocks_tree(jp);
+    jp->file_blocks = winx_bpt_create();
+    return 0;
+}
 
 /**
  * @internal
- * @brief An auxiliary routine used to sort file blocks in the binary tree.
+ * @brief Fills the tree of file blocks
+ * by blocks of all the files at once.
+ * @return Zero for success, negative value otherwise.
+ * @note The tree must be empty before this call.
  */
-static int blocks_compare(const void *prb_a, const void *prb_b, void *prb_param)
+int build_file_blocks_tree(udefrag_job_parameters *jp)
 {
-    struct file_block *a, *b;
-    
-    a = (struct file_block *)prb_a;
-    b = (struct file_block *)prb_b;
+    winx_bpt_entry *entries;
+    winx_file_info *f;
+    winx_blockmap *block;
+    ULONGLONG n = 0;
+    ULONGLONG time;
+    int result;
     
-    if(a->block->lcn < b->block->lcn)
+    if(jp->file_blocks == NULL)
         return (-1);
-    if(a->block->lcn == b->block->lcn)
-        return 0;
-    return 1;
-}
+    
+    time = start_timing("file blocks tree building",jp);
 
-/**
- * @internal
- * @brief An auxiliary routine used to free memory allocated for the tree items.
- */
-static void free_item (void *prb_item, void *prb_param)
-{
-    struct file_block *item = (struct file_block *)prb_item;
-    winx_free(item);
-}
+    for(f = jp->filelist; f; f = f->next){
+        for(block = f->disp.blockmap; block; block = block->next){
+            n ++;
+            if(block->next == f->disp.blockmap) break;
+        }
+        if(f->next == jp->filelist) break;
+    }
+    
+    entries = winx_tmalloc((size_t)n * sizeof(winx_bpt_entry));
+    if(entries == NULL && n){
+        /* add the blocks one by one then */
+        etrace("cannot allocate %I64u bytes of memory",
+            n * sizeof(winx_bpt_entry));
+        for(f = jp->filelist; f; f = f->next){
+            for(block = f->disp.blockmap; block; block = block->next){
+                if(add_block_to_file_blocks_tree(jp,f,block) < 0) goto done;
+                if(block->next == f->disp.blockmap) break;
+            }
+            if(f->next == jp->filelist) break;
+        }
+        goto done;
+    }
+    
+    n = 0;
+    for(f = jp->filelist; f; f = f->next){
+        for(block = f->disp.blockmap; block; block = block->next){
+            entries[n].key = block->lcn;
+            entries[n].item = block;
+            entries[n].context = f;
+            entries[n].marked = is_surely_unmovable(f) ? 0 : 1;
+            n ++;
+            if(block->next == f->disp.blockmap) break;
+        }
+        if(f->next == jp->filelist) break;
+    }
+    
+    result = winx_bpt_build(jp->file_blocks,entries,n);
+    winx_free(entries);
+    if(result < 0){
+        destroy_file_blocks_tree(jp);
+    } else if(jp->file_blocks->count != n){
+        etrace("%I64u duplicates found",n - jp->file_blocks->count);
+    }
 
-/**
- * @internal
- * @brief Creates and initializes a binary
- * tree to store all the file blocks into.
- * @return Zero for success, negative value otherwise.
- * @note jp->file_blocks must be initialized by NULL
- * or point to a valid tree before this call.
- */
-int create_file_blocks_tree(udefrag_job_parameters *jp)
-{
-    itrace("create_file_blocks_tree called");
-    if(jp->file_blocks) destroy_file_blocks_tree(jp);
-    jp->file_blocks = prb_create(blocks_compare,NULL,NULL);
-    return 0;
+done:
+    stop_timing("file blocks tree building",time,jp);
+    return jp->file_blocks ? 0 : (-1);
 }
 
 /**
@@ -200,8 +245,7 @@ int create_file_blocks_tree(udefrag_job_parameters *jp)
  */
 int add_block_to_file_blocks_tree(udefrag_job_parameters *jp, winx_file_info *file, winx_blockmap *block)
 {
-    struct file_block *fb;
-    void **p;
+    int result;
     
     if(file == NULL || block == NULL)
         return (-1);
@@ -209,15 +253,16 @@ int add_block_to_file_blocks_tree(udefrag_job_parameters *jp, winx_file_info *fi
     if(jp->file_blocks == NULL)
         return (-1);
 
-    fb = winx_malloc(sizeof *fb);
-    fb->file = file;
-    fb->block = block;
-    p = prb_probe(jp->file_blocks,(void *)fb);
-    /* if a duplicate item exists... */
-    if(*p != fb){
-        etrace("a duplicate found");
-        winx_free(fb);
+    result = winx_bpt_insert(jp->file_blocks,block->lcn,block,file);
+    if(result < 0){
+        etrace("not enough memory");
+        destroy_file_blocks_tree(jp);
+        return (-1);
     }
+    /* if a duplicate item exists... */
+    if(result > 0) etrace("a duplicate found");
+    else if(!is_surely_unmovable(file))
+        winx_bpt_mark(jp->file_blocks,block->lcn,1);
     return 0;
 }
 
@@ -228,27 +273,19 @@ int add_block_to_file_blocks_tree(udefrag_job_parameters *jp, winx_file_info *fi
  */
 int remove_block_from_file_blocks_tree(udefrag_job_parameters *jp, winx_blockmap *block)
 {
-    struct file_block *fb;
-    struct file_block b;
-    
     if(block == NULL)
         return (-1);
     
     if(jp->file_blocks == NULL)
         return (-1);
 
-    b.file = NULL;
-    b.block = block;
-    fb = prb_delete(jp->file_blocks,&b);
-    if(fb == NULL){
+    if(winx_bpt_erase(jp->file_blocks,block->lcn) == NULL){
         /* the following debugging output indicates either
            a bug, or file system inconsistency */
         etrace("failed for %p: VCN = %I64u, LCN = %I64u, LEN = %I64u",
             block, block->vcn, block->lcn, block->length);
         /* if block does not exist in the tree, we have nothing to cleanup */
-        return 0;
     }
-    winx_free(fb);
     return 0;
 }
 
@@ -260,11 +297,39 @@ void destroy_file_blocks_tree(udefrag_job_parameters *jp)
 {
     itrace("destroy_file_blocks_tree called");
     if(jp->file_blocks){
-        prb_destroy(jp->file_blocks,free_item);
+        winx_bpt_destroy(jp->file_blocks);
         jp->file_blocks = NULL;
     }
 }
 
+/**
+ * @internal
+ * @brief Marks blocks of a file in the binary
+ * tree as movable or unmovable, depending
+ * on the current state of the file.
+ * @note The tree holds a single entry per LCN,
+ * so entries of cross-linked blocks may belong
+ * to other files; those are left untouched.
+ */
+void mark_file_blocks(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    winx_blockmap *block;
+    winx_bpt_entry *item;
+    winx_bpt_iterator it;
+    int marked;
+    
+    if(jp->file_blocks == NULL)
+        return;
+    
+    marked = is_surely_unmovable(f) ? 0 : 1;
+    for(block = f->disp.blockmap; block; block = block->next){
+        item = winx_bpt_lower_bound(jp->file_blocks,block->lcn,&it);
+        if(item && item->key == block->lcn && item->context == f)
+            winx_bpt_mark(jp->file_blocks,block->lcn,marked);
+        if(block->next == f->disp.blockmap) break;
+    }
+}
+
 /************************************************************/
 /*                  File blocks searching                   */
 /************************************************************/
@@ -280,6 +345,8 @@ void destroy_file_blocks_tree(udefrag_job_parameters *jp)
  * @param[out] first_file pointer to
  * variable receiving information about
  * the file the found block belongs to.
+ * @note Blocks of files which cannot be moved
+ * for sure are skipped without checking them.
  * @note In case of termination request
  * returns NULL immediately.
  */
@@ -288,9 +355,8 @@ winx_blockmap *find_first_block(udefrag_job_parameters *jp,
 {
     winx_file_info *found_file;
     winx_blockmap *first_block;
-    winx_blockmap b;
-    struct file_block fb, *item;
-    struct prb_traverser t;
+    winx_bpt_entry *item;
+    winx_bpt_iterator it;
     int movable_file;
     ULONGLONG tm = winx_xtime();
     
@@ -298,20 +364,10 @@ winx_blockmap *find_first_block(udefrag_job_parameters *jp,
         return NULL;
     
     found_file = NULL; first_block = NULL;
-    b.lcn = *min_lcn; fb.block = &b;
-    prb_t_init(&t,jp->file_blocks);
-    item = prb_t_insert(&t,jp->file_blocks,&fb);
-    if(item == &fb){
-        /* block at min_lcn not found */
-        item = prb_t_next(&t);
-        if(prb_delete(jp->file_blocks,&fb) == NULL){
-            etrace("cannot remove block from the tree");
-            winx_flush_dbg_log(0); /* 'cause the error is critical */
-        }
-    }
+    item = winx_bpt_lower_bound_marked(jp->file_blocks,*min_lcn,&it);
     if(item){
-        found_file = item->file;
-        first_block = item->block;
+        found_file = (winx_file_info *)item->context;
+        first_block = (winx_blockmap *)item->item;
     }
     while(!jp->termination_router((void *)jp)){
         if(found_file == NULL) break;
@@ -335,11 +391,11 @@ winx_blockmap *find_first_block(udefrag_job_parameters *jp,
         
         /* skip the current block */
         *min_lcn = *min_lcn + 1;
-        /* and go to the next one */
-        item = prb_t_next(&t);
+        /* and go to the next movable one */
+        item = winx_bpt_lower_bound_marked(jp->file_blocks,item->key + 1,&it);
         if(item == NULL) break;
-        found_file = item->file;
-        first_block = item->block;
+        found_file = (winx_file_info *)item->context;
+        first_block = (winx_blockmap *)item->item;
     }
     *first_file = NULL;
     jp->p_counters.searching_time += winx_xtime() - tm;
@@ -43,6 +43,27 @@
 #define OPTIMIZER_MAGIC_CONSTANT_N  10
 #define OPTIMIZER_MAGIC_CONSTANT_M  1
 
+/*
+* Default number of regions released by moved files
+* above which the entire volume gets rescanned instead
+* of the individual regions.
+*/
+#define DEFAULT_RELEASED_REGIONS_THRESHOLD 1024
+
+/*
+* Default number of MFT chunks being read
+* and analyzed simultaneously; 1 disables
+* reading in advance, 15 is the maximum.
+*/
+#define DEFAULT_MFT_QUEUE_DEPTH 2
+#define MAX_MFT_QUEUE_DEPTH     15
+
+/*
+* Maximum length of file paths, in characters,
+* including the terminating null character.
+*/
+#define MAX_FILE_PATH_LENGTH 32768
+
 /************************************************************/
 /*                Prototypes, constants etc.                */
 /************************************************************/
@@ -120,6 +141,19 @@
 
 #define is_block_excluded(b)         ((b)->length == 0)
 
+/*
+* Files having any of these flags set
+* are never moved until the flags get
+* cleared, so their blocks are left
+* unmarked in the tree of file blocks.
+*/
+#define UD_FILE_UNMOVABLE_FLAGS (UD_FILE_LOCKED | UD_FILE_MOVING_FAILED | \
+    UD_FILE_IMPROPER_STATE | UD_FILE_CURRENTLY_EXCLUDED | \
+    UD_FILE_MOVED_TO_FRONT | UD_FILE_ESSENTIAL_BOOT_FILE)
+
+#define is_surely_unmovable(f) \
+    (((f)->user_defined_flags & UD_FILE_UNMOVABLE_FLAGS) || (f)->disp.blockmap == NULL)
+
 /*
 * NOTE: these flags are mutually exclusive.
 */
@@ -130,6 +164,13 @@
 #define UD_SORT_BY_ACCESS_TIME        0x10
 #define UD_SORT_DESCENDING            0x20
 
+/*
+* Placement of files defragmented entirely.
+*/
+#define UD_PLACE_FIRST_FIT            0 /* the first free region large enough */
+#define UD_PLACE_NEAR_FILE            1 /* the free region nearest to the file itself */
+#define UD_PLACE_NEAR_DIRECTORY       2 /* the free region nearest to the parent directory */
+
 typedef struct _udefrag_options {
     winx_patlist in_filter;     /* paths to be defragmented */
     winx_patlist ex_filter;     /* paths to be skipped */
@@ -139,6 +180,11 @@ typedef struct _udefrag_options {
     ULONGLONG size_limit;       /* file size threshold */
     ULONGLONG optimizer_size_limit; /* file size threshold for the disk optimization */
     ULONGLONG fragments_limit;  /* file fragments threshold */
+    ULONGLONG released_regions_limit; /* released regions threshold for partial rescans */
+    int mft_queue_depth;        /* number of MFT chunks being read and analyzed simultaneously */
+    int sorting_threads;        /* number of threads sorting files, zero means one per processor */
+    int listing_threads;        /* number of threads listing directories in advance, zero means none */
+    int compact_paths;          /* nonzero value forces the file list to keep paths in the compact form */
     ULONGLONG time_limit;       /* processing time limit, in seconds */
     int refresh_interval;       /* progress refresh interval, in milliseconds */
     int disable_reports;        /* nonzero value disables generation of the file fragmentation reports */
@@ -146,6 +192,7 @@ typedef struct _udefrag_options {
     int dry_run;                /* set %UD_DRY_RUN% variable to avoid actual data moving in tests */
     int job_flags;              /* flags triggering algorithm features */
     int sorting_flags;          /* flags triggering file sorting features (UD_SORT_xxx flags) */
+    int placement;              /* placement of files defragmented entirely (one of UD_PLACE_xxx constants) */
     int algorithm_defined_fst;  /* nonzero value indicates that the fragment size threshold
                                    is set by the algorithm and not by the user */
     double fragmentation_threshold; /* fragmentation level threshold */
@@ -205,6 +252,37 @@ struct file_counters {
     unsigned long giant_files;
 };
 
+enum {
+    TINY_FILE = 0,
+    SMALL_FILE,
+    AVERAGE_FILE,
+    BIG_FILE,
+    HUGE_FILE,
+    GIANT_FILE
+};
+
+/*
+* Frequently accessed information about a file.
+* Entries are kept in a single array, so passes
+* over all the files run through it instead of
+* touching every item of the list of files.
+* The file refers to its entry through the
+* user_defined_data member.
+*/
+typedef struct _file_entry {
+    ULONGLONG clusters;          /* number of clusters */
+    ULONGLONG lcn;               /* LCN of the first block */
+    ULONGLONG path_key;          /* sort key of the path, see compare_file_paths */
+    unsigned long has_path_key;  /* nonzero value indicates that the path_key is valid */
+    unsigned long fragments;     /* number of fragments */
+    unsigned long flags;         /* copy of the user_defined_flags */
+    unsigned long attributes;    /* copy of the FILE_ATTRIBUTE_xxx flags */
+    unsigned long size_class;    /* one of the TINY_FILE ... GIANT_FILE constants */
+    winx_file_info *file;        /* the file itself */
+} file_entry;
+
+#define file_entry_of(f) ((file_entry *)(f)->user_defined_data)
+
 typedef int  (*udefrag_termination_router)(void /*udefrag_job_parameters*/ *p);
 
 typedef struct _udefrag_job_parameters {
@@ -221,21 +299,30 @@ typedef struct _udefrag_job_parameters {
     winx_volume_information v_info;             /* basic volume information */
     file_system_type fs_type;                   /* type of the file system */
     int is_fat;                                 /* nonzero value indicates that the file system is a kind of FAT */
+    winx_arena *arena;                          /* arena the list of files, maps of blocks and regions are allocated from */
     winx_file_info *filelist;                   /* list of files */
+    file_entry *catalog;                        /* frequently accessed information about files */
+    unsigned long catalog_size;                 /* number of entries in the catalog */
     struct prb_table *fragmented_files;         /* binary tree of fragmented files; does not contain filtered out files */
     struct prb_table *free_regions;             /* binary tree of free space regions */
     unsigned long free_regions_count;           /* number of free space regions */
+    struct prb_table *released_regions;         /* binary tree of regions released by moved files, not rescanned yet */
+    int released_regions_lost;                  /* nonzero value indicates that some released regions were not remembered */
     ULONGLONG clusters_at_once;                 /* number of clusters to be moved at once */
     cmap cluster_map;                           /* cluster map's internal data */
     WINX_FILE *fVolume;                         /* handle of the volume, intended for use by file moving routines */
     struct performance_counters p_counters;     /* performance counters */
-    struct prb_table *file_blocks;              /* binary tree of all file blocks found on the volume */
+    winx_bptree *file_blocks;                   /* B+ tree of all file blocks found on the volume */
+    struct _analysis_pipeline *pipeline;        /* passes files found to the analysis stages; NULL if not running */
+    winx_extent_map extent_map;                 /* map of extents of the file processed last */
+    winx_file_info *extent_map_file;            /* file the map of extents has been built for */
     struct file_counters f_counters;            /* file counters */
     NTSTATUS last_move_status;                  /* status of the last move file operation; zero by default */
     ULONGLONG already_optimized_clusters;       /* number of clusters needing no sorting in optimization */
     int progress_trigger;                       /* a trigger used for debugging purposes */
     struct _mft_zone mft_zone;                  /* initial mft zone disposition */
     int win_version;                            /* Windows version */
+    wchar_t *path_buffers[2];                   /* buffers to build compact paths into, see get_file_path */
 } udefrag_job_parameters;
 
 int get_options(udefrag_job_parameters *jp);
@@ -259,6 +346,10 @@ int defragment(udefrag_job_parameters *jp);
 int optimize(udefrag_job_parameters *jp);
 int optimize_mft(udefrag_job_parameters *jp);
 void destroy_lists(udefrag_job_parameters *jp);
+wchar_t *build_file_path(winx_file_info *f,wchar_t **buffer);
+wchar_t *get_file_path(winx_file_info *f,int i,udefrag_job_parameters *jp);
+int compare_paths_of_files(winx_file_info *a,winx_file_info *b,wchar_t **buffers);
+int compare_file_paths(winx_file_info *a,winx_file_info *b,udefrag_job_parameters *jp);
 int check_fragmentation_level(udefrag_job_parameters *jp);
 
 void dbg_print_header(udefrag_job_parameters *jp);
@@ -278,10 +369,17 @@ int exclude_by_fragments(winx_file_info *f,udefrag_job_parameters *jp);
 int exclude_by_size(winx_file_info *f,udefrag_job_parameters *jp);
 int expand_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp);
 void truncate_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp);
-winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments);
-void release_fragments_list(winx_blockmap **fragments);
+winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments,udefrag_job_parameters *jp);
+void release_fragments_list(winx_blockmap **fragments,udefrag_job_parameters *jp);
 void clear_currently_excluded_flag(udefrag_job_parameters *jp);
 
+int build_file_catalog(udefrag_job_parameters *jp);
+void destroy_file_catalog(udefrag_job_parameters *jp);
+void update_file_entry(winx_file_info *f,udefrag_job_parameters *jp);
+void set_file_flags(winx_file_info *f,unsigned long flags,udefrag_job_parameters *jp);
+void clear_file_flags(winx_file_info *f,unsigned long flags,udefrag_job_parameters *jp);
+unsigned long get_size_class(ULONGLONG clusters,udefrag_job_parameters *jp);
+
 int move_file(winx_file_info *f,
               ULONGLONG vcn,
               ULONGLONG length,
@@ -290,16 +388,23 @@ int move_file(winx_file_info *f,
               );
 int can_move(winx_file_info *f,udefrag_job_parameters *jp);
 int can_move_entirely(winx_file_info *f,udefrag_job_parameters *jp);
+winx_extent_map *get_extent_map(winx_file_info *f,udefrag_job_parameters *jp);
+void invalidate_extent_map(udefrag_job_parameters *jp);
 
 winx_volume_region *find_first_free_region(udefrag_job_parameters *jp,ULONGLONG min_lcn,ULONGLONG min_length);
-winx_volume_region *find_last_free_region(udefrag_job_parameters *jp,ULONGLONG min_lcn,ULONGLONG min_length);
+winx_volume_region *find_last_free_region(udefrag_job_parameters *jp,ULONGLONG min_lcn,ULONGLONG max_lcn,ULONGLONG min_length);
 winx_volume_region *find_largest_free_region(udefrag_job_parameters *jp);
+winx_volume_region *find_nearest_free_region(udefrag_job_parameters *jp,ULONGLONG lcn,ULONGLONG min_length,ULONGLONG *target_lcn);
 void update_free_space_layout(udefrag_job_parameters *jp,ULONGLONG lcn,ULONGLONG length);
+void remember_released_region(udefrag_job_parameters *jp,ULONGLONG lcn,ULONGLONG length);
+void rescan_released_regions(udefrag_job_parameters *jp);
 
 int create_file_blocks_tree(udefrag_job_parameters *jp);
+int build_file_blocks_tree(udefrag_job_parameters *jp);
 int add_block_to_file_blocks_tree(udefrag_job_parameters *jp, winx_file_info *file, winx_blockmap *block);
 int remove_block_from_file_blocks_tree(udefrag_job_parameters *jp, winx_blockmap *block);
 void destroy_file_blocks_tree(udefrag_job_parameters *jp);
+void mark_file_blocks(winx_file_info *f,udefrag_job_parameters *jp);
 winx_blockmap *find_first_block(udefrag_job_parameters *jp,
     ULONGLONG *min_lcn, int flags, winx_file_info **first_file);
 
@@ -300,12 +300,111 @@ static DWORD WINAPI start_job(LPVOID p)
  * @internal
  * @brief Destroys the list of free regions, the
  * list of files and the list of fragmented files.
+ * @details Then releases the arena of the job,
+ * which frees all the list entries, maps of file
+ * blocks and regions at once.
  */
 void destroy_lists(udefrag_job_parameters *jp)
 {
-    winx_scan_disk_release(jp->filelist);
+    destroy_file_catalog(jp);
+    winx_scan_disk_release(jp->filelist,jp->arena);
+    jp->filelist = NULL;
     winx_release_free_volume_regions(jp->free_regions);
-    if(jp->fragmented_files) prb_destroy(jp->fragmented_files,NULL);
+    jp->free_regions = NULL;
+    winx_release_free_volume_regions(jp->released_regions);
+    jp->released_regions = NULL;
+    jp->released_regions_lost = 0;
+    winx_prb_destroy_pooled(jp->fragmented_files);
+    jp->fragmented_files = NULL;
+    winx_release_extent_map(&jp->extent_map);
+    jp->extent_map_file = NULL;
+    winx_arena_destroy(jp->arena);
+    jp->arena = NULL;
+    winx_free(jp->path_buffers[0]);
+    winx_free(jp->path_buffers[1]);
+    jp->path_buffers[0] = jp->path_buffers[1] = NULL;
+}
+
+/**
+ * @internal
+ * @brief Retrieves the full path of a file.
+ * @details Returns f->path if it is available,
+ * otherwise builds the compact path in the buffer.
+ * @param[in] f the file.
+ * @param[in,out] buffer pointer to the buffer;
+ * gets allocated when the buffer is NULL.
+ * @return The path, NULL indicates failure.
+ * @note The path built stays valid until
+ * the next call using the same buffer.
+ */
+wchar_t *build_file_path(winx_file_info *f,wchar_t **buffer)
+{
+    if(f->path || f->parent == NULL)
+        return f->path;
+    
+    if(*buffer == NULL)
+        *buffer = winx_malloc(MAX_FILE_PATH_LENGTH * sizeof(wchar_t));
+    if(winx_get_file_path(f,*buffer,MAX_FILE_PATH_LENGTH) < 0)
+        return NULL;
+    return *buffer;
+}
+
+/**
+ * @internal
+ * @brief Retrieves the full path of a file.
+ * @details Builds the compact path in one
+ * of the two buffers of the job.
+ * @param[in] f the file.
+ * @param[in] i index of the buffer, 0 or 1.
+ * @param[in] jp the job parameters.
+ * @return The path, NULL indicates failure.
+ * @note The path built stays valid until
+ * the next call using the same buffer.
+ */
+wchar_t *get_file_path(winx_file_info *f,int i,udefrag_job_parameters *jp)
+{
+    return build_file_path(f,&jp->path_buffers[i]);
+}
+
+/**
+ * @internal
+ * @brief Compares paths of two files
+ * regardless of the characters case.
+ * @details Compares sort keys of the paths
+ * cached in the catalog first; the paths
+ * themselves get compared for equal keys only.
+ * @param[in] a the first file.
+ * @param[in] b the second file.
+ * @param[in,out] buffers array of two buffers
+ * to build compact paths into, see build_file_path.
+ */
+int compare_paths_of_files(winx_file_info *a,winx_file_info *b,wchar_t **buffers)
+{
+    file_entry *ea = file_entry_of(a);
+    file_entry *eb = file_entry_of(b);
+    wchar_t *path_a, *path_b;
+    
+    if(ea && eb && ea->has_path_key && eb->has_path_key){
+        if(ea->path_key != eb->path_key)
+            return (ea->path_key < eb->path_key) ? (-1) : 1;
+    }
+    
+    path_a = build_file_path(a,&buffers[0]);
+    path_b = build_file_path(b,&buffers[1]);
+    if(path_a == NULL || path_b == NULL)
+        return (path_a ? 1 : 0) - (path_b ? 1 : 0);
+    return winx_wcsicmp(path_a,path_b);
+}
+
+/**
+ * @internal
+ * @brief Compares paths of two files
+ * regardless of the characters case.
+ * @details Uses the buffers of the job.
+ */
+int compare_file_paths(winx_file_info *a,winx_file_info *b,udefrag_job_parameters *jp)
+{
+    return compare_paths_of_files(a,b,jp->path_buffers);
 }
 
 /**
@@ -342,9 +441,12 @@ int udefrag_start_job(char volume_letter,udefrag_job_type job_type,int flags,
     
     memset(&jp,0,sizeof(udefrag_job_parameters));
     jp.win_version = winx_get_os_version();
+    jp.arena = NULL;
     jp.filelist = NULL;
     jp.fragmented_files = NULL;
     jp.free_regions = NULL;
+    jp.released_regions = NULL;
+    jp.released_regions_lost = 0;
     jp.progress_refresh_time = 0;
     
     jp.volume_letter = volume_letter;
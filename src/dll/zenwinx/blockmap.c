@@ -0,0 +1,222 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2016 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file blockmap.c
+ * @brief Maps of file blocks.
+ * @details Extent maps keep blocks of a file
+ * in contiguous arrays, so they can be found
+ * by VCN or LCN in logarithmic time. Each
+ * extent refers to its block of the list kept
+ * in winx_file_disposition structure, thus
+ * code working with the lists remains valid.
+ * @addtogroup File
+ * @{
+ */
+
+#include "ntndk.h"
+#include "zenwinx.h"
+
+/**
+ * @internal
+ * @brief Restores the heap property
+ * of the array of LCN ordered indices.
+ */
+static void sift_down(winx_extent_map *map,unsigned long i,unsigned long n)
+{
+    unsigned long child, index = map->lcn_order[i];
+    
+    while(i < n / 2){
+        child = 2 * i + 1;
+        if(child + 1 < n){
+            if(map->extents[map->lcn_order[child + 1]].lcn > \
+              map->extents[map->lcn_order[child]].lcn) child ++;
+        }
+        if(map->extents[index].lcn >= map->extents[map->lcn_order[child]].lcn) break;
+        map->lcn_order[i] = map->lcn_order[child];
+        i = child;
+    }
+    map->lcn_order[i] = index;
+}
+
+/**
+ * @internal
+ * @brief Sorts the extents by LCN.
+ * @details Uses heap sort, which needs
+ * neither recursion nor additional memory.
+ */
+static void sort_by_lcn(winx_extent_map *map)
+{
+    unsigned long i, n = map->count, index;
+    
+    for(i = 0; i < n; i++) map->lcn_order[i] = i;
+    if(n < 2) return;
+    
+    for(i = n / 2; i > 0; i--) sift_down(map,i - 1,n);
+    for(i = n - 1; i > 0; i--){
+        index = map->lcn_order[0];
+        map->lcn_order[0] = map->lcn_order[i];
+        map->lcn_order[i] = index;
+        sift_down(map,0,i);
+    }
+}
+
+/**
+ * @brief Builds the extent map of a file.
+ * @param[in] blockmap the list of blocks of the file.
+ * @param[in,out] map the map to be filled. It must be
+ * zeroed before the first use; the memory allocated
+ * for the map gets reused in subsequent calls.
+ * @return Zero for success, negative value otherwise.
+ * @note The map remains valid until the list of
+ * blocks gets changed.
+ */
+int winx_build_extent_map(winx_blockmap *blockmap,winx_extent_map *map)
+{
+    winx_blockmap *block;
+    winx_extent *extents;
+    unsigned long *lcn_order;
+    unsigned long count, size;
+    
+    DbgCheck1(map,-1);
+    
+    /* count blocks */
+    for(block = blockmap, count = 0; block; block = block->next){
+        count ++;
+        if(block->next == blockmap) break;
+    }
+    
+    /* allocate memory */
+    if(count > map->size){
+        size = max(count,map->size * 2);
+        extents = winx_tmalloc(size * sizeof(winx_extent));
+        lcn_order = winx_tmalloc(size * sizeof(unsigned long));
+        if(extents == NULL || lcn_order == NULL){
+            etrace("cannot allocate %I64u bytes of memory",
+                (ULONGLONG)size * (sizeof(winx_extent) + sizeof(unsigned long)));
+            winx_free(extents);
+            winx_free(lcn_order);
+            return (-1);
+        }
+        winx_free(map->extents);
+        winx_free(map->lcn_order);
+        map->extents = extents;
+        map->lcn_order = lcn_order;
+        map->size = size;
+    }
+    
+    /* fill the map */
+    map->count = 0;
+    map->clusters = 0;
+    map->fragments = 0;
+    for(block = blockmap; block; block = block->next){
+        map->extents[map->count].vcn = block->vcn;
+        map->extents[map->count].lcn = block->lcn;
+        map->extents[map->count].length = block->length;
+        map->extents[map->count].block = block;
+        map->count ++;
+        map->clusters += block->length;
+        if(block == blockmap || \
+          block->lcn != (block->prev->lcn + block->prev->length)){
+            map->fragments ++;
+        }
+        if(block->next == blockmap) break;
+    }
+    
+    sort_by_lcn(map);
+    return 0;
+}
+
+/**
+ * @brief Searches for the extent containing
+ * the specified VCN or following it.
+ * @return Index of the first extent ending after
+ * the VCN; map->count if there is no such extent.
+ */
+unsigned long winx_find_extent_by_vcn(winx_extent_map *map,ULONGLONG vcn)
+{
+    unsigned long lo = 0, hi = map->count, mid;
+    
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if(map->extents[mid].vcn + map->extents[mid].length <= vcn)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief Searches for the extent
+ * containing the specified LCN.
+ * @return Index of the extent in map->extents
+ * array, map->count if the LCN belongs to
+ * none of the extents.
+ */
+unsigned long winx_find_extent_by_lcn(winx_extent_map *map,ULONGLONG lcn)
+{
+    unsigned long lo = 0, hi = map->count, mid;
+    winx_extent *e;
+    
+    /* search for the first extent starting after the LCN */
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if(map->extents[map->lcn_order[mid]].lcn <= lcn)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo == 0) return map->count;
+    
+    /* extents of a file never overlap on disk */
+    e = &map->extents[map->lcn_order[lo - 1]];
+    if(lcn < e->lcn + e->length)
+        return map->lcn_order[lo - 1];
+    return map->count;
+}
+
+/**
+ * @brief Retrieves the block containing the specified VCN.
+ * @details Intended for code working with lists of blocks.
+ * @return The block of the list; NULL if the VCN belongs
+ * to none of the blocks.
+ */
+winx_blockmap *winx_get_block_by_vcn(winx_extent_map *map,ULONGLONG vcn)
+{
+    unsigned long i = winx_find_extent_by_vcn(map,vcn);
+    
+    if(i == map->count) return NULL;
+    if(vcn < map->extents[i].vcn) return NULL;
+    return map->extents[i].block;
+}
+
+/**
+ * @brief Releases memory allocated
+ * by winx_build_extent_map.
+ */
+void winx_release_extent_map(winx_extent_map *map)
+{
+    if(map == NULL) return;
+    winx_free(map->extents);
+    winx_free(map->lcn_order);
+    memset(map,0,sizeof(winx_extent_map));
+}
+
+/** @} */
@@ -0,0 +1,818 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2016 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file bptree.c
+ * @brief B+ trees of entries ordered by LCN.
+ * @details Leaves keep entries in contiguous arrays
+ * and are linked together, so range scans run
+ * over memory sequentially and searches touch
+ * a few nodes only. Nodes get released as soon
+ * as they become empty, underfilled nodes are
+ * never merged: the height of a tree depends on
+ * the largest number of entries it ever held.
+ *
+ * Entries can be marked. Inner nodes count marked
+ * entries of each of their children, so searches
+ * for marked entries skip unmarked subtrees entirely.
+ * @addtogroup BinaryTrees
+ * @{
+ */
+
+#include "ntndk.h"
+#include "zenwinx.h"
+
+/* fill factor of trees built by winx_bpt_build */
+#define BUILD_LEAF_FILL  (WINX_BPT_LEAF_SIZE * 3 / 4)
+#define BUILD_NODE_FILL  (WINX_BPT_FANOUT * 3 / 4)
+
+/************************************************************/
+/*                    Internal Routines                     */
+/************************************************************/
+
+/**
+ * @internal
+ * @brief Allocates a leaf.
+ */
+static winx_bpt_leaf *alloc_leaf(void)
+{
+    winx_bpt_leaf *leaf;
+    
+    leaf = winx_tmalloc(sizeof(winx_bpt_leaf));
+    if(leaf == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sizeof(winx_bpt_leaf));
+        return NULL;
+    }
+    leaf->next = leaf->prev = NULL;
+    leaf->count = leaf->marked = 0;
+    return leaf;
+}
+
+/**
+ * @internal
+ * @brief Allocates an inner node.
+ */
+static winx_bpt_node *alloc_node(void)
+{
+    winx_bpt_node *node;
+    
+    node = winx_tmalloc(sizeof(winx_bpt_node));
+    if(node == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sizeof(winx_bpt_node));
+        return NULL;
+    }
+    node->count = 0;
+    return node;
+}
+
+/**
+ * @internal
+ * @brief Releases a subtree.
+ * @param[in] node the root of the subtree.
+ * @param[in] height number of levels
+ * of inner nodes in the subtree.
+ */
+static void free_subtree(void *node,int height)
+{
+    winx_bpt_node *n = (winx_bpt_node *)node;
+    int i;
+    
+    if(height > 0){
+        for(i = 0; i < n->count; i++)
+            free_subtree(n->children[i],height - 1);
+    }
+    winx_free(node);
+}
+
+/**
+ * @internal
+ * @brief Returns number of marked entries of a subtree.
+ * @param[in] node the root of the subtree.
+ * @param[in] height number of levels
+ * of inner nodes in the subtree.
+ */
+static ULONGLONG count_marks(void *node,int height)
+{
+    winx_bpt_node *n = (winx_bpt_node *)node;
+    ULONGLONG marked = 0;
+    int i;
+    
+    if(height == 0)
+        return ((winx_bpt_leaf *)node)->marked;
+    for(i = 0; i < n->count; i++)
+        marked += n->marked[i];
+    return marked;
+}
+
+/**
+ * @internal
+ * @brief Counts marked entries of a leaf.
+ */
+static int count_leaf_marks(winx_bpt_leaf *leaf)
+{
+    int i, marked = 0;
+    
+    for(i = 0; i < leaf->count; i++)
+        if(leaf->entries[i].marked) marked ++;
+    return marked;
+}
+
+/**
+ * @internal
+ * @brief Returns index of the first
+ * entry of a leaf not less than the key.
+ */
+static int leaf_lower_bound(winx_bpt_leaf *leaf,ULONGLONG key)
+{
+    int lo = 0, hi = leaf->count, mid;
+    
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(leaf->entries[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @internal
+ * @brief Returns index of the first
+ * entry of a leaf greater than the key.
+ */
+static int leaf_upper_bound(winx_bpt_leaf *leaf,ULONGLONG key)
+{
+    int lo = 0, hi = leaf->count, mid;
+    
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(leaf->entries[mid].key <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @internal
+ * @brief Returns index of the child
+ * of an inner node the key belongs to.
+ * @note The first key of a node
+ * is never used for routing.
+ */
+static int find_child(winx_bpt_node *node,ULONGLONG key)
+{
+    int lo = 1, hi = node->count, mid;
+    
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(node->keys[mid] <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+/**
+ * @internal
+ * @brief Searches for the leaf the key belongs to.
+ * @param[in] tree the tree; must be not empty.
+ * @param[in] key the key.
+ * @param[out] path array receiving the inner
+ * nodes passed, starting from the lowest one.
+ * May be NULL.
+ * @param[out] slots array receiving indices
+ * of the children chosen in the inner nodes.
+ * May be NULL.
+ */
+static winx_bpt_leaf *find_leaf(winx_bptree *tree,ULONGLONG key,
+    winx_bpt_node **path,int *slots)
+{
+    void *node = tree->root;
+    int level, i;
+    
+    for(level = tree->height - 1; level >= 0; level--){
+        i = find_child((winx_bpt_node *)node,key);
+        if(path){
+            path[level] = (winx_bpt_node *)node;
+            slots[level] = i;
+        }
+        node = ((winx_bpt_node *)node)->children[i];
+    }
+    return (winx_bpt_leaf *)node;
+}
+
+/**
+ * @internal
+ * @brief Inserts a child into an inner node.
+ * @note The node must have room for the child.
+ */
+static void insert_child(winx_bpt_node *node,int pos,
+    ULONGLONG key,void *child,ULONGLONG marked)
+{
+    memmove(node->keys + pos + 1,node->keys + pos,
+        (node->count - pos) * sizeof(ULONGLONG));
+    memmove(node->children + pos + 1,node->children + pos,
+        (node->count - pos) * sizeof(void *));
+    memmove(node->marked + pos + 1,node->marked + pos,
+        (node->count - pos) * sizeof(ULONGLONG));
+    node->keys[pos] = key;
+    node->children[pos] = child;
+    node->marked[pos] = marked;
+    node->count ++;
+}
+
+/**
+ * @internal
+ * @brief Removes a child from an inner node.
+ */
+static void remove_child(winx_bpt_node *node,int pos)
+{
+    memmove(node->keys + pos,node->keys + pos + 1,
+        (node->count - pos - 1) * sizeof(ULONGLONG));
+    memmove(node->children + pos,node->children + pos + 1,
+        (node->count - pos - 1) * sizeof(void *));
+    memmove(node->marked + pos,node->marked + pos + 1,
+        (node->count - pos - 1) * sizeof(ULONGLONG));
+    node->count --;
+}
+
+/**
+ * @internal
+ * @brief Positions an iterator.
+ * @return The entry the iterator points to.
+ */
+static winx_bpt_entry *seek(winx_bpt_iterator *it,winx_bpt_leaf *leaf,int pos)
+{
+    if(leaf && pos == leaf->count){
+        leaf = leaf->next;
+        pos = 0;
+    }
+    it->leaf = leaf;
+    it->index = pos;
+    return leaf ? &leaf->entries[pos] : NULL;
+}
+
+/**
+ * @internal
+ * @brief Searches a subtree for the first
+ * marked entry with the key not less than
+ * the specified one.
+ */
+static winx_bpt_entry *find_marked(winx_bpt_iterator *it,
+    void *node,int height,ULONGLONG key)
+{
+    winx_bpt_node *n = (winx_bpt_node *)node;
+    winx_bpt_leaf *leaf;
+    winx_bpt_entry *entry;
+    int i;
+    
+    if(height == 0){
+        leaf = (winx_bpt_leaf *)node;
+        for(i = leaf_lower_bound(leaf,key); i < leaf->count; i++){
+            if(leaf->entries[i].marked) return seek(it,leaf,i);
+        }
+        return NULL;
+    }
+    
+    for(i = find_child(n,key); i < n->count; i++){
+        if(n->marked[i] == 0) continue;
+        entry = find_marked(it,n->children[i],height - 1,key);
+        if(entry) return entry;
+    }
+    return NULL;
+}
+
+/**
+ * @internal
+ * @brief Compares entries by keys.
+ */
+static int compare_entries(const void *a,const void *b,void *param)
+{
+    ULONGLONG k1 = ((winx_bpt_entry *)a)->key;
+    ULONGLONG k2 = ((winx_bpt_entry *)b)->key;
+    
+    if(k1 < k2) return (-1);
+    return (k1 > k2) ? 1 : 0;
+}
+
+/************************************************************/
+/*                     Public Routines                      */
+/************************************************************/
+
+/**
+ * @brief Creates an empty B+ tree.
+ * @return The tree, NULL indicates failure.
+ */
+winx_bptree *winx_bpt_create(void)
+{
+    winx_bptree *tree;
+    
+    tree = winx_tmalloc(sizeof(winx_bptree));
+    if(tree == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sizeof(winx_bptree));
+        return NULL;
+    }
+    memset(tree,0,sizeof(winx_bptree));
+    return tree;
+}
+
+/**
+ * @brief Inserts an entry into a B+ tree.
+ * @param[in] tree the tree.
+ * @param[in] key the key of the entry.
+ * @param[in] item the item of the entry.
+ * @param[in] context data associated with the item.
+ * @note The entry gets inserted unmarked.
+ * @return Zero for success, positive value if
+ * an entry with the same key exists already,
+ * negative value in case of errors. The tree
+ * remains unchanged unless the entry gets inserted.
+ */
+int winx_bpt_insert(winx_bptree *tree,ULONGLONG key,void *item,void *context)
+{
+    winx_bpt_node *path[WINX_BPT_MAX_HEIGHT];
+    winx_bpt_node *spare[WINX_BPT_MAX_HEIGHT + 1];
+    int slots[WINX_BPT_MAX_HEIGHT];
+    winx_bpt_leaf *leaf, *right = NULL;
+    winx_bpt_node *node, *new_node;
+    void *child, *new_child;
+    ULONGLONG separator;
+    int pos, level, splits = 0, i, half;
+    
+    if(tree->root == NULL){
+        leaf = alloc_leaf();
+        if(leaf == NULL) return (-1);
+        tree->root = leaf;
+        tree->height = 0;
+        tree->first = tree->last = leaf;
+    }
+    
+    leaf = find_leaf(tree,key,path,slots);
+    pos = leaf_lower_bound(leaf,key);
+    if(pos < leaf->count && leaf->entries[pos].key == key)
+        return 1;
+    
+    if(leaf->count == WINX_BPT_LEAF_SIZE){
+        /* allocate all the nodes needed in advance */
+        for(level = 0; level < tree->height; level++){
+            if(path[level]->count < WINX_BPT_FANOUT) break;
+        }
+        splits = level;
+        if(level == tree->height){
+            /* the root needs to be split as well */
+            if(tree->height == WINX_BPT_MAX_HEIGHT) return (-1);
+            splits ++;
+        }
+        right = alloc_leaf();
+        if(right == NULL) return (-1);
+        for(i = 0; i < splits; i++){
+            spare[i] = alloc_node();
+            if(spare[i] == NULL){
+                while(i > 0) winx_free(spare[--i]);
+                winx_free(right);
+                return (-1);
+            }
+        }
+        
+        /* split the leaf */
+        half = WINX_BPT_LEAF_SIZE / 2;
+        memcpy(right->entries,leaf->entries + half,
+            (WINX_BPT_LEAF_SIZE - half) * sizeof(winx_bpt_entry));
+        right->count = WINX_BPT_LEAF_SIZE - half;
+        leaf->count = half;
+        right->marked = count_leaf_marks(right);
+        leaf->marked -= right->marked;
+        right->prev = leaf;
+        right->next = leaf->next;
+        if(leaf->next) leaf->next->prev = right;
+        else tree->last = right;
+        leaf->next = right;
+        if(pos > half){
+            leaf = right;
+            pos -= half;
+        }
+    }
+    
+    memmove(leaf->entries + pos + 1,leaf->entries + pos,
+        (leaf->count - pos) * sizeof(winx_bpt_entry));
+    leaf->entries[pos].key = key;
+    leaf->entries[pos].item = item;
+    leaf->entries[pos].context = context;
+    leaf->entries[pos].marked = 0;
+    leaf->count ++;
+    tree->count ++;
+    
+    if(right == NULL) return 0;
+    
+    /* add the new leaf to the inner nodes */
+    child = right->prev;
+    new_child = right;
+    separator = right->entries[0].key;
+    for(level = 0, i = 0; level < tree->height; level++){
+        node = path[level];
+        pos = slots[level] + 1;
+        node->marked[pos - 1] = count_marks(child,level);
+        if(node->count < WINX_BPT_FANOUT){
+            insert_child(node,pos,separator,new_child,
+                count_marks(new_child,level));
+            return 0;
+        }
+        /* split the inner node */
+        new_node = spare[i++];
+        half = WINX_BPT_FANOUT / 2;
+        memcpy(new_node->keys,node->keys + half,
+            (WINX_BPT_FANOUT - half) * sizeof(ULONGLONG));
+        memcpy(new_node->children,node->children + half,
+            (WINX_BPT_FANOUT - half) * sizeof(void *));
+        memcpy(new_node->marked,node->marked + half,
+            (WINX_BPT_FANOUT - half) * sizeof(ULONGLONG));
+        new_node->count = WINX_BPT_FANOUT - half;
+        node->count = half;
+        if(pos > half){
+            insert_child(new_node,pos - half,separator,
+                new_child,count_marks(new_child,level));
+        } else {
+            insert_child(node,pos,separator,
+                new_child,count_marks(new_child,level));
+        }
+        child = node;
+        new_child = new_node;
+        separator = new_node->keys[0];
+    }
+    
+    /* grow the tree */
+    new_node = spare[i];
+    new_node->count = 2;
+    new_node->keys[0] = 0;
+    new_node->children[0] = tree->root;
+    new_node->marked[0] = count_marks(child,tree->height);
+    new_node->keys[1] = separator;
+    new_node->children[1] = new_child;
+    new_node->marked[1] = count_marks(new_child,tree->height);
+    tree->root = new_node;
+    tree->height ++;
+    return 0;
+}
+
+/**
+ * @brief Removes an entry from a B+ tree.
+ * @param[in] tree the tree.
+ * @param[in] key the key of the entry.
+ * @return The item of the removed entry,
+ * NULL indicates that nothing found.
+ */
+void *winx_bpt_erase(winx_bptree *tree,ULONGLONG key)
+{
+    winx_bpt_node *path[WINX_BPT_MAX_HEIGHT];
+    int slots[WINX_BPT_MAX_HEIGHT];
+    winx_bpt_leaf *leaf;
+    winx_bpt_node *node;
+    void *item;
+    int pos, level;
+    
+    if(tree == NULL || tree->root == NULL)
+        return NULL;
+    
+    leaf = find_leaf(tree,key,path,slots);
+    pos = leaf_lower_bound(leaf,key);
+    if(pos == leaf->count || leaf->entries[pos].key != key)
+        return NULL;
+    
+    item = leaf->entries[pos].item;
+    if(leaf->entries[pos].marked){
+        leaf->marked --;
+        for(level = 0; level < tree->height; level++)
+            path[level]->marked[slots[level]] --;
+    }
+    memmove(leaf->entries + pos,leaf->entries + pos + 1,
+        (leaf->count - pos - 1) * sizeof(winx_bpt_entry));
+    leaf->count --;
+    tree->count --;
+    if(leaf->count) return item;
+    
+    /* release the empty leaf */
+    if(leaf->prev) leaf->prev->next = leaf->next;
+    else tree->first = leaf->next;
+    if(leaf->next) leaf->next->prev = leaf->prev;
+    else tree->last = leaf->prev;
+    winx_free(leaf);
+    
+    /* release inner nodes which became empty */
+    for(level = 0; level < tree->height; level++){
+        node = path[level];
+        remove_child(node,slots[level]);
+        if(node->count) break;
+        winx_free(node);
+    }
+    if(level == tree->height){
+        tree->root = NULL;
+        tree->height = 0;
+        return item;
+    }
+    
+    /* shrink the tree */
+    while(tree->height > 0){
+        node = (winx_bpt_node *)tree->root;
+        if(node->count > 1) break;
+        tree->root = node->children[0];
+        tree->height --;
+        winx_free(node);
+    }
+    return item;
+}
+
+/**
+ * @brief Fills an empty B+ tree by entries.
+ * @details Takes O(n) time when the entries
+ * are sorted by keys already, otherwise sorts
+ * them first. Entries with duplicated keys
+ * are skipped, except of the first ones
+ * in the order of the array.
+ * @param[in] tree the tree; must be empty.
+ * @param[in,out] entries array of entries.
+ * @param[in] n number of entries.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+int winx_bpt_build(winx_bptree *tree,winx_bpt_entry *entries,ULONGLONG n)
+{
+    void **children = NULL;
+    ULONGLONG *keys = NULL;
+    ULONGLONG n_leaves, k, m, i, j, first, done = 0;
+    winx_bpt_leaf *leaf, *prev = NULL;
+    winx_bpt_node *node;
+    int c, height = 0;
+    
+    if(tree->root){
+        etrace("the tree is not empty");
+        return (-1);
+    }
+    if(n == 0) return 0;
+    
+    /* winx_sort is stable, so the first of duplicates go first */
+    for(i = 1; i < n; i++){
+        if(entries[i].key < entries[i - 1].key) break;
+    }
+    if(i < n){
+        if(winx_sort(entries,n,sizeof(winx_bpt_entry),
+          compare_entries,NULL,1) < 0) return (-1);
+    }
+    
+    n_leaves = (n + BUILD_LEAF_FILL - 1) / BUILD_LEAF_FILL;
+    children = winx_tmalloc((size_t)n_leaves * sizeof(void *));
+    keys = winx_tmalloc((size_t)n_leaves * sizeof(ULONGLONG));
+    if(children == NULL || keys == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            n_leaves * (sizeof(void *) + sizeof(ULONGLONG)));
+        goto fail;
+    }
+    
+    /* fill the leaves */
+    for(i = 0, k = 0; i < n; k++){
+        leaf = alloc_leaf();
+        if(leaf == NULL) goto fail;
+        children[k] = leaf;
+        while(i < n && leaf->count < BUILD_LEAF_FILL){
+            if(entries[i].marked) leaf->marked ++;
+            leaf->entries[leaf->count ++] = entries[i ++];
+            tree->count ++;
+            /* skip duplicates */
+            while(i < n && entries[i].key == entries[i - 1].key) i ++;
+        }
+        keys[k] = leaf->entries[0].key;
+        leaf->prev = prev;
+        if(prev) prev->next = leaf;
+        else tree->first = leaf;
+        prev = leaf;
+        done = k + 1;
+    }
+    tree->last = prev;
+    
+    /* build the inner levels */
+    for(k = done; k > 1; k = m){
+        m = (k + BUILD_NODE_FILL - 1) / BUILD_NODE_FILL;
+        for(j = 0; j < m; j++){
+            node = alloc_node();
+            if(node == NULL){
+                /* nodes of two levels are in the arrays now */
+                for(i = 0; i < j; i++) free_subtree(children[i],height + 1);
+                for(i = j * BUILD_NODE_FILL; i < k; i++) free_subtree(children[i],height);
+                done = 0;
+                goto fail;
+            }
+            first = j * BUILD_NODE_FILL;
+            for(c = 0; c < BUILD_NODE_FILL && first + c < k; c++){
+                node->keys[c] = keys[first + c];
+                node->children[c] = children[first + c];
+                node->marked[c] = count_marks(children[first + c],height);
+            }
+            node->count = c;
+            keys[j] = node->keys[0];
+            children[j] = node;
+        }
+        height ++;
+    }
+    
+    tree->root = children[0];
+    tree->height = height;
+    winx_free(children);
+    winx_free(keys);
+    return 0;
+    
+fail:
+    for(i = 0; i < done; i++) winx_free(children[i]);
+    winx_free(children);
+    winx_free(keys);
+    memset(tree,0,sizeof(winx_bptree));
+    return (-1);
+}
+
+/**
+ * @brief Searches for the first entry
+ * with the key not less than the specified one.
+ * @param[in] tree the tree.
+ * @param[in] key the key.
+ * @param[out] it the iterator positioned
+ * at the entry found.
+ * @return The entry, NULL indicates
+ * that nothing found.
+ */
+winx_bpt_entry *winx_bpt_lower_bound(winx_bptree *tree,
+    ULONGLONG key,winx_bpt_iterator *it)
+{
+    winx_bpt_leaf *leaf;
+    
+    if(tree == NULL || tree->root == NULL)
+        return seek(it,NULL,0);
+    
+    leaf = find_leaf(tree,key,NULL,NULL);
+    return seek(it,leaf,leaf_lower_bound(leaf,key));
+}
+
+/**
+ * @brief Searches for the first entry
+ * with the key greater than the specified one.
+ * @details The same as winx_bpt_lower_bound
+ * otherwise.
+ */
+winx_bpt_entry *winx_bpt_upper_bound(winx_bptree *tree,
+    ULONGLONG key,winx_bpt_iterator *it)
+{
+    winx_bpt_leaf *leaf;
+    
+    if(tree == NULL || tree->root == NULL)
+        return seek(it,NULL,0);
+    
+    leaf = find_leaf(tree,key,NULL,NULL);
+    return seek(it,leaf,leaf_upper_bound(leaf,key));
+}
+
+/**
+ * @brief Marks or unmarks an entry of a B+ tree.
+ * @param[in] tree the tree.
+ * @param[in] key the key of the entry.
+ * @param[in] marked nonzero value
+ * marks the entry, zero unmarks it.
+ * @return Zero for success, negative
+ * value if nothing found.
+ */
+int winx_bpt_mark(winx_bptree *tree,ULONGLONG key,int marked)
+{
+    winx_bpt_node *path[WINX_BPT_MAX_HEIGHT];
+    int slots[WINX_BPT_MAX_HEIGHT];
+    winx_bpt_leaf *leaf;
+    winx_bpt_entry *entry;
+    int pos, level;
+    
+    if(tree == NULL || tree->root == NULL)
+        return (-1);
+    
+    leaf = find_leaf(tree,key,path,slots);
+    pos = leaf_lower_bound(leaf,key);
+    if(pos == leaf->count || leaf->entries[pos].key != key)
+        return (-1);
+    
+    entry = &leaf->entries[pos];
+    marked = marked ? 1 : 0;
+    if(entry->marked == marked) return 0;
+    entry->marked = marked;
+    if(marked){
+        leaf->marked ++;
+        for(level = 0; level < tree->height; level++)
+            path[level]->marked[slots[level]] ++;
+    } else {
+        leaf->marked --;
+        for(level = 0; level < tree->height; level++)
+            path[level]->marked[slots[level]] --;
+    }
+    return 0;
+}
+
+/**
+ * @brief Searches for the first marked entry
+ * with the key not less than the specified one.
+ * @details Subtrees containing no marked
+ * entries are skipped, so the search takes
+ * O(log n) time regardless of how many
+ * unmarked entries precede the one found.
+ * The same as winx_bpt_lower_bound otherwise.
+ */
+winx_bpt_entry *winx_bpt_lower_bound_marked(winx_bptree *tree,
+    ULONGLONG key,winx_bpt_iterator *it)
+{
+    winx_bpt_entry *entry = NULL;
+    
+    if(tree && tree->root)
+        entry = find_marked(it,tree->root,tree->height,key);
+    return entry ? entry : seek(it,NULL,0);
+}
+
+/**
+ * @brief Positions an iterator
+ * at the first entry of a B+ tree.
+ * @return The entry, NULL indicates
+ * that the tree is empty.
+ */
+winx_bpt_entry *winx_bpt_first(winx_bptree *tree,winx_bpt_iterator *it)
+{
+    return seek(it,tree ? tree->first : NULL,0);
+}
+
+/**
+ * @brief Positions an iterator
+ * at the last entry of a B+ tree.
+ * @return The entry, NULL indicates
+ * that the tree is empty.
+ */
+winx_bpt_entry *winx_bpt_last(winx_bptree *tree,winx_bpt_iterator *it)
+{
+    winx_bpt_leaf *leaf = tree ? tree->last : NULL;
+    
+    return seek(it,leaf,leaf ? leaf->count - 1 : 0);
+}
+
+/**
+ * @brief Advances an iterator.
+ * @return The next entry, NULL indicates
+ * that the end of the tree is reached.
+ * @note Iterators become invalid once
+ * the tree gets changed.
+ */
+winx_bpt_entry *winx_bpt_next(winx_bpt_iterator *it)
+{
+    if(it->leaf == NULL) return NULL;
+    return seek(it,it->leaf,it->index + 1);
+}
+
+/**
+ * @brief Moves an iterator backwards.
+ * @return The previous entry, NULL indicates
+ * that the beginning of the tree is reached.
+ */
+winx_bpt_entry *winx_bpt_prev(winx_bpt_iterator *it)
+{
+    winx_bpt_leaf *leaf = it->leaf;
+    
+    if(leaf == NULL) return NULL;
+    if(it->index > 0){
+        it->index --;
+        return &leaf->entries[it->index];
+    }
+    leaf = leaf->prev;
+    return seek(it,leaf,leaf ? leaf->count - 1 : 0);
+}
+
+/**
+ * @brief Destroys a B+ tree.
+ */
+void winx_bpt_destroy(winx_bptree *tree)
+{
+    if(tree == NULL) return;
+    if(tree->root) free_subtree(tree->root,tree->height);
+    winx_free(tree);
+}
+
+/** @} */
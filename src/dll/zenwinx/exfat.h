@@ -0,0 +1,134 @@
+/*
+ *  UltraDefrag - powerful defragmentation tool for Windows NT.
+ *  Copyright (c) 2007-2016 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+* Internal exFAT structures.
+*/
+
+#ifndef _EXFAT_H_
+#define _EXFAT_H_
+
+/*
+* Source: exFAT File System Specification,
+* https://docs.microsoft.com/en-us/windows/win32/fileio/exfat-specification
+*/
+
+/*
+* NOTE: All these structures and function prototypes
+* are internal - for ftw_exfat.c file only.
+*/
+
+#pragma pack(push, 1)
+typedef struct {
+    UCHAR JumpBoot[3];                  /* Jump to the boot loader routine. */
+    UCHAR FileSystemName[8];            /* "EXFAT   " */
+    UCHAR MustBeZero[53];               /* Overlaps the BIOS parameter block of FAT. */
+    ULONGLONG PartitionOffset;          /* Number of sectors preceding the volume. */
+    ULONGLONG VolumeLength;             /* Size of the volume, in sectors. */
+    ULONG FatOffset;                    /* The first sector of the first FAT. */
+    ULONG FatLength;                    /* Size of a single FAT, in sectors. */
+    ULONG ClusterHeapOffset;            /* The sector of the first data cluster. */
+    ULONG ClusterCount;                 /* Number of data clusters. */
+    ULONG FirstClusterOfRootDirectory;  /**/
+    ULONG VolumeSerialNumber;           /**/
+    USHORT FileSystemRevision;          /* 1.00 is stored as 0x0100. */
+    USHORT VolumeFlags;                 /* Bit 0 - the active FAT, bit 1 - the volume is dirty. */
+    UCHAR BytesPerSectorShift;          /* log2 of the sector size, 9 - 12. */
+    UCHAR SectorsPerClusterShift;       /* log2 of the number of sectors per cluster. */
+    UCHAR NumberOfFats;                 /* 1 or 2. */
+    UCHAR DriveSelect;                  /**/
+    UCHAR PercentInUse;                 /**/
+    UCHAR Reserved[7];                  /**/
+} EXFAT_BOOT_SECTOR, *PEXFAT_BOOT_SECTOR;
+
+/* a generic directory entry */
+typedef struct {
+    UCHAR EntryType;                    /* One of the EXFAT_ENTRY_xxx constants. */
+    UCHAR CustomDefined[19];            /**/
+    ULONG FirstCluster;                 /* Valid for entries having a cluster allocation. */
+    ULONGLONG DataLength;               /**/
+} EXFAT_DIRECTORY_ENTRY, *PEXFAT_DIRECTORY_ENTRY;
+
+/* the primary entry of each set describing a file or a directory */
+typedef struct {
+    UCHAR EntryType;                    /* EXFAT_ENTRY_FILE */
+    UCHAR SecondaryCount;               /* Number of entries following this one in the set. */
+    USHORT SetChecksum;                 /* Checksum of all the entries of the set. */
+    USHORT FileAttributes;              /* FILE_ATTRIBUTE_xxx flags. */
+    USHORT Reserved1;                   /**/
+    ULONG CreateTimestamp;              /* Date and time in DOS format. */
+    ULONG LastModifiedTimestamp;        /**/
+    ULONG LastAccessedTimestamp;        /**/
+    UCHAR Create10msIncrement;          /* Hundredths of seconds, 0 - 199. */
+    UCHAR LastModified10msIncrement;    /**/
+    UCHAR CreateUtcOffset;              /* Bit 7 - the offset is valid, bits 0 - 6 - signed offset, in 15 minute units. */
+    UCHAR LastModifiedUtcOffset;        /**/
+    UCHAR LastAccessedUtcOffset;        /**/
+    UCHAR Reserved2[7];                 /**/
+} EXFAT_FILE_ENTRY, *PEXFAT_FILE_ENTRY;
+
+/* the first secondary entry of each file set */
+typedef struct {
+    UCHAR EntryType;                    /* EXFAT_ENTRY_STREAM */
+    UCHAR GeneralSecondaryFlags;        /* EXFAT_FLAG_xxx flags. */
+    UCHAR Reserved1;                    /**/
+    UCHAR NameLength;                   /* Length of the name, in characters. */
+    USHORT NameHash;                    /* Hash of the up-cased name. */
+    USHORT Reserved2;                   /**/
+    ULONGLONG ValidDataLength;          /**/
+    ULONG Reserved3;                    /**/
+    ULONG FirstCluster;                 /* The first cluster of the stream. */
+    ULONGLONG DataLength;               /* Size of the stream, in bytes. */
+} EXFAT_STREAM_ENTRY, *PEXFAT_STREAM_ENTRY;
+
+/* the name is stored in the entries following the stream entry */
+typedef struct {
+    UCHAR EntryType;                    /* EXFAT_ENTRY_FILE_NAME */
+    UCHAR GeneralSecondaryFlags;        /**/
+    USHORT FileName[15];                /* A portion of the name, in Unicode. */
+} EXFAT_FILE_NAME_ENTRY, *PEXFAT_FILE_NAME_ENTRY;
+#pragma pack(pop)
+
+#define EXFAT_ENTRY_END_OF_DIRECTORY    0x00
+#define EXFAT_ENTRY_IN_USE              0x80 /* entries having this bit clear are free */
+#define EXFAT_ENTRY_ALLOCATION_BITMAP   0x81
+#define EXFAT_ENTRY_UPCASE_TABLE        0x82
+#define EXFAT_ENTRY_VOLUME_LABEL        0x83
+#define EXFAT_ENTRY_FILE                0x85
+#define EXFAT_ENTRY_STREAM              0xc0
+#define EXFAT_ENTRY_FILE_NAME           0xc1
+
+#define EXFAT_FLAG_ALLOCATION_POSSIBLE  0x01
+#define EXFAT_FLAG_NO_FAT_CHAIN         0x02 /* the stream is contiguous, the FAT is not used */
+
+#define EXFAT_VOLUME_FLAG_ACTIVE_FAT    0x01
+
+#define EXFAT_UTC_OFFSET_VALID          0x80
+
+#define EXFAT_NAME_CHARS_PER_ENTRY      15
+#define EXFAT_MAX_NAME_LENGTH           255
+
+#define EXFAT_FIRST_CLUSTER             2
+#define EXFAT_BAD_CLUSTER               0xfffffff7
+#define EXFAT_END_OF_CHAIN              0xffffffff
+
+/* directories cannot be larger */
+#define EXFAT_MAX_DIRECTORY_SIZE        (256 * 1024 * 1024)
+
+#endif /* _EXFAT_H_ */
@@ -0,0 +1,118 @@
+/*
+ *  UltraDefrag - powerful defragmentation tool for Windows NT.
+ *  Copyright (c) 2007-2016 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+* Internal FAT structures.
+*/
+
+#ifndef _FAT_H_
+#define _FAT_H_
+
+/*
+* Source: Microsoft Extensible Firmware Initiative
+* FAT32 File System Specification, version 1.03.
+*/
+
+/*
+* NOTE: All these structures and function prototypes
+* are internal - for ftw_fat.c file only.
+*/
+
+#pragma pack(push, 1)
+typedef struct {
+    UCHAR Jump[3];              /* Jump to the boot loader routine. */
+    UCHAR OemName[8];           /* Name of the formatting tool. */
+    USHORT BytesPerSector;      /* 512, 1024, 2048 or 4096. */
+    UCHAR SectorsPerCluster;    /* A power of two. */
+    USHORT ReservedSectors;     /* Number of sectors preceding the first FAT. */
+    UCHAR NumberOfFats;         /* Number of copies of the FAT. */
+    USHORT RootEntries;         /* Number of root directory entries, zero on FAT32. */
+    USHORT TotalSectors16;      /* Number of sectors, zero if it does not fit in 16 bits. */
+    UCHAR Media;                /* Media descriptor. */
+    USHORT SectorsPerFat16;     /* Size of a single FAT, zero on FAT32. */
+    USHORT SectorsPerTrack;     /**/
+    USHORT NumberOfHeads;       /**/
+    ULONG HiddenSectors;        /* Number of sectors preceding the volume. */
+    ULONG TotalSectors32;       /* Number of sectors, if TotalSectors16 is zero. */
+    /* the following fields are valid on FAT32 only */
+    ULONG SectorsPerFat32;      /* Size of a single FAT. */
+    USHORT ExtFlags;            /* Bits 0-3 - the active FAT, bit 7 - mirroring is disabled. */
+    USHORT Version;             /* Must be zero. */
+    ULONG RootCluster;          /* The first cluster of the root directory. */
+} FAT_BOOT_SECTOR, *PFAT_BOOT_SECTOR;
+
+typedef struct {
+    UCHAR Name[11];             /* The short name, 8 + 3 characters padded by spaces. */
+    UCHAR Attributes;           /* A combination of FAT_ATTR_xxx flags. */
+    UCHAR NtFlags;              /* FAT_NT_LOWERCASE_xxx flags. */
+    UCHAR CreationTimeTenths;   /* Tenths of seconds, 0 - 199. */
+    USHORT CreationTime;        /* Local time, in DOS format. */
+    USHORT CreationDate;        /* Local date, in DOS format. */
+    USHORT LastAccessDate;      /**/
+    USHORT FirstClusterHigh;    /* High word of the first cluster, FAT32 only. */
+    USHORT LastWriteTime;       /**/
+    USHORT LastWriteDate;       /**/
+    USHORT FirstClusterLow;     /* Low word of the first cluster. */
+    ULONG FileSize;             /* The size of the file, in bytes; zero for directories. */
+} FAT_DIRECTORY_ENTRY, *PFAT_DIRECTORY_ENTRY;
+
+/* long names are stored in reverse order right before the short entry */
+typedef struct {
+    UCHAR Ordinal;              /* Sequence number, FAT_LFN_LAST_ENTRY marks the first stored entry. */
+    USHORT Name1[5];            /* Characters 1 - 5 of the portion, in Unicode. */
+    UCHAR Attributes;           /* Always FAT_ATTR_LONG_NAME. */
+    UCHAR Type;                 /* Must be zero. */
+    UCHAR Checksum;             /* Checksum of the short name. */
+    USHORT Name2[6];            /* Characters 6 - 11 of the portion. */
+    USHORT FirstClusterLow;     /* Must be zero. */
+    USHORT Name3[2];            /* Characters 12 - 13 of the portion. */
+} FAT_LFN_ENTRY, *PFAT_LFN_ENTRY;
+#pragma pack(pop)
+
+#define FAT_ATTR_READ_ONLY  0x01
+#define FAT_ATTR_HIDDEN     0x02
+#define FAT_ATTR_SYSTEM     0x04
+#define FAT_ATTR_VOLUME_ID  0x08
+#define FAT_ATTR_DIRECTORY  0x10
+#define FAT_ATTR_ARCHIVE    0x20
+#define FAT_ATTR_LONG_NAME  0x0f
+#define FAT_ATTR_LONG_NAME_MASK 0x3f
+
+#define FAT_NT_LOWERCASE_BASE      0x08
+#define FAT_NT_LOWERCASE_EXTENSION 0x10
+
+#define FAT_LFN_LAST_ENTRY      0x40
+#define FAT_LFN_ORDINAL_MASK    0x1f
+#define FAT_LFN_CHARS_PER_ENTRY 13
+
+#define FAT_DIRENT_END          0x00 /* the entry and all the following ones are free */
+#define FAT_DIRENT_DELETED      0xe5 /* the entry is free */
+#define FAT_DIRENT_E5           0x05 /* the name begins with 0xE5 character */
+
+/* volumes having less clusters are FAT12, FAT16 or FAT32 respectively */
+#define FAT12_MAX_CLUSTERS      4085
+#define FAT16_MAX_CLUSTERS      65525
+
+#define FAT_FIRST_CLUSTER       2
+#define FAT32_CLUSTER_MASK      0x0fffffff
+
+/* directories cannot contain more entries */
+#define FAT_MAX_DIRECTORY_ENTRIES 65536
+
+#endif /* _FAT_H_ */
@@ -567,17 +567,30 @@ NTSTATUS winx_defrag_fopen(winx_file_info *f,int action,HANDLE *phandle)
     ULONG flags = FILE_SYNCHRONOUS_IO_NONALERT;
     int i, length;
     char volume_letter;
-    wchar_t *path;
+    wchar_t *path, *file_path = NULL;
     wchar_t buffer[MAX_PATH + 1];
 
     if(f == NULL || phandle == NULL)
         return STATUS_INVALID_PARAMETER;
     
-    if(f->path == NULL)
+    /* build compact paths temporarily, to avoid keeping them */
+    path = f->path;
+    if(path == NULL && f->parent){
+        length = winx_get_file_path_length(f) + 1;
+        file_path = winx_tmalloc(length * sizeof(wchar_t));
+        if(file_path == NULL)
+            return STATUS_NO_MEMORY;
+        (void)winx_get_file_path(f,file_path,length);
+        path = file_path;
+    }
+    
+    if(path == NULL)
         return STATUS_INVALID_PARAMETER;
     
-    if(f->path[0] == 0)
+    if(path[0] == 0){
+        winx_free(file_path);
         return STATUS_INVALID_PARAMETER;
+    }
     
     if(is_directory(f)){
         flags |= FILE_OPEN_FOR_BACKUP_INTENT;
@@ -627,19 +640,18 @@ NTSTATUS winx_defrag_fopen(winx_file_info *f,int action,HANDLE *phandle)
     * Handle special cases, according to
     * http://msdn.microsoft.com/en-us/library/windows/desktop/aa363911(v=vs.85).aspx
     */
-    path = f->path;
-    length = (int)wcslen(f->path);
+    length = (int)wcslen(path);
     if(length >= 9){ /* to ensure that we have at least \??\X:\$x */
-        if(f->path[7] == '$'){
-            volume_letter = (char)f->path[4];
+        if(path[7] == '$'){
+            volume_letter = (char)path[4];
             for(i = 0; special_file_names[i].original_name; i++){
-                if(winx_wcsistr(f->path,special_file_names[i].original_name)){
-                    if(wcslen(f->path) == wcslen(special_file_names[i].original_name) + 0x7){
+                if(winx_wcsistr(path,special_file_names[i].original_name)){
+                    if(wcslen(path) == wcslen(special_file_names[i].original_name) + 0x7){
                         _snwprintf(buffer,MAX_PATH,L"\\??\\%c:\\%ws",volume_letter,
                             special_file_names[i].accepted_name);
                         buffer[MAX_PATH] = 0;
+                        itrace("%ws used instead of %ws",buffer,path);
                         path = buffer;
-                        itrace("%ws used instead of %ws",path,f->path);
                         break;
                     }
                 }
@@ -654,6 +666,7 @@ NTSTATUS winx_defrag_fopen(winx_file_info *f,int action,HANDLE *phandle)
                 FILE_OPEN,flags,NULL,0);
     if(status != STATUS_SUCCESS)
         *phandle = NULL;
+    winx_free(file_path);
     return status;
 }
 
@@ -54,7 +54,15 @@
 /* external functions prototypes */
 winx_file_info *ntfs_scan_disk(char volume_letter,
     int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
-    ftw_terminator t, void *user_defined_data);
+    ftw_terminator t, void *user_defined_data, winx_arena *arena);
+int fat_scan_disk(winx_volume_information *v,wchar_t *rootpath,
+    winx_path_node *top,int flags,ftw_filter_callback fcb,
+    ftw_progress_callback pcb,ftw_terminator t,void *user_defined_data,
+    winx_file_info **filelist,winx_arena *arena);
+int exfat_scan_disk(winx_volume_information *v,wchar_t *rootpath,
+    winx_path_node *top,int flags,ftw_filter_callback fcb,
+    ftw_progress_callback pcb,ftw_terminator t,void *user_defined_data,
+    winx_file_info **filelist,winx_arena *arena);
 
 /**
  * @internal
@@ -75,8 +83,10 @@ static int ftw_check_for_termination(ftw_terminator t,void *user_defined_data)
  * @internal
  * @brief Validates a map of file blocks,
  * destroys it in case of errors found.
+ * @param[in] arena the arena the map
+ * has been allocated from.
  */
-void validate_blockmap(winx_file_info *f)
+void validate_blockmap(winx_file_info *f,winx_arena *arena)
 {
     winx_blockmap *b1 = NULL, *b2 = NULL;
     
@@ -99,39 +109,30 @@ void validate_blockmap(winx_file_info *f)
     if(b1) b2 = b1->next;
     if(b1 && b2 && b2 != b1){
         if(b1->vcn == b2->vcn){
-            etrace("%ws: wrong map detected:", f->path);
+            etrace("%ws: wrong map detected:", winx_file_path(f));
             for(b1 = f->disp.blockmap; b1; b1 = b1->next){
                 etrace("VCN = %I64u, LCN = %I64u, LEN = %I64u",
                     b1->vcn, b1->lcn, b1->length);
                 if(b1->next == f->disp.blockmap) break;
             }
-            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+            winx_list_destroy_ex((list_entry **)(void *)&f->disp.blockmap,
+                sizeof(winx_blockmap),arena);
         }
     }
 #endif
 }
 
 /**
- * @brief Retrieves disposition of a file.
- * @param[out] f pointer to structure
- * receiving the information.
- * @param[in] t address of procedure to be called
- * each time when winx_ftw_dump_file would like
- * to know whether it must be terminated or not.
- * Nonzero value, returned by the registered
- * routine, terminates the dump immediately.
- * @param[in] user_defined_data pointer to data
- * to be passed to the registered terminator.
- * @return Zero for success, negative value otherwise.
- * @note
- * - The callback procedure should complete as quickly
- * as possible to avoid slowdown of the scan.
- * - For resident NTFS streams (small files and
- * directories located inside MFT) this function resets
- * all the file disposition structure fields to zero.
+ * @internal
+ * @brief winx_ftw_dump_file analog
+ * using a buffer of the caller.
+ * @param[in] buffer the buffer of FILE_MAP_SIZE
+ * bytes to list file fragments into; NULL forces
+ * to allocate it for the dump.
  */
-int winx_ftw_dump_file(winx_file_info *f,
-        ftw_terminator t, void *user_defined_data)
+static int ftw_dump_file(winx_file_info *f,
+        ftw_terminator t, void *user_defined_data, winx_arena *arena,
+        GET_RETRIEVAL_DESCRIPTOR *buffer)
 {
     GET_RETRIEVAL_DESCRIPTOR *filemap;
     HANDLE hFile;
@@ -143,22 +144,21 @@ int winx_ftw_dump_file(winx_file_info *f,
     int i;
     winx_blockmap *block = NULL;
     
-    DbgCheck1(f,-1);
-    
     /* reset disposition related fields */
     f->disp.clusters = 0;
     f->disp.fragments = 0;
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+    winx_list_destroy_ex((list_entry **)(void *)&f->disp.blockmap,
+        sizeof(winx_blockmap),arena);
     
     /* open the file */
     status = winx_defrag_fopen(f,WINX_OPEN_FOR_DUMP,&hFile);
     if(status != STATUS_SUCCESS){
-        strace(status,"cannot open %ws",f->path);
+        strace(status,"cannot open %ws",winx_file_path(f));
         return 0; /* the file is locked by system */
     }
     
     /* allocate memory */
-    filemap = winx_malloc(FILE_MAP_SIZE);
+    filemap = buffer ? buffer : winx_malloc(FILE_MAP_SIZE);
     
     /* dump the file */
     startVcn = 0;
@@ -177,20 +177,20 @@ int winx_ftw_dump_file(winx_file_info *f,
         if(status != STATUS_SUCCESS && status != STATUS_BUFFER_OVERFLOW){
             /* it always returns STATUS_END_OF_FILE for small files placed inside MFT */
             if(status == STATUS_END_OF_FILE) goto empty_map_detected;
-            strace(status,"dump failed for %ws",f->path);
+            strace(status,"dump failed for %ws",winx_file_path(f));
             goto dump_failed;
         }
 
         if(ftw_check_for_termination(t,user_defined_data)){
             if(counter > MAX_COUNT)
-                etrace("%ws: infinite main loop?",f->path);
+                etrace("%ws: infinite main loop?",winx_file_path(f));
             /* reset incomplete maps */
             goto cleanup;
         }
         
         /* check for an empty map */
         if(!filemap->NumberOfPairs && status != STATUS_SUCCESS){
-            etrace("%ws: empty map of file detected",f->path);
+            etrace("%ws: empty map of file detected",winx_file_path(f));
             goto empty_map_detected;
         }
         
@@ -203,12 +203,16 @@ int winx_ftw_dump_file(winx_file_info *f,
             
             /* the following is usual for 3.99 GB files on FAT32 under XP */
             if(filemap->Pair[i].Vcn == 0){
-                etrace("%ws: wrong map of file detected",f->path);
+                etrace("%ws: wrong map of file detected",winx_file_path(f));
                 goto dump_failed;
             }
             
-            block = (winx_blockmap *)winx_list_insert((list_entry **)&f->disp.blockmap,
-                (list_entry *)block,sizeof(winx_blockmap));
+            block = (winx_blockmap *)winx_list_insert_ex((list_entry **)&f->disp.blockmap,
+                (list_entry *)block,sizeof(winx_blockmap),arena);
+            if(block == NULL){
+                etrace("not enough memory for %ws",winx_file_path(f));
+                goto dump_failed;
+            }
             block->lcn = filemap->Pair[i].Lcn;
             block->length = filemap->Pair[i].Vcn - startVcn;
             block->vcn = startVcn;
@@ -231,8 +235,8 @@ int winx_ftw_dump_file(winx_file_info *f,
     /* small directories placed inside MFT have empty list of fragments... */
 
     /* the dump is completed */
-    validate_blockmap(f);
-    winx_free(filemap);
+    validate_blockmap(f,arena);
+    if(filemap != buffer) winx_free(filemap);
     winx_defrag_fclose(hFile);
     return 0;
     
@@ -240,31 +244,326 @@ cleanup:
 empty_map_detected:
     f->disp.clusters = 0;
     f->disp.fragments = 0;
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
-    winx_free(filemap);
+    winx_list_destroy_ex((list_entry **)(void *)&f->disp.blockmap,
+        sizeof(winx_blockmap),arena);
+    if(filemap != buffer) winx_free(filemap);
     winx_defrag_fclose(hFile);
     return 0;
 
 dump_failed:
     f->disp.clusters = 0;
     f->disp.fragments = 0;
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
-    winx_free(filemap);
+    winx_list_destroy_ex((list_entry **)(void *)&f->disp.blockmap,
+        sizeof(winx_blockmap),arena);
+    if(filemap != buffer) winx_free(filemap);
     winx_defrag_fclose(hFile);
     return (-1);
 }
 
+/**
+ * @brief Retrieves disposition of a file.
+ * @param[out] f pointer to structure
+ * receiving the information.
+ * @param[in] t address of procedure to be called
+ * each time when winx_ftw_dump_file would like
+ * to know whether it must be terminated or not.
+ * Nonzero value, returned by the registered
+ * routine, terminates the dump immediately.
+ * @param[in] user_defined_data pointer to data
+ * to be passed to the registered terminator.
+ * @param[in] arena the arena the map of blocks
+ * gets allocated from; NULL forces to use the
+ * global heap.
+ * @return Zero for success, negative value otherwise.
+ * @note
+ * - The callback procedure should complete as quickly
+ * as possible to avoid slowdown of the scan.
+ * - For resident NTFS streams (small files and
+ * directories located inside MFT) this function resets
+ * all the file disposition structure fields to zero.
+ */
+int winx_ftw_dump_file(winx_file_info *f,
+        ftw_terminator t, void *user_defined_data, winx_arena *arena)
+{
+    DbgCheck1(f,-1);
+    
+    return ftw_dump_file(f,t,user_defined_data,arena,NULL);
+}
+
+/*
+**************************************************
+*             Compact path storage
+**************************************************
+*/
+
+/**
+ * @internal
+ * @brief Size of blocks the
+ * path storage consists of.
+ */
+#define PATH_STORE_BLOCK_SIZE (64*1024)
+
+/**
+ * @internal
+ * @brief Initial number of buckets of
+ * the table of interned names; must be
+ * a power of two.
+ */
+#define PATH_STORE_INITIAL_SIZE 4096
+
+typedef struct _path_store_block {
+    struct _path_store_block *next;
+    size_t used;  /* number of bytes used */
+    size_t size;  /* number of bytes available */
+} path_store_block;
+
+typedef struct _interned_name {
+    struct _interned_name *next;
+    ULONG hash;
+    wchar_t name[1];
+} interned_name;
+
+typedef struct _path_store {
+    winx_path_node top;       /* the top directory */
+    path_store_block *blocks; /* list of blocks, the current one first */
+    interned_name **buckets;  /* table of interned names */
+    ULONG size;               /* number of buckets, always a power of two */
+    ULONG count;              /* number of interned names */
+    ULONGLONG bytes;          /* total size of the blocks, in bytes */
+    ULONGLONG refs;           /* number of references to the storage */
+} path_store;
+
+/**
+ * @internal
+ * @brief Allocates memory inside the path storage.
+ * @note The memory gets released along with
+ * the entire storage only.
+ */
+static void *ftw_path_store_alloc(path_store *ps,size_t n)
+{
+    path_store_block *block;
+    size_t size;
+    char *p;
+    
+    /* keep pointers aligned */
+    n = (n + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    
+    block = ps->blocks;
+    if(block == NULL || block->used + n > block->size){
+        size = max(n,PATH_STORE_BLOCK_SIZE - sizeof(path_store_block));
+        block = winx_malloc(sizeof(path_store_block) + size);
+        block->used = 0;
+        block->size = size;
+        block->next = ps->blocks;
+        ps->blocks = block;
+        ps->bytes += sizeof(path_store_block) + size;
+    }
+    
+    p = (char *)(block + 1) + block->used;
+    block->used += n;
+    return (void *)p;
+}
+
+/**
+ * @internal
+ * @brief Doubles the number of buckets of
+ * the table of interned names when the
+ * table becomes too crowded.
+ */
+static void ftw_grow_path_store(path_store *ps)
+{
+    interned_name **buckets, *e, *next;
+    ULONG size, i, k;
+    
+    if(ps->count < ps->size * 2 || ps->size >= 0x40000000) return;
+    size = ps->size * 2;
+    
+    buckets = winx_tmalloc(size * sizeof(interned_name *));
+    if(buckets == NULL) return; /* the chains just become longer */
+    memset(buckets,0,size * sizeof(interned_name *));
+    
+    for(i = 0; i < ps->size; i++){
+        for(e = ps->buckets[i]; e; e = next){
+            next = e->next;
+            k = e->hash & (size - 1);
+            e->next = buckets[k];
+            buckets[k] = e;
+        }
+    }
+    ps->bytes += (size - ps->size) * sizeof(interned_name *);
+    winx_free(ps->buckets);
+    ps->buckets = buckets;
+    ps->size = size;
+}
+
+/**
+ * @internal
+ * @brief Creates a compact path storage.
+ * @param[in] path the path of the top directory.
+ * @return The top directory of the storage.
+ * @note The caller holds a reference to the storage
+ * and must release it by ftw_release_path_store.
+ */
+winx_path_node *ftw_create_path_store(wchar_t *path)
+{
+    path_store *ps;
+    int length;
+    
+    ps = winx_malloc(sizeof(path_store));
+    memset(ps,0,sizeof(path_store));
+    ps->size = PATH_STORE_INITIAL_SIZE;
+    ps->buckets = winx_malloc(ps->size * sizeof(interned_name *));
+    memset(ps->buckets,0,ps->size * sizeof(interned_name *));
+    ps->bytes = sizeof(path_store) + ps->size * sizeof(interned_name *);
+    ps->refs = 1;
+    
+    /* only the root directory path contains trailing backslash */
+    length = (int)wcslen(path);
+    if(length && path[length - 1] == '\\') length --;
+    ps->top.parent = NULL;
+    ps->top.store = (void *)ps;
+    ps->top.name = ftw_path_store_alloc(ps,(length + 1) * sizeof(wchar_t));
+    memcpy(ps->top.name,path,length * sizeof(wchar_t));
+    ps->top.name[length] = 0;
+    ps->top.length = length;
+    return &ps->top;
+}
+
+/**
+ * @internal
+ * @brief Releases a reference to the path storage.
+ * @details The storage gets destroyed when
+ * the last reference is released.
+ */
+void ftw_release_path_store(winx_path_node *node)
+{
+    path_store *ps = (path_store *)node->store;
+    path_store_block *block, *next;
+    
+    if(-- ps->refs) return;
+    
+    for(block = ps->blocks; block; block = next){
+        next = block->next;
+        winx_free(block);
+    }
+    winx_free(ps->buckets);
+    winx_free(ps);
+}
+
+/**
+ * @internal
+ * @brief Returns the amount of memory
+ * used by the path storage, in bytes.
+ */
+ULONGLONG ftw_get_path_store_size(winx_path_node *node)
+{
+    return ((path_store *)node->store)->bytes;
+}
+
+/**
+ * @internal
+ * @brief Returns a copy of the name stored
+ * in the path storage, shared by all its users.
+ */
+static wchar_t *ftw_intern_name(path_store *ps,wchar_t *name)
+{
+    interned_name *e;
+    ULONG hash = 2166136261u;
+    wchar_t *s;
+    int length;
+    
+    /* FNV-1a */
+    for(s = name; *s; s++){
+        hash ^= (ULONG)(*s);
+        hash *= 16777619u;
+    }
+    length = (int)(s - name);
+    
+    for(e = ps->buckets[hash & (ps->size - 1)]; e; e = e->next){
+        if(e->hash == hash && !wcscmp(e->name,name))
+            return e->name;
+    }
+    
+    ftw_grow_path_store(ps);
+    e = ftw_path_store_alloc(ps,sizeof(interned_name) + length * sizeof(wchar_t));
+    e->hash = hash;
+    memcpy(e->name,name,(length + 1) * sizeof(wchar_t));
+    e->next = ps->buckets[hash & (ps->size - 1)];
+    ps->buckets[hash & (ps->size - 1)] = e;
+    ps->count ++;
+    return e->name;
+}
+
+/**
+ * @internal
+ * @brief Adds a directory to the path storage.
+ * @param[in] parent the parent directory.
+ * @param[in] name the name of the directory.
+ * @return The directory added.
+ */
+winx_path_node *ftw_add_path_node(winx_path_node *parent,wchar_t *name)
+{
+    path_store *ps = (path_store *)parent->store;
+    winx_path_node *node;
+    
+    node = ftw_path_store_alloc(ps,sizeof(winx_path_node));
+    node->parent = parent;
+    node->store = parent->store;
+    node->name = ftw_intern_name(ps,name);
+    node->length = parent->length + 1 + (unsigned long)wcslen(node->name);
+    return node;
+}
+
+/**
+ * @internal
+ * @brief Makes the path of a file compact.
+ * @details Replaces the file name by the
+ * interned one and refers to the parent
+ * directory instead of the full path.
+ */
+void ftw_set_compact_path(winx_file_info *f,winx_path_node *parent)
+{
+    path_store *ps = (path_store *)parent->store;
+    wchar_t *name;
+    
+    name = ftw_intern_name(ps,f->name);
+    winx_free(f->name);
+    f->name = name;
+    f->parent = parent;
+    ps->refs ++;
+}
+
+/**
+ * @internal
+ * @brief Releases strings of a file list entry.
+ */
+static void ftw_release_entry_strings(winx_file_info *f)
+{
+    winx_free(f->path);
+    f->path = NULL;
+    if(f->parent){
+        /* the name belongs to the path storage */
+        ftw_release_path_store(f->parent);
+        f->parent = NULL;
+    } else {
+        winx_free(f->name);
+    }
+    f->name = NULL;
+}
+
 /**
  * @internal
  * @brief Adds a directory to the file list.
+ * @param[in] filemap the buffer to list file
+ * fragments into; NULL forces to allocate it.
  * @return Address of the inserted list entry,
  * NULL indicates failure.
  */
 static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
-    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+    winx_path_node *node, int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
     ftw_terminator t, void *user_defined_data,
-    winx_file_info **filelist,
-    FILE_BOTH_DIR_INFORMATION *file_entry)
+    winx_file_info **filelist, winx_arena *arena,
+    FILE_BOTH_DIR_INFORMATION *file_entry, GET_RETRIEVAL_DESCRIPTOR *filemap)
 {
     winx_file_info *f;
     int length;
@@ -279,19 +578,32 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
     }
     
     /* insert new item to the file list */
-    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)filelist,
-        NULL,sizeof(winx_file_info));
+    f = (winx_file_info *)winx_list_insert_ex((list_entry **)(void *)filelist,
+        NULL,sizeof(winx_file_info),arena);
+    if(f == NULL){
+        mtrace();
+        return NULL;
+    }
     
     /* extract filename */
     f->name = winx_tmalloc(file_entry->FileNameLength + sizeof(wchar_t));
     if(f->name == NULL){
         etrace("cannot allocate %u bytes of memory",
             file_entry->FileNameLength + sizeof(wchar_t));
-        winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+        winx_list_remove_ex((list_entry **)(void *)filelist,
+            (list_entry *)f,sizeof(winx_file_info),arena);
         return NULL;
     }
     memset(f->name,0,file_entry->FileNameLength + sizeof(wchar_t));
     memcpy(f->name,file_entry->FileName,file_entry->FileNameLength);
+    f->path = NULL;
+    f->parent = NULL;
+    
+    /* refer to the parent directory in case of compact paths */
+    if(node){
+        ftw_set_compact_path(f,node);
+        goto path_built;
+    }
     
     /* check whether we are in the root directory or not */
     length = (int)wcslen(path);
@@ -307,7 +619,8 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
         etrace("cannot allocate %u bytes of memory",
             length * sizeof(wchar_t));
         winx_free(f->name);
-        winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+        winx_list_remove_ex((list_entry **)(void *)filelist,
+            (list_entry *)f,sizeof(winx_file_info),arena);
         return NULL;
     }
     if(is_rootdir)
@@ -316,6 +629,7 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
         (void)_snwprintf(f->path,length,L"%ws\\%ws",path,f->name);
     f->path[length - 1] = 0;
     
+path_built:
     /* save file attributes and access times */
     f->flags = file_entry->FileAttributes;
     f->creation_time = file_entry->CreationTime.QuadPart;
@@ -324,6 +638,7 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
     
     /* reset user defined flags */
     f->user_defined_flags = 0;
+    f->user_defined_data = NULL;
     
     //trace(D"%ws",f->path);
     
@@ -335,10 +650,10 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
 
     /* get file disposition if requested */
     if(flags & WINX_FTW_DUMP_FILES){
-        if(winx_ftw_dump_file(f,t,user_defined_data) < 0){
-            winx_free(f->name);
-            winx_free(f->path);
-            winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+        if(ftw_dump_file(f,t,user_defined_data,arena,filemap) < 0){
+            ftw_release_entry_strings(f);
+            winx_list_remove_ex((list_entry **)(void *)filelist,
+                (list_entry *)f,sizeof(winx_file_info),arena);
             return NULL;
         }
     }    
@@ -354,7 +669,7 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
 static int ftw_add_root_directory(wchar_t *path, int flags,
     ftw_filter_callback fcb, ftw_progress_callback pcb, 
     ftw_terminator t, void *user_defined_data,
-    winx_file_info **filelist)
+    winx_file_info **filelist, winx_arena *arena)
 {
     winx_file_info *f;
     int length;
@@ -372,13 +687,18 @@ static int ftw_add_root_directory(wchar_t *path, int flags,
     }
     
     /* insert new item to the file list */
-    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)filelist,
-        NULL,sizeof(winx_file_info));
+    f = (winx_file_info *)winx_list_insert_ex((list_entry **)(void *)filelist,
+        NULL,sizeof(winx_file_info),arena);
+    if(f == NULL){
+        mtrace();
+        return (-1);
+    }
     
     /* build path */
     length = (int)wcslen(path) + 1;
     f->path = winx_malloc(length * sizeof(wchar_t));
     wcscpy(f->path,path);
+    f->parent = NULL;
     
     /* save . filename */
     f->name = winx_malloc(2 * sizeof(wchar_t));
@@ -412,6 +732,7 @@ static int ftw_add_root_directory(wchar_t *path, int flags,
     
     /* reset user defined flags */
     f->user_defined_flags = 0;
+    f->user_defined_data = NULL;
     
     /* reset internal data fields */
     memset(&f->internal,0,sizeof(winx_file_internal_info));
@@ -421,10 +742,10 @@ static int ftw_add_root_directory(wchar_t *path, int flags,
 
     /* get file disposition if requested */
     if(flags & WINX_FTW_DUMP_FILES){
-        if(winx_ftw_dump_file(f,t,user_defined_data) < 0){
-            winx_free(f->name);
-            winx_free(f->path);
-            winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+        if(winx_ftw_dump_file(f,t,user_defined_data,arena) < 0){
+            ftw_release_entry_strings(f);
+            winx_list_remove_ex((list_entry **)(void *)filelist,
+                (list_entry *)f,sizeof(winx_file_info),arena);
             return (-1);
         }
     }
@@ -469,17 +790,54 @@ static HANDLE ftw_open_directory(wchar_t *path)
     return hDir;
 }
 
+static int ftw_helper(wchar_t *path, winx_path_node *node, int flags,
+        ftw_filter_callback fcb, ftw_progress_callback pcb,
+        ftw_terminator t, void *user_defined_data,
+        winx_file_info **filelist, winx_arena *arena);
+
+/**
+ * @internal
+ * @brief Scans a subdirectory in case of compact paths.
+ * @details Builds the path of the subdirectory, since
+ * it is not stored in the file list in this case.
+ */
+static int ftw_compact_helper(winx_file_info *f,winx_path_node *node,
+        int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+        ftw_terminator t, void *user_defined_data,
+        winx_file_info **filelist, winx_arena *arena)
+{
+    wchar_t *path;
+    int length, result;
+    
+    length = winx_get_file_path_length(f) + 1;
+    path = winx_tmalloc(length * sizeof(wchar_t));
+    if(path == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            length * sizeof(wchar_t));
+        return (-1);
+    }
+    (void)winx_get_file_path(f,path,length);
+    
+    node = ftw_add_path_node(node,f->name);
+    result = ftw_helper(path,node,flags,fcb,pcb,t,user_defined_data,filelist,arena);
+    winx_free(path);
+    return result;
+}
+
 /**
  * @internal
  * @brief Scans a directory and adds information
  * about files found to the file list.
+ * @param[in] path the path of the directory.
+ * @param[in] node the directory in the compact
+ * path storage; NULL if paths are not compact.
  * @return Zero for success, -1 indicates failure,
  * -2 indicates termination requested by the caller.
  */
-static int ftw_helper(wchar_t *path, int flags,
+static int ftw_helper(wchar_t *path, winx_path_node *node, int flags,
         ftw_filter_callback fcb, ftw_progress_callback pcb,
         ftw_terminator t, void *user_defined_data,
-        winx_file_info **filelist)
+        winx_file_info **filelist, winx_arena *arena)
 {
     FILE_BOTH_DIR_INFORMATION *file_listing, *file_entry;
     HANDLE hDir;
@@ -543,8 +901,8 @@ static int ftw_helper(wchar_t *path, int flags,
             continue;
         
         /* add the entry to the file list */
-        f = ftw_add_entry_to_filelist(path,flags,fcb,pcb,t,
-                user_defined_data,filelist,file_entry);
+        f = ftw_add_entry_to_filelist(path,node,flags,fcb,pcb,t,
+                user_defined_data,filelist,arena,file_entry,NULL);
         if(f == NULL){
             winx_free(file_listing);
             NtClose(hDir);
@@ -573,7 +931,13 @@ static int ftw_helper(wchar_t *path, int flags,
         if(is_directory(f) && (flags & WINX_FTW_RECURSIVE) && !skip_children){
             /* don't follow reparse points! */
             if(!is_reparse_point(f)){
-                result = ftw_helper(f->path,flags,fcb,pcb,t,user_defined_data,filelist);
+                if(node){
+                    result = ftw_compact_helper(f,node,flags,fcb,pcb,
+                        t,user_defined_data,filelist,arena);
+                } else {
+                    result = ftw_helper(f->path,NULL,flags,fcb,pcb,
+                        t,user_defined_data,filelist,arena);
+                }
                 if(result < 0){
                     winx_free(file_listing);
                     NtClose(hDir);
@@ -589,11 +953,782 @@ static int ftw_helper(wchar_t *path, int flags,
     return (-2);
 }
 
+/*
+**************************************************
+*          Parallel directory traversal
+**************************************************
+*/
+
+/*
+* Worker threads list directories and dump
+* files in advance, while the calling thread
+* walks through the listings in the same order
+* as ftw_helper does and calls all the callbacks.
+* Thus both the callbacks and the resulting list
+* of files are exactly the same as in case of
+* a single threaded walk.
+*
+* Each worker queues subdirectories it finds in a
+* deque of its own and takes the newest task from
+* there, which is the subdirectory to be walked
+* through first. Idle workers steal the oldest
+* tasks from the others. A single lock guards all
+* the deques: it is taken once per directory, so
+* the workers rarely wait for it.
+*/
+
+/**
+ * @internal
+ * @brief Maximum number of directories being
+ * listed in advance. The rest of subdirectories
+ * get listed by the calling thread when needed.
+ */
+#define FTW_MAX_PENDING_TASKS 1024
+
+/* states of the directory listing tasks */
+#define FTW_TASK_IDLE     0 /* not queued, gets listed by the calling thread */
+#define FTW_TASK_QUEUED   1 /* waiting for a worker */
+#define FTW_TASK_RUNNING  2 /* being listed */
+#define FTW_TASK_DONE     3 /* listed */
+
+struct _ftw_worker;
+
+typedef struct _ftw_task {
+    struct _ftw_task *next;       /* the next task of the deque */
+    struct _ftw_task *prev;       /* the previous task of the deque */
+    struct _ftw_task *children;   /* tasks listing subdirectories, in the order of the listing */
+    struct _ftw_task *sibling;    /* the next subdirectory of the parent directory */
+    winx_file_info *entry;        /* the directory in the listing of the parent directory */
+    wchar_t *path;                /* the path of the directory */
+    winx_file_info *filelist;     /* the listing, the last entry first */
+    struct _ftw_worker *queue;    /* the worker whose deque holds the task */
+    struct _ftw_worker *owner;    /* the worker whose arena holds the listing */
+    int state;                    /* one of the FTW_TASK_xxx constants */
+    int pending;                  /* nonzero value indicates that the task has been queued */
+    int cancelled;                /* nonzero value stops the listing */
+    int result;                   /* zero for success, -1 indicates failure */
+} ftw_task;
+
+typedef struct _ftw_worker {
+    struct _ftw_pool *pool;       /* the pool the worker belongs to */
+    ftw_task *deque;              /* queued tasks, the oldest one first */
+    ftw_task *task;               /* the task being executed */
+    FILE_BOTH_DIR_INFORMATION *file_listing; /* buffer of FILE_LISTING_SIZE bytes */
+    GET_RETRIEVAL_DESCRIPTOR *filemap;       /* buffer of FILE_MAP_SIZE bytes */
+    winx_arena *arena;            /* arena the listings get allocated from */
+    winx_file_info *garbage;      /* listings of skipped directories */
+    ULONGLONG directories;        /* number of directories listed */
+    HANDLE hDoneEvent;            /* signaled when the thread terminates */
+} ftw_worker;
+
+typedef struct _ftw_pool {
+    ftw_worker workers[WINX_FTW_MAX_THREADS + 1]; /* the first one is the calling thread */
+    int n;                        /* number of threads started */
+    int flags;                    /* combination of WINX_FTW_xxx flags */
+    HANDLE hLock;                 /* guards the deques and states of the tasks */
+    HANDLE hWorkEvent;            /* signaled when tasks get queued */
+    HANDLE hTaskDoneEvent;        /* signaled when a task gets completed */
+    int queued;                   /* number of queued tasks */
+    int pending;                  /* number of queued tasks not walked through yet */
+    int quit;                     /* nonzero value forces the threads to exit */
+} ftw_pool;
+
+/**
+ * @internal
+ * @brief Acquires the lock of the pool.
+ */
+static void ftw_lock_pool(ftw_pool *pool)
+{
+    (void)NtWaitForSingleObject(pool->hLock,FALSE,NULL);
+}
+
+/**
+ * @internal
+ * @brief Releases the lock of the pool.
+ */
+static void ftw_unlock_pool(ftw_pool *pool)
+{
+    (void)NtReleaseMutant(pool->hLock,NULL);
+}
+
+/**
+ * @internal
+ * @brief Checks whether the worker
+ * must stop listing the directory.
+ */
+static int ftw_worker_terminator(void *user_defined_data)
+{
+    ftw_worker *w = (ftw_worker *)user_defined_data;
+
+    if(w->pool->quit) return 1;
+    return w->task ? w->task->cancelled : 0;
+}
+
+/**
+ * @internal
+ * @brief Checks whether a file is a
+ * directory the walk must go into
+ * unless the filter skips it.
+ */
+static int ftw_is_subdirectory(winx_file_info *f,int flags)
+{
+    /* don't follow reparse points! */
+    if(!is_directory(f) || is_reparse_point(f)) return 0;
+    return (flags & WINX_FTW_RECURSIVE) ? 1 : 0;
+}
+
+/**
+ * @internal
+ * @brief Creates a directory listing task.
+ * @param[in] path the path of the directory;
+ * NULL forces to retrieve it from the entry.
+ * @param[in] entry the directory in the listing
+ * of the parent directory.
+ * @return The task, NULL indicates failure.
+ */
+static ftw_task *ftw_create_task(wchar_t *path,winx_file_info *entry)
+{
+    ftw_task *task;
+    int length;
+
+    task = winx_tmalloc(sizeof(ftw_task));
+    if(task == NULL){
+        mtrace();
+        return NULL;
+    }
+    memset(task,0,sizeof(ftw_task));
+    task->entry = entry;
+
+    length = path ? (int)wcslen(path) + 1 : winx_get_file_path_length(entry) + 1;
+    task->path = winx_tmalloc(length * sizeof(wchar_t));
+    if(task->path == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            length * sizeof(wchar_t));
+        winx_free(task);
+        return NULL;
+    }
+    if(path) wcscpy(task->path,path);
+    else (void)winx_get_file_path(entry,task->path,length);
+    return task;
+}
+
+/**
+ * @internal
+ * @brief Inserts a task to the deque of a worker.
+ * @param[in] before the task to insert the new one
+ * before; NULL forces to insert it as the newest one.
+ * @note Must be called with the pool locked.
+ */
+static void ftw_queue_task(ftw_worker *w,ftw_task *task,ftw_task *before)
+{
+    ftw_task *next = before ? before : w->deque;
+
+    if(next == NULL){
+        task->next = task->prev = task;
+        w->deque = task;
+    } else {
+        task->next = next;
+        task->prev = next->prev;
+        task->prev->next = task;
+        task->next->prev = task;
+        /* insertion before the oldest task makes the new one the oldest */
+        if(before == w->deque) w->deque = task;
+    }
+    task->queue = w;
+    task->state = FTW_TASK_QUEUED;
+    w->pool->queued ++;
+}
+
+/**
+ * @internal
+ * @brief Removes a task from the deque it belongs to.
+ * @note Must be called with the pool locked.
+ */
+static void ftw_unqueue_task(ftw_task *task)
+{
+    ftw_worker *w = task->queue;
+
+    if(task->next == task){
+        w->deque = NULL;
+    } else {
+        if(task == w->deque) w->deque = task->next;
+        task->prev->next = task->next;
+        task->next->prev = task->prev;
+    }
+    task->next = task->prev = NULL;
+    task->queue = NULL;
+    task->state = FTW_TASK_IDLE;
+    w->pool->queued --;
+}
+
+/**
+ * @internal
+ * @brief Takes a task to be executed by a worker:
+ * the newest task of its own deque or, if there
+ * are no tasks there, the oldest one of another.
+ * @return The task, NULL indicates that
+ * there are no tasks queued at all.
+ * @note Must be called with the pool locked.
+ */
+static ftw_task *ftw_take_task(ftw_worker *w)
+{
+    ftw_pool *pool = w->pool;
+    ftw_task *task = NULL;
+    int i, k;
+
+    if(w->deque){
+        task = w->deque->prev;
+    } else {
+        k = (int)(w - pool->workers);
+        for(i = 1; i <= pool->n; i++){
+            task = pool->workers[(k + i) % (pool->n + 1)].deque;
+            if(task) break;
+        }
+    }
+    if(task){
+        ftw_unqueue_task(task);
+        task->state = FTW_TASK_RUNNING;
+    }
+    return task;
+}
+
+/**
+ * @internal
+ * @brief Queues subdirectories found by a task.
+ * @details The first subdirectory becomes the
+ * newest task of the deque, thus the worker lists
+ * it first, as well as the calling thread needs
+ * it first. The last ones are the oldest tasks
+ * stolen by the other workers.
+ * @return Number of tasks queued.
+ * @note Must be called with the pool locked.
+ */
+static int ftw_queue_subdirectories(ftw_worker *w,ftw_task *task)
+{
+    ftw_pool *pool = w->pool;
+    ftw_task *child, *before = NULL;
+    int n = 0;
+
+    for(child = task->children; child; child = child->sibling){
+        if(pool->pending >= FTW_MAX_PENDING_TASKS) break;
+        ftw_queue_task(w,child,before);
+        child->pending = 1;
+        pool->pending ++;
+        before = child;
+        n ++;
+    }
+    return n;
+}
+
+/**
+ * @internal
+ * @brief Lists a directory.
+ * @details Adds entries of the directory to
+ * the listing of the task, dumps files if
+ * requested and creates tasks for subdirectories.
+ * Does the same as ftw_helper, except of calling
+ * the callbacks and walking through the subdirectories.
+ */
+static void ftw_list_directory(ftw_worker *w,ftw_task *task)
+{
+    ftw_pool *pool = w->pool;
+    FILE_BOTH_DIR_INFORMATION *file_entry;
+    HANDLE hDir;
+    IO_STATUS_BLOCK iosb;
+    NTSTATUS status;
+    winx_file_info *f;
+    ftw_task *child, *last = NULL;
+    int n = 0;
+
+    w->task = task;
+    task->owner = w;
+
+    /* open the directory */
+    hDir = ftw_open_directory(task->path);
+    if(hDir == NULL)
+        goto done; /* the directory is locked by system, skip it */
+
+    /* reset the buffer */
+    memset((void *)w->file_listing,0,FILE_LISTING_SIZE);
+    file_entry = w->file_listing;
+
+    /* list directory entries */
+    while(!ftw_worker_terminator((void *)w)){
+        /* get a directory entry */
+        if(file_entry->NextEntryOffset){
+            /* go to the next directory entry */
+            file_entry = (FILE_BOTH_DIR_INFORMATION *)((char *)file_entry + \
+                file_entry->NextEntryOffset);
+        } else {
+            /* read the next portion of directory entries */
+            memset((void *)w->file_listing,0,FILE_LISTING_SIZE);
+            status = NtQueryDirectoryFile(hDir,NULL,NULL,NULL,
+                &iosb,(void *)w->file_listing,FILE_LISTING_SIZE,
+                FileBothDirectoryInformation,
+                FALSE /* return multiple entries */,
+                NULL,
+                FALSE /* do not restart scan */
+                );
+            if(status != STATUS_SUCCESS){
+                if(status != STATUS_NO_MORE_FILES)
+                    strace(status,"cannot get directory information");
+                /* no more entries to read */
+                break;
+            }
+            file_entry = w->file_listing;
+        }
+
+        /* skip . and .. entries */
+        if(file_entry->FileNameLength == sizeof(wchar_t)){
+            if(file_entry->FileName[0] == '.')
+                continue;
+        }
+        if(file_entry->FileNameLength == 2 * sizeof(wchar_t)){
+            if(file_entry->FileName[0] == '.' && file_entry->FileName[1] == '.')
+                continue;
+        }
+
+        /* validate the entry */
+        if(file_entry->FileNameLength == 0)
+            continue;
+
+        /* add the entry to the listing */
+        f = ftw_add_entry_to_filelist(task->path,NULL,pool->flags,NULL,NULL,
+                ftw_worker_terminator,(void *)w,&task->filelist,w->arena,
+                file_entry,w->filemap);
+        if(f == NULL){
+            task->result = (-1);
+            break;
+        }
+
+        /*
+        * The calling thread creates the task
+        * itself if there is not enough memory.
+        */
+        if(ftw_is_subdirectory(f,pool->flags)){
+            child = ftw_create_task(f->path,f);
+            if(child){
+                if(last) last->sibling = child;
+                else task->children = child;
+                last = child;
+            }
+        }
+    }
+    NtClose(hDir);
+
+done:
+    ftw_lock_pool(pool);
+    if(!ftw_worker_terminator((void *)w))
+        n = ftw_queue_subdirectories(w,task);
+    task->state = FTW_TASK_DONE;
+    w->task = NULL;
+    w->directories ++;
+    ftw_unlock_pool(pool);
+
+    if(n) (void)NtSetEvent(pool->hWorkEvent,NULL);
+    (void)NtSetEvent(pool->hTaskDoneEvent,NULL);
+}
+
+static DWORD WINAPI ftw_worker_thread(LPVOID p)
+{
+    ftw_worker *w = (ftw_worker *)p;
+    ftw_pool *pool = w->pool;
+    ftw_task *task;
+    int queued;
+
+    while(!pool->quit){
+        ftw_lock_pool(pool);
+        task = ftw_take_task(w);
+        queued = pool->queued;
+        ftw_unlock_pool(pool);
+        if(task == NULL){
+            (void)NtWaitForSingleObject(pool->hWorkEvent,FALSE,NULL);
+            continue;
+        }
+        /* wake up another worker to take the rest */
+        if(queued) (void)NtSetEvent(pool->hWorkEvent,NULL);
+        ftw_list_directory(w,task);
+    }
+
+    /* let the next worker exit as well */
+    (void)NtSetEvent(pool->hWorkEvent,NULL);
+    (void)NtSetEvent(w->hDoneEvent,NULL);
+    winx_exit_thread(0);
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Waits for a task to be completed.
+ * @details Tasks not taken by the workers
+ * yet get executed by the calling thread.
+ */
+static void ftw_wait_for_task(ftw_pool *pool,ftw_task *task)
+{
+    int state;
+
+    ftw_lock_pool(pool);
+    if(task->state == FTW_TASK_QUEUED)
+        ftw_unqueue_task(task);
+    state = task->state;
+    if(state == FTW_TASK_IDLE)
+        task->state = FTW_TASK_RUNNING;
+    /* the task is not listed in advance anymore */
+    if(task->pending){
+        task->pending = 0;
+        pool->pending --;
+    }
+    ftw_unlock_pool(pool);
+
+    if(state == FTW_TASK_IDLE){
+        ftw_list_directory(&pool->workers[0],task);
+        return;
+    }
+
+    while(state != FTW_TASK_DONE){
+        (void)NtWaitForSingleObject(pool->hTaskDoneEvent,FALSE,NULL);
+        ftw_lock_pool(pool);
+        state = task->state;
+        ftw_unlock_pool(pool);
+    }
+}
+
+/**
+ * @internal
+ * @brief Attaches a list of files
+ * to the beginning of another one.
+ */
+static void ftw_attach_list(winx_file_info **filelist,winx_file_info *list)
+{
+    winx_file_info *tail;
+
+    if(list == NULL) return;
+    if(*filelist){
+        tail = list->prev;
+        list->prev->next = *filelist;
+        list->prev = (*filelist)->prev;
+        (*filelist)->prev->next = list;
+        (*filelist)->prev = tail;
+    }
+    *filelist = list;
+}
+
+/**
+ * @internal
+ * @brief Destroys a task.
+ * @details Cancels tasks of all the subdirectories
+ * and keeps the listing till the end of the walk,
+ * since it belongs to the arena of a worker.
+ */
+static void ftw_destroy_task(ftw_pool *pool,ftw_task *task)
+{
+    ftw_task *child, *next;
+    int state;
+
+    ftw_lock_pool(pool);
+    if(task->state == FTW_TASK_QUEUED)
+        ftw_unqueue_task(task);
+    state = task->state;
+    if(state == FTW_TASK_RUNNING)
+        task->cancelled = 1;
+    if(task->pending){
+        task->pending = 0;
+        pool->pending --;
+    }
+    ftw_unlock_pool(pool);
+
+    if(state == FTW_TASK_RUNNING)
+        ftw_wait_for_task(pool,task);
+
+    for(child = task->children; child; child = next){
+        next = child->sibling;
+        ftw_destroy_task(pool,child);
+    }
+    if(task->filelist)
+        ftw_attach_list(&task->owner->garbage,task->filelist);
+    winx_free(task->path);
+    winx_free(task);
+}
+
+/**
+ * @internal
+ * @brief Moves the first listed entry
+ * to the beginning of the file list.
+ */
+static winx_file_info *ftw_move_entry(ftw_task *task,winx_file_info **filelist)
+{
+    winx_file_info *f = task->filelist->prev;
+
+    if(f == task->filelist){
+        task->filelist = NULL;
+    } else {
+        f->prev->next = f->next;
+        f->next->prev = f->prev;
+    }
+    f->next = f->prev = f;
+    ftw_attach_list(filelist,f);
+    return f;
+}
+
+/**
+ * @internal
+ * @brief ftw_helper analog walking
+ * through listings of the directories.
+ * @details Destroys the task.
+ */
+static int ftw_walk_task(ftw_pool *pool,ftw_task *task,winx_path_node *node,
+        ftw_filter_callback fcb, ftw_progress_callback pcb,
+        ftw_terminator t, void *user_defined_data, winx_file_info **filelist)
+{
+    winx_file_info *f;
+    ftw_task *child;
+    int skip_children, subdirectory, result;
+
+    ftw_wait_for_task(pool,task);
+
+    while(1){
+        if(ftw_check_for_termination(t,user_defined_data)){
+            result = (-2);
+            break;
+        }
+
+        if(task->filelist == NULL){
+            /* no more entries */
+            result = task->result;
+            break;
+        }
+
+        /* add the entry to the file list */
+        f = ftw_move_entry(task,filelist);
+        subdirectory = ftw_is_subdirectory(f,pool->flags);
+        child = NULL;
+        if(subdirectory && task->children && task->children->entry == f){
+            child = task->children;
+            task->children = child->sibling;
+        }
+        if(node){
+            /* the worker has built the full path */
+            winx_free(f->path);
+            f->path = NULL;
+            ftw_set_compact_path(f,node);
+        }
+
+        /* check for termination */
+        if(ftw_check_for_termination(t,user_defined_data)){
+            itrace("terminated by user");
+            if(child) ftw_destroy_task(pool,child);
+            result = (-2);
+            break;
+        }
+
+        /* call the callback routines */
+        if(pcb != NULL)
+            pcb(f,user_defined_data);
+
+        skip_children = 0;
+        if(fcb != NULL)
+            skip_children = fcb(f,user_defined_data);
+
+        if(!subdirectory) continue;
+
+        /* scan subdirectories if requested */
+        if(skip_children){
+            if(child) ftw_destroy_task(pool,child);
+            continue;
+        }
+        if(child == NULL){
+            child = ftw_create_task(NULL,f);
+            if(child == NULL){
+                result = (-1);
+                break;
+            }
+        }
+        result = ftw_walk_task(pool,child,node ? ftw_add_path_node(node,f->name) : NULL,
+            fcb,pcb,t,user_defined_data,filelist);
+        if(result < 0) break;
+    }
+
+    /* stop listing of the rest of the tree */
+    if(result == (-2)) pool->quit = 1;
+    ftw_destroy_task(pool,task);
+    return result;
+}
+
+/**
+ * @internal
+ * @brief Stops the threads started by
+ * ftw_start_pool and destroys the pool.
+ * @details Collects blocks allocated by
+ * the threads in the arena of the walk.
+ */
+static void ftw_stop_pool(ftw_pool *pool,winx_arena *arena)
+{
+    ftw_worker *w;
+    ULONGLONG directories = 0;
+    int i;
+
+    pool->quit = 1;
+    if(pool->hWorkEvent)
+        (void)NtSetEvent(pool->hWorkEvent,NULL);
+
+    for(i = 0; i <= WINX_FTW_MAX_THREADS; i++){
+        w = &pool->workers[i];
+        if(w->hDoneEvent){
+            (void)NtWaitForSingleObject(w->hDoneEvent,FALSE,NULL);
+            NtClose(w->hDoneEvent);
+        }
+        if(i) directories += w->directories;
+        winx_ftw_release(w->garbage,w->arena);
+        if(i) winx_arena_merge(arena,w->arena);
+        winx_free(w->file_listing);
+        winx_free(w->filemap);
+    }
+
+    if(pool->n){
+        itrace("%I64u directories listed by %u threads, %I64u by the calling thread",
+            directories,pool->n,pool->workers[0].directories);
+    }
+
+    if(pool->hLock) NtClose(pool->hLock);
+    if(pool->hWorkEvent) NtClose(pool->hWorkEvent);
+    if(pool->hTaskDoneEvent) NtClose(pool->hTaskDoneEvent);
+    winx_free(pool);
+}
+
+/**
+ * @internal
+ * @brief Starts threads listing directories.
+ * @param[in] n number of threads.
+ * @return The pool of threads, NULL indicates
+ * that the walk must be single threaded.
+ */
+static ftw_pool *ftw_start_pool(int n,int flags,winx_arena *arena)
+{
+    ftw_pool *pool;
+    ftw_worker *w;
+    NTSTATUS status;
+    int i;
+
+    pool = winx_tmalloc(sizeof(ftw_pool));
+    if(pool == NULL){
+        mtrace();
+        return NULL;
+    }
+    memset(pool,0,sizeof(ftw_pool));
+    pool->flags = flags;
+
+    status = NtCreateMutant(&pool->hLock,MUTEX_ALL_ACCESS,NULL,FALSE);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot create mutex");
+        pool->hLock = NULL;
+        goto fail;
+    }
+    status = NtCreateEvent(&pool->hWorkEvent,STANDARD_RIGHTS_ALL | 0x1ff,
+        NULL,SynchronizationEvent,FALSE);
+    if(!NT_SUCCESS(status)){
+        pool->hWorkEvent = NULL;
+        goto event_failed;
+    }
+    status = NtCreateEvent(&pool->hTaskDoneEvent,STANDARD_RIGHTS_ALL | 0x1ff,
+        NULL,SynchronizationEvent,FALSE);
+    if(!NT_SUCCESS(status)){
+        pool->hTaskDoneEvent = NULL;
+        goto event_failed;
+    }
+
+    for(i = 0; i <= n; i++){
+        w = &pool->workers[i];
+        w->pool = pool;
+        w->file_listing = winx_tmalloc(FILE_LISTING_SIZE);
+        w->filemap = winx_tmalloc(FILE_MAP_SIZE);
+        if(w->file_listing == NULL || w->filemap == NULL){
+            mtrace();
+            break;
+        }
+        /* the calling thread uses the arena of the walk */
+        if(i == 0){
+            w->arena = arena;
+            continue;
+        }
+        /* each thread allocates files from an arena of its own */
+        if(arena){
+            w->arena = winx_arena_create();
+            if(w->arena == NULL) break;
+        }
+        status = NtCreateEvent(&w->hDoneEvent,STANDARD_RIGHTS_ALL | 0x1ff,
+            NULL,SynchronizationEvent,FALSE);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot create event");
+            w->hDoneEvent = NULL;
+            break;
+        }
+        /* running threads look for tasks to steal up to pool->n */
+        ftw_lock_pool(pool);
+        pool->n = i;
+        ftw_unlock_pool(pool);
+        if(winx_create_thread(ftw_worker_thread,(PVOID)w) < 0){
+            ftw_lock_pool(pool);
+            pool->n = i - 1;
+            ftw_unlock_pool(pool);
+            NtClose(w->hDoneEvent);
+            w->hDoneEvent = NULL;
+            break;
+        }
+    }
+
+    if(pool->n == 0) goto fail;
+    itrace("%u threads will list directories",pool->n);
+    return pool;
+
+event_failed:
+    strace(status,"cannot create event");
+fail:
+    ftw_stop_pool(pool,arena);
+    return NULL;
+}
+
+/**
+ * @internal
+ * @brief ftw_helper analog listing
+ * directories by a few threads.
+ * @details Falls back to ftw_helper
+ * if the threads cannot be started.
+ */
+static int ftw_parallel_helper(wchar_t *path, winx_path_node *node, int flags,
+        ftw_filter_callback fcb, ftw_progress_callback pcb,
+        ftw_terminator t, void *user_defined_data,
+        winx_file_info **filelist, winx_arena *arena)
+{
+    ftw_pool *pool;
+    ftw_task *task;
+    int n, result;
+
+    n = (flags & WINX_FTW_THREADS_MASK) >> 12;
+    if(n == 0 || !(flags & WINX_FTW_RECURSIVE))
+        goto single_threaded;
+
+    task = ftw_create_task(path,NULL);
+    if(task == NULL) return (-1);
+    pool = ftw_start_pool(n,flags,arena);
+    if(pool == NULL){
+        winx_free(task->path);
+        winx_free(task);
+        goto single_threaded;
+    }
+
+    result = ftw_walk_task(pool,task,node,fcb,pcb,t,user_defined_data,filelist);
+    ftw_stop_pool(pool,arena);
+    return result;
+
+single_threaded:
+    return ftw_helper(path,node,flags,fcb,pcb,t,user_defined_data,filelist,arena);
+}
+
 /**
  * @internal
  * @brief Removes resident streams from the file list.
  */
-static void ftw_remove_resident_streams(winx_file_info **filelist)
+static void ftw_remove_resident_streams(winx_file_info **filelist,winx_arena *arena)
 {
     winx_file_info *f, *head, *next = NULL;
 
@@ -601,10 +1736,11 @@ static void ftw_remove_resident_streams(winx_file_info **filelist)
         head = *filelist;
         next = f->next;
         if(f->disp.fragments == 0){
-            winx_free(f->name);
-            winx_free(f->path);
-            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
-            winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+            ftw_release_entry_strings(f);
+            winx_list_destroy_ex((list_entry **)(void *)&f->disp.blockmap,
+                sizeof(winx_blockmap),arena);
+            winx_list_remove_ex((list_entry **)(void *)filelist,
+                (list_entry *)f,sizeof(winx_file_info),arena);
         }
         if(*filelist == NULL) break;
         if(next == head) break;
@@ -615,7 +1751,7 @@ static void ftw_remove_resident_streams(winx_file_info **filelist)
  * @internal
  * @brief Removes invalid streams from the file list.
  */
-static void ftw_remove_invalid_streams(winx_file_info **filelist)
+static void ftw_remove_invalid_streams(winx_file_info **filelist,winx_arena *arena)
 {
     winx_file_info *f, *head, *next = NULL;
     int invalid_entry;
@@ -624,16 +1760,19 @@ static void ftw_remove_invalid_streams(winx_file_info **filelist)
         head = *filelist;
         next = f->next;
         invalid_entry = 0;
-        if(f->path == NULL){
+        if(f->parent){
+            /* compact paths are always valid */
+        } else if(f->path == NULL){
             invalid_entry = 1;
         } else if(f->path[0] == 0){
             invalid_entry = 1;
         }
         if(invalid_entry){
-            winx_free(f->name);
-            winx_free(f->path);
-            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
-            winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+            ftw_release_entry_strings(f);
+            winx_list_destroy_ex((list_entry **)(void *)&f->disp.blockmap,
+                sizeof(winx_blockmap),arena);
+            winx_list_remove_ex((list_entry **)(void *)filelist,
+                (list_entry *)f,sizeof(winx_file_info),arena);
         }
         if(*filelist == NULL) break;
         if(next == head) break;
@@ -654,11 +1793,17 @@ static void ftw_remove_invalid_streams(winx_file_info **filelist)
  * callback may be called when all the file information is gathered except of the
  * file name and path. If WINX_FTW_SKIP_RESIDENT_STREAMS flag is set, the progress
  * callback will never be called for files of zero length and resident NTFS streams.
+ * For each file the progress callback gets called before the filter callback, so
+ * it may apply filters not depending on names and paths; on NTFS it gets called
+ * while the MFT is being parsed, long before the paths are built.
  * @param[in] t the address of the callback routine to be called each time when
  * winx_ftw would like to know whether it must be terminated or not. Nonzero value,
  * returned by the registered routine, terminates the scan immediately.
  * @param[in] user_defined_data pointer to data to be passed to all the registered
  * callbacks.
+ * @param[in] arena the arena the list of files and the maps of their blocks get
+ * allocated from; NULL forces to use the global heap. The arena must not be
+ * destroyed before the list is released.
  * @return The list of files, NULL indicates failure.
  * @note
  * - Optimized for little directories scan.
@@ -674,6 +1819,12 @@ static void ftw_remove_invalid_streams(winx_file_info **filelist)
  *   list, but may pass through the filter callback.
  * - All the callback procedures should complete as
  *   quickly as possible to avoid slowdown of the scan.
+ * - WINX_FTW_THREADS(n) forces n threads to list directories
+ *   and dump files in advance. The callbacks are still called
+ *   by the calling thread, in the same order, and the list is
+ *   the same as well. Contents of directories skipped by the
+ *   filter callback may be listed in vain then, and files get
+ *   dumped without calls to the terminator.
  * - To scan root directories, add trailing backslash to their paths.
  * @par Example:
  * @code
@@ -702,18 +1853,19 @@ static void ftw_remove_invalid_streams(winx_file_info **filelist)
  *
  * // list all files on disk c:
  * filelist = winx_ftw(L"\\??\\c:\\",0,filter,update_progress,
- *     terminator,&user_defined_data);
+ *     terminator,&user_defined_data,NULL);
  * // ...
  * // process list of files
  * // ...
- * winx_ftw_release(filelist);
+ * winx_ftw_release(filelist,NULL);
  * @endcode
  */
 winx_file_info *winx_ftw(wchar_t *path, int flags,
         ftw_filter_callback fcb, ftw_progress_callback pcb,
-        ftw_terminator t, void *user_defined_data)
+        ftw_terminator t, void *user_defined_data, winx_arena *arena)
 {
     winx_file_info *filelist = NULL;
+    winx_path_node *top = NULL;
     
     DbgCheck1(path,NULL);
     
@@ -725,18 +1877,26 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
         }
     }
     
-    if(ftw_helper(path,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    if(flags & WINX_FTW_COMPACT_PATHS)
+        top = ftw_create_path_store(path);
+    
+    if(ftw_parallel_helper(path,top,flags,fcb,pcb,t,user_defined_data,&filelist,arena) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy the list */
-        winx_ftw_release(filelist);
-        return NULL;
+        winx_ftw_release(filelist,arena);
+        filelist = NULL;
+        goto done;
     }
       
     if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS)
-        ftw_remove_resident_streams(&filelist);
+        ftw_remove_resident_streams(&filelist,arena);
     
     /* get rid of invalid entries */
-    ftw_remove_invalid_streams(&filelist);
+    ftw_remove_invalid_streams(&filelist,arena);
+
+done:
+    /* the storage remains alive while the list refers to it */
+    if(top) ftw_release_path_store(top);
     return filelist;
 }
 
@@ -746,9 +1906,13 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
  * @details On NTFS-formatted disks this
  * routine analyzes MFT records directly
  * to speed the scan (up to 25 times).
- * On FAT disks, however, general purpose
- * system API work faster as they benifit
- * from the Windows file caching. We never
+ * On FAT12/16/32 disks it loads the FAT
+ * into memory and reads directories
+ * straight from the disk, so maps of
+ * files get built from cluster chains
+ * instead of a request to the file
+ * system driver per file. exFAT disks
+ * are scanned the same way. We never
  * tried to analyze UDF-formatted disks
  * directly because of high complexity
  * of UDF standards, so we use general
@@ -756,12 +1920,15 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
  */
 winx_file_info *winx_scan_disk(char volume_letter, int flags,
         ftw_filter_callback fcb, ftw_progress_callback pcb, ftw_terminator t,
-        void *user_defined_data)
+        void *user_defined_data, winx_arena *arena)
 {
     winx_file_info *filelist = NULL;
+    winx_path_node *top = NULL;
     wchar_t rootpath[] = L"\\??\\A:\\";
     winx_volume_information v;
     ULONGLONG time;
+    int is_fat = 0, is_exfat = 0;
+    int result = (-3);
     
     /* ensure that it will work on w2k */
     volume_letter = winx_toupper(volume_letter);
@@ -780,61 +1947,172 @@ winx_file_info *winx_scan_disk(char volume_letter, int flags,
     if(winx_get_volume_information(volume_letter,&v) >= 0){
         itrace("file system is %s",v.fs_name);
         if(!strcmp(v.fs_name,"NTFS")){
-            filelist = ntfs_scan_disk(volume_letter,flags,fcb,pcb,t,user_defined_data);
+            filelist = ntfs_scan_disk(volume_letter,flags,fcb,pcb,t,user_defined_data,arena);
             goto cleanup;
         }
+        /* exFAT is not handled by the FAT scanner */
+        if(!strncmp(v.fs_name,"FAT",3)) is_fat = 1;
+        if(!strcmp(v.fs_name,"exFAT")) is_exfat = 1;
     }
     
     /* collect information about the root directory */
     rootpath[4] = (wchar_t)volume_letter;
-    if(ftw_add_root_directory(rootpath,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    if(ftw_add_root_directory(rootpath,flags,fcb,pcb,t,user_defined_data,&filelist,arena) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy the list */
-        winx_ftw_release(filelist);
+        winx_ftw_release(filelist,arena);
         filelist = NULL;
         goto done;
     }
 
     /* collect information about the entire directory tree */
     flags |= WINX_FTW_RECURSIVE;
-    if(ftw_helper(rootpath,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
-      !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
+    if(flags & WINX_FTW_COMPACT_PATHS)
+        top = ftw_create_path_store(rootpath);
+    if(is_fat){
+        result = fat_scan_disk(&v,rootpath,top,flags,fcb,pcb,
+            t,user_defined_data,&filelist,arena);
+    } else if(is_exfat){
+        result = exfat_scan_disk(&v,rootpath,top,flags,fcb,pcb,
+            t,user_defined_data,&filelist,arena);
+    }
+    if(result == (-3)){
+        /* use general purpose API */
+        result = ftw_parallel_helper(rootpath,top,flags,fcb,pcb,t,user_defined_data,&filelist,arena);
+    }
+    if(result == (-1) && !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy the list */
-        winx_ftw_release(filelist);
+        winx_ftw_release(filelist,arena);
         filelist = NULL;
         goto done;
     }
 
 cleanup:
     if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS)
-        ftw_remove_resident_streams(&filelist);
+        ftw_remove_resident_streams(&filelist,arena);
     /* get rid of invalid entries */
-    ftw_remove_invalid_streams(&filelist);
+    ftw_remove_invalid_streams(&filelist,arena);
         
 done:
+    if(top) ftw_release_path_store(top);
     winx_dbg_print_header(0,0,I"winx_scan_disk completed in %I64u ms",
         winx_xtime() - time);
     return filelist;
 }
 
+/**
+ * @brief Retrieves length of the full native path of a file.
+ * @param[in] f the file.
+ * @return Length of the path, in characters.
+ * Negative value indicates that the path is unknown.
+ */
+int winx_get_file_path_length(winx_file_info *f)
+{
+    DbgCheck1(f,-1);
+    
+    if(f->path) return (int)wcslen(f->path);
+    if(f->parent == NULL) return (-1);
+    return (int)(f->parent->length + 1 + wcslen(f->name));
+}
+
+/**
+ * @brief Retrieves the full native path of a file.
+ * @details Works for both regular and compact
+ * paths (see WINX_FTW_COMPACT_PATHS).
+ * @param[in] f the file.
+ * @param[out] buffer the buffer receiving the path.
+ * @param[in] length length of the buffer, in characters.
+ * @return Length of the path, in characters.
+ * Negative value indicates that the path is unknown
+ * or the buffer is too small.
+ */
+int winx_get_file_path(winx_file_info *f,wchar_t *buffer,int length)
+{
+    winx_path_node *node;
+    int n, i, name_length;
+    
+    DbgCheck2(f,buffer,-1);
+    
+    n = winx_get_file_path_length(f);
+    if(n < 0 || n >= length) return (-1);
+    
+    if(f->path){
+        wcscpy(buffer,f->path);
+        return n;
+    }
+    
+    /* fill the buffer from the end */
+    buffer[n] = 0;
+    name_length = (int)wcslen(f->name);
+    i = n - name_length;
+    memcpy(buffer + i,f->name,name_length * sizeof(wchar_t));
+    buffer[-- i] = '\\';
+    for(node = f->parent; node->parent; node = node->parent){
+        name_length = (int)(node->length - node->parent->length - 1);
+        i -= name_length;
+        memcpy(buffer + i,node->name,name_length * sizeof(wchar_t));
+        buffer[-- i] = '\\';
+    }
+    memcpy(buffer,node->name,node->length * sizeof(wchar_t));
+    return n;
+}
+
+/**
+ * @brief Returns the full native path of a file.
+ * @details In case of compact paths (see WINX_FTW_COMPACT_PATHS)
+ * builds the path on demand and keeps it in f->path then,
+ * until the file list gets released.
+ * @return The path, NULL indicates failure.
+ * @note Intended for files processed individually;
+ * use winx_get_file_path to go through all the files.
+ */
+wchar_t *winx_file_path(winx_file_info *f)
+{
+    wchar_t *path;
+    int length;
+    
+    DbgCheck1(f,NULL);
+    
+    if(f->path || f->parent == NULL)
+        return f->path;
+    
+    length = winx_get_file_path_length(f) + 1;
+    path = winx_tmalloc(length * sizeof(wchar_t));
+    if(path == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            length * sizeof(wchar_t));
+        return NULL;
+    }
+    (void)winx_get_file_path(f,path,length);
+    f->path = path;
+    return f->path;
+}
+
 /**
  * @brief Releases resources allocated
  * by winx_ftw or winx_scan_disk.
  * @param[in] filelist the list
  * of files to be released.
+ * @param[in] arena the arena the list
+ * has been allocated from.
+ * @note The list entries and the maps
+ * of blocks allocated from an arena are
+ * left there, winx_arena_destroy releases
+ * them all at once.
  */
-void winx_ftw_release(winx_file_info *filelist)
+void winx_ftw_release(winx_file_info *filelist,winx_arena *arena)
 {
     winx_file_info *f;
 
     /* walk through the list of files and free allocated memory */
     for(f = filelist; f != NULL; f = f->next){
-        winx_free(f->name);
-        winx_free(f->path);
-        winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+        ftw_release_entry_strings(f);
+        if(arena == NULL)
+            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
         if(f->next == filelist) break;
     }
-    winx_list_destroy((list_entry **)(void *)&filelist);
+    if(arena == NULL)
+        winx_list_destroy((list_entry **)(void *)&filelist);
 }
 
 /** @} */
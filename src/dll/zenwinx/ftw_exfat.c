@@ -0,0 +1,895 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2016 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file ftw_exfat.c
+ * @brief Fast file tree walk for exFAT.
+ * @details The FAT and the allocation bitmap
+ * get loaded into memory entirely, so maps of
+ * files are built from their cluster chains or,
+ * for contiguous files not using the FAT, from
+ * their directory entries alone. Directories
+ * get read straight from the volume as well.
+ * @addtogroup File
+ * @{
+ */
+
+#include "ntndk.h"
+#include "zenwinx.h"
+#include "exfat.h"
+
+/*
+* Size of the portions of the FAT
+* to be read directly from the disk.
+*/
+#define EXFAT_CHUNK_SIZE (4 * 1024 * 1024)
+
+/*
+* Larger FATs are never loaded into memory,
+* the generic file tree walk is used instead.
+*/
+#define EXFAT_MAX_FAT_SIZE (256 * 1024 * 1024)
+
+/*
+* Maximum depth of the directory tree;
+* deeper directories are skipped.
+*/
+#define EXFAT_MAX_DEPTH 256
+
+/* internal structures */
+typedef struct _exfat_layout {
+    ULONG sector_size;              /* sector size, in bytes */
+    ULONG sectors_per_cluster;      /* number of sectors per cluster */
+    ULONG cluster_size;             /* cluster size, in bytes */
+    ULONG clusters;                 /* number of data clusters */
+    ULONGLONG fat_sector;           /* the first sector of the active FAT */
+    ULONG fat_size;                 /* number of bytes of the FAT to be loaded */
+    ULONG root_cluster;             /* the first cluster of the root directory */
+    ULONGLONG first_data_sector;    /* the sector of the first data cluster */
+    int active_fat;                 /* index of the active FAT and allocation bitmap */
+} exfat_layout;
+
+typedef struct _exfat_scan_parameters {
+    exfat_layout el;            /* the layout of the volume */
+    WINX_FILE *f_volume;        /* volume handle */
+    int flags;                  /* combination of WINX_FTW_xxx flags */
+    ftw_filter_callback fcb;    /**/
+    ftw_progress_callback pcb;  /**/
+    ftw_terminator t;           /* termination callback */
+    void *user_defined_data;    /* pointer to data to be passed to all callbacks */
+    char *fat_buffer;           /* the buffer allocated for the FAT */
+    ULONG *fat;                 /* the active FAT, aligned on the sector boundary */
+    char *bitmap_buffer;        /* the buffer allocated for the allocation bitmap */
+    unsigned char *bitmap;      /* the allocation bitmap; NULL if it cannot be read */
+    unsigned char *visited;     /* bitmap of directories already scanned; may be NULL */
+    unsigned long errors;       /* number of critical errors preventing gathering of complete information */
+    winx_file_info **filelist;  /* list of files */
+    winx_arena *arena;          /* arena the list is allocated from; NULL for the global heap */
+} exfat_scan_parameters;
+
+winx_path_node *ftw_add_path_node(winx_path_node *parent,wchar_t *name);
+void ftw_set_compact_path(winx_file_info *f,winx_path_node *parent);
+
+/*
+**************************************************
+*                Common routines
+**************************************************
+*/
+
+static int ftw_exfat_check_for_termination(exfat_scan_parameters *sp)
+{
+    if(!(sp->flags & WINX_FTW_ALLOW_PARTIAL_SCAN) && sp->errors)
+        return 1;
+
+    if(sp->t == NULL)
+        return 0;
+
+    return sp->t(sp->user_defined_data);
+}
+
+/**
+ * @note
+ * - lsn, buffer, length must be valid before this call.
+ * - length must be an integral of the sector size.
+ */
+static NTSTATUS read_sectors(ULONGLONG lsn,PVOID buffer,ULONG length,exfat_scan_parameters *sp)
+{
+    IO_STATUS_BLOCK iosb;
+    LARGE_INTEGER offset;
+    NTSTATUS status;
+
+    offset.QuadPart = lsn * sp->el.sector_size;
+    status = NtReadFile(winx_fileno(sp->f_volume),NULL,NULL,NULL,&iosb,buffer,length,&offset,NULL);
+    if(NT_SUCCESS(status)){
+        status = NtWaitForSingleObject(winx_fileno(sp->f_volume),FALSE,NULL);
+        if(NT_SUCCESS(status)) status = iosb.Status;
+    }
+    if(status == STATUS_SUCCESS && iosb.Information < length){
+        etrace("less bytes read than needed?");
+        status = STATUS_UNSUCCESSFUL;
+    }
+    return status;
+}
+
+/**
+ * @brief Allocates a buffer aligned on the sector boundary.
+ * @param[out] buffer the allocated buffer to be released
+ * by winx_free.
+ * @return The aligned address, NULL indicates failure.
+ */
+static char *alloc_aligned_buffer(ULONG size,ULONG sector_size,char **buffer)
+{
+    *buffer = winx_tmalloc(size + sector_size);
+    if(*buffer == NULL){
+        etrace("cannot allocate %u bytes of memory",size + sector_size);
+        return NULL;
+    }
+    return (char *)(((ULONG_PTR)*buffer + sector_size - 1) & ~((ULONG_PTR)sector_size - 1));
+}
+
+/*
+**************************************************
+*            FAT and allocation bitmap
+**************************************************
+*/
+
+static int is_valid_cluster(ULONG cluster,exfat_scan_parameters *sp)
+{
+    return (cluster >= EXFAT_FIRST_CLUSTER && \
+        cluster - EXFAT_FIRST_CLUSTER < sp->el.clusters) ? 1 : 0;
+}
+
+/**
+ * @brief Reads the boot sector and
+ * determines the layout of the volume.
+ * @details Cross-checks the layout against
+ * the information reported by the system,
+ * so LCNs we calculate will be the same
+ * as reported by the file system driver.
+ * @return Zero for success, negative
+ * value otherwise.
+ */
+static int get_exfat_layout(winx_volume_information *v,exfat_scan_parameters *sp)
+{
+    EXFAT_BOOT_SECTOR *bs;
+    exfat_layout *el = &sp->el;
+    char *buffer, *sector;
+    NTSTATUS status;
+
+    el->sector_size = v->bytes_per_sector;
+    if(el->sector_size < 512 || el->sector_size > 4096 || \
+      (el->sector_size & (el->sector_size - 1))){
+        etrace("unexpected sector size: %u",el->sector_size);
+        return (-1);
+    }
+
+    sector = alloc_aligned_buffer(el->sector_size,el->sector_size,&buffer);
+    if(sector == NULL) return (-1);
+
+    status = read_sectors(0,sector,el->sector_size,sp);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot read the boot sector");
+        winx_free(buffer);
+        return (-1);
+    }
+
+    bs = (EXFAT_BOOT_SECTOR *)sector;
+    if(memcmp(bs->FileSystemName,"EXFAT   ",8) || \
+      (UCHAR)sector[510] != 0x55 || (UCHAR)sector[511] != 0xaa){
+        etrace("exFAT boot sector signature is missing");
+        goto fail;
+    }
+    if(bs->BytesPerSectorShift > 12 || \
+      ((ULONG)1 << bs->BytesPerSectorShift) != el->sector_size || \
+      bs->SectorsPerClusterShift > 25 - bs->BytesPerSectorShift || \
+      bs->NumberOfFats == 0 || bs->NumberOfFats > 2){
+        etrace("invalid boot sector");
+        goto fail;
+    }
+
+    el->sectors_per_cluster = (ULONG)1 << bs->SectorsPerClusterShift;
+    el->cluster_size = el->sector_size * el->sectors_per_cluster;
+    el->clusters = bs->ClusterCount;
+    el->first_data_sector = bs->ClusterHeapOffset;
+    el->root_cluster = bs->FirstClusterOfRootDirectory;
+    el->active_fat = (bs->NumberOfFats == 2 && \
+        (bs->VolumeFlags & EXFAT_VOLUME_FLAG_ACTIVE_FAT)) ? 1 : 0;
+    el->fat_sector = bs->FatOffset + (ULONGLONG)el->active_fat * bs->FatLength;
+
+    if(el->first_data_sector < bs->FatOffset + (ULONGLONG)bs->FatLength * bs->NumberOfFats || \
+      el->first_data_sector + (ULONGLONG)el->clusters * el->sectors_per_cluster > bs->VolumeLength || \
+      !is_valid_cluster(el->root_cluster,sp)){
+        etrace("invalid boot sector");
+        goto fail;
+    }
+
+    /* ensure that we use the same cluster numbering as the system */
+    if(el->clusters != v->total_clusters || el->cluster_size != v->bytes_per_cluster){
+        etrace("layout mismatch: %u clusters of %u bytes on disk, " \
+            "%I64u clusters of %I64u bytes reported by the system",
+            el->clusters,el->cluster_size,v->total_clusters,v->bytes_per_cluster);
+        goto fail;
+    }
+
+    /* load only the part of the FAT describing existing clusters */
+    if(el->clusters > (EXFAT_MAX_FAT_SIZE / sizeof(ULONG)) - EXFAT_FIRST_CLUSTER){
+        etrace("the FAT is too large to be loaded");
+        goto fail;
+    }
+    el->fat_size = (el->clusters + EXFAT_FIRST_CLUSTER) * sizeof(ULONG);
+    el->fat_size = (el->fat_size + el->sector_size - 1) / el->sector_size * el->sector_size;
+    if(el->fat_size > (ULONGLONG)bs->FatLength * el->sector_size){
+        etrace("the FAT is too small to describe %u clusters",el->clusters);
+        goto fail;
+    }
+
+    itrace("exFAT volume of %u clusters of %u bytes",
+        el->clusters,el->cluster_size);
+    winx_free(buffer);
+    return 0;
+
+fail:
+    winx_free(buffer);
+    return (-1);
+}
+
+/**
+ * @brief Loads the active FAT into memory.
+ * @return Zero for success, negative
+ * value otherwise.
+ */
+static int load_fat(exfat_scan_parameters *sp)
+{
+    char *buffer, *fat;
+    ULONG offset, length;
+    NTSTATUS status;
+
+    fat = alloc_aligned_buffer(sp->el.fat_size,sp->el.sector_size,&buffer);
+    if(fat == NULL) return (-1);
+
+    for(offset = 0; offset < sp->el.fat_size; offset += length){
+        if(ftw_exfat_check_for_termination(sp)){
+            winx_free(buffer);
+            return (-1);
+        }
+        length = min(sp->el.fat_size - offset,EXFAT_CHUNK_SIZE);
+        status = read_sectors(sp->el.fat_sector + offset / sp->el.sector_size,
+            fat + offset,length,sp);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot read the FAT");
+            winx_free(buffer);
+            return (-1);
+        }
+    }
+
+    sp->fat_buffer = buffer;
+    sp->fat = (ULONG *)fat;
+    return 0;
+}
+
+/**
+ * @brief Checks whether all clusters
+ * of a map are marked as allocated.
+ * @details Contiguous files don't use
+ * the FAT, so the allocation bitmap is
+ * the only way to catch wrong maps.
+ */
+static int is_allocated(winx_blockmap *blockmap,exfat_scan_parameters *sp)
+{
+    winx_blockmap *block;
+    ULONGLONG i;
+
+    if(sp->bitmap == NULL) return 1;
+
+    for(block = blockmap; block; block = block->next){
+        for(i = block->lcn; i < block->lcn + block->length; i++){
+            if(!(sp->bitmap[i >> 3] & (1 << (i & 7))))
+                return 0;
+        }
+        if(block->next == blockmap) break;
+    }
+    return 1;
+}
+
+/**
+ * @brief Builds a map of blocks of a stream.
+ * @param[in] cluster the first cluster of the stream.
+ * @param[in] length size of the stream, in clusters;
+ * zero forces to follow the cluster chain until its end.
+ * @param[in] no_fat_chain nonzero value indicates a
+ * contiguous stream not described by the FAT.
+ * @param[out] disp the structure receiving the map;
+ * it must be empty before this call.
+ * @param[in] arena the arena the map gets allocated
+ * from; NULL forces to use the global heap.
+ * @return Zero for success, -1 indicates a broken
+ * chain or lack of memory; the map remains empty then.
+ * @note LCNs reported by the system for exFAT volumes
+ * start from the first data cluster, which is cluster 2.
+ */
+static int get_stream_map(ULONG cluster,ULONGLONG length,int no_fat_chain,
+    winx_file_disposition *disp,winx_arena *arena,exfat_scan_parameters *sp)
+{
+    winx_blockmap *block = NULL;
+    ULONGLONG vcn = 0;
+
+    if(no_fat_chain){
+        if(!is_valid_cluster(cluster,sp) || length == 0 || \
+          cluster - EXFAT_FIRST_CLUSTER + length > sp->el.clusters)
+            return (-1);
+        block = (winx_blockmap *)winx_list_insert_ex((list_entry **)(void *)&disp->blockmap,
+            NULL,sizeof(winx_blockmap),arena);
+        if(block == NULL){
+            mtrace();
+            sp->errors ++;
+            return (-1);
+        }
+        block->vcn = 0;
+        block->lcn = cluster - EXFAT_FIRST_CLUSTER;
+        block->length = length;
+        disp->fragments = 1;
+        vcn = length;
+        goto done;
+    }
+
+    while(length == 0 || vcn < length){
+        if(cluster == EXFAT_END_OF_CHAIN && length == 0)
+            break;
+        /* a chain cannot be longer than the volume */
+        if(!is_valid_cluster(cluster,sp) || vcn == sp->el.clusters)
+            goto fail;
+        if(block && block->lcn + block->length == cluster - EXFAT_FIRST_CLUSTER){
+            block->length ++;
+        } else {
+            block = (winx_blockmap *)winx_list_insert_ex((list_entry **)(void *)&disp->blockmap,
+                (list_entry *)block,sizeof(winx_blockmap),arena);
+            if(block == NULL){
+                mtrace();
+                sp->errors ++;
+                goto fail;
+            }
+            block->vcn = vcn;
+            block->lcn = cluster - EXFAT_FIRST_CLUSTER;
+            block->length = 1;
+            disp->fragments ++;
+        }
+        vcn ++;
+        cluster = sp->fat[cluster];
+    }
+
+done:
+    disp->clusters = vcn;
+    if(is_allocated(disp->blockmap,sp))
+        return 0;
+    etrace("the map refers to free clusters");
+
+fail:
+    winx_list_destroy_ex((list_entry **)(void *)&disp->blockmap,
+        sizeof(winx_blockmap),arena);
+    disp->clusters = 0;
+    disp->fragments = 0;
+    return (-1);
+}
+
+/**
+ * @brief Reads a stream into memory.
+ * @param[in] size size of the stream, in bytes;
+ * zero forces to read the cluster chain until its end.
+ * @param[out] buffer the buffer to be released
+ * by winx_free.
+ * @param[out] length number of bytes read.
+ * @return The contents of the stream, NULL
+ * indicates failure.
+ */
+static char *read_stream(ULONG cluster,ULONGLONG size,int no_fat_chain,
+    ULONG max_size,char **buffer,ULONG *length,exfat_scan_parameters *sp)
+{
+    winx_file_disposition disp;
+    winx_blockmap *block;
+    char *data;
+    ULONG n, offset = 0;
+    ULONGLONG clusters;
+    NTSTATUS status;
+
+    clusters = (size + sp->el.cluster_size - 1) / sp->el.cluster_size;
+    memset(&disp,0,sizeof(winx_file_disposition));
+    if(get_stream_map(cluster,clusters,no_fat_chain,&disp,NULL,sp) < 0){
+        etrace("broken stream at cluster %u",cluster);
+        return NULL;
+    }
+
+    /* ignore extra clusters */
+    if(disp.clusters * sp->el.cluster_size < max_size)
+        max_size = (ULONG)disp.clusters * sp->el.cluster_size;
+
+    data = alloc_aligned_buffer(max_size,sp->el.sector_size,buffer);
+    if(data == NULL) goto fail;
+
+    /* read each block at once */
+    for(block = disp.blockmap; block && offset < max_size; block = block->next){
+        n = (ULONG)min(block->length * sp->el.cluster_size,(ULONGLONG)(max_size - offset));
+        status = read_sectors(sp->el.first_data_sector + block->lcn * sp->el.sectors_per_cluster,
+            data + offset,n,sp);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot read stream at cluster %u",cluster);
+            winx_free(*buffer);
+            data = NULL;
+            goto fail;
+        }
+        offset += n;
+        if(block->next == disp.blockmap) break;
+    }
+    *length = offset;
+
+fail:
+    winx_list_destroy_ex((list_entry **)(void *)&disp.blockmap,
+        sizeof(winx_blockmap),NULL);
+    return data;
+}
+
+/**
+ * @brief Loads the allocation bitmap
+ * described in the root directory.
+ * @details The scan works without the
+ * bitmap as well, it just cannot validate
+ * maps of contiguous files then.
+ */
+static void load_allocation_bitmap(char *entries,ULONG size,exfat_scan_parameters *sp)
+{
+    EXFAT_DIRECTORY_ENTRY *e;
+    ULONG i, length;
+    char *bitmap;
+
+    for(i = 0; i < size / sizeof(EXFAT_DIRECTORY_ENTRY); i++){
+        e = (EXFAT_DIRECTORY_ENTRY *)entries + i;
+        if(e->EntryType == EXFAT_ENTRY_END_OF_DIRECTORY)
+            break;
+        if(e->EntryType != EXFAT_ENTRY_ALLOCATION_BITMAP)
+            continue;
+        /* the second bitmap corresponds to the second FAT */
+        if((e->CustomDefined[0] & 0x1) != sp->el.active_fat)
+            continue;
+        if(e->DataLength < (sp->el.clusters + 7) / 8 || \
+          e->DataLength > EXFAT_MAX_FAT_SIZE){
+            etrace("invalid size of the allocation bitmap: %I64u",e->DataLength);
+            return;
+        }
+        bitmap = read_stream(e->FirstCluster,e->DataLength,0,
+            (ULONG)e->DataLength + sp->el.cluster_size,&sp->bitmap_buffer,&length,sp);
+        if(bitmap == NULL || length < (sp->el.clusters + 7) / 8){
+            etrace("cannot read the allocation bitmap");
+            if(bitmap) winx_free(sp->bitmap_buffer);
+            sp->bitmap_buffer = NULL;
+            return;
+        }
+        sp->bitmap = (unsigned char *)bitmap;
+        return;
+    }
+    etrace("allocation bitmap not found");
+}
+
+/*
+**************************************************
+*               Directory entries
+**************************************************
+*/
+
+static USHORT get_set_checksum(UCHAR *entries,ULONG count)
+{
+    USHORT sum = 0;
+    ULONG i;
+
+    for(i = 0; i < count * sizeof(EXFAT_DIRECTORY_ENTRY); i++){
+        /* skip the checksum itself */
+        if(i == 2 || i == 3) continue;
+        sum = (USHORT)(((sum & 1) ? 0x8000 : 0) + (sum >> 1) + entries[i]);
+    }
+    return sum;
+}
+
+/**
+ * @brief Converts a timestamp stored
+ * in DOS format to the standard time format.
+ * @param[in] increment hundredths of seconds.
+ * @param[in] utc_offset offset from UTC; if it
+ * is not valid, the time is treated as local.
+ * @return The time, zero if it isn't defined.
+ */
+static ULONGLONG get_file_time(ULONG timestamp,UCHAR increment,UCHAR utc_offset)
+{
+    TIME_FIELDS tf;
+    LARGE_INTEGER local_time, system_time;
+    int offset;
+
+    if(timestamp == 0) return 0;
+
+    tf.Year = (short)(1980 + (timestamp >> 25));
+    tf.Month = (short)((timestamp >> 21) & 0xf);
+    tf.Day = (short)((timestamp >> 16) & 0x1f);
+    tf.Hour = (short)((timestamp >> 11) & 0x1f);
+    tf.Minute = (short)((timestamp >> 5) & 0x3f);
+    tf.Second = (short)((timestamp & 0x1f) * 2 + increment / 100);
+    tf.Milliseconds = (short)((increment % 100) * 10);
+    tf.Weekday = 0;
+    if(!RtlTimeFieldsToTime(&tf,&local_time))
+        return 0;
+
+    if(utc_offset & EXFAT_UTC_OFFSET_VALID){
+        /* a signed 7-bit number of 15 minute intervals */
+        offset = utc_offset & 0x7f;
+        if(offset & 0x40) offset -= 0x80;
+        return local_time.QuadPart - (LONGLONG)offset * 15 * 60 * 10000000;
+    }
+
+    if(RtlLocalTimeToSystemTime(&local_time,&system_time) != STATUS_SUCCESS)
+        return 0;
+    return system_time.QuadPart;
+}
+
+/**
+ * @brief Adds a file to the file list.
+ * @param[in] path the path of the parent directory.
+ * @param[in] node the parent directory in the compact
+ * path storage; NULL if paths are not compact.
+ * @return Address of the inserted list entry,
+ * NULL indicates failure.
+ */
+static winx_file_info *add_file(wchar_t *path,winx_path_node *node,wchar_t *name,
+    EXFAT_FILE_ENTRY *fe,EXFAT_STREAM_ENTRY *se,exfat_scan_parameters *sp)
+{
+    winx_file_info *f;
+    int name_length, length;
+    ULONGLONG clusters;
+
+    /* insert new item to the file list */
+    f = (winx_file_info *)winx_list_insert_ex((list_entry **)(void *)sp->filelist,
+        NULL,sizeof(winx_file_info),sp->arena);
+    if(f == NULL){
+        mtrace();
+        goto fail;
+    }
+
+    name_length = (int)wcslen(name);
+    f->name = winx_tmalloc((name_length + 1) * sizeof(wchar_t));
+    if(f->name == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (name_length + 1) * sizeof(wchar_t));
+        goto fail_remove;
+    }
+    memcpy(f->name,name,(name_length + 1) * sizeof(wchar_t));
+    f->path = NULL;
+    f->parent = NULL;
+
+    /* refer to the parent directory in case of compact paths */
+    if(node){
+        ftw_set_compact_path(f,node);
+    } else {
+        /* only the root directory contains trailing backslash */
+        length = (int)wcslen(path);
+        f->path = winx_tmalloc((length + name_length + 2) * sizeof(wchar_t));
+        if(f->path == NULL){
+            etrace("cannot allocate %u bytes of memory",
+                (length + name_length + 2) * sizeof(wchar_t));
+            winx_free(f->name);
+            goto fail_remove;
+        }
+        memcpy(f->path,path,length * sizeof(wchar_t));
+        if(path[length - 1] != '\\') f->path[length++] = '\\';
+        memcpy(f->path + length,name,(name_length + 1) * sizeof(wchar_t));
+    }
+
+    /* save file attributes and access times */
+    f->flags = fe->FileAttributes & (FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | \
+        FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_ARCHIVE);
+    if(f->flags == 0) f->flags = FILE_ATTRIBUTE_NORMAL;
+    f->creation_time = get_file_time(fe->CreateTimestamp,
+        fe->Create10msIncrement,fe->CreateUtcOffset);
+    f->last_modification_time = get_file_time(fe->LastModifiedTimestamp,
+        fe->LastModified10msIncrement,fe->LastModifiedUtcOffset);
+    f->last_access_time = get_file_time(fe->LastAccessedTimestamp,
+        0,fe->LastAccessedUtcOffset);
+
+    /* reset user defined flags */
+    f->user_defined_flags = 0;
+    f->user_defined_data = NULL;
+
+    /* reset internal data fields */
+    memset(&f->internal,0,sizeof(winx_file_internal_info));
+
+    /* reset file disposition */
+    memset(&f->disp,0,sizeof(winx_file_disposition));
+
+    /* get file disposition if requested */
+    if((sp->flags & WINX_FTW_DUMP_FILES) && se->FirstCluster && se->DataLength && \
+      (se->GeneralSecondaryFlags & EXFAT_FLAG_ALLOCATION_POSSIBLE)){
+        clusters = (se->DataLength + sp->el.cluster_size - 1) / sp->el.cluster_size;
+        if(get_stream_map(se->FirstCluster,clusters,
+          se->GeneralSecondaryFlags & EXFAT_FLAG_NO_FAT_CHAIN,
+          &f->disp,sp->arena,sp) < 0){
+            etrace("%ws: broken cluster chain",winx_file_path(f));
+        }
+    }
+
+    return f;
+
+fail_remove:
+    winx_list_remove_ex((list_entry **)(void *)sp->filelist,
+        (list_entry *)f,sizeof(winx_file_info),sp->arena);
+fail:
+    sp->errors ++;
+    return NULL;
+}
+
+/**
+ * @brief Validates a set of directory entries
+ * describing a file and extracts its name.
+ * @param[in] e the primary entry of the set.
+ * @param[in] count number of entries available
+ * starting from the primary one.
+ * @param[out] name the buffer receiving the name,
+ * at least EXFAT_MAX_NAME_LENGTH + 1 characters long.
+ * @return Zero for success, -1 indicates
+ * an invalid set to be skipped.
+ */
+static int get_file_name(EXFAT_DIRECTORY_ENTRY *e,ULONG count,wchar_t *name)
+{
+    EXFAT_FILE_ENTRY *fe = (EXFAT_FILE_ENTRY *)e;
+    EXFAT_STREAM_ENTRY *se = (EXFAT_STREAM_ENTRY *)(e + 1);
+    EXFAT_FILE_NAME_ENTRY *ne;
+    ULONG i, j, n = 0;
+
+    if(fe->SecondaryCount < 2 || fe->SecondaryCount >= count)
+        return (-1);
+    if(se->EntryType != EXFAT_ENTRY_STREAM || se->NameLength == 0)
+        return (-1);
+    if((se->NameLength + EXFAT_NAME_CHARS_PER_ENTRY - 1) / \
+      EXFAT_NAME_CHARS_PER_ENTRY > (ULONG)fe->SecondaryCount - 1)
+        return (-1);
+    if(get_set_checksum((UCHAR *)e,fe->SecondaryCount + 1) != fe->SetChecksum)
+        return (-1);
+
+    for(i = 2; n < se->NameLength; i++){
+        ne = (EXFAT_FILE_NAME_ENTRY *)(e + i);
+        if(ne->EntryType != EXFAT_ENTRY_FILE_NAME)
+            return (-1);
+        for(j = 0; j < EXFAT_NAME_CHARS_PER_ENTRY && n < se->NameLength; j++)
+            name[n++] = (wchar_t)ne->FileName[j];
+    }
+    name[n] = 0;
+    return 0;
+}
+
+/*
+**************************************************
+*                 Tree traversal
+**************************************************
+*/
+
+/**
+ * @brief Checks whether a directory is scanned
+ * already and marks it as scanned otherwise.
+ * @details Protects the traversal from cycles
+ * caused by cross-linked directories.
+ */
+static int is_directory_visited(ULONG cluster,exfat_scan_parameters *sp)
+{
+    ULONG i;
+
+    if(sp->visited == NULL)
+        return 0;
+
+    i = cluster - EXFAT_FIRST_CLUSTER;
+    if(sp->visited[i >> 3] & (1 << (i & 7)))
+        return 1;
+    sp->visited[i >> 3] |= (UCHAR)(1 << (i & 7));
+    return 0;
+}
+
+/**
+ * @brief Scans a directory and adds information
+ * about files found to the file list.
+ * @param[in] se the stream entry of the directory;
+ * NULL for the root directory.
+ * @param[in] path the path of the directory.
+ * @param[in] node the directory in the compact
+ * path storage; NULL if paths are not compact.
+ * @param[in] depth the nesting level of the directory.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ * @note The callbacks get called in the same order
+ * as the generic file tree walk does.
+ */
+static int scan_directory(EXFAT_STREAM_ENTRY *se,wchar_t *path,
+    winx_path_node *node,int depth,exfat_scan_parameters *sp)
+{
+    EXFAT_DIRECTORY_ENTRY *e;
+    EXFAT_STREAM_ENTRY stream;
+    wchar_t name[EXFAT_MAX_NAME_LENGTH + 1];
+    winx_file_info *f;
+    winx_path_node *child;
+    char *buffer, *entries;
+    ULONG cluster, size, count, i;
+    int skip_children, result = 0;
+
+    cluster = se ? se->FirstCluster : sp->el.root_cluster;
+    if(depth > EXFAT_MAX_DEPTH){
+        etrace("directory at cluster %u is nested too deep",cluster);
+        return 0;
+    }
+    if(!is_valid_cluster(cluster,sp)){
+        etrace("invalid directory cluster: %u",cluster);
+        return 0;
+    }
+    if(is_directory_visited(cluster,sp)){
+        etrace("cross-linked directory detected at cluster %u",cluster);
+        return 0;
+    }
+
+    if(se){
+        if(se->DataLength == 0) return 0;
+        entries = read_stream(cluster,se->DataLength,
+            se->GeneralSecondaryFlags & EXFAT_FLAG_NO_FAT_CHAIN,
+            EXFAT_MAX_DIRECTORY_SIZE,&buffer,&size,sp);
+    } else {
+        /* the root directory has no stream entry, follow its chain */
+        entries = read_stream(cluster,0,0,EXFAT_MAX_DIRECTORY_SIZE,&buffer,&size,sp);
+        if(entries) load_allocation_bitmap(entries,size,sp);
+    }
+    if(entries == NULL)
+        return 0; /* the directory is unreadable, skip it */
+
+    count = size / sizeof(EXFAT_DIRECTORY_ENTRY);
+    for(i = 0; i < count; i++){
+        if(ftw_exfat_check_for_termination(sp)){
+            result = -2;
+            break;
+        }
+
+        e = (EXFAT_DIRECTORY_ENTRY *)entries + i;
+        if(e->EntryType == EXFAT_ENTRY_END_OF_DIRECTORY)
+            break;
+
+        /* skip free entries, volume labels, etc. */
+        if(e->EntryType != EXFAT_ENTRY_FILE)
+            continue;
+
+        if(get_file_name(e,count - i,name) < 0){
+            etrace("invalid directory entry set at cluster %u, entry %u",cluster,i);
+            continue;
+        }
+
+        /* keep a copy of the stream entry, the buffer gets released before return */
+        memcpy(&stream,e + 1,sizeof(EXFAT_STREAM_ENTRY));
+        f = add_file(path,node,name,(EXFAT_FILE_ENTRY *)e,&stream,sp);
+        i += ((EXFAT_FILE_ENTRY *)e)->SecondaryCount;
+        if(f == NULL){
+            result = -1;
+            break;
+        }
+
+        /* check for termination */
+        if(ftw_exfat_check_for_termination(sp)){
+            itrace("terminated by user");
+            result = -2;
+            break;
+        }
+
+        /* call the callback routines */
+        if(sp->pcb != NULL)
+            sp->pcb(f,sp->user_defined_data);
+
+        skip_children = 0;
+        if(sp->fcb != NULL)
+            skip_children = sp->fcb(f,sp->user_defined_data);
+
+        /* scan subdirectories */
+        if(is_directory(f) && !skip_children){
+            child = node ? ftw_add_path_node(node,f->name) : NULL;
+            result = scan_directory(&stream,node ? NULL : f->path,
+                child,depth + 1,sp);
+            if(result < 0) break;
+        }
+    }
+
+    winx_free(buffer);
+    return result;
+}
+
+/**
+ * @internal
+ * @brief Adds all files of an exFAT volume
+ * to the list of files, reading the FAT,
+ * the allocation bitmap and the directories
+ * straight from the disk.
+ * @details The root directory itself must be
+ * in the list already. Maps of the files get
+ * built from their cluster chains or directly
+ * from their directory entries for contiguous
+ * files, thus the scan costs a single large read
+ * of the FAT and the bitmap and a single read
+ * per block of each directory.
+ * @param[in] v information about the volume.
+ * @param[in] rootpath the path of the root directory.
+ * @param[in] top the root directory in the compact
+ * path storage; NULL if paths are not compact.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller,
+ * -3 indicates that the volume cannot be scanned
+ * directly; no files get added to the list then.
+ */
+int exfat_scan_disk(winx_volume_information *v,wchar_t *rootpath,
+    winx_path_node *top,int flags,ftw_filter_callback fcb,
+    ftw_progress_callback pcb,ftw_terminator t,void *user_defined_data,
+    winx_file_info **filelist,winx_arena *arena)
+{
+    wchar_t path[] = L"\\??\\A:";
+    exfat_scan_parameters sp;
+    ULONGLONG time;
+    int result;
+
+    time = winx_xtime();
+
+    memset(&sp,0,sizeof(exfat_scan_parameters));
+    sp.flags = flags;
+    sp.fcb = fcb;
+    sp.pcb = pcb;
+    sp.t = t;
+    sp.user_defined_data = user_defined_data;
+    sp.filelist = filelist;
+    sp.arena = arena;
+
+    /* open the volume for read access */
+    path[4] = winx_toupper(v->volume_letter);
+    sp.f_volume = winx_fopen(path,"r");
+    if(sp.f_volume == NULL)
+        return (-3);
+
+    if(get_exfat_layout(v,&sp) < 0 || load_fat(&sp) < 0){
+        if(ftw_exfat_check_for_termination(&sp)){
+            winx_fclose(sp.f_volume);
+            return (-2);
+        }
+        itrace("the volume cannot be scanned directly");
+        winx_fclose(sp.f_volume);
+        return (-3);
+    }
+
+    sp.visited = winx_tmalloc(sp.el.clusters / 8 + 1);
+    if(sp.visited == NULL){
+        etrace("cannot allocate %u bytes of memory",sp.el.clusters / 8 + 1);
+    } else {
+        memset(sp.visited,0,sp.el.clusters / 8 + 1);
+    }
+    itrace("FAT loaded in %I64u ms",winx_xtime() - time);
+
+    result = scan_directory(NULL,rootpath,top,0,&sp);
+
+    winx_free(sp.visited);
+    winx_free(sp.bitmap_buffer);
+    winx_free(sp.fat_buffer);
+    winx_fclose(sp.f_volume);
+
+    itrace("exFAT scan completed in %I64u ms",winx_xtime() - time);
+
+    if(result == 0 && !(sp.flags & WINX_FTW_ALLOW_PARTIAL_SCAN) && sp.errors)
+        return (-1);
+    return result;
+}
+
+/** @} */
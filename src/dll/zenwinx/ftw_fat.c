@@ -0,0 +1,949 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2016 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file ftw_fat.c
+ * @brief Fast file tree walk for FAT.
+ * @details The FAT gets loaded into memory
+ * entirely, so maps of files are built from
+ * their cluster chains without a single
+ * request to the file system driver.
+ * Directories get read cluster by cluster
+ * straight from the volume as well.
+ * @addtogroup File
+ * @{
+ */
+
+#include "ntndk.h"
+#include "zenwinx.h"
+#include "fat.h"
+
+/*
+* Size of the portions of the FAT
+* to be read directly from the disk.
+*/
+#define FAT_CHUNK_SIZE (4 * 1024 * 1024)
+
+/*
+* Larger FATs are never loaded into memory,
+* the generic file tree walk is used instead.
+*/
+#define FAT_MAX_SIZE (256 * 1024 * 1024)
+
+/*
+* Maximum depth of the directory tree;
+* deeper directories are skipped.
+*/
+#define FAT_MAX_DEPTH 256
+
+/* long names cannot contain more characters */
+#define FAT_MAX_LFN_ENTRIES 20
+
+/* an internal value indicating the end of a cluster chain */
+#define FAT_END_OF_CHAIN 0xffffffff
+
+enum {
+    FAT_TYPE_12,
+    FAT_TYPE_16,
+    FAT_TYPE_32
+};
+
+/* internal structures */
+typedef struct _fat_layout {
+    int type;                       /* one of the FAT_TYPE_xxx constants */
+    ULONG sector_size;              /* sector size, in bytes */
+    ULONG sectors_per_cluster;      /* number of sectors per cluster */
+    ULONG cluster_size;             /* cluster size, in bytes */
+    ULONG clusters;                 /* number of data clusters */
+    ULONGLONG fat_sector;           /* the first sector of the active FAT */
+    ULONG fat_size;                 /* number of bytes of the FAT to be loaded */
+    ULONGLONG root_sector;          /* the first sector of the root directory, FAT12/16 only */
+    ULONG root_size;                /* size of the root directory, in bytes, FAT12/16 only */
+    ULONG root_cluster;             /* the first cluster of the root directory, FAT32 only */
+    ULONGLONG first_data_sector;    /* the sector of the first data cluster */
+} fat_layout;
+
+typedef struct _fat_scan_parameters {
+    fat_layout fl;              /* the layout of the volume */
+    WINX_FILE *f_volume;        /* volume handle */
+    int flags;                  /* combination of WINX_FTW_xxx flags */
+    ftw_filter_callback fcb;    /**/
+    ftw_progress_callback pcb;  /**/
+    ftw_terminator t;           /* termination callback */
+    void *user_defined_data;    /* pointer to data to be passed to all callbacks */
+    char *fat_buffer;           /* the buffer allocated for the FAT */
+    unsigned char *fat;         /* the active FAT, aligned on the sector boundary */
+    unsigned char *visited;     /* bitmap of directories already scanned; may be NULL */
+    unsigned long errors;       /* number of critical errors preventing gathering of complete information */
+    winx_file_info **filelist;  /* list of files */
+    winx_arena *arena;          /* arena the list is allocated from; NULL for the global heap */
+} fat_scan_parameters;
+
+/* a long name being collected from directory entries */
+typedef struct _fat_long_name {
+    wchar_t name[FAT_MAX_LFN_ENTRIES * FAT_LFN_CHARS_PER_ENTRY + 1];
+    int next;                   /* ordinal of the entry expected next; zero if there is no valid long name */
+    UCHAR checksum;             /* checksum of the short name the long name belongs to */
+} fat_long_name;
+
+winx_path_node *ftw_add_path_node(winx_path_node *parent,wchar_t *name);
+void ftw_set_compact_path(winx_file_info *f,winx_path_node *parent);
+
+/*
+**************************************************
+*                Common routines
+**************************************************
+*/
+
+static int ftw_fat_check_for_termination(fat_scan_parameters *sp)
+{
+    if(!(sp->flags & WINX_FTW_ALLOW_PARTIAL_SCAN) && sp->errors)
+        return 1;
+
+    if(sp->t == NULL)
+        return 0;
+
+    return sp->t(sp->user_defined_data);
+}
+
+/**
+ * @note
+ * - lsn, buffer, length must be valid before this call.
+ * - length must be an integral of the sector size.
+ */
+static NTSTATUS read_sectors(ULONGLONG lsn,PVOID buffer,ULONG length,fat_scan_parameters *sp)
+{
+    IO_STATUS_BLOCK iosb;
+    LARGE_INTEGER offset;
+    NTSTATUS status;
+
+    offset.QuadPart = lsn * sp->fl.sector_size;
+    status = NtReadFile(winx_fileno(sp->f_volume),NULL,NULL,NULL,&iosb,buffer,length,&offset,NULL);
+    if(NT_SUCCESS(status)){
+        status = NtWaitForSingleObject(winx_fileno(sp->f_volume),FALSE,NULL);
+        if(NT_SUCCESS(status)) status = iosb.Status;
+    }
+    if(status == STATUS_SUCCESS && iosb.Information < length){
+        etrace("less bytes read than needed?");
+        status = STATUS_UNSUCCESSFUL;
+    }
+    return status;
+}
+
+/**
+ * @brief Allocates a buffer aligned on the sector boundary.
+ * @param[out] buffer the allocated buffer to be released
+ * by winx_free.
+ * @return The aligned address, NULL indicates failure.
+ */
+static char *alloc_aligned_buffer(ULONG size,ULONG sector_size,char **buffer)
+{
+    *buffer = winx_tmalloc(size + sector_size);
+    if(*buffer == NULL){
+        etrace("cannot allocate %u bytes of memory",size + sector_size);
+        return NULL;
+    }
+    return (char *)(((ULONG_PTR)*buffer + sector_size - 1) & ~((ULONG_PTR)sector_size - 1));
+}
+
+/*
+**************************************************
+*                  FAT routines
+**************************************************
+*/
+
+/**
+ * @brief Reads the boot sector and
+ * determines the layout of the volume.
+ * @details Cross-checks the layout against
+ * the information reported by the system,
+ * so LCNs we calculate will be the same
+ * as reported by the file system driver.
+ * @return Zero for success, negative
+ * value otherwise.
+ */
+static int get_fat_layout(winx_volume_information *v,fat_scan_parameters *sp)
+{
+    FAT_BOOT_SECTOR *bs;
+    fat_layout *fl = &sp->fl;
+    char *buffer, *sector;
+    ULONG sectors_per_fat, total_sectors, root_sectors;
+    ULONG active_fat, fat_entries_size;
+    NTSTATUS status;
+
+    fl->sector_size = v->bytes_per_sector;
+    if(fl->sector_size < 512 || fl->sector_size > 4096 || \
+      (fl->sector_size & (fl->sector_size - 1))){
+        etrace("unexpected sector size: %u",fl->sector_size);
+        return (-1);
+    }
+
+    sector = alloc_aligned_buffer(fl->sector_size,fl->sector_size,&buffer);
+    if(sector == NULL) return (-1);
+
+    status = read_sectors(0,sector,fl->sector_size,sp);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot read the boot sector");
+        winx_free(buffer);
+        return (-1);
+    }
+
+    bs = (FAT_BOOT_SECTOR *)sector;
+    if((UCHAR)sector[510] != 0x55 || (UCHAR)sector[511] != 0xaa){
+        etrace("boot sector signature is missing");
+        goto fail;
+    }
+    if(bs->BytesPerSector != fl->sector_size || bs->SectorsPerCluster == 0 || \
+      (bs->SectorsPerCluster & (bs->SectorsPerCluster - 1)) || \
+      bs->ReservedSectors == 0 || bs->NumberOfFats == 0){
+        etrace("invalid BIOS parameter block");
+        goto fail;
+    }
+
+    sectors_per_fat = bs->SectorsPerFat16 ? bs->SectorsPerFat16 : bs->SectorsPerFat32;
+    total_sectors = bs->TotalSectors16 ? bs->TotalSectors16 : bs->TotalSectors32;
+    root_sectors = ((ULONG)bs->RootEntries * sizeof(FAT_DIRECTORY_ENTRY) \
+        + fl->sector_size - 1) / fl->sector_size;
+    fl->sectors_per_cluster = bs->SectorsPerCluster;
+    fl->cluster_size = fl->sector_size * fl->sectors_per_cluster;
+    fl->root_sector = bs->ReservedSectors + (ULONGLONG)bs->NumberOfFats * sectors_per_fat;
+    fl->root_size = root_sectors * fl->sector_size;
+    fl->first_data_sector = fl->root_sector + root_sectors;
+    if(sectors_per_fat == 0 || total_sectors <= fl->first_data_sector){
+        etrace("invalid BIOS parameter block");
+        goto fail;
+    }
+    fl->clusters = (ULONG)((total_sectors - fl->first_data_sector) / fl->sectors_per_cluster);
+
+    /* the type of FAT depends on the number of clusters only */
+    if(fl->clusters < FAT12_MAX_CLUSTERS){
+        fl->type = FAT_TYPE_12;
+        fat_entries_size = (fl->clusters + FAT_FIRST_CLUSTER) * 3 / 2 + 1;
+    } else if(fl->clusters < FAT16_MAX_CLUSTERS){
+        fl->type = FAT_TYPE_16;
+        fat_entries_size = (fl->clusters + FAT_FIRST_CLUSTER) * 2;
+    } else {
+        fl->type = FAT_TYPE_32;
+        fat_entries_size = (fl->clusters + FAT_FIRST_CLUSTER) * 4;
+    }
+    if((fl->type == FAT_TYPE_32) != (bs->RootEntries == 0)){
+        etrace("FAT type mismatch");
+        goto fail;
+    }
+
+    /* ensure that we use the same cluster numbering as the system */
+    if(fl->clusters != v->total_clusters || fl->cluster_size != v->bytes_per_cluster){
+        etrace("layout mismatch: %u clusters of %u bytes on disk, " \
+            "%I64u clusters of %I64u bytes reported by the system",
+            fl->clusters,fl->cluster_size,v->total_clusters,v->bytes_per_cluster);
+        goto fail;
+    }
+
+    active_fat = 0;
+    if(fl->type == FAT_TYPE_32){
+        fl->root_cluster = bs->RootCluster & FAT32_CLUSTER_MASK;
+        if(fl->root_cluster < FAT_FIRST_CLUSTER || \
+          fl->root_cluster - FAT_FIRST_CLUSTER >= fl->clusters){
+            etrace("invalid root directory cluster: %u",fl->root_cluster);
+            goto fail;
+        }
+        if(bs->ExtFlags & 0x80){
+            /* mirroring is disabled, only a single FAT is in use */
+            active_fat = bs->ExtFlags & 0xf;
+            if(active_fat >= bs->NumberOfFats){
+                etrace("invalid active FAT number: %u",active_fat);
+                goto fail;
+            }
+        }
+    } else {
+        fl->root_cluster = 0;
+    }
+    fl->fat_sector = bs->ReservedSectors + (ULONGLONG)active_fat * sectors_per_fat;
+
+    /* load only the part of the FAT describing existing clusters */
+    fl->fat_size = (fat_entries_size + fl->sector_size - 1) / fl->sector_size * fl->sector_size;
+    if(fl->fat_size > sectors_per_fat * fl->sector_size){
+        etrace("the FAT is too small to describe %u clusters",fl->clusters);
+        goto fail;
+    }
+    if(fl->fat_size > FAT_MAX_SIZE){
+        etrace("the FAT is too large to be loaded: %u bytes",fl->fat_size);
+        goto fail;
+    }
+
+    itrace("FAT%u volume of %u clusters of %u bytes",
+        (fl->type == FAT_TYPE_12) ? 12 : ((fl->type == FAT_TYPE_16) ? 16 : 32),
+        fl->clusters,fl->cluster_size);
+    winx_free(buffer);
+    return 0;
+
+fail:
+    winx_free(buffer);
+    return (-1);
+}
+
+/**
+ * @brief Loads the active FAT into memory.
+ * @return Zero for success, negative
+ * value otherwise.
+ */
+static int load_fat(fat_scan_parameters *sp)
+{
+    char *buffer, *fat;
+    ULONG offset, length;
+    NTSTATUS status;
+
+    fat = alloc_aligned_buffer(sp->fl.fat_size,sp->fl.sector_size,&buffer);
+    if(fat == NULL) return (-1);
+
+    for(offset = 0; offset < sp->fl.fat_size; offset += length){
+        if(ftw_fat_check_for_termination(sp)){
+            winx_free(buffer);
+            return (-1);
+        }
+        length = min(sp->fl.fat_size - offset,FAT_CHUNK_SIZE);
+        status = read_sectors(sp->fl.fat_sector + offset / sp->fl.sector_size,
+            fat + offset,length,sp);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot read the FAT");
+            winx_free(buffer);
+            return (-1);
+        }
+    }
+
+    sp->fat_buffer = buffer;
+    sp->fat = (unsigned char *)fat;
+    return 0;
+}
+
+/**
+ * @brief Retrieves the cluster following
+ * the specified one in a cluster chain.
+ * @return The next cluster, FAT_END_OF_CHAIN
+ * if the chain ends there, or any other value
+ * which is not a valid cluster number (0 for
+ * free clusters, for instance) in case of
+ * a broken chain.
+ */
+static ULONG get_next_cluster(ULONG cluster,fat_scan_parameters *sp)
+{
+    unsigned char *p;
+    ULONG next;
+
+    switch(sp->fl.type){
+    case FAT_TYPE_12:
+        p = sp->fat + cluster + cluster / 2;
+        next = (ULONG)p[0] | ((ULONG)p[1] << 8);
+        next = (cluster & 1) ? (next >> 4) : (next & 0xfff);
+        return (next >= 0xff8) ? FAT_END_OF_CHAIN : next;
+    case FAT_TYPE_16:
+        next = ((USHORT *)sp->fat)[cluster];
+        return (next >= 0xfff8) ? FAT_END_OF_CHAIN : next;
+    default:
+        next = ((ULONG *)sp->fat)[cluster] & FAT32_CLUSTER_MASK;
+        return (next >= 0x0ffffff8) ? FAT_END_OF_CHAIN : next;
+    }
+}
+
+static int is_valid_cluster(ULONG cluster,fat_scan_parameters *sp)
+{
+    return (cluster >= FAT_FIRST_CLUSTER && \
+        cluster - FAT_FIRST_CLUSTER < sp->fl.clusters) ? 1 : 0;
+}
+
+/**
+ * @brief Builds a map of blocks of a cluster chain.
+ * @param[in] cluster the first cluster of the chain.
+ * @param[out] disp the structure receiving the map;
+ * it must be empty before this call.
+ * @param[in] arena the arena the map gets allocated
+ * from; NULL forces to use the global heap.
+ * @return Zero for success, -1 indicates a broken
+ * chain or lack of memory; the map remains empty then.
+ * @note LCNs reported by the system for FAT volumes
+ * start from the first data cluster, which is cluster 2.
+ */
+static int get_cluster_chain(ULONG cluster,winx_file_disposition *disp,
+    winx_arena *arena,fat_scan_parameters *sp)
+{
+    winx_blockmap *block = NULL;
+    ULONG count = 0;
+    ULONGLONG vcn = 0;
+
+    while(cluster != FAT_END_OF_CHAIN){
+        /* a chain cannot be longer than the volume */
+        if(!is_valid_cluster(cluster,sp) || count == sp->fl.clusters){
+            goto fail;
+        }
+        if(block && block->lcn + block->length == cluster - FAT_FIRST_CLUSTER){
+            block->length ++;
+        } else {
+            block = (winx_blockmap *)winx_list_insert_ex((list_entry **)(void *)&disp->blockmap,
+                (list_entry *)block,sizeof(winx_blockmap),arena);
+            if(block == NULL){
+                mtrace();
+                sp->errors ++;
+                goto fail;
+            }
+            block->vcn = vcn;
+            block->lcn = cluster - FAT_FIRST_CLUSTER;
+            block->length = 1;
+            disp->fragments ++;
+        }
+        vcn ++; count ++;
+        cluster = get_next_cluster(cluster,sp);
+    }
+
+    disp->clusters = vcn;
+    return 0;
+
+fail:
+    winx_list_destroy_ex((list_entry **)(void *)&disp->blockmap,
+        sizeof(winx_blockmap),arena);
+    disp->clusters = 0;
+    disp->fragments = 0;
+    return (-1);
+}
+
+/**
+ * @brief Reads all entries of a directory.
+ * @param[in] cluster the first cluster of the
+ * directory; zero for the root directory of
+ * FAT12/16 volumes.
+ * @param[out] buffer the buffer to be released
+ * by winx_free.
+ * @param[out] size size of the directory, in bytes.
+ * @return The directory entries, NULL indicates failure.
+ */
+static char *read_directory(ULONG cluster,char **buffer,ULONG *size,fat_scan_parameters *sp)
+{
+    winx_file_disposition disp;
+    winx_blockmap *block;
+    char *entries;
+    ULONG max_size, length, offset = 0;
+    NTSTATUS status;
+
+    if(cluster == 0){
+        /* the root directory of FAT12/16 has a fixed location */
+        entries = alloc_aligned_buffer(sp->fl.root_size,sp->fl.sector_size,buffer);
+        if(entries == NULL) return NULL;
+        status = read_sectors(sp->fl.root_sector,entries,sp->fl.root_size,sp);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot read the root directory");
+            winx_free(*buffer);
+            return NULL;
+        }
+        *size = sp->fl.root_size;
+        return entries;
+    }
+
+    memset(&disp,0,sizeof(winx_file_disposition));
+    if(get_cluster_chain(cluster,&disp,NULL,sp) < 0){
+        etrace("broken cluster chain of directory at cluster %u",cluster);
+        return NULL;
+    }
+
+    /* directories cannot be larger, ignore extra clusters */
+    max_size = FAT_MAX_DIRECTORY_ENTRIES * sizeof(FAT_DIRECTORY_ENTRY);
+    if(max_size < sp->fl.cluster_size) max_size = sp->fl.cluster_size;
+    if(disp.clusters * sp->fl.cluster_size < max_size)
+        max_size = (ULONG)disp.clusters * sp->fl.cluster_size;
+
+    entries = alloc_aligned_buffer(max_size,sp->fl.sector_size,buffer);
+    if(entries == NULL) goto fail;
+
+    /* read each block at once */
+    for(block = disp.blockmap; block && offset < max_size; block = block->next){
+        length = (ULONG)min(block->length * sp->fl.cluster_size,(ULONGLONG)(max_size - offset));
+        status = read_sectors(sp->fl.first_data_sector + block->lcn * sp->fl.sectors_per_cluster,
+            entries + offset,length,sp);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot read directory at cluster %u",cluster);
+            winx_free(*buffer);
+            entries = NULL;
+            goto fail;
+        }
+        offset += length;
+        if(block->next == disp.blockmap) break;
+    }
+    *size = offset;
+
+fail:
+    winx_list_destroy_ex((list_entry **)(void *)&disp.blockmap,
+        sizeof(winx_blockmap),NULL);
+    return entries;
+}
+
+/*
+**************************************************
+*               Directory entries
+**************************************************
+*/
+
+static UCHAR get_short_name_checksum(UCHAR *name)
+{
+    UCHAR sum = 0;
+    int i;
+
+    for(i = 0; i < 11; i++)
+        sum = (UCHAR)(((sum & 1) << 7) + (sum >> 1) + name[i]);
+    return sum;
+}
+
+/**
+ * @brief Collects a portion of a long name.
+ * @details Portions are stored in reverse order;
+ * any inconsistency invalidates the long name.
+ */
+static void collect_long_name(FAT_LFN_ENTRY *e,fat_long_name *ln)
+{
+    int ordinal = e->Ordinal & FAT_LFN_ORDINAL_MASK;
+    wchar_t *p;
+    int i;
+
+    if(e->Ordinal & FAT_LFN_LAST_ENTRY){
+        if(ordinal == 0 || ordinal > FAT_MAX_LFN_ENTRIES){
+            ln->next = 0;
+            return;
+        }
+        ln->checksum = e->Checksum;
+        ln->name[ordinal * FAT_LFN_CHARS_PER_ENTRY] = 0;
+    } else if(ln->next == 0 || ordinal != ln->next || e->Checksum != ln->checksum){
+        ln->next = 0;
+        return;
+    }
+
+    p = ln->name + (ordinal - 1) * FAT_LFN_CHARS_PER_ENTRY;
+    for(i = 0; i < 5; i++) *p++ = (wchar_t)e->Name1[i];
+    for(i = 0; i < 6; i++) *p++ = (wchar_t)e->Name2[i];
+    for(i = 0; i < 2; i++) *p++ = (wchar_t)e->Name3[i];
+    ln->next = ordinal - 1;
+}
+
+/**
+ * @brief Completes a long name collected
+ * for the specified short entry.
+ * @return The long name, NULL if
+ * there is no valid long name.
+ */
+static wchar_t *get_long_name(FAT_DIRECTORY_ENTRY *e,fat_long_name *ln)
+{
+    wchar_t *p;
+
+    /* the first portion must be collected already */
+    if(ln->next != 0 || ln->name[0] == 0)
+        return NULL;
+    if(get_short_name_checksum(e->Name) != ln->checksum)
+        return NULL;
+
+    /* the name is terminated by zero and padded by 0xFFFF characters */
+    for(p = ln->name; *p && *p != 0xffff; p++){}
+    *p = 0;
+    return ln->name;
+}
+
+/**
+ * @brief Converts a short name to Unicode.
+ * @param[out] name the buffer receiving
+ * the name, at least 13 characters long.
+ */
+static void get_short_name(FAT_DIRECTORY_ENTRY *e,wchar_t *name)
+{
+    char oem_name[13];
+    ANSI_STRING as;
+    UNICODE_STRING us;
+    int i, n, length = 0;
+    char c;
+
+    /* the base name */
+    for(n = 8; n > 0 && e->Name[n - 1] == ' '; n--){}
+    for(i = 0; i < n; i++){
+        c = (char)e->Name[i];
+        if(i == 0 && (UCHAR)c == FAT_DIRENT_E5) c = (char)FAT_DIRENT_DELETED;
+        if((e->NtFlags & FAT_NT_LOWERCASE_BASE) && c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        oem_name[length++] = c;
+    }
+
+    /* the extension */
+    for(n = 3; n > 0 && e->Name[8 + n - 1] == ' '; n--){}
+    if(n) oem_name[length++] = '.';
+    for(i = 0; i < n; i++){
+        c = (char)e->Name[8 + i];
+        if((e->NtFlags & FAT_NT_LOWERCASE_EXTENSION) && c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        oem_name[length++] = c;
+    }
+    oem_name[length] = 0;
+
+    as.Buffer = oem_name;
+    as.Length = (USHORT)length;
+    as.MaximumLength = (USHORT)(length + 1);
+    us.Buffer = name;
+    us.Length = 0;
+    us.MaximumLength = 13 * sizeof(wchar_t);
+    if(RtlOemStringToUnicodeString(&us,&as,FALSE) == STATUS_SUCCESS){
+        name[us.Length / sizeof(wchar_t)] = 0;
+    } else {
+        for(i = 0; i <= length; i++)
+            name[i] = (wchar_t)(UCHAR)oem_name[i];
+    }
+}
+
+/**
+ * @brief Converts local time stored
+ * in DOS format to the standard time format.
+ * @return The time, zero if it isn't defined.
+ */
+static ULONGLONG get_file_time(USHORT date,USHORT time,UCHAR tenths)
+{
+    TIME_FIELDS tf;
+    LARGE_INTEGER local_time, system_time;
+
+    if(date == 0) return 0;
+
+    tf.Year = (short)(1980 + (date >> 9));
+    tf.Month = (short)((date >> 5) & 0xf);
+    tf.Day = (short)(date & 0x1f);
+    tf.Hour = (short)(time >> 11);
+    tf.Minute = (short)((time >> 5) & 0x3f);
+    tf.Second = (short)((time & 0x1f) * 2 + tenths / 100);
+    tf.Milliseconds = (short)((tenths % 100) * 10);
+    tf.Weekday = 0;
+    if(!RtlTimeFieldsToTime(&tf,&local_time))
+        return 0;
+
+    if(RtlLocalTimeToSystemTime(&local_time,&system_time) != STATUS_SUCCESS)
+        return 0;
+    return system_time.QuadPart;
+}
+
+static ULONG get_first_cluster(FAT_DIRECTORY_ENTRY *e,fat_scan_parameters *sp)
+{
+    ULONG cluster = e->FirstClusterLow;
+
+    if(sp->fl.type == FAT_TYPE_32)
+        cluster |= (ULONG)e->FirstClusterHigh << 16;
+    return cluster;
+}
+
+/**
+ * @brief Adds a file to the file list.
+ * @param[in] path the path of the parent directory.
+ * @param[in] node the parent directory in the compact
+ * path storage; NULL if paths are not compact.
+ * @return Address of the inserted list entry,
+ * NULL indicates failure.
+ */
+static winx_file_info *add_file(wchar_t *path,winx_path_node *node,
+    wchar_t *name,FAT_DIRECTORY_ENTRY *e,fat_scan_parameters *sp)
+{
+    winx_file_info *f;
+    int name_length, length;
+
+    /* insert new item to the file list */
+    f = (winx_file_info *)winx_list_insert_ex((list_entry **)(void *)sp->filelist,
+        NULL,sizeof(winx_file_info),sp->arena);
+    if(f == NULL){
+        mtrace();
+        goto fail;
+    }
+
+    name_length = (int)wcslen(name);
+    f->name = winx_tmalloc((name_length + 1) * sizeof(wchar_t));
+    if(f->name == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (name_length + 1) * sizeof(wchar_t));
+        goto fail_remove;
+    }
+    memcpy(f->name,name,(name_length + 1) * sizeof(wchar_t));
+    f->path = NULL;
+    f->parent = NULL;
+
+    /* refer to the parent directory in case of compact paths */
+    if(node){
+        ftw_set_compact_path(f,node);
+    } else {
+        /* only the root directory contains trailing backslash */
+        length = (int)wcslen(path);
+        f->path = winx_tmalloc((length + name_length + 2) * sizeof(wchar_t));
+        if(f->path == NULL){
+            etrace("cannot allocate %u bytes of memory",
+                (length + name_length + 2) * sizeof(wchar_t));
+            winx_free(f->name);
+            goto fail_remove;
+        }
+        memcpy(f->path,path,length * sizeof(wchar_t));
+        if(path[length - 1] != '\\') f->path[length++] = '\\';
+        memcpy(f->path + length,name,(name_length + 1) * sizeof(wchar_t));
+    }
+
+    /* save file attributes and access times */
+    f->flags = e->Attributes & (FAT_ATTR_READ_ONLY | FAT_ATTR_HIDDEN | \
+        FAT_ATTR_SYSTEM | FAT_ATTR_DIRECTORY | FAT_ATTR_ARCHIVE);
+    if(f->flags == 0) f->flags = FILE_ATTRIBUTE_NORMAL;
+    f->creation_time = get_file_time(e->CreationDate,e->CreationTime,e->CreationTimeTenths);
+    f->last_modification_time = get_file_time(e->LastWriteDate,e->LastWriteTime,0);
+    f->last_access_time = get_file_time(e->LastAccessDate,0,0);
+
+    /* reset user defined flags */
+    f->user_defined_flags = 0;
+    f->user_defined_data = NULL;
+
+    /* reset internal data fields */
+    memset(&f->internal,0,sizeof(winx_file_internal_info));
+
+    /* reset file disposition */
+    memset(&f->disp,0,sizeof(winx_file_disposition));
+
+    /* get file disposition if requested */
+    if(sp->flags & WINX_FTW_DUMP_FILES){
+        if(get_first_cluster(e,sp)){
+            if(get_cluster_chain(get_first_cluster(e,sp),&f->disp,sp->arena,sp) < 0)
+                etrace("%ws: broken cluster chain",winx_file_path(f));
+        }
+    }
+
+    return f;
+
+fail_remove:
+    winx_list_remove_ex((list_entry **)(void *)sp->filelist,
+        (list_entry *)f,sizeof(winx_file_info),sp->arena);
+fail:
+    sp->errors ++;
+    return NULL;
+}
+
+/*
+**************************************************
+*                 Tree traversal
+**************************************************
+*/
+
+/**
+ * @brief Checks whether a directory is scanned
+ * already and marks it as scanned otherwise.
+ * @details Protects the traversal from cycles
+ * caused by cross-linked directories.
+ */
+static int is_directory_visited(ULONG cluster,fat_scan_parameters *sp)
+{
+    ULONG i;
+
+    if(sp->visited == NULL || cluster == 0)
+        return 0;
+
+    i = cluster - FAT_FIRST_CLUSTER;
+    if(sp->visited[i >> 3] & (1 << (i & 7)))
+        return 1;
+    sp->visited[i >> 3] |= (UCHAR)(1 << (i & 7));
+    return 0;
+}
+
+/**
+ * @brief Scans a directory and adds information
+ * about files found to the file list.
+ * @param[in] cluster the first cluster of the
+ * directory; zero for the root directory of
+ * FAT12/16 volumes.
+ * @param[in] path the path of the directory.
+ * @param[in] node the directory in the compact
+ * path storage; NULL if paths are not compact.
+ * @param[in] depth the nesting level of the directory.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ * @note The callbacks get called in the same order
+ * as the generic file tree walk does.
+ */
+static int scan_directory(ULONG cluster,wchar_t *path,winx_path_node *node,
+    int depth,fat_scan_parameters *sp)
+{
+    FAT_DIRECTORY_ENTRY *e;
+    fat_long_name ln;
+    wchar_t short_name[13];
+    wchar_t *name;
+    winx_file_info *f;
+    winx_path_node *child;
+    char *buffer, *entries;
+    ULONG size, i, first_cluster;
+    int skip_children, result = 0;
+
+    if(depth > FAT_MAX_DEPTH){
+        etrace("directory at cluster %u is nested too deep",cluster);
+        return 0;
+    }
+    if(cluster && !is_valid_cluster(cluster,sp)){
+        etrace("invalid directory cluster: %u",cluster);
+        return 0;
+    }
+    if(is_directory_visited(cluster,sp)){
+        etrace("cross-linked directory detected at cluster %u",cluster);
+        return 0;
+    }
+
+    entries = read_directory(cluster,&buffer,&size,sp);
+    if(entries == NULL)
+        return 0; /* the directory is unreadable, skip it */
+
+    ln.next = 0; ln.name[0] = 0;
+    for(i = 0; i < size / sizeof(FAT_DIRECTORY_ENTRY); i++){
+        if(ftw_fat_check_for_termination(sp)){
+            result = -2;
+            break;
+        }
+
+        e = (FAT_DIRECTORY_ENTRY *)entries + i;
+        if(e->Name[0] == FAT_DIRENT_END)
+            break;
+        if(e->Name[0] == FAT_DIRENT_DELETED){
+            ln.next = 0; ln.name[0] = 0;
+            continue;
+        }
+        if((e->Attributes & FAT_ATTR_LONG_NAME_MASK) == FAT_ATTR_LONG_NAME){
+            collect_long_name((FAT_LFN_ENTRY *)e,&ln);
+            continue;
+        }
+
+        /* skip volume labels, . and .. entries */
+        if((e->Attributes & FAT_ATTR_VOLUME_ID) || e->Name[0] == '.'){
+            ln.next = 0; ln.name[0] = 0;
+            continue;
+        }
+
+        name = get_long_name(e,&ln);
+        if(name == NULL || name[0] == 0){
+            get_short_name(e,short_name);
+            name = short_name;
+        }
+
+        /* add the entry to the file list */
+        f = add_file(path,node,name,e,sp);
+        ln.next = 0; ln.name[0] = 0;
+        if(f == NULL){
+            result = -1;
+            break;
+        }
+
+        /* check for termination */
+        if(ftw_fat_check_for_termination(sp)){
+            itrace("terminated by user");
+            result = -2;
+            break;
+        }
+
+        /* call the callback routines */
+        if(sp->pcb != NULL)
+            sp->pcb(f,sp->user_defined_data);
+
+        skip_children = 0;
+        if(sp->fcb != NULL)
+            skip_children = sp->fcb(f,sp->user_defined_data);
+
+        /* scan subdirectories */
+        first_cluster = get_first_cluster(e,sp);
+        if(is_directory(f) && !skip_children && first_cluster){
+            child = node ? ftw_add_path_node(node,f->name) : NULL;
+            result = scan_directory(first_cluster,
+                node ? NULL : f->path,child,depth + 1,sp);
+            if(result < 0) break;
+        }
+    }
+
+    winx_free(buffer);
+    return result;
+}
+
+/**
+ * @internal
+ * @brief Adds all files of a FAT12/16/32
+ * volume to the list of files, reading the
+ * FAT and the directories straight from the disk.
+ * @details The root directory itself must be
+ * in the list already. Maps of the files get
+ * built from their cluster chains, thus the
+ * scan costs a single large read of the FAT
+ * and a single read per block of each directory.
+ * @param[in] v information about the volume.
+ * @param[in] rootpath the path of the root directory.
+ * @param[in] top the root directory in the compact
+ * path storage; NULL if paths are not compact.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller,
+ * -3 indicates that the volume cannot be scanned
+ * directly; no files get added to the list then.
+ */
+int fat_scan_disk(winx_volume_information *v,wchar_t *rootpath,
+    winx_path_node *top,int flags,ftw_filter_callback fcb,
+    ftw_progress_callback pcb,ftw_terminator t,void *user_defined_data,
+    winx_file_info **filelist,winx_arena *arena)
+{
+    wchar_t path[] = L"\\??\\A:";
+    fat_scan_parameters sp;
+    ULONGLONG time;
+    int result;
+
+    time = winx_xtime();
+
+    memset(&sp,0,sizeof(fat_scan_parameters));
+    sp.flags = flags;
+    sp.fcb = fcb;
+    sp.pcb = pcb;
+    sp.t = t;
+    sp.user_defined_data = user_defined_data;
+    sp.filelist = filelist;
+    sp.arena = arena;
+
+    /* open the volume for read access */
+    path[4] = winx_toupper(v->volume_letter);
+    sp.f_volume = winx_fopen(path,"r");
+    if(sp.f_volume == NULL)
+        return (-3);
+
+    if(get_fat_layout(v,&sp) < 0 || load_fat(&sp) < 0){
+        if(ftw_fat_check_for_termination(&sp)){
+            winx_fclose(sp.f_volume);
+            return (-2);
+        }
+        itrace("the volume cannot be scanned directly");
+        winx_fclose(sp.f_volume);
+        return (-3);
+    }
+
+    sp.visited = winx_tmalloc(sp.fl.clusters / 8 + 1);
+    if(sp.visited == NULL){
+        etrace("cannot allocate %u bytes of memory",sp.fl.clusters / 8 + 1);
+    } else {
+        memset(sp.visited,0,sp.fl.clusters / 8 + 1);
+    }
+    itrace("FAT loaded in %I64u ms",winx_xtime() - time);
+
+    result = scan_directory(sp.fl.root_cluster,rootpath,top,0,&sp);
+
+    winx_free(sp.visited);
+    winx_free(sp.fat_buffer);
+    winx_fclose(sp.f_volume);
+
+    itrace("FAT scan completed in %I64u ms",winx_xtime() - time);
+
+    if(result == 0 && !(sp.flags & WINX_FTW_ALLOW_PARTIAL_SCAN) && sp.errors)
+        return (-1);
+    return result;
+}
+
+/** @} */
@@ -42,6 +42,36 @@
 */
 //#define SHOW_ATTR_LISTS_INFO
 
+/*
+* Size of the portions of the MFT
+* to be read directly from the disk.
+*/
+#define MFT_CHUNK_SIZE (4 * 1024 * 1024)
+
+/*
+* Update sequence arrays protect
+* each 512 bytes of NTFS records.
+*/
+#define NTFS_USA_STRIDE 512
+
+/*
+* Maximum number of threads
+* analyzing file records.
+*/
+#define MFT_MAX_THREADS 16
+
+/*
+* Default number of chunks of the MFT
+* being read and analyzed simultaneously.
+*/
+#define MFT_DEFAULT_QUEUE_DEPTH 2
+
+/*
+* Initial number of buckets of the table
+* of streams; must be a power of two.
+*/
+#define STREAM_TABLE_INITIAL_SIZE 4096
+
 /* internal structures */
 typedef struct _mft_layout {
     unsigned long file_record_size;         /* size of a single mft file record, in bytes */
@@ -69,6 +99,21 @@ typedef struct {
     ULONGLONG LastAccessTime;        /**/
 } my_file_information;
 
+/* an entry of the table of streams */
+typedef struct _stream_entry {
+    struct _stream_entry *next; /* next entry of the same bucket */
+    ULONGLONG mft_id;           /* base mft index of the stream */
+    ULONG name_hash;            /* hash of the stream name as stored in the attribute */
+    winx_file_info *f;          /* the stream */
+} stream_entry;
+
+/* a table of streams keyed by (base mft index, stream name) */
+typedef struct _stream_table {
+    stream_entry **buckets;     /* array of buckets; NULL until the first insertion */
+    ULONG size;                 /* number of buckets, always a power of two */
+    ULONG count;                /* number of entries */
+} stream_table;
+
 typedef struct _mft_scan_parameters {
     int mft_scan_direction;     /* mft scan direction, right to left in the current algorithm */
     mft_layout ml;              /* mft layout structure */
@@ -83,13 +128,54 @@ typedef struct _mft_scan_parameters {
     unsigned long processed_attr_list_entries; /* just for debugging purposes */
     unsigned long errors;       /* number of critical errors preventing gathering of complete information */
     winx_file_info **filelist;  /* list of files */
+    winx_arena *arena;          /* arena the list is allocated from; NULL for the global heap */
+    stream_table streams;       /* index of the list of files */
+    winx_blockmap *mft_blockmap;        /* $MFT data runs; NULL if the MFT cannot be read directly */
+    winx_blockmap *mft_bitmap_blockmap; /* $MFT::$BITMAP data runs, if nonresident */
+    ULONGLONG mft_bitmap_size;          /* size of $MFT::$BITMAP, in bytes */
+    unsigned char *mft_bitmap;          /* $MFT::$BITMAP contents; NULL if not available */
 } mft_scan_parameters;
 
-/* an auxiliary structure for binary search */
-typedef struct {
-    ULONGLONG mft_id;
-    winx_file_info *f;
-} file_entry;
+/* a thread analyzing a part of each chunk of the mft */
+typedef struct _mft_worker {
+    mft_scan_parameters sp;     /* private copy of the scan parameters */
+    winx_file_info *filelist;   /* list of streams found by the thread */
+    char *buffer;               /* the chunk of the mft */
+    ULONGLONG vcn;              /* the first cluster of the chunk */
+    ULONGLONG first;            /* the first record to be analyzed */
+    ULONGLONG last;             /* the last record to be analyzed */
+    HANDLE hStartEvent;         /* signaled when the records are ready */
+    HANDLE hDoneEvent;          /* signaled when the records are analyzed */
+    int quit;                   /* nonzero value forces the thread to exit */
+} mft_worker;
+
+/* a chunk of the mft */
+typedef struct _mft_chunk {
+    char *buffer;               /* the buffer allocated for the chunk */
+    char *aligned_buffer;       /* the buffer aligned on the sector boundary */
+    ULONGLONG first;            /* the first record to be analyzed */
+    ULONGLONG last;             /* the last record to be analyzed */
+    ULONGLONG vcn;              /* the first cluster read */
+    ULONGLONG length;           /* number of clusters read */
+    NTSTATUS status;            /* result of the read operation */
+    int eof;                    /* nonzero value indicates the end of the mft */
+    HANDLE hFullEvent;          /* signaled when the chunk is read */
+    HANDLE hEmptyEvent;         /* signaled when the chunk is analyzed */
+} mft_chunk;
+
+/* a thread reading chunks of the mft in advance */
+typedef struct _mft_reader {
+    mft_scan_parameters *sp;    /* the scan parameters */
+    mft_chunk *chunks;          /* queue of chunks */
+    int depth;                  /* number of chunks in the queue */
+    ULONGLONG records_per_chunk;/* number of records per chunk */
+    ULONGLONG next;             /* the first record of the next chunk */
+    int eof;                    /* nonzero value indicates the end of the mft */
+    ULONGLONG io_time;          /* time spent for reading, in milliseconds */
+    ULONGLONG parse_stall;      /* time spent for waiting on analysis, in milliseconds */
+    HANDLE hDoneEvent;          /* signaled when the thread terminates */
+    int quit;                   /* nonzero value forces the thread to exit */
+} mft_reader;
 
 typedef struct {
     ATTRIBUTE_TYPE AttributeType; /* the type of the attribute */
@@ -102,8 +188,15 @@ typedef void (*attribute_handler)(PATTRIBUTE pattr,mft_scan_parameters *sp);
 static void analyze_resident_stream(PRESIDENT_ATTRIBUTE pr_attr,mft_scan_parameters *sp);
 static void analyze_non_resident_stream(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan_parameters *sp);
 static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_parameters *sp);
+static int get_run_list(PNONRESIDENT_ATTRIBUTE pnr_attr,winx_blockmap **blockmap,mft_scan_parameters *sp);
+static void stop_mft_workers(mft_worker *workers,int n,mft_scan_parameters *sp);
 
-void validate_blockmap(winx_file_info *f);
+void validate_blockmap(winx_file_info *f,winx_arena *arena);
+winx_path_node *ftw_create_path_store(wchar_t *path);
+void ftw_release_path_store(winx_path_node *node);
+ULONGLONG ftw_get_path_store_size(winx_path_node *node);
+winx_path_node *ftw_add_path_node(winx_path_node *parent,wchar_t *name);
+void ftw_set_compact_path(winx_file_info *f,winx_path_node *parent);
 
 /*
 **************************************************
@@ -385,6 +478,44 @@ static void get_number_of_file_records_callback(PATTRIBUTE pattr,mft_scan_parame
     }
 }
 
+/**
+ * @brief Saves locations of $MFT data and $MFT::$BITMAP
+ * to make direct reading of the MFT possible.
+ */
+static void get_mft_runs_callback(PATTRIBUTE pattr,mft_scan_parameters *sp)
+{
+    PNONRESIDENT_ATTRIBUTE pnr_attr;
+    PRESIDENT_ATTRIBUTE pr_attr;
+    
+    if(pattr->NameLength) return; /* skip named streams */
+    
+    if(pattr->AttributeType == AttributeData && pattr->Nonresident){
+        pnr_attr = (PNONRESIDENT_ATTRIBUTE)pattr;
+        if(pnr_attr->LowVcn || sp->mft_blockmap) return;
+        if(get_run_list(pnr_attr,&sp->mft_blockmap,sp) < 0)
+            etrace("cannot get $Mft data runs");
+    } else if(pattr->AttributeType == AttributeBitmap){
+        if(sp->mft_bitmap || sp->mft_bitmap_blockmap) return;
+        if(pattr->Nonresident){
+            pnr_attr = (PNONRESIDENT_ATTRIBUTE)pattr;
+            if(pnr_attr->LowVcn) return;
+            if(get_run_list(pnr_attr,&sp->mft_bitmap_blockmap,sp) < 0){
+                etrace("cannot get $Mft::$BITMAP data runs");
+                return;
+            }
+            sp->mft_bitmap_size = pnr_attr->InitializedSize;
+        } else {
+            pr_attr = (PRESIDENT_ATTRIBUTE)pattr;
+            if(pr_attr->ValueOffset == 0 || pr_attr->ValueLength == 0) return;
+            sp->mft_bitmap = winx_tmalloc(pr_attr->ValueLength);
+            if(sp->mft_bitmap == NULL) return;
+            memcpy(sp->mft_bitmap,(char *)pr_attr + pr_attr->ValueOffset,
+                pr_attr->ValueLength);
+            sp->mft_bitmap_size = pr_attr->ValueLength;
+        }
+    }
+}
+
 /**
  * @brief Retrieves total number of mft file records.
  * @return Zero for success, negative value otherwise.
@@ -440,6 +571,9 @@ static int get_number_of_file_records(mft_scan_parameters *sp)
     /* get actual number of mft entries */
     enumerate_attributes(frh,get_number_of_file_records_callback,sp);
     
+    /* get location of the mft */
+    enumerate_attributes(frh,get_mft_runs_callback,sp);
+    
     /* free memory */
     winx_free(nfrob);
     
@@ -1022,6 +1156,172 @@ scan_done:
     winx_free(cluster);
 }
 
+/*
+**************************************************
+*                Table of streams
+**************************************************
+*/
+
+/**
+ * @brief Calculates FNV-1a hash of a stream name.
+ */
+static ULONG hash_stream_name(const wchar_t *name)
+{
+    ULONG hash = 2166136261u;
+    
+    for(; *name; name++){
+        hash ^= (ULONG)(*name);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static ULONG get_stream_bucket(ULONGLONG mft_id,ULONG name_hash,ULONG size)
+{
+    ULONG x = (ULONG)mft_id ^ (ULONG)(mft_id >> 32);
+    
+    return ((x * 2654435761u) ^ name_hash) & (size - 1);
+}
+
+/**
+ * @brief Doubles the number of buckets
+ * when the table becomes too crowded.
+ * @note Failure to grow is not fatal,
+ * the chains just become longer.
+ */
+static void grow_stream_table(stream_table *t)
+{
+    stream_entry **buckets, *e, *next;
+    ULONG size, i, k;
+    
+    if(t->buckets == NULL){
+        size = STREAM_TABLE_INITIAL_SIZE;
+    } else {
+        if(t->count < t->size * 2 || t->size >= 0x40000000) return;
+        size = t->size * 2;
+    }
+    
+    buckets = winx_tmalloc(size * sizeof(stream_entry *));
+    if(buckets == NULL){
+        if(t->buckets) return;
+        /* the table cannot work without buckets at all */
+        buckets = winx_malloc(size * sizeof(stream_entry *));
+    }
+    memset(buckets,0,size * sizeof(stream_entry *));
+    
+    for(i = 0; i < t->size; i++){
+        for(e = t->buckets[i]; e; e = next){
+            next = e->next;
+            k = get_stream_bucket(e->mft_id,e->name_hash,size);
+            e->next = buckets[k];
+            buckets[k] = e;
+        }
+    }
+    winx_free(t->buckets);
+    t->buckets = buckets;
+    t->size = size;
+}
+
+static void add_stream_entry(stream_table *t,stream_entry *e)
+{
+    ULONG k;
+    
+    grow_stream_table(t);
+    k = get_stream_bucket(e->mft_id,e->name_hash,t->size);
+    e->next = t->buckets[k];
+    t->buckets[k] = e;
+    t->count ++;
+}
+
+/**
+ * @brief Adds a stream to the table.
+ * @param[in] t the table.
+ * @param[in] f the stream; its name must
+ * be the name stored in the attribute.
+ * @param[in] arena the arena the entry
+ * gets allocated from; NULL forces to
+ * use the global heap.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+static int add_stream(stream_table *t,winx_file_info *f,winx_arena *arena)
+{
+    stream_entry *e;
+    
+    e = winx_arena_alloc(arena,sizeof(stream_entry));
+    if(e == NULL) return (-1);
+    e->mft_id = f->internal.BaseMftId;
+    e->name_hash = hash_stream_name(f->name);
+    e->f = f;
+    add_stream_entry(t,e);
+    return 0;
+}
+
+/**
+ * @brief Searches for a stream in the table.
+ * @note Streams are renamed when their base
+ * record is analyzed completely, so that the
+ * name comparison is valid only while the base
+ * record is being analyzed.
+ */
+static winx_file_info *find_stream(stream_table *t,
+    ULONGLONG mft_id,const wchar_t *name)
+{
+    stream_entry *e;
+    ULONG hash;
+    
+    if(t->buckets == NULL) return NULL;
+    hash = hash_stream_name(name);
+    e = t->buckets[get_stream_bucket(mft_id,hash,t->size)];
+    for(; e; e = e->next){
+        if(e->mft_id == mft_id && e->name_hash == hash){
+            if(!wcscmp(e->f->name,name)) return e->f;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Moves all entries of one table to another.
+ */
+static void merge_stream_tables(stream_table *dst,stream_table *src)
+{
+    stream_entry *e, *next;
+    ULONG i;
+    
+    for(i = 0; i < src->size; i++){
+        for(e = src->buckets[i]; e; e = next){
+            next = e->next;
+            add_stream_entry(dst,e);
+        }
+    }
+    winx_free(src->buckets);
+    src->buckets = NULL;
+    src->size = src->count = 0;
+}
+
+/**
+ * @brief Destroys a table of streams.
+ * @param[in] t the table.
+ * @param[in] arena the arena the entries
+ * were allocated from.
+ */
+static void destroy_stream_table(stream_table *t,winx_arena *arena)
+{
+    stream_entry *e, *next;
+    ULONG i;
+    
+    for(i = 0; i < t->size; i++){
+        for(e = t->buckets[i]; e; e = next){
+            next = e->next;
+            winx_arena_free(arena,e,sizeof(stream_entry));
+        }
+    }
+    winx_free(t->buckets);
+    t->buckets = NULL;
+    t->size = t->count = 0;
+}
+
 /*
 **************************************************
 *       Nonresident file streams analysis
@@ -1033,46 +1333,47 @@ static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_paramete
     winx_file_info *f;
     
     /* few streams may have the same mft id */
-    for(f = *sp->filelist; f != NULL; f = f->next){
-        /*
-        * we scan mft from the end to the beginning (RTL)
-        * and we add new records to the left side of the file list...
-        */
-        if(sp->mft_scan_direction == MFT_SCAN_RTL){
-            if(f->internal.BaseMftId > sp->mfi.BaseMftId){
-                /* we have no chance to find the record in the list */
-                break;
-            }
-        } else {
-            if(f->internal.BaseMftId < sp->mfi.BaseMftId) break;
-        }
-        if(!wcscmp(f->name,attr_name) && f->internal.BaseMftId == sp->mfi.BaseMftId)
-            return f; /* slow? */
-        //if(f->internal.BaseMftId == sp->mfi.BaseMftId) return f; /* safe? */
-        if(f->next == *sp->filelist) break;
-    }
+    f = find_stream(&sp->streams,sp->mfi.BaseMftId,attr_name);
+    if(f) return f;
     
-    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)sp->filelist,NULL,sizeof(winx_file_info));
+    f = (winx_file_info *)winx_list_insert_ex((list_entry **)(void *)sp->filelist,
+        NULL,sizeof(winx_file_info),sp->arena);
+    if(f == NULL){
+        mtrace();
+        sp->errors ++;
+        return NULL;
+    }
 
     /* initialize structure */
     f->name = winx_wcsdup(attr_name);
     if(f->name == NULL){
         etrace("cannot allocate %u bytes of memory",
             (wcslen(attr_name) + 1) * sizeof(wchar_t));
-        winx_list_remove((list_entry **)(void *)sp->filelist,(list_entry *)f);
+        winx_list_remove_ex((list_entry **)(void *)sp->filelist,
+            (list_entry *)f,sizeof(winx_file_info),sp->arena);
         sp->errors ++;
         return NULL;
     }
     
     f->path = NULL;
+    f->parent = NULL;
     f->flags = 0;
     f->user_defined_flags = 0;
+    f->user_defined_data = NULL;
     memset(&f->disp,0,sizeof(winx_file_disposition));
     f->internal.BaseMftId = sp->mfi.BaseMftId;
     f->internal.ParentDirectoryMftId = FILE_root;
     f->creation_time = 0;
     f->last_modification_time = 0;
     f->last_access_time = 0;
+    if(add_stream(&sp->streams,f,sp->arena) < 0){
+        mtrace();
+        winx_free(f->name);
+        winx_list_remove_ex((list_entry **)(void *)sp->filelist,
+            (list_entry *)f,sizeof(winx_file_info),sp->arena);
+        sp->errors ++;
+        return NULL;
+    }
     return f;
 }
 
@@ -1082,8 +1383,13 @@ static void process_run(winx_file_info *f,ULONGLONG vcn,ULONGLONG lcn,ULONGLONG
     
     /* add information to f->disp */
     if(f->disp.blockmap) prev_block = f->disp.blockmap->prev;
-    block = (winx_blockmap *)winx_list_insert((list_entry **)&f->disp.blockmap,
-        (list_entry *)prev_block,sizeof(winx_blockmap));
+    block = (winx_blockmap *)winx_list_insert_ex((list_entry **)&f->disp.blockmap,
+        (list_entry *)prev_block,sizeof(winx_blockmap),sp->arena);
+    if(block == NULL){
+        mtrace();
+        sp->errors ++;
+        return;
+    }
     
     block->vcn = vcn;
     block->lcn = lcn;
@@ -1144,6 +1450,49 @@ static ULONGLONG RunCount(PUCHAR run)
     return count;
 }
 
+/**
+ * @brief Decodes the list of runs
+ * of a nonresident attribute.
+ * @param[in] pnr_attr the attribute.
+ * @param[out] blockmap the list of blocks.
+ * @param[in] sp the scan parameters.
+ * @return Zero for success, negative value otherwise.
+ * @note Virtual runs are treated as errors here,
+ * because the routine is intended for system files
+ * which must be allocated entirely.
+ */
+static int get_run_list(PNONRESIDENT_ATTRIBUTE pnr_attr,winx_blockmap **blockmap,mft_scan_parameters *sp)
+{
+    ULONGLONG lcn, vcn, length;
+    PUCHAR run, end;
+    winx_blockmap *block, *prev_block;
+    
+    lcn = 0; vcn = pnr_attr->LowVcn;
+    run = (PUCHAR)((char *)pnr_attr + pnr_attr->RunArrayOffset);
+    end = (PUCHAR)((char *)pnr_attr + pnr_attr->Attribute.Length);
+    while(run < end && *run){
+        if(run + RunLength(run) > end) goto fail;
+        lcn += RunLCN(run);
+        length = RunCount(run);
+        if(RunLCN(run) == 0 || !check_run(lcn,length,sp)) goto fail;
+        
+        prev_block = *blockmap ? (*blockmap)->prev : NULL;
+        block = (winx_blockmap *)winx_list_insert((list_entry **)blockmap,
+            (list_entry *)prev_block,sizeof(winx_blockmap));
+        block->vcn = vcn;
+        block->lcn = lcn;
+        block->length = length;
+        
+        run += RunLength(run);
+        vcn += length;
+    }
+    if(*blockmap) return 0;
+
+fail:
+    winx_list_destroy((list_entry **)blockmap);
+    return (-1);
+}
+
 static void process_run_list(wchar_t *attr_name,PNONRESIDENT_ATTRIBUTE pnr_attr,
                 mft_scan_parameters *sp,BOOLEAN is_attr_list)
 {
@@ -1242,7 +1591,7 @@ static void analyze_non_resident_stream(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan
 **************************************************
 */
 
-static int update_stream_name(winx_file_info *f,mft_scan_parameters *sp)
+static void update_stream_name(winx_file_info *f,mft_scan_parameters *sp)
 {
     wchar_t *new_name;
     int length;
@@ -1258,7 +1607,6 @@ static int update_stream_name(winx_file_info *f,mft_scan_parameters *sp)
     
     winx_free(f->name);
     f->name = new_name;
-    return 0;
 }
 
 /**
@@ -1287,14 +1635,12 @@ static void analyze_attribute_list_callback(PATTRIBUTE pattr,mft_scan_parameters
  * @details Forces all child records
  * to be analyzed as well.
  */
-static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
+static void analyze_file_record(ULONGLONG mft_id,FILE_RECORD_HEADER *frh,
                                 mft_scan_parameters *sp)
 {
-    FILE_RECORD_HEADER *frh;
     winx_file_info *f, *next, *head;
     
     /* validate header */
-    frh = (FILE_RECORD_HEADER *)nfrob->FileRecordBuffer;
     if(!is_file_record(frh))
         return;
     if(!(frh->Flags & 0x1))
@@ -1321,7 +1667,7 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
     */
     
     /* initialize the sp->mfi structure */
-    sp->mfi.BaseMftId = GetMftIdFromFRN(nfrob->FileReferenceNumber);
+    sp->mfi.BaseMftId = mft_id;
     sp->mfi.ParentDirectoryMftId = FILE_root;
     sp->mfi.Flags = 0x0;
     if(frh->Flags & 0x2)
@@ -1370,19 +1716,10 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
             /* set parent directory id for the stream */
             f->internal.ParentDirectoryMftId = sp->mfi.ParentDirectoryMftId;
             /* add filename to the name of the stream */
-            if(update_stream_name(f,sp) < 0){
-                winx_list_remove((list_entry **)(void *)sp->filelist,(list_entry *)f);
-                if(*sp->filelist == NULL) break;
-                if(*sp->filelist != head){
-                    head = *sp->filelist;
-                    f = next;
-                    continue;
-                }
-            } else {
-                /* call the progress callback */
-                if(sp->pcb)
-                    sp->pcb(f,sp->user_defined_data);
-            }
+            update_stream_name(f,sp);
+            /* call the progress callback */
+            if(sp->pcb)
+                sp->pcb(f,sp->user_defined_data);
         }
         f = next;
         if(f == head) break;
@@ -1395,253 +1732,970 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
 **************************************************
 */
 
-static winx_file_info * find_directory_by_mft_id(ULONGLONG mft_id,
-    file_entry *f_array,unsigned long n_entries,mft_scan_parameters *sp)
+/*
+* The maximum depth of the directory tree:
+* NTFS paths cannot exceed 32767 characters.
+*/
+#define MAX_DIRECTORY_DEPTH 16384
+
+/* an entry of the dense array of directories */
+typedef struct _directory_entry {
+    winx_file_info *f;          /* the default stream of the base record */
+    ULONG path_length;          /* length of f->path, in characters */
+    winx_path_node *node;       /* the directory in the compact path storage */
+} directory_entry;
+
+/* an auxiliary structure for the build_full_paths routine */
+typedef struct _path_builder {
+    directory_entry *dirs;      /* array indexed by mft index; NULL if not available */
+    ULONGLONG n_dirs;           /* number of entries in the array */
+    winx_file_info **chain;     /* directories being resolved */
+    wchar_t root[8];            /* path of the root directory: \??\X: */
+    ULONG root_length;          /* length of the root path, in characters */
+    winx_path_node *top;        /* the root of the compact path storage; NULL if paths are not compact */
+} path_builder;
+
+/**
+ * @brief Searches for a directory.
+ * @details Index allocation attributes of directories
+ * have empty names (see get_attribute_name), so the
+ * directory is the stream of the specified base record
+ * stored in the table under the empty name.
+ */
+static winx_file_info * find_directory_by_mft_id(ULONGLONG mft_id,mft_scan_parameters *sp)
 {
-    winx_file_info *f;
-    ULONG lim, i, k;
-    signed long m;
-    BOOLEAN ascending_order;
-
-    if(f_array == NULL){ /* use slow linear search */
-        for(f = *sp->filelist; f != NULL; f = f->next){
-            if(f->internal.BaseMftId == mft_id){
-                if(wcsstr(f->name,L":$") == NULL)
-                    return f;
-            }
-            if(f->next == *sp->filelist) break;
-        }
-        return NULL;
-    } else { /* use fast binary search */
-        /* Based on bsearch() algorithm copyrighted by DJ Delorie (1994). */
-        ascending_order = (sp->mft_scan_direction == MFT_SCAN_RTL) ? TRUE : FALSE;
-        i = 0;
-        for(lim = n_entries; lim != 0; lim >>= 1){
-            k = i + (lim >> 1);
-            if(f_array[k].mft_id == mft_id){
-                /* search for proper entry in neighbourhood of found entry */
-                for(m = k; m >= 0; m --){
-                    if(f_array[m].mft_id != mft_id) break;
-                }
-                for(m = m + 1; (unsigned long)(m) < n_entries; m ++){
-                    if(f_array[m].mft_id != mft_id) break;
-                    if(wcsstr(f_array[m].f->name,L":$") == NULL)
-                        return f_array[m].f;
-                }
-                etrace("Exit 1");
-                return NULL;
-            }
-            if(ascending_order){
-                if(mft_id > f_array[k].mft_id){
-                    i = k + 1; lim --; /* move right */
-                } /* else move left */
-            } else {
-                if(mft_id < f_array[k].mft_id){
-                    i = k + 1; lim --; /* move right */
-                } /* else move left */
-            }
+    stream_entry *e;
+    ULONG hash;
+    
+    if(sp->streams.buckets == NULL) return NULL;
+    hash = hash_stream_name(L"");
+    e = sp->streams.buckets[get_stream_bucket(mft_id,hash,sp->streams.size)];
+    for(; e; e = e->next){
+        if(e->mft_id == mft_id && e->name_hash == hash){
+            if(wcsstr(e->f->name,L":$") == NULL) return e->f;
         }
-        etrace("Exit 2");
-        return NULL;
     }
+    return NULL;
 }
 
 /**
- * @brief Retrieves path of the specified directory
- * as well as mft index of its parent directory.
- * @param[in] mft_id the mft index of the directory to be inspected.
- * @param[out] path the output buffer receiving the directory path.
- * @param[out] parent_mft_id pointer to variable receiving the mft
- * index of the parent directory.
- * @return Nonzero value indicates that the output buffer contains
- * the full native path, otherwise it contains the directory name only.
+ * @brief Sets the path of a stream.
+ * @param[in] f the stream.
+ * @param[in] parent the path of the parent directory.
+ * @param[in] parent_length length of the parent path, in characters.
+ * @param[out] length length of the resulting path, in characters.
+ * @param[in] sp the scan parameters.
+ * @return Zero for success, negative value otherwise.
  */
-static int get_directory_information(ULONGLONG mft_id,wchar_t **path,ULONGLONG *parent_mft_id,
-    file_entry *f_array,unsigned long n_entries,mft_scan_parameters *sp)
+static int set_stream_path(winx_file_info *f,wchar_t *parent,
+    ULONG parent_length,ULONG *length,mft_scan_parameters *sp)
 {
-    winx_file_info *f;
+    ULONG name_length = (ULONG)wcslen(f->name);
+    ULONG n = parent_length + 1 + name_length;
     
-    *path = NULL;
-    *parent_mft_id = FILE_root;
-    
-    f = find_directory_by_mft_id(mft_id,f_array,n_entries,sp);
-    if(f == NULL){
-        etrace("%I64u directory not found",mft_id);
+    f->path = winx_tmalloc((n + 1) * sizeof(wchar_t));
+    if(f->path == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (n + 1) * sizeof(wchar_t));
         sp->errors ++;
-        return 0;
+        return (-1);
     }
     
-    *parent_mft_id = f->internal.ParentDirectoryMftId;
+    memcpy(f->path,parent,parent_length * sizeof(wchar_t));
+    f->path[parent_length] = '\\';
+    memcpy(f->path + parent_length + 1,f->name,(name_length + 1) * sizeof(wchar_t));
+    *length = n;
+    return 0;
+}
+
+static winx_file_info *get_directory(path_builder *pb,
+    ULONGLONG mft_id,mft_scan_parameters *sp)
+{
+    if(pb->dirs)
+        return (mft_id < pb->n_dirs) ? pb->dirs[mft_id].f : NULL;
+    return find_directory_by_mft_id(mft_id,sp);
+}
+
+static ULONG get_directory_path_length(path_builder *pb,winx_file_info *d)
+{
+    if(pb->dirs) return pb->dirs[d->internal.BaseMftId].path_length;
+    return (ULONG)wcslen(d->path);
+}
+
+static void set_directory_path_length(path_builder *pb,winx_file_info *f,ULONG length)
+{
+    ULONGLONG mft_id = f->internal.BaseMftId;
     
-    if(f->path){
-        *path = f->path;
-        return 1;
+    if(pb->dirs && mft_id < pb->n_dirs && pb->dirs[mft_id].f == f)
+        pb->dirs[mft_id].path_length = length;
+}
+
+/**
+ * @brief Retrieves the path of the parent directory of a stream.
+ * @details Walks up to the nearest directory having its path
+ * already resolved, then resolves all the directories passed
+ * from the top down. So, each directory gets resolved once.
+ * @param[in] pb the path builder.
+ * @param[in] f the stream.
+ * @param[out] length length of the path, in characters.
+ * @param[in] sp the scan parameters.
+ * @return The path of the parent directory.
+ */
+static wchar_t *get_parent_path(path_builder *pb,winx_file_info *f,
+    ULONG *length,mft_scan_parameters *sp)
+{
+    winx_file_info *d;
+    ULONGLONG mft_id;
+    wchar_t *path = pb->root;
+    ULONG path_length = pb->root_length;
+    ULONG n, i = 0;
+    
+    /* walk up to the nearest resolved directory */
+    mft_id = f->internal.ParentDirectoryMftId;
+    while(mft_id != FILE_root){
+        d = get_directory(pb,mft_id,sp);
+        if(d == NULL){
+            etrace("%I64u directory not found",mft_id);
+            sp->errors ++;
+            break;
+        }
+        if(d->path){
+            path = d->path;
+            path_length = get_directory_path_length(pb,d);
+            break;
+        }
+        if(i == MAX_DIRECTORY_DEPTH){
+            etrace("directory tree is too deep at %I64u",mft_id);
+            sp->errors ++;
+            break;
+        }
+        pb->chain[i++] = d;
+        mft_id = d->internal.ParentDirectoryMftId;
     }
     
-    if(f->name){
-        *path = f->name;
+    /* resolve the directories from the top down */
+    while(i){
+        d = pb->chain[--i];
+        /* in case of cycles the directory may be resolved already */
+        if(d->path == NULL){
+            if(set_stream_path(d,path,path_length,&n,sp) < 0) continue;
+            set_directory_path_length(pb,d,n);
+        } else {
+            n = get_directory_path_length(pb,d);
+        }
+        path = d->path;
+        path_length = n;
     }
-    return 0;
+    
+    *length = path_length;
+    return path;
 }
 
-/* an auxiliary structure for the build_file_path routine */
-typedef struct _path_parts {
-    wchar_t child[MAX_PATH];   /* already gathered part of the path */
-    wchar_t buffer[MAX_PATH];  /* an auxiliary buffer */
-} path_parts;
-
-static void build_file_path(winx_file_info *f,file_entry *f_array,
-    unsigned long n_entries,path_parts *p,mft_scan_parameters *sp)
-{
-    ULONGLONG mft_id,parent_mft_id;
-    int full_path_retrieved = 0;
-    wchar_t *parent_path,*src;
-    
-    /* initialize p->child by the filename */
-    wcsncpy(p->child,f->name,MAX_PATH - 1);
-    p->child[MAX_PATH - 1] = 0;
-    
-    /* loop through parent directories */
-    parent_mft_id = f->internal.ParentDirectoryMftId;
-    while(parent_mft_id != FILE_root && !full_path_retrieved){
-        if(ftw_ntfs_check_for_termination(sp)) return;
-        mft_id = parent_mft_id;
-        full_path_retrieved = get_directory_information(mft_id,
-            &parent_path,&parent_mft_id,f_array,n_entries,sp);
-        if(parent_path)
-            _snwprintf(p->buffer,MAX_PATH,L"%ws\\%ws",parent_path,p->child);
-        else
-            _snwprintf(p->buffer,MAX_PATH,L"\\%ws",p->child);
-        p->buffer[MAX_PATH - 1] = 0;
-        wcscpy(p->child,p->buffer);
-    }
-    
-    /* append root directory path, if not appended yet */
-    if(p->child[1] == '?'){
-        src = p->child;
-    } else {
-        _snwprintf(p->buffer,MAX_PATH,L"\\??\\%c:\\%ws",sp->volume_letter,p->child);
-        p->buffer[MAX_PATH - 1] = 0;
-        src = p->buffer;
+/**
+ * @brief get_parent_path analog for compact paths.
+ * @return The parent directory in the path storage.
+ */
+static winx_path_node *get_parent_node(path_builder *pb,
+    winx_file_info *f,mft_scan_parameters *sp)
+{
+    directory_entry *d;
+    winx_path_node *node = pb->top;
+    ULONGLONG mft_id;
+    ULONG i = 0;
+    
+    /* walk up to the nearest resolved directory */
+    mft_id = f->internal.ParentDirectoryMftId;
+    while(mft_id != FILE_root){
+        if(mft_id >= pb->n_dirs || pb->dirs[mft_id].f == NULL){
+            etrace("%I64u directory not found",mft_id);
+            sp->errors ++;
+            break;
+        }
+        d = &pb->dirs[mft_id];
+        if(d->node){
+            node = d->node;
+            break;
+        }
+        if(i == MAX_DIRECTORY_DEPTH){
+            etrace("directory tree is too deep at %I64u",mft_id);
+            sp->errors ++;
+            break;
+        }
+        pb->chain[i++] = d->f;
+        mft_id = d->f->internal.ParentDirectoryMftId;
     }
     
-    /* update f->path */
-    f->path = winx_wcsdup(src);
-    if(f->path == NULL){
-        etrace("cannot allocate %u bytes of memory",
-            (wcslen(src) + 1) * sizeof(wchar_t));
-        sp->errors ++;
-        return;
+    /* resolve the directories from the top down */
+    while(i){
+        d = &pb->dirs[pb->chain[--i]->internal.BaseMftId];
+        /* in case of cycles the directory may be resolved already */
+        if(d->node == NULL)
+            d->node = ftw_add_path_node(node,d->f->name);
+        node = d->node;
     }
-
-    //trace(D"%ws",f->path);
+    
+    return node;
 }
 
 /**
- * @todo This procedure eats lots of CPU tacts,
- * optimize it for speed or run with thread priority
- * below normal.
+ * @brief Builds paths of all the streams found.
+ * @details Default streams of all the base records
+ * are collected into a dense array indexed by the mft
+ * index, which makes search for parent directories
+ * trivial. If the array cannot be allocated, the
+ * table of streams is used instead.
+ *
+ * If WINX_FTW_COMPACT_PATHS flag is set, directories
+ * are added to the compact path storage instead and
+ * the streams refer to them.
  */
 static int build_full_paths(mft_scan_parameters *sp)
 {
-    path_parts *p;
-    file_entry *f_array = NULL;
-    unsigned long n_entries = 0;
+    path_builder pb;
+    stream_entry *e;
     winx_file_info *f;
-    ULONG i;
+    winx_path_node *node;
+    wchar_t *parent;
+    ULONG hash, i, length, parent_length;
+    ULONGLONG full_paths_size = 0;
     ULONGLONG time;
     
     itrace("build_full_paths started...");
     time = winx_xtime();
     
     /* allocate memory */
-    p = winx_malloc(sizeof(path_parts));
-
-    /* prepare data for fast binary search */
-    for(f = *sp->filelist; f != NULL; f = f->next){
-        n_entries++;
-        if(f->next == *sp->filelist) break;
-    }
-
-    if(n_entries){
-        f_array = winx_tmalloc(n_entries * sizeof(file_entry));
-        if(f_array == NULL){
-            etrace("cannot allocate %u bytes of memory",
-                n_entries * sizeof(file_entry));
-        }
-    }
-
-    if(f_array){
-        /* fill the array */
-        i = 0;
-        for(f = *sp->filelist; f != NULL; f = f->next){
-            f_array[i].mft_id = f->internal.BaseMftId;
-            f_array[i].f = f;
-            if(i == (n_entries - 1)){ 
-                if(f->next != *sp->filelist)
-                    etrace("???");
-                break;
+    pb.chain = winx_malloc(MAX_DIRECTORY_DEPTH * sizeof(winx_file_info *));
+    pb.n_dirs = sp->ml.number_of_file_records;
+    pb.dirs = winx_tmalloc((SIZE_T)(pb.n_dirs * sizeof(directory_entry)));
+    if(pb.dirs == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            pb.n_dirs * sizeof(directory_entry));
+        itrace("directories will be searched through the table of streams");
+    } else {
+        memset(pb.dirs,0,(SIZE_T)(pb.n_dirs * sizeof(directory_entry)));
+        hash = hash_stream_name(L"");
+        for(i = 0; i < sp->streams.size; i++){
+            for(e = sp->streams.buckets[i]; e; e = e->next){
+                if(e->name_hash != hash || e->mft_id >= pb.n_dirs) continue;
+                if(pb.dirs[e->mft_id].f == NULL && wcsstr(e->f->name,L":$") == NULL)
+                    pb.dirs[e->mft_id].f = e->f;
             }
-            i++;
-            if(f->next == *sp->filelist) break;
         }
-        itrace("fast binary search will be used");
-    } else {
-        itrace("slow linear search will be used");
+    }
+    _snwprintf(pb.root,sizeof(pb.root) / sizeof(wchar_t),L"\\??\\%c:",sp->volume_letter);
+    pb.root[sizeof(pb.root) / sizeof(wchar_t) - 1] = 0;
+    pb.root_length = (ULONG)wcslen(pb.root);
+    
+    /* compact paths need the array of directories */
+    pb.top = NULL;
+    if((sp->flags & WINX_FTW_COMPACT_PATHS) && pb.dirs){
+        pb.top = ftw_create_path_store(pb.root);
+        itrace("compact paths will be used");
     }
     
     for(f = *sp->filelist; f != NULL; f = f->next){
         if(ftw_ntfs_check_for_termination(sp)) break;
-        build_file_path(f,f_array,n_entries,p,sp);
+        if(pb.top){
+            node = get_parent_node(&pb,f,sp);
+            ftw_set_compact_path(f,node);
+            /* estimate the size of the full path */
+            full_paths_size += (node->length + 2 + wcslen(f->name)) * sizeof(wchar_t);
+        } else if(f->path == NULL){
+            /* directories may be resolved already */
+            parent = get_parent_path(&pb,f,&parent_length,sp);
+            if(set_stream_path(f,parent,parent_length,&length,sp) == 0)
+                set_directory_path_length(&pb,f,length);
+        }
+        //trace(D"%ws",f->path);
         if(f->next == *sp->filelist) break;
     }
     
+    if(pb.top){
+        itrace("compact paths take %I64u bytes instead of %I64u bytes",
+            ftw_get_path_store_size(pb.top),full_paths_size);
+        /* the storage remains alive while the list refers to it */
+        ftw_release_path_store(pb.top);
+    }
+    
     /* free allocated resources */
-    winx_free(f_array);
-    winx_free(p);
+    winx_free(pb.dirs);
+    winx_free(pb.chain);
     itrace("build_full_paths completed in %I64u ms",winx_xtime() - time);
     return 0;
 }
 
 /*
 **************************************************
-*       NTFS scan entry point and helpers
+*             Direct MFT reading
 **************************************************
 */
 
 /**
- * @brief Scans the entire MFT and adds
- * all files found to the list of files.
- * @return Zero for success, -1 indicates failure,
- * -2 indicates termination requested by the caller.
- * @note sp->f_volume must be set before this call.
+ * @brief Reads a range of clusters of the MFT.
+ * @param[in] vcn the first virtual cluster to be read.
+ * @param[in] length number of clusters to be read.
+ * @param[out] buffer the buffer to read data into.
+ * @param[in] sp the scan parameters.
  */
-static int scan_mft(mft_scan_parameters *sp)
+static NTSTATUS read_mft_clusters(ULONGLONG vcn,ULONGLONG length,
+        char *buffer,mft_scan_parameters *sp)
 {
-    NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob;
-    ULONGLONG start_time;
-    ULONGLONG mft_id, ret_mft_id;
+    winx_blockmap *block;
+    ULONGLONG n, lsn;
     NTSTATUS status;
-    int result;
-    
-    itrace("mft scan started");
-    start_time = winx_xtime();
     
-#ifdef TEST_NTFS_SCANNER
-    dtrace("NTFS SCANNER TEST STARTED");
-    srnd(1);
-#endif
-    
-    /* get mft layout */
-    if(get_mft_layout(sp) < 0){
-fail:
-        etrace("mft scan failed");
-        return (-1);
+    for(block = sp->mft_blockmap; block && length; block = block->next){
+        if(block->vcn + block->length > vcn && block->vcn <= vcn){
+            n = min(block->vcn + block->length - vcn,length);
+            lsn = (block->lcn + vcn - block->vcn) * sp->ml.sectors_per_cluster;
+            status = read_sectors(lsn,buffer,(ULONG)(n * sp->ml.cluster_size),sp);
+            if(!NT_SUCCESS(status)) return status;
+            buffer += n * sp->ml.cluster_size;
+            vcn += n; length -= n;
+        }
+        if(block->next == sp->mft_blockmap) break;
     }
+    
+    /* the range is beyond the known runs */
+    return length ? STATUS_END_OF_FILE : STATUS_SUCCESS;
+}
 
-    /* allocate memory */
-    nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
-    if(nfrob == NULL){
+/**
+ * @brief Reads $MFT::$BITMAP to be able
+ * to skip unused file records.
+ * @note The bitmap is optional; if it cannot
+ * be read, all the records will be inspected.
+ */
+static void load_mft_bitmap(mft_scan_parameters *sp)
+{
+    winx_blockmap *block;
+    ULONGLONG clusters = 0;
+    ULONGLONG lsn;
+    char *buffer;
+    NTSTATUS status;
+    
+    if(sp->mft_bitmap || sp->mft_bitmap_blockmap == NULL) return;
+    
+    for(block = sp->mft_bitmap_blockmap; block; block = block->next){
+        clusters += block->length;
+        if(block->next == sp->mft_bitmap_blockmap) break;
+    }
+    if(sp->mft_bitmap_size > clusters * sp->ml.cluster_size)
+        sp->mft_bitmap_size = clusters * sp->ml.cluster_size;
+    
+    buffer = winx_tmalloc((SIZE_T)(clusters * sp->ml.cluster_size));
+    if(buffer == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            clusters * sp->ml.cluster_size);
+        return;
+    }
+    
+    sp->mft_bitmap = (unsigned char *)buffer;
+    for(block = sp->mft_bitmap_blockmap; block; block = block->next){
+        lsn = block->lcn * sp->ml.sectors_per_cluster;
+        status = read_sectors(lsn,buffer,
+            (ULONG)(block->length * sp->ml.cluster_size),sp);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot read $Mft::$BITMAP");
+            winx_free(sp->mft_bitmap);
+            sp->mft_bitmap = NULL;
+            return;
+        }
+        buffer += block->length * sp->ml.cluster_size;
+        if(block->next == sp->mft_bitmap_blockmap) break;
+    }
+}
+
+/**
+ * @brief Checks whether a file record is in use or not.
+ */
+static int is_file_record_in_use(ULONGLONG mft_id,mft_scan_parameters *sp)
+{
+    if(sp->mft_bitmap == NULL || mft_id / 8 >= sp->mft_bitmap_size)
+        return 1; /* we don't know, so let's assume it is in use */
+    return (sp->mft_bitmap[mft_id / 8] & (1 << (mft_id % 8))) ? 1 : 0;
+}
+
+/**
+ * @brief Applies update sequence array
+ * fixups to a file record read from disk.
+ * @return Zero for success, negative value
+ * indicates that the record is corrupted.
+ */
+static int apply_fixups(FILE_RECORD_HEADER *frh,mft_scan_parameters *sp)
+{
+    USHORT *usa, *check;
+    ULONG i, count, offset;
+    
+    if(!is_file_record(frh)) return (-1);
+    
+    count = frh->Ntfs.UsaCount;
+    offset = frh->Ntfs.UsaOffset;
+    if(count < 2 || (count - 1) * NTFS_USA_STRIDE != sp->ml.file_record_size)
+        return (-1);
+    if((offset & 1) || offset + count * sizeof(USHORT) > NTFS_USA_STRIDE - sizeof(USHORT))
+        return (-1);
+    
+    usa = (USHORT *)((char *)frh + offset);
+    for(i = 1; i < count; i++){
+        check = (USHORT *)((char *)frh + i * NTFS_USA_STRIDE - sizeof(USHORT));
+        /* mismatch indicates an incomplete write */
+        if(*check != usa[0]) return (-1);
+        *check = usa[i];
+    }
+    return 0;
+}
+
+/**
+ * @brief Analyzes file records of a chunk of the MFT.
+ * @param[in] buffer the chunk.
+ * @param[in] vcn the first cluster of the chunk.
+ * @param[in] first the first record to be analyzed.
+ * @param[in] last the last record to be analyzed.
+ * @param[in] sp the scan parameters.
+ */
+static void analyze_file_records(char *buffer,ULONGLONG vcn,
+        ULONGLONG first,ULONGLONG last,mft_scan_parameters *sp)
+{
+    FILE_RECORD_HEADER *frh;
+    ULONGLONG mft_id;
+    
+    for(mft_id = last; !ftw_ntfs_check_for_termination(sp); mft_id --){
+        frh = (FILE_RECORD_HEADER *)(buffer + \
+            (mft_id * sp->ml.file_record_size - vcn * sp->ml.cluster_size));
+        if(is_file_record_in_use(mft_id,sp)){
+            if(apply_fixups(frh,sp) == 0){
+#ifdef TEST_NTFS_SCANNER
+                randomize_file_record_data((char *)frh,sp->ml.file_record_size);
+#endif
+                analyze_file_record(mft_id,frh,sp);
+            }
+        }
+        if(mft_id == first) break;
+    }
+}
+
+static DWORD WINAPI mft_worker_thread(LPVOID p)
+{
+    mft_worker *w = (mft_worker *)p;
+    
+    while(1){
+        (void)NtWaitForSingleObject(w->hStartEvent,FALSE,NULL);
+        if(w->quit) break;
+        analyze_file_records(w->buffer,w->vcn,w->first,w->last,&w->sp);
+        (void)NtSetEvent(w->hDoneEvent,NULL);
+    }
+    
+    (void)NtSetEvent(w->hDoneEvent,NULL);
+    winx_exit_thread(0);
+    return 0;
+}
+
+/**
+ * @brief Starts threads analyzing file records,
+ * one thread per processor.
+ * @param[in] sp the scan parameters.
+ * @param[out] workers array of the threads.
+ * @return Number of threads started. Zero
+ * indicates that the records will be
+ * analyzed by the current thread.
+ * @note Each thread gathers streams
+ * into its own list, the termination and
+ * progress callbacks are never called there.
+ */
+static int start_mft_workers(mft_scan_parameters *sp,mft_worker **workers)
+{
+    SYSTEM_BASIC_INFORMATION sbi;
+    mft_worker *w;
+    NTSTATUS status;
+    int i, n;
+    
+    *workers = NULL;
+    
+    status = ZwQuerySystemInformation(SystemBasicInformation,&sbi,sizeof(sbi),NULL);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot get number of processors");
+        return 0;
+    }
+    n = min(sbi.NumberOfProcessors,MFT_MAX_THREADS);
+    if(n < 2) return 0;
+    
+    *workers = winx_tmalloc(n * sizeof(mft_worker));
+    if(*workers == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            n * sizeof(mft_worker));
+        return 0;
+    }
+    
+    for(i = 0; i < n; i++){
+        w = &(*workers)[i];
+        memcpy(&w->sp,sp,sizeof(mft_scan_parameters));
+        w->sp.filelist = &w->filelist;
+        w->sp.pcb = NULL;
+        w->sp.t = NULL;
+        w->sp.errors = 0;
+        w->sp.processed_attr_list_entries = 0;
+        memset(&w->sp.streams,0,sizeof(stream_table));
+        w->filelist = NULL;
+        w->quit = 0;
+        status = NtCreateEvent(&w->hStartEvent,STANDARD_RIGHTS_ALL | 0x1ff,
+            NULL,SynchronizationEvent,FALSE);
+        if(NT_SUCCESS(status)){
+            status = NtCreateEvent(&w->hDoneEvent,STANDARD_RIGHTS_ALL | 0x1ff,
+                NULL,SynchronizationEvent,FALSE);
+            if(!NT_SUCCESS(status)) NtClose(w->hStartEvent);
+        }
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot create event");
+            break;
+        }
+        /* each thread allocates streams from an arena of its own */
+        if(sp->arena){
+            w->sp.arena = winx_arena_create();
+            if(w->sp.arena == NULL){
+                NtClose(w->hStartEvent);
+                NtClose(w->hDoneEvent);
+                break;
+            }
+        }
+        if(winx_create_thread(mft_worker_thread,(PVOID)w) < 0){
+            NtClose(w->hStartEvent);
+            NtClose(w->hDoneEvent);
+            winx_arena_merge(sp->arena,w->sp.arena);
+            break;
+        }
+    }
+    
+    if(i < 2){
+        stop_mft_workers(*workers,i,sp);
+        *workers = NULL;
+        return 0;
+    }
+    
+    itrace("%u threads will analyze file records",i);
+    return i;
+}
+
+/**
+ * @brief Stops threads started by start_mft_workers.
+ * @details Collects blocks allocated by the threads
+ * in the arena of the scan.
+ */
+static void stop_mft_workers(mft_worker *workers,int n,mft_scan_parameters *sp)
+{
+    int i;
+    
+    for(i = 0; i < n; i++){
+        workers[i].quit = 1;
+        (void)NtSetEvent(workers[i].hStartEvent,NULL);
+    }
+    for(i = 0; i < n; i++){
+        (void)NtWaitForSingleObject(workers[i].hDoneEvent,FALSE,NULL);
+        NtClose(workers[i].hStartEvent);
+        NtClose(workers[i].hDoneEvent);
+        /* normally the lists are empty here */
+        destroy_stream_table(&workers[i].sp.streams,workers[i].sp.arena);
+        winx_ftw_release(workers[i].filelist,workers[i].sp.arena);
+        winx_arena_merge(sp->arena,workers[i].sp.arena);
+    }
+    winx_free(workers);
+}
+
+/**
+ * @brief Analyzes file records of a chunk
+ * of the MFT by a few threads simultaneously.
+ * @details Each thread analyzes a contiguous range
+ * of records, the lowest range is assigned to the first
+ * thread. Child records are always retrieved by the
+ * thread owning the base record, wherever they are.
+ * Then the lists of streams gathered by the threads are
+ * attached to the beginning of the common list: as well
+ * as the records are analyzed from the end of the MFT
+ * to its beginning, this keeps the list sorted by the
+ * base mft index, exactly as the single threaded
+ * analysis does.
+ */
+static void analyze_file_records_in_parallel(char *buffer,ULONGLONG vcn,
+        ULONGLONG first,ULONGLONG last,mft_worker *workers,int n,
+        mft_scan_parameters *sp)
+{
+    ULONGLONG records_per_thread;
+    winx_file_info *f, *head, *tail;
+    mft_worker *w;
+    int i, used;
+    
+    records_per_thread = (last - first) / n + 1;
+    for(i = 0, used = 0; i < n; i++, used++){
+        w = &workers[i];
+        w->buffer = buffer;
+        w->vcn = vcn;
+        w->first = first + i * records_per_thread;
+        if(w->first > last) break;
+        w->last = min(w->first + records_per_thread - 1,last);
+        (void)NtSetEvent(w->hStartEvent,NULL);
+    }
+    
+    for(i = used - 1; i >= 0; i--){
+        w = &workers[i];
+        (void)NtWaitForSingleObject(w->hDoneEvent,FALSE,NULL);
+        sp->errors += w->sp.errors;
+        sp->processed_attr_list_entries += w->sp.processed_attr_list_entries;
+        w->sp.errors = 0;
+        w->sp.processed_attr_list_entries = 0;
+        if(w->filelist == NULL) continue;
+        
+        /* call the progress callback */
+        if(sp->pcb){
+            for(f = w->filelist; f != NULL; f = f->next){
+                sp->pcb(f,sp->user_defined_data);
+                if(f->next == w->filelist) break;
+            }
+        }
+        
+        /* attach the list to the beginning of the common list */
+        if(*sp->filelist){
+            head = *sp->filelist;
+            tail = w->filelist->prev;
+            head->prev->next = w->filelist;
+            w->filelist->prev = head->prev;
+            tail->next = head;
+            head->prev = tail;
+        }
+        *sp->filelist = w->filelist;
+        w->filelist = NULL;
+        merge_stream_tables(&sp->streams,&w->sp.streams);
+    }
+}
+
+/**
+ * @brief Retrieves file records of the specified range
+ * one by one through FSCTL_GET_NTFS_FILE_RECORD.
+ * @details Used when the MFT cannot be read directly.
+ */
+static void scan_mft_range_by_fsctl(ULONGLONG first,ULONGLONG last,
+        mft_scan_parameters *sp)
+{
+    NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob;
+    ULONGLONG mft_id;
+    NTSTATUS status;
+    
+    nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
+    if(nfrob == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sp->ml.file_record_buffer_size);
+        sp->errors ++;
+        return;
+    }
+    
+    for(mft_id = last; !ftw_ntfs_check_for_termination(sp); mft_id --){
+        if(is_file_record_in_use(mft_id,sp)){
+            status = get_file_record(mft_id,nfrob,sp);
+            /* records not in use are substituted by the preceding ones */
+            if(NT_SUCCESS(status) && GetMftIdFromFRN(nfrob->FileReferenceNumber) == mft_id)
+                analyze_file_record(mft_id,(FILE_RECORD_HEADER *)nfrob->FileRecordBuffer,sp);
+        }
+        if(mft_id == first) break;
+    }
+    
+    winx_free(nfrob);
+}
+
+/**
+ * @brief Determines the next chunk of the MFT
+ * containing file records in use.
+ * @return Nonzero value if the chunk is found,
+ * zero indicates the end of the MFT.
+ */
+static int get_next_mft_chunk(mft_reader *r,mft_chunk *c)
+{
+    mft_scan_parameters *sp = r->sp;
+    ULONGLONG first, last, lo, hi;
+    
+    while(!r->eof){
+        first = r->next;
+        last = min(first + r->records_per_chunk,sp->ml.number_of_file_records) - 1;
+        if(first == 0) r->eof = 1;
+        else r->next -= r->records_per_chunk;
+        
+        /* skip unused records at both ends of the chunk */
+        for(lo = first; lo <= last && !is_file_record_in_use(lo,sp); lo++){}
+        for(hi = last; hi > lo && !is_file_record_in_use(hi,sp); hi--){}
+        
+        if(lo <= last){
+            c->first = lo;
+            c->last = hi;
+            c->vcn = lo * sp->ml.file_record_size / sp->ml.cluster_size;
+            c->length = ((hi + 1) * sp->ml.file_record_size + \
+                sp->ml.cluster_size - 1) / sp->ml.cluster_size - c->vcn;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the next chunk of the MFT.
+ * @note c->eof is set when no more chunks left.
+ */
+static void read_next_mft_chunk(mft_reader *r,mft_chunk *c)
+{
+    ULONGLONG time;
+    
+    c->eof = get_next_mft_chunk(r,c) ? 0 : 1;
+    if(c->eof) return;
+    
+    time = winx_xtime();
+    c->status = read_mft_clusters(c->vcn,c->length,c->aligned_buffer,r->sp);
+    r->io_time += winx_xtime() - time;
+}
+
+static DWORD WINAPI mft_reader_thread(LPVOID p)
+{
+    mft_reader *r = (mft_reader *)p;
+    mft_chunk *c;
+    ULONGLONG time;
+    int i = 0;
+    
+    while(1){
+        c = &r->chunks[i];
+        time = winx_xtime();
+        (void)NtWaitForSingleObject(c->hEmptyEvent,FALSE,NULL);
+        r->parse_stall += winx_xtime() - time;
+        if(r->quit) break;
+        read_next_mft_chunk(r,c);
+        (void)NtSetEvent(c->hFullEvent,NULL);
+        if(c->eof) break;
+        i = (i + 1) % r->depth;
+    }
+    
+    (void)NtSetEvent(r->hDoneEvent,NULL);
+    winx_exit_thread(0);
+    return 0;
+}
+
+/**
+ * @brief Closes events of the queue of chunks.
+ */
+static void close_mft_reader_events(mft_reader *r)
+{
+    int i;
+    
+    for(i = 0; i < r->depth; i++){
+        if(r->chunks[i].hFullEvent) NtClose(r->chunks[i].hFullEvent);
+        if(r->chunks[i].hEmptyEvent) NtClose(r->chunks[i].hEmptyEvent);
+        r->chunks[i].hFullEvent = r->chunks[i].hEmptyEvent = NULL;
+    }
+    if(r->hDoneEvent) NtClose(r->hDoneEvent);
+    r->hDoneEvent = NULL;
+}
+
+/**
+ * @brief Starts a thread reading
+ * chunks of the MFT in advance.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+static int start_mft_reader(mft_reader *r)
+{
+    NTSTATUS status;
+    int i;
+    
+    for(i = 0; i < r->depth; i++){
+        /* all the chunks are empty initially */
+        status = NtCreateEvent(&r->chunks[i].hEmptyEvent,
+            STANDARD_RIGHTS_ALL | 0x1ff,NULL,SynchronizationEvent,TRUE);
+        if(!NT_SUCCESS(status)){
+            r->chunks[i].hEmptyEvent = NULL;
+            goto fail;
+        }
+        status = NtCreateEvent(&r->chunks[i].hFullEvent,
+            STANDARD_RIGHTS_ALL | 0x1ff,NULL,SynchronizationEvent,FALSE);
+        if(!NT_SUCCESS(status)){
+            r->chunks[i].hFullEvent = NULL;
+            goto fail;
+        }
+    }
+    status = NtCreateEvent(&r->hDoneEvent,
+        STANDARD_RIGHTS_ALL | 0x1ff,NULL,NotificationEvent,FALSE);
+    if(!NT_SUCCESS(status)){
+        r->hDoneEvent = NULL;
+        goto fail;
+    }
+    
+    if(winx_create_thread(mft_reader_thread,(PVOID)r) < 0){
+        close_mft_reader_events(r);
+        return (-1);
+    }
+    return 0;
+    
+fail:
+    strace(status,"cannot create event");
+    close_mft_reader_events(r);
+    return (-1);
+}
+
+/**
+ * @brief Stops the thread started by start_mft_reader.
+ */
+static void stop_mft_reader(mft_reader *r)
+{
+    int i;
+    
+    r->quit = 1;
+    for(i = 0; i < r->depth; i++)
+        (void)NtSetEvent(r->chunks[i].hEmptyEvent,NULL);
+    (void)NtWaitForSingleObject(r->hDoneEvent,FALSE,NULL);
+    close_mft_reader_events(r);
+}
+
+/**
+ * @brief Analyzes file records of a chunk of the MFT.
+ * @note If the chunk cannot be read, its records
+ * are retrieved one by one through FSCTL.
+ */
+static void analyze_mft_chunk(mft_chunk *c,mft_worker *workers,
+        int n_workers,mft_scan_parameters *sp)
+{
+    if(NT_SUCCESS(c->status)){
+        if(n_workers){
+            analyze_file_records_in_parallel(c->aligned_buffer,c->vcn,
+                c->first,c->last,workers,n_workers,sp);
+        } else {
+            analyze_file_records(c->aligned_buffer,c->vcn,c->first,c->last,sp);
+        }
+    } else {
+        strace(c->status,"cannot read mft clusters %I64u - %I64u",
+            c->vcn,c->vcn + c->length - 1);
+        scan_mft_range_by_fsctl(c->first,c->last,sp);
+    }
+}
+
+/**
+ * @brief Scans the MFT by reading it
+ * directly from the disk in large chunks.
+ * @details File records are analyzed from the
+ * end of the MFT to its beginning, as well as in
+ * scan_mft_by_fsctl. Unused records are skipped
+ * in accordance with $MFT::$BITMAP.
+ *
+ * Whenever the queue depth requested through
+ * WINX_FTW_MFT_QUEUE_DEPTH exceeds one, a dedicated
+ * thread reads the next chunks while the current one
+ * is being analyzed; time spent by each side waiting
+ * for the other is reported to the log.
+ * @return Zero for success, negative value
+ * indicates that the MFT cannot be read directly.
+ */
+static int scan_mft_directly(mft_scan_parameters *sp)
+{
+    ULONGLONG chunk_size;
+    ULONGLONG chunks = 0, bytes = 0;
+    ULONGLONG start_time, time, io_stall = 0;
+    mft_reader r;
+    mft_chunk *c;
+    mft_worker *workers;
+    int n_workers;
+    int i, pipelined;
+    
+    if(sp->mft_blockmap == NULL)
+        return (-1);
+    if(sp->ml.file_record_size % NTFS_USA_STRIDE){
+        etrace("unexpected file record size %u",sp->ml.file_record_size);
+        return (-1);
+    }
+    
+    /* chunks consist of whole clusters and whole records */
+    chunk_size = MFT_CHUNK_SIZE;
+    if(chunk_size < sp->ml.cluster_size) chunk_size = sp->ml.cluster_size;
+    if(chunk_size < sp->ml.file_record_size) chunk_size = sp->ml.file_record_size;
+    
+    memset(&r,0,sizeof(mft_reader));
+    r.sp = sp;
+    r.records_per_chunk = chunk_size / sp->ml.file_record_size;
+    r.depth = (sp->flags & WINX_FTW_MFT_QUEUE_DEPTH_MASK) >> 8;
+    if(r.depth == 0) r.depth = MFT_DEFAULT_QUEUE_DEPTH;
+    r.chunks = winx_tmalloc(r.depth * sizeof(mft_chunk));
+    if(r.chunks == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            r.depth * sizeof(mft_chunk));
+        return (-1);
+    }
+    memset(r.chunks,0,r.depth * sizeof(mft_chunk));
+    
+    /* raw disk reads need buffers to be aligned */
+    for(i = 0; i < r.depth; i++){
+        c = &r.chunks[i];
+        c->buffer = winx_tmalloc((SIZE_T)chunk_size + sp->ml.sector_size);
+        if(c->buffer == NULL){
+            etrace("cannot allocate %I64u bytes of memory",
+                chunk_size + sp->ml.sector_size);
+            break;
+        }
+        c->aligned_buffer = (char *)(((ULONG_PTR)c->buffer + sp->ml.sector_size - 1) \
+            & ~(ULONG_PTR)(sp->ml.sector_size - 1));
+    }
+    if(i == 0){
+        winx_free(r.chunks);
+        return (-1);
+    }
+    r.depth = i;
+    
+    load_mft_bitmap(sp);
+    itrace("direct mft reading started, %I64u bytes per chunk, %s",
+        chunk_size,sp->mft_bitmap ? "mft bitmap available" : "no mft bitmap");
+    n_workers = start_mft_workers(sp,&workers);
+    
+    sp->mft_scan_direction = MFT_SCAN_RTL;
+    r.next = (sp->ml.number_of_file_records - 1) / r.records_per_chunk * r.records_per_chunk;
+    pipelined = (r.depth > 1 && start_mft_reader(&r) == 0) ? 1 : 0;
+    if(pipelined) itrace("%u chunks of mft will be read in advance",r.depth - 1);
+    
+    start_time = winx_xtime();
+    for(i = 0; !ftw_ntfs_check_for_termination(sp); i = (i + 1) % r.depth){
+        c = &r.chunks[i];
+        if(pipelined){
+            time = winx_xtime();
+            (void)NtWaitForSingleObject(c->hFullEvent,FALSE,NULL);
+            io_stall += winx_xtime() - time;
+        } else {
+            read_next_mft_chunk(&r,c);
+        }
+        if(c->eof) break;
+        if(NT_SUCCESS(c->status))
+            chunks ++, bytes += c->length * sp->ml.cluster_size;
+        analyze_mft_chunk(c,workers,n_workers,sp);
+        if(pipelined) (void)NtSetEvent(c->hEmptyEvent,NULL);
+    }
+    
+    if(pipelined){
+        stop_mft_reader(&r);
+        itrace("mft read in %I64u ms, analysis stalled on i/o for %I64u ms, " \
+            "i/o stalled on analysis for %I64u ms",r.io_time,io_stall,r.parse_stall);
+    } else {
+        itrace("mft read in %I64u ms, analyzed in %I64u ms",
+            r.io_time,winx_xtime() - start_time - r.io_time);
+    }
+    itrace("%I64u chunks of mft read, %I64u bytes totally",chunks,bytes);
+    if(n_workers) stop_mft_workers(workers,n_workers,sp);
+    for(i = 0; i < r.depth; i++) winx_free(r.chunks[i].buffer);
+    winx_free(r.chunks);
+    return 0;
+}
+
+/**
+ * @brief Scans the MFT by retrieving each file
+ * record through FSCTL_GET_NTFS_FILE_RECORD.
+ * @return Zero for success, negative value otherwise.
+ */
+static int scan_mft_by_fsctl(mft_scan_parameters *sp)
+{
+    NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob;
+    ULONGLONG mft_id, ret_mft_id;
+    NTSTATUS status;
+    
+    /* allocate memory */
+    nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
+    if(nfrob == NULL){
         etrace("cannot allocate %u bytes of memory",
             sp->ml.file_record_buffer_size);
         return (-1);
@@ -1656,7 +2710,7 @@ fail:
             if(mft_id == 0){
                 strace(status,"get_file_record for $Mft failed");
                 winx_free(nfrob);
-                goto fail;
+                return (-1);
             }
             /* it returns 0xc000000d (invalid parameter) for non existing records */
             mft_id --; /* try to retrieve the previous record */
@@ -1666,7 +2720,7 @@ fail:
         /* analyze the file record */
         ret_mft_id = GetMftIdFromFRN(nfrob->FileReferenceNumber);
         //trace(D"NTFS record found, id = %I64u",ret_mft_id);
-        analyze_file_record(nfrob,sp);
+        analyze_file_record(ret_mft_id,(FILE_RECORD_HEADER *)nfrob->FileRecordBuffer,sp);
 
         /* go to the next record */
         if(ret_mft_id == 0 || mft_id == 0)
@@ -1679,6 +2733,61 @@ fail:
             mft_id = ret_mft_id - 1;
         }
     }
+    
+    winx_free(nfrob);
+    return 0;
+}
+
+/**
+ * @brief Releases resources
+ * allocated by get_mft_layout.
+ */
+static void release_mft_layout(mft_scan_parameters *sp)
+{
+    winx_list_destroy((list_entry **)(void *)&sp->mft_blockmap);
+    winx_list_destroy((list_entry **)(void *)&sp->mft_bitmap_blockmap);
+    winx_free(sp->mft_bitmap);
+    sp->mft_bitmap = NULL;
+}
+
+/*
+**************************************************
+*       NTFS scan entry point and helpers
+**************************************************
+*/
+
+/**
+ * @brief Scans the entire MFT and adds
+ * all files found to the list of files.
+ * @return Zero for success, -1 indicates failure,
+ * -2 indicates termination requested by the caller.
+ * @note sp->f_volume must be set before this call.
+ */
+static int scan_mft(mft_scan_parameters *sp)
+{
+    ULONGLONG start_time;
+    int result;
+    
+    itrace("mft scan started");
+    start_time = winx_xtime();
+    
+#ifdef TEST_NTFS_SCANNER
+    dtrace("NTFS SCANNER TEST STARTED");
+    srnd(1);
+#endif
+    
+    /* get mft layout */
+    if(get_mft_layout(sp) < 0){
+fail:
+        etrace("mft scan failed");
+        return (-1);
+    }
+
+    /* scan all file records, read the mft directly whenever possible */
+    if(scan_mft_directly(sp) < 0){
+        itrace("mft cannot be read directly, file records will be retrieved one by one");
+        if(scan_mft_by_fsctl(sp) < 0) goto fail;
+    }
 
     itrace("%u attribute list entries have been processed totally",
         sp->processed_attr_list_entries);
@@ -1688,8 +2797,6 @@ fail:
     /* build full paths */
     result = build_full_paths(sp);
 
-    winx_free(nfrob);
-
 #ifdef TEST_NTFS_SCANNER
     dtrace("NTFS SCANNER TEST PASSED");
 #endif
@@ -1709,7 +2816,8 @@ fail:
 static int ntfs_scan_disk_helper(char volume_letter,
     int flags, ftw_filter_callback fcb,
     ftw_progress_callback pcb, ftw_terminator t,
-    void *user_defined_data, winx_file_info **filelist)
+    void *user_defined_data, winx_file_info **filelist,
+    winx_arena *arena)
 {
     wchar_t path[] = L"\\??\\A:";
     int result;
@@ -1717,6 +2825,7 @@ static int ntfs_scan_disk_helper(char volume_letter,
     winx_file_info *f;
     
     sp.filelist = filelist;
+    sp.arena = arena;
     sp.volume_letter = volume_letter;
     sp.processed_attr_list_entries = 0;
     sp.errors = 0;
@@ -1725,6 +2834,11 @@ static int ntfs_scan_disk_helper(char volume_letter,
     sp.pcb = pcb;
     sp.t = t;
     sp.user_defined_data = user_defined_data;
+    sp.mft_blockmap = NULL;
+    sp.mft_bitmap_blockmap = NULL;
+    sp.mft_bitmap_size = 0;
+    sp.mft_bitmap = NULL;
+    memset(&sp.streams,0,sizeof(stream_table));
     
     /* open the volume for read access */
     path[4] = winx_toupper(volume_letter);
@@ -1734,6 +2848,8 @@ static int ntfs_scan_disk_helper(char volume_letter,
     
     /* scan mft directly -> add all files to the list */
     result = scan_mft(&sp);
+    release_mft_layout(&sp);
+    destroy_stream_table(&sp.streams,sp.arena);
     if(result < 0){
         winx_fclose(sp.f_volume);
         return result;
@@ -1742,7 +2858,7 @@ static int ntfs_scan_disk_helper(char volume_letter,
     /* call the filter callback for each file found */
     for(f = *filelist; f != NULL; f = f->next){
         if(ftw_ntfs_check_for_termination(&sp)) break;
-        validate_blockmap(f);
+        validate_blockmap(f,sp.arena);
         if(fcb) (void)fcb(f,sp.user_defined_data);
         if(f->next == *filelist) break;
     }
@@ -1766,14 +2882,14 @@ static int ntfs_scan_disk_helper(char volume_letter,
  */
 winx_file_info *ntfs_scan_disk(char volume_letter,
     int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
-    ftw_terminator t, void *user_defined_data)
+    ftw_terminator t, void *user_defined_data, winx_arena *arena)
 {
     winx_file_info *filelist = NULL;
     
-    if(ntfs_scan_disk_helper(volume_letter,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    if(ntfs_scan_disk_helper(volume_letter,flags,fcb,pcb,t,user_defined_data,&filelist,arena) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy the list */
-        winx_ftw_release(filelist);
+        winx_ftw_release(filelist,arena);
         return NULL;
     }
         
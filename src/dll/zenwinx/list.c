@@ -39,6 +39,19 @@
  * and returns NULL afterwards.
  */
 list_entry *winx_list_insert(list_entry **phead,list_entry *prev,long size)
+{
+    return winx_list_insert_ex(phead,prev,size,NULL);
+}
+
+/**
+ * @brief winx_list_insert analog
+ * allocating the item from an arena.
+ * @param[in] arena the arena; NULL
+ * forces to use the global heap.
+ * @note All the items of the list must
+ * be allocated from the same arena.
+ */
+list_entry *winx_list_insert_ex(list_entry **phead,list_entry *prev,long size,winx_arena *arena)
 {
     list_entry *new_item;
     
@@ -50,7 +63,9 @@ list_entry *winx_list_insert(list_entry **phead,list_entry *prev,long size)
     if(size < sizeof(list_entry))
         return NULL;
 
-    new_item = (list_entry *)winx_malloc(size);
+    new_item = (list_entry *)winx_arena_alloc(arena,size);
+    if(new_item == NULL)
+        return NULL;
 
     /* is list empty? */
     if(*phead == NULL){
@@ -80,6 +95,18 @@ list_entry *winx_list_insert(list_entry **phead,list_entry *prev,long size)
  * @param[in] item pointer to the item to be removed.
  */
 void winx_list_remove(list_entry **phead,list_entry *item)
+{
+    winx_list_remove_ex(phead,item,0,NULL);
+}
+
+/**
+ * @brief winx_list_remove analog
+ * returning the item to an arena.
+ * @param[in] size size of the item, in bytes.
+ * @param[in] arena the arena the item
+ * has been allocated from.
+ */
+void winx_list_remove_ex(list_entry **phead,list_entry *item,long size,winx_arena *arena)
 {
     /*
     * Avoid winx_dbg_xxx calls here
@@ -94,7 +121,7 @@ void winx_list_remove(list_entry **phead,list_entry *item)
 
     /* remove alone first item? */
     if(item == *phead && item->next == *phead){
-        winx_free(item);
+        winx_arena_free(arena,item,size);
         *phead = NULL;
         return;
     }
@@ -105,7 +132,7 @@ void winx_list_remove(list_entry **phead,list_entry *item)
     }
     item->prev->next = item->next;
     item->next->prev = item->prev;
-    winx_free(item);
+    winx_arena_free(arena,item,size);
 }
 
 /**
@@ -116,6 +143,18 @@ void winx_list_remove(list_entry **phead,list_entry *item)
  * pointing to the list's head.
  */
 void winx_list_destroy(list_entry **phead)
+{
+    winx_list_destroy_ex(phead,0,NULL);
+}
+
+/**
+ * @brief winx_list_destroy analog
+ * returning all the items to an arena.
+ * @param[in] size size of each item, in bytes.
+ * @param[in] arena the arena the items
+ * have been allocated from.
+ */
+void winx_list_destroy_ex(list_entry **phead,long size,winx_arena *arena)
 {
     list_entry *item, *next, *head;
     
@@ -127,7 +166,7 @@ void winx_list_destroy(list_entry **phead)
 
     do {
         next = item->next;
-        winx_free(item);
+        winx_arena_free(arena,item,size);
         item = next;
     } while (next != head);
 
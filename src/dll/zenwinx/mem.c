@@ -140,4 +140,313 @@ void winx_destroy_global_heap(void)
     }
 }
 
+/*
+* Arenas serve small blocks of a few fixed sizes
+* (file list entries, maps of file blocks, volume
+* regions) from large chunks of the global heap.
+* Released blocks are kept in lists of their size
+* class for reuse; the chunks themselves are
+* released all at once when the arena gets
+* destroyed. Arenas aren't thread safe: each
+* thread needs an arena of its own.
+*/
+#define ARENA_CHUNK_SIZE        (256 * 1024)
+#define ARENA_MAX_BLOCK_SIZE    (WINX_ARENA_GRANULARITY * WINX_ARENA_SIZE_CLASSES)
+
+typedef struct _arena_chunk {
+    struct _arena_chunk *next;
+} arena_chunk;
+
+/* keeps blocks aligned on the granularity boundary */
+#define ARENA_CHUNK_HEADER_SIZE \
+    ((sizeof(arena_chunk) + WINX_ARENA_GRANULARITY - 1) & ~(WINX_ARENA_GRANULARITY - 1))
+
+/**
+ * @brief Creates an arena.
+ * @return The arena, NULL indicates failure.
+ */
+winx_arena *winx_arena_create(void)
+{
+    winx_arena *arena;
+    
+    arena = winx_tmalloc(sizeof(winx_arena));
+    if(arena == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sizeof(winx_arena));
+        return NULL;
+    }
+    memset(arena,0,sizeof(winx_arena));
+    return arena;
+}
+
+/**
+ * @brief Allocates a block of memory from an arena.
+ * @param[in] arena the arena. If this parameter
+ * is NULL, the block gets allocated by winx_malloc.
+ * @param[in] size size of the block, in bytes.
+ * @return The address of the allocated block.
+ * NULL indicates failure.
+ * @note Blocks larger than the largest size class
+ * are allocated by winx_malloc as well, they must
+ * be released explicitly.
+ */
+void *winx_arena_alloc(winx_arena *arena,size_t size)
+{
+    arena_chunk *chunk;
+    void *block;
+    int i;
+    
+    if(arena == NULL) return winx_malloc(size);
+    
+    if(size == 0 || size > ARENA_MAX_BLOCK_SIZE){
+        block = winx_malloc(size);
+        if(block){
+            arena->allocations ++;
+            arena->heap_allocations ++;
+        }
+        return block;
+    }
+    
+    i = (int)((size - 1) / WINX_ARENA_GRANULARITY);
+    size = (i + 1) * WINX_ARENA_GRANULARITY;
+    
+    /* reuse a released block if possible */
+    block = arena->free_blocks[i];
+    if(block){
+        arena->free_blocks[i] = *(void **)block;
+    } else {
+        if(arena->available < size){
+            /* the rest of the current chunk gets lost */
+            chunk = winx_malloc(ARENA_CHUNK_SIZE);
+            if(chunk == NULL) return NULL;
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+            arena->top = (char *)chunk + ARENA_CHUNK_HEADER_SIZE;
+            arena->available = ARENA_CHUNK_SIZE - ARENA_CHUNK_HEADER_SIZE;
+            arena->heap_allocations ++;
+            arena->bytes_reserved += ARENA_CHUNK_SIZE;
+        }
+        block = arena->top;
+        arena->top += size;
+        arena->available -= size;
+    }
+    
+    arena->allocations ++;
+    arena->bytes_in_use += size;
+    if(arena->bytes_in_use > arena->peak_bytes_in_use)
+        arena->peak_bytes_in_use = arena->bytes_in_use;
+    return block;
+}
+
+/**
+ * @brief Releases a block allocated
+ * by winx_arena_alloc.
+ * @param[in] arena the arena.
+ * @param[in] block the block.
+ * @param[in] size size of the block, exactly
+ * as requested from winx_arena_alloc.
+ */
+void winx_arena_free(winx_arena *arena,void *block,size_t size)
+{
+    int i;
+    
+    if(block == NULL) return;
+    
+    if(arena == NULL){
+        winx_free(block);
+        return;
+    }
+    
+    arena->releases ++;
+    if(size == 0 || size > ARENA_MAX_BLOCK_SIZE){
+        winx_free(block);
+        return;
+    }
+    
+    i = (int)((size - 1) / WINX_ARENA_GRANULARITY);
+    *(void **)block = arena->free_blocks[i];
+    arena->free_blocks[i] = block;
+    arena->bytes_in_use -= (i + 1) * WINX_ARENA_GRANULARITY;
+}
+
+/**
+ * @brief Moves all the blocks of an arena
+ * to another one and destroys the former.
+ * @details Used to collect blocks allocated
+ * by a few threads in a single arena.
+ * @param[in,out] arena the destination arena.
+ * @param[in] src the arena to be merged.
+ */
+void winx_arena_merge(winx_arena *arena,winx_arena *src)
+{
+    arena_chunk *chunk;
+    void *block;
+    int i;
+    
+    if(arena == NULL || src == NULL) return;
+    
+    /* attach the chunks */
+    if(src->chunks){
+        for(chunk = src->chunks; chunk->next; chunk = chunk->next) {}
+        chunk->next = arena->chunks;
+        arena->chunks = src->chunks;
+    }
+    
+    /* attach the released blocks */
+    for(i = 0; i < WINX_ARENA_SIZE_CLASSES; i++){
+        block = src->free_blocks[i];
+        if(block == NULL) continue;
+        while(*(void **)block) block = *(void **)block;
+        *(void **)block = arena->free_blocks[i];
+        arena->free_blocks[i] = src->free_blocks[i];
+    }
+    
+    /* the rest of the current chunk of src gets lost */
+    arena->allocations += src->allocations;
+    arena->releases += src->releases;
+    arena->heap_allocations += src->heap_allocations;
+    arena->bytes_in_use += src->bytes_in_use;
+    if(arena->bytes_in_use > arena->peak_bytes_in_use)
+        arena->peak_bytes_in_use = arena->bytes_in_use;
+    arena->bytes_reserved += src->bytes_reserved;
+    winx_free(src);
+}
+
+/**
+ * @brief Destroys an arena.
+ * @details Releases all the blocks allocated from
+ * the arena at once, except of those larger than
+ * the largest size class.
+ */
+void winx_arena_destroy(winx_arena *arena)
+{
+    arena_chunk *chunk, *next;
+    
+    if(arena == NULL) return;
+    
+    itrace("%I64u blocks allocated, %I64u released, %I64u heap allocations",
+        arena->allocations,arena->releases,arena->heap_allocations);
+    itrace("peak usage: %I64u bytes, %I64u bytes reserved",
+        arena->peak_bytes_in_use,arena->bytes_reserved);
+
+    for(chunk = arena->chunks; chunk; chunk = next){
+        next = chunk->next;
+        winx_free(chunk);
+    }
+    winx_free(arena);
+}
+
+/*
+* Pooled binary trees take both their nodes and
+* their items from an arena of their own. Every
+* slot of the pool is of the same size, large enough
+* to hold a node, an item or the tree itself, so
+* the libavl allocator interface, which doesn't pass
+* sizes on release, can be served by the arena.
+* Destruction of a pooled tree releases the chunks
+* of the arena, without walking the tree.
+*/
+typedef struct _tree_pool {
+    struct libavl_allocator allocator; /* must be the first member */
+    winx_arena *arena;
+    size_t slot_size;
+} tree_pool;
+
+static void *tree_pool_malloc(struct libavl_allocator *allocator,size_t size)
+{
+    tree_pool *pool = (tree_pool *)allocator;
+    
+    if(size > pool->slot_size) return NULL;
+    return winx_arena_alloc(pool->arena,pool->slot_size);
+}
+
+static void tree_pool_free(struct libavl_allocator *allocator,void *block)
+{
+    tree_pool *pool = (tree_pool *)allocator;
+    
+    winx_arena_free(pool->arena,block,pool->slot_size);
+}
+
+/**
+ * @brief Creates a binary tree taking
+ * its nodes and items from a pool.
+ * @param[in] compare the comparison function.
+ * @param[in] param the parameter to be passed
+ * to the comparison function.
+ * @param[in] item_size size of the items to be
+ * allocated by winx_prb_alloc_item; zero if the
+ * items are allocated by the caller.
+ * @return The tree, NULL indicates failure.
+ * @note The tree must be destroyed by
+ * winx_prb_destroy_pooled.
+ */
+struct prb_table *winx_prb_create_pooled(prb_comparison_func *compare,
+    void *param,size_t item_size)
+{
+    struct prb_table *tree;
+    tree_pool *pool;
+    
+    pool = winx_tmalloc(sizeof(tree_pool));
+    if(pool == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sizeof(tree_pool));
+        return NULL;
+    }
+    pool->allocator.libavl_malloc = tree_pool_malloc;
+    pool->allocator.libavl_free = tree_pool_free;
+    pool->slot_size = max(item_size,max(sizeof(struct prb_node),sizeof(struct prb_table)));
+    if(pool->slot_size > ARENA_MAX_BLOCK_SIZE){
+        etrace("items of %u bytes cannot be pooled",item_size);
+        winx_free(pool);
+        return NULL;
+    }
+    pool->arena = winx_arena_create();
+    if(pool->arena == NULL){
+        winx_free(pool);
+        return NULL;
+    }
+    
+    tree = prb_create(compare,param,&pool->allocator);
+    if(tree == NULL){
+        etrace("cannot create the tree");
+        winx_arena_destroy(pool->arena);
+        winx_free(pool);
+    }
+    return tree;
+}
+
+/**
+ * @brief Allocates an item of a pooled tree.
+ * @return The item, NULL indicates failure.
+ */
+void *winx_prb_alloc_item(struct prb_table *tree)
+{
+    return tree_pool_malloc(tree->prb_alloc,
+        ((tree_pool *)tree->prb_alloc)->slot_size);
+}
+
+/**
+ * @brief Releases an item of a pooled tree.
+ */
+void winx_prb_free_item(struct prb_table *tree,void *item)
+{
+    if(item) tree_pool_free(tree->prb_alloc,item);
+}
+
+/**
+ * @brief Destroys a pooled binary tree.
+ * @details All the nodes and items
+ * get released at once.
+ */
+void winx_prb_destroy_pooled(struct prb_table *tree)
+{
+    tree_pool *pool;
+    
+    if(tree == NULL) return;
+    pool = (tree_pool *)tree->prb_alloc;
+    itrace("%u items were in the tree",tree->prb_count);
+    winx_arena_destroy(pool->arena);
+    winx_free(pool);
+}
+
 /** @} */
@@ -1327,12 +1327,15 @@ VOID        NTAPI    RtlFreeUnicodeString(PUNICODE_STRING);
 NTSTATUS    NTAPI    RtlGetVersion(OSVERSIONINFOW *);
 VOID        NTAPI    RtlInitAnsiString(PANSI_STRING,PCSZ);
 VOID        NTAPI    RtlInitUnicodeString(PUNICODE_STRING,PCWSTR);
+NTSTATUS    NTAPI    RtlLocalTimeToSystemTime(const LARGE_INTEGER* LocalTime,PLARGE_INTEGER SystemTime);
 PRTL_USER_PROCESS_PARAMETERS NTAPI RtlNormalizeProcessParams(RTL_USER_PROCESS_PARAMETERS*);
 ULONG       NTAPI    RtlNtStatusToDosError(NTSTATUS);
+NTSTATUS    NTAPI    RtlOemStringToUnicodeString(PUNICODE_STRING,PANSI_STRING,SIZE_T);
 NTSTATUS    NTAPI    RtlQueryEnvironmentVariable_U(PWSTR,PUNICODE_STRING,PUNICODE_STRING);
 NTSTATUS    NTAPI    RtlQueryRegistryValues(ULONG RelativeTo,PCWSTR Path,PRTL_QUERY_REGISTRY_TABLE QueryTable,PVOID Context,PVOID Environment);
 NTSTATUS    NTAPI    RtlSetEnvironmentVariable(PWSTR,PUNICODE_STRING,PUNICODE_STRING);
 NTSTATUS    NTAPI    RtlSystemTimeToLocalTime(const LARGE_INTEGER* SystemTime,PLARGE_INTEGER LocalTime);
+BOOLEAN     NTAPI    RtlTimeFieldsToTime(PTIME_FIELDS TimeFields,PLARGE_INTEGER Time);
 VOID        NTAPI    RtlTimeToTimeFields(PLARGE_INTEGER Time,PTIME_FIELDS TimeFields);
 NTSTATUS    NTAPI    RtlUnicodeStringToAnsiString(PANSI_STRING,PUNICODE_STRING,SIZE_T);
 NTSTATUS    NTAPI    RtlUnicodeToMultiByteN(PCHAR,ULONG,PULONG,PCWCH,ULONG);
@@ -41,6 +41,26 @@
 #define malloc winx_malloc
 #define free winx_free
 
+/* Recomputes augmented data of |node| from its item and its subtrees. */
+static void
+augment_node (struct prb_table *tree, struct prb_node *node)
+{
+  if (tree->prb_augment != NULL)
+    tree->prb_augment (node, tree->prb_param);
+}
+
+/* Recomputes augmented data of |node| and all its ancestors.
+   |node| may be |NULL|. */
+static void
+augment_path (struct prb_table *tree, struct prb_node *node)
+{
+  if (tree->prb_augment == NULL)
+    return;
+
+  for (; node != NULL; node = node->prb_parent)
+    tree->prb_augment (node, tree->prb_param);
+}
+
 /* Creates and returns a new table
    with comparison function |compare| using parameter |param|
    and memory allocator |allocator|.
@@ -48,6 +68,20 @@
 struct prb_table *
 prb_create (prb_comparison_func *compare, void *param,
             struct libavl_allocator *allocator)
+{
+  return prb_create_augmented (compare, param, allocator, NULL);
+}
+
+/* Creates and returns a new table like |prb_create()| does.
+   Whenever the shape of the tree or the set of items
+   in a subtree changes, |augment| is called for each node
+   affected, children first, so it can maintain summary data
+   of the node's subtree (stored in the node's item).
+   Returns |NULL| if memory allocation failed. */
+struct prb_table *
+prb_create_augmented (prb_comparison_func *compare, void *param,
+                      struct libavl_allocator *allocator,
+                      prb_augment_func *augment)
 {
   struct prb_table *tree;
 
@@ -65,6 +99,7 @@ prb_create (prb_comparison_func *compare, void *param,
   tree->prb_param = param;
   tree->prb_alloc = allocator;
   tree->prb_count = 0;
+  tree->prb_augment = augment;
 
   return tree;
 }
@@ -92,6 +127,35 @@ prb_find (const struct prb_table *tree, const void *item)
   return NULL;
 }
 
+/* Recomputes augmented data of the node holding an item matching |item|
+   and of all its ancestors.  Must be called whenever an item of
+   an augmented tree changes in a way affecting its augmented data,
+   e.g. when its length changes in place. */
+void
+prb_reaugment (struct prb_table *tree, const void *item)
+{
+  struct prb_node *p;
+
+  assert (tree != NULL && item != NULL);
+  if (tree->prb_augment == NULL)
+    return;
+
+  for (p = tree->prb_root; p != NULL; )
+    {
+      int cmp = tree->prb_compare (item, p->prb_data, tree->prb_param);
+
+      if (cmp < 0)
+        p = p->prb_link[0];
+      else if (cmp > 0)
+        p = p->prb_link[1];
+      else /* |cmp == 0| */
+        {
+          augment_path (tree, p);
+          return;
+        }
+    }
+}
+
 /* Inserts |item| into |tree| and returns a pointer to |item|'s address.
    If a duplicate item is found in the tree,
    returns a pointer to the duplicate without inserting |item|.
@@ -127,6 +191,7 @@ prb_probe (struct prb_table *tree, void *item)
   else
     tree->prb_root = n;
   n->prb_color = PRB_RED;
+  augment_path (tree, n);
 
   q = n;
   for (;;)
@@ -167,6 +232,8 @@ prb_probe (struct prb_table *tree, void *item)
                   f->prb_parent = q;
                   if (f->prb_link[1] != NULL)
                     f->prb_link[1]->prb_parent = f;
+                  augment_node (tree, f);
+                  augment_node (tree, q);
 
                   f = q;
                 }
@@ -182,6 +249,8 @@ prb_probe (struct prb_table *tree, void *item)
               g->prb_parent = f;
               if (g->prb_link[0] != NULL)
                 g->prb_link[0]->prb_parent = g;
+              augment_node (tree, g);
+              augment_node (tree, f);
               break;
             }
         }
@@ -210,6 +279,8 @@ prb_probe (struct prb_table *tree, void *item)
                   f->prb_parent = q;
                   if (f->prb_link[0] != NULL)
                     f->prb_link[0]->prb_parent = f;
+                  augment_node (tree, f);
+                  augment_node (tree, q);
 
                   f = q;
                 }
@@ -225,6 +296,8 @@ prb_probe (struct prb_table *tree, void *item)
               g->prb_parent = f;
               if (g->prb_link[1] != NULL)
                 g->prb_link[1]->prb_parent = g;
+              augment_node (tree, g);
+              augment_node (tree, f);
               break;
             }
         }
@@ -259,6 +332,8 @@ prb_replace (struct prb_table *table, void *item)
     {
       void *r = *p;
       *p = item;
+      augment_path (table, (struct prb_node *)
+                    ((char *) p - offsetof (struct prb_node, prb_data)));
       return r;
     }
 }
@@ -354,6 +429,9 @@ prb_delete (struct prb_table *tree, const void *item)
         }
     }
 
+  if (f != (struct prb_node *) &tree->prb_root)
+    augment_path (tree, f);
+
   if (p->prb_color == PRB_BLACK)
     {
       for (;;)
@@ -391,6 +469,8 @@ prb_delete (struct prb_table *tree, const void *item)
 
                   w->prb_parent = f->prb_parent;
                   f->prb_parent = w;
+                  augment_node (tree, f);
+                  augment_node (tree, w);
 
                   g = w;
                   w = f->prb_link[1];
@@ -419,6 +499,8 @@ prb_delete (struct prb_table *tree, const void *item)
                         w->prb_link[0]->prb_parent = w;
                       w = f->prb_link[1] = y;
                       w->prb_link[1]->prb_parent = w;
+                      augment_node (tree, w->prb_link[1]);
+                      augment_node (tree, w);
                     }
 
                   w->prb_color = f->prb_color;
@@ -433,6 +515,8 @@ prb_delete (struct prb_table *tree, const void *item)
                   f->prb_parent = w;
                   if (f->prb_link[1] != NULL)
                     f->prb_link[1]->prb_parent = f;
+                  augment_node (tree, f);
+                  augment_node (tree, w);
                   break;
                 }
             }
@@ -451,6 +535,8 @@ prb_delete (struct prb_table *tree, const void *item)
 
                   w->prb_parent = f->prb_parent;
                   f->prb_parent = w;
+                  augment_node (tree, f);
+                  augment_node (tree, w);
 
                   g = w;
                   w = f->prb_link[0];
@@ -479,6 +565,8 @@ prb_delete (struct prb_table *tree, const void *item)
                         w->prb_link[1]->prb_parent = w;
                       w = f->prb_link[0] = y;
                       w->prb_link[0]->prb_parent = w;
+                      augment_node (tree, w->prb_link[0]);
+                      augment_node (tree, w);
                     }
 
                   w->prb_color = f->prb_color;
@@ -493,6 +581,8 @@ prb_delete (struct prb_table *tree, const void *item)
                   f->prb_parent = w;
                   if (f->prb_link[0] != NULL)
                     f->prb_link[0]->prb_parent = f;
+                  augment_node (tree, f);
+                  augment_node (tree, w);
                   break;
                 }
             }
@@ -712,6 +802,7 @@ prb_t_replace (struct prb_traverser *trav, void *new)
   assert (trav != NULL && trav->prb_node != NULL && new != NULL);
   old = trav->prb_node->prb_data;
   trav->prb_node->prb_data = new;
+  augment_path (trav->prb_table, trav->prb_node);
   return old;
 }
 
@@ -756,8 +847,9 @@ prb_copy (const struct prb_table *org, prb_copy_func *copy,
   struct prb_node *y;
 
   assert (org != NULL);
-  new = prb_create (org->prb_compare, org->prb_param,
-                    allocator != NULL ? allocator : org->prb_alloc);
+  new = prb_create_augmented (org->prb_compare, org->prb_param,
+                              allocator != NULL ? allocator : org->prb_alloc,
+                              org->prb_augment);
   if (new == NULL)
     return NULL;
   new->prb_count = org->prb_count;
@@ -844,6 +936,168 @@ prb_copy (const struct prb_table *org, prb_copy_func *copy,
     }
 }
 
+/* Links |nodes[lo]| ... |nodes[hi - 1]| into a balanced subtree
+   holding |items[lo]| ... |items[hi - 1]| in inorder, below |parent|.
+   Nodes at depth |red_depth| are colored red, all the rest black.
+   Returns the root of the subtree. */
+static struct prb_node *
+link_subtree (struct prb_table *tree, struct prb_node **nodes,
+              void **items, size_t lo, size_t hi, int depth, int red_depth,
+              struct prb_node *parent)
+{
+  struct prb_node *p;
+  size_t mid;
+
+  if (lo >= hi)
+    return NULL;
+
+  mid = lo + (hi - lo) / 2;
+  p = nodes[mid];
+  p->prb_data = items[mid];
+  p->prb_parent = parent;
+  p->prb_color = (depth == red_depth) ? PRB_RED : PRB_BLACK;
+  p->prb_link[0] = link_subtree (tree, nodes, items, lo, mid,
+                                 depth + 1, red_depth, p);
+  p->prb_link[1] = link_subtree (tree, nodes, items, mid + 1, hi,
+                                 depth + 1, red_depth, p);
+  augment_node (tree, p);
+  return p;
+}
+
+/* Links |n| nodes into |tree| holding |items| in inorder.
+   Any previous contents of |tree| must be unlinked already. */
+static void
+link_tree (struct prb_table *tree, struct prb_node **nodes,
+           void **items, size_t n)
+{
+  int height = 0;
+
+  /* Leaves of the lowest level become red,
+     so every path holds the same number of black nodes. */
+  while (((size_t) 1 << (height + 1)) <= n)
+    height++;
+
+  tree->prb_root = link_subtree (tree, nodes, items, 0, n, 0,
+                                 height > 0 ? height : -1, NULL);
+  tree->prb_count = n;
+}
+
+/* Allocates |n| nodes of |tree| into |nodes|.
+   Returns nonzero if memory allocation failed;
+   nothing remains allocated then. */
+static int
+alloc_nodes (struct prb_table *tree, struct prb_node **nodes, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    {
+      nodes[i] = tree->prb_alloc->libavl_malloc (tree->prb_alloc,
+                                                 sizeof *nodes[i]);
+      if (nodes[i] == NULL)
+        {
+          while (i > 0)
+            tree->prb_alloc->libavl_free (tree->prb_alloc, nodes[--i]);
+          return -1;
+        }
+    }
+  return 0;
+}
+
+/* Fills empty |tree| by |n| items of |items|, which must be
+   sorted in ascending order according to the comparison function
+   of |tree| and must contain no duplicates.  Takes linear time.
+   Returns zero if successful, nonzero if memory allocation failed;
+   |tree| remains empty then. */
+int
+prb_build_from_sorted (struct prb_table *tree, void **items, size_t n)
+{
+  struct prb_node **nodes;
+
+  assert (tree != NULL && tree->prb_root == NULL);
+  assert (items != NULL || n == 0);
+
+  if (n == 0)
+    return 0;
+
+  nodes = winx_tmalloc (n * sizeof *nodes);
+  if (nodes == NULL)
+    return -1;
+  if (alloc_nodes (tree, nodes, n) != 0)
+    {
+      winx_free (nodes);
+      return -1;
+    }
+
+  link_tree (tree, nodes, items, n);
+  winx_free (nodes);
+  return 0;
+}
+
+/* Inserts |n| items of |items|, sorted in ascending order and
+   containing neither duplicates nor items equal to those of |tree|,
+   into |tree|.  When the number of items is comparable to the size
+   of |tree|, merges both sequences and relinks all the nodes in
+   linear time, otherwise inserts the items one by one.
+   Returns zero if successful, nonzero if memory allocation failed;
+   some of the items may be inserted then. */
+int
+prb_merge_sorted (struct prb_table *tree, void **items, size_t n)
+{
+  struct prb_node **nodes;
+  struct prb_traverser trav;
+  void **merged, *item;
+  size_t m, total, cost, i, j, k;
+
+  assert (tree != NULL);
+  assert (items != NULL || n == 0);
+
+  m = tree->prb_count;
+  total = m + n;
+
+  /* Approximate cost of the insertions, in node visits. */
+  for (cost = 1; ((size_t) 1 << cost) < total && cost < 64; cost++)
+    ;
+  cost *= n;
+
+  nodes = NULL, merged = NULL;
+  if (cost > total)
+    {
+      nodes = winx_tmalloc (total * sizeof *nodes);
+      merged = winx_tmalloc (total * sizeof *merged);
+    }
+  if (nodes == NULL || merged == NULL
+      || alloc_nodes (tree, nodes + m, n) != 0)
+    {
+      winx_free (nodes);
+      winx_free (merged);
+      for (i = 0; i < n; i++)
+        if (prb_probe (tree, items[i]) == NULL)
+          return -1;
+      return 0;
+    }
+
+  /* Merge the items, collecting the nodes of the tree. */
+  i = j = k = 0;
+  for (item = prb_t_first (&trav, tree); item != NULL;
+       item = prb_t_next (&trav))
+    {
+      nodes[i++] = trav.prb_node;
+      while (j < n && tree->prb_compare (items[j], item,
+                                         tree->prb_param) < 0)
+        merged[k++] = items[j++];
+      merged[k++] = item;
+    }
+  while (j < n)
+    merged[k++] = items[j++];
+  assert (i == m && k == total);
+
+  link_tree (tree, nodes, merged, total);
+  winx_free (nodes);
+  winx_free (merged);
+  return 0;
+}
+
 /* Frees storage allocated for |tree|.
    If |destroy != NULL|, applies it to each data item in inorder. */
 void
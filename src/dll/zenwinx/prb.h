@@ -30,6 +30,8 @@ typedef int prb_comparison_func (const void *prb_a, const void *prb_b,
                                  void *prb_param);
 typedef void prb_item_func (void *prb_item, void *prb_param);
 typedef void *prb_copy_func (void *prb_item, void *prb_param);
+struct prb_node;
+typedef void prb_augment_func (struct prb_node *prb_node, void *prb_param);
 
 #ifndef LIBAVL_ALLOCATOR
 #define LIBAVL_ALLOCATOR
@@ -59,6 +61,7 @@ struct prb_table
     void *prb_param;                   /* Extra argument to |prb_compare|. */
     struct libavl_allocator *prb_alloc; /* Memory allocator. */
     size_t prb_count;                  /* Number of items in tree. */
+    prb_augment_func *prb_augment;     /* Subtree data maintainer or |NULL|. */
   };
 
 /* Color of a red-black node. */
@@ -87,6 +90,9 @@ struct prb_traverser
 /* Table functions. */
 struct prb_table *prb_create (prb_comparison_func *, void *,
                               struct libavl_allocator *);
+struct prb_table *prb_create_augmented (prb_comparison_func *, void *,
+                                        struct libavl_allocator *,
+                                        prb_augment_func *);
 struct prb_table *prb_copy (const struct prb_table *, prb_copy_func *,
                             prb_item_func *, struct libavl_allocator *);
 void prb_destroy (struct prb_table *, prb_item_func *);
@@ -97,6 +103,9 @@ void *prb_delete (struct prb_table *, const void *);
 void *prb_find (const struct prb_table *, const void *);
 void prb_assert_insert (struct prb_table *, void *);
 void *prb_assert_delete (struct prb_table *, void *);
+void prb_reaugment (struct prb_table *, const void *);
+int prb_build_from_sorted (struct prb_table *, void **, size_t);
+int prb_merge_sorted (struct prb_table *, void **, size_t);
 
 #define prb_count(table) ((size_t) (table)->prb_count)
 
@@ -0,0 +1,305 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2016 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file sort.c
+ * @brief Sorting.
+ * @details Arrays get split into equal parts
+ * sorted by separate threads, then the sorted
+ * parts get merged pairwise, in parallel as well.
+ * The sort is stable.
+ * @addtogroup Sorting
+ * @{
+ */
+
+#include "ntndk.h"
+#include "zenwinx.h"
+
+/*
+* Arrays shorter than this are
+* sorted by the calling thread.
+*/
+#define SERIAL_SORT_THRESHOLD 0x4000
+
+/* length of runs sorted by insertion */
+#define INSERTION_SORT_RUN 16
+
+typedef struct _sort_task {
+    char *base;             /* the array */
+    char *buffer;           /* auxiliary array of the same size */
+    size_t size;            /* size of an element */
+    ULONGLONG first;        /* the first element of the range */
+    ULONGLONG middle;       /* the first element of the second run, for merges */
+    ULONGLONG last;         /* the first element beyond the range */
+    int merge;              /* nonzero value indicates a merge of two runs */
+    winx_sort_compare cmp;  /* the comparison routine */
+    void *param;            /* parameter to be passed to the comparison routine */
+    HANDLE hDoneEvent;      /* signaled once the task is completed */
+} sort_task;
+
+/************************************************************/
+/*                    Internal Routines                     */
+/************************************************************/
+
+/**
+ * @internal
+ * @brief Retrieves number of processors.
+ */
+static int get_number_of_processors(void)
+{
+    SYSTEM_BASIC_INFORMATION sbi;
+    NTSTATUS status;
+
+    status = ZwQuerySystemInformation(SystemBasicInformation,&sbi,sizeof(sbi),NULL);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot get number of processors");
+        return 1;
+    }
+    return (int)sbi.NumberOfProcessors;
+}
+
+/**
+ * @internal
+ * @brief Merges two adjacent sorted runs.
+ * @details Merges src[first, middle) and
+ * src[middle, last) into dst[first, last).
+ */
+static void merge_runs(char *dst,char *src,sort_task *t,
+    ULONGLONG first,ULONGLONG middle,ULONGLONG last)
+{
+    ULONGLONG i = first, j = middle, k = first;
+    size_t size = t->size;
+
+    while(i < middle && j < last){
+        /* take equal elements from the left run to keep the sort stable */
+        if(t->cmp(src + j * size,src + i * size,t->param) < 0){
+            memcpy(dst + k * size,src + j * size,size); j ++;
+        } else {
+            memcpy(dst + k * size,src + i * size,size); i ++;
+        }
+        k ++;
+    }
+    if(i < middle) memcpy(dst + k * size,src + i * size,(size_t)(middle - i) * size);
+    if(j < last) memcpy(dst + k * size,src + j * size,(size_t)(last - j) * size);
+}
+
+/**
+ * @internal
+ * @brief Sorts a short range by insertion.
+ * @param[in] tmp space for a single element.
+ */
+static void insertion_sort(sort_task *t,ULONGLONG first,ULONGLONG last,char *tmp)
+{
+    size_t size = t->size;
+    char *base = t->base;
+    ULONGLONG i, j;
+
+    for(i = first + 1; i < last; i++){
+        for(j = i; j > first; j--){
+            if(t->cmp(base + (j - 1) * size,base + i * size,t->param) <= 0) break;
+        }
+        if(j == i) continue;
+        memcpy(tmp,base + i * size,size);
+        memmove(base + (j + 1) * size,base + j * size,(size_t)(i - j) * size);
+        memcpy(base + j * size,tmp,size);
+    }
+}
+
+/**
+ * @internal
+ * @brief Sorts a range of an array.
+ */
+static void sort_range(sort_task *t)
+{
+    ULONGLONG i, width, middle, last;
+    char *src = t->base, *dst = t->buffer, *p;
+    size_t size = t->size;
+
+    /* the auxiliary array is free yet, use it for swaps */
+    for(i = t->first; i < t->last; i += INSERTION_SORT_RUN){
+        insertion_sort(t,i,min(i + INSERTION_SORT_RUN,t->last),
+            t->buffer + t->first * size);
+    }
+
+    for(width = INSERTION_SORT_RUN; width < t->last - t->first; width *= 2){
+        for(i = t->first; i < t->last; i += 2 * width){
+            middle = min(i + width,t->last);
+            last = min(i + 2 * width,t->last);
+            merge_runs(dst,src,t,i,middle,last);
+        }
+        p = src; src = dst; dst = p;
+    }
+
+    if(src != t->base){
+        memcpy(t->base + t->first * size,src + t->first * size,
+            (size_t)(t->last - t->first) * size);
+    }
+}
+
+/**
+ * @internal
+ * @brief Executes a sorting task.
+ */
+static void run_task(sort_task *t)
+{
+    if(t->merge){
+        merge_runs(t->buffer,t->base,t,t->first,t->middle,t->last);
+        memcpy(t->base + t->first * t->size,t->buffer + t->first * t->size,
+            (size_t)(t->last - t->first) * t->size);
+    } else {
+        sort_range(t);
+    }
+}
+
+/**
+ * @internal
+ * @brief Executes a sorting task
+ * in a separate thread.
+ */
+static DWORD WINAPI sort_thread(LPVOID p)
+{
+    sort_task *t = (sort_task *)p;
+
+    run_task(t);
+    (void)NtSetEvent(t->hDoneEvent,NULL);
+    winx_exit_thread(0);
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Executes sorting tasks in parallel.
+ * @details The first task gets executed by the
+ * calling thread; tasks which cannot be passed
+ * to separate threads get executed there too.
+ */
+static void run_tasks(sort_task *tasks,int n)
+{
+    NTSTATUS status;
+    int i;
+
+    for(i = 1; i < n; i++){
+        tasks[i].hDoneEvent = NULL;
+        status = NtCreateEvent(&tasks[i].hDoneEvent,STANDARD_RIGHTS_ALL | 0x1ff,
+            NULL,SynchronizationEvent,FALSE);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot create event");
+            tasks[i].hDoneEvent = NULL;
+            run_task(&tasks[i]);
+            continue;
+        }
+        if(winx_create_thread(sort_thread,(PVOID)&tasks[i]) < 0){
+            NtClose(tasks[i].hDoneEvent);
+            tasks[i].hDoneEvent = NULL;
+            run_task(&tasks[i]);
+        }
+    }
+
+    run_task(&tasks[0]);
+
+    for(i = 1; i < n; i++){
+        if(tasks[i].hDoneEvent){
+            (void)NtWaitForSingleObject(tasks[i].hDoneEvent,FALSE,NULL);
+            NtClose(tasks[i].hDoneEvent);
+        }
+    }
+}
+
+/************************************************************/
+/*                     Public Routines                      */
+/************************************************************/
+
+/**
+ * @brief Sorts an array, in parallel.
+ * @param[in,out] base the array.
+ * @param[in] n number of elements.
+ * @param[in] size size of an element, in bytes.
+ * @param[in] cmp the comparison routine.
+ * @param[in] params array of parameters to be
+ * passed to the comparison routine, one per thread,
+ * so each thread may use a context of its own.
+ * Must hold WINX_SORT_MAX_THREADS entries. May be NULL.
+ * @param[in] threads number of threads to be used,
+ * zero means one thread per processor.
+ * @return Zero for success, negative value otherwise.
+ * @note The comparison routine must be safe
+ * to be called by several threads at once.
+ */
+int winx_sort(void *base,ULONGLONG n,size_t size,
+    winx_sort_compare cmp,void **params,int threads)
+{
+    sort_task tasks[WINX_SORT_MAX_THREADS];
+    ULONGLONG bounds[WINX_SORT_MAX_THREADS + 1];
+    char *buffer;
+    int i, k, step;
+
+    if(n < 2) return 0;
+
+    if(base == NULL || cmp == NULL){
+        etrace("invalid parameter");
+        return (-1);
+    }
+
+    if(threads <= 0) threads = get_number_of_processors();
+    if(threads > WINX_SORT_MAX_THREADS) threads = WINX_SORT_MAX_THREADS;
+    if(threads < 1 || n < SERIAL_SORT_THRESHOLD) threads = 1;
+
+    buffer = winx_tmalloc((size_t)(n * size));
+    if(buffer == NULL){
+        etrace("cannot allocate %I64u bytes of memory",n * size);
+        return (-1);
+    }
+
+    for(i = 0; i <= threads; i++)
+        bounds[i] = n * i / threads;
+
+    /* sort parts of the array */
+    for(i = 0; i < threads; i++){
+        tasks[i].base = (char *)base;
+        tasks[i].buffer = buffer;
+        tasks[i].size = size;
+        tasks[i].first = bounds[i];
+        tasks[i].middle = tasks[i].last = bounds[i + 1];
+        tasks[i].merge = 0;
+        tasks[i].cmp = cmp;
+        tasks[i].param = params ? params[i] : NULL;
+    }
+    run_tasks(tasks,threads);
+
+    /* merge them pairwise */
+    for(step = 1; step < threads; step *= 2){
+        for(i = 0, k = 0; i + step < threads; i += 2 * step, k++){
+            tasks[k].base = (char *)base;
+            tasks[k].buffer = buffer;
+            tasks[k].size = size;
+            tasks[k].first = bounds[i];
+            tasks[k].middle = bounds[i + step];
+            tasks[k].last = bounds[min(i + 2 * step,threads)];
+            tasks[k].merge = 1;
+            tasks[k].cmp = cmp;
+            tasks[k].param = params ? params[k] : NULL;
+        }
+        run_tasks(tasks,k);
+    }
+
+    winx_free(buffer);
+    return 0;
+}
+
+/** @} */
@@ -204,6 +204,32 @@ int winx_wcsicmp(const wchar_t *s1, const wchar_t *s2)
     return result;
 }
 
+/**
+ * @brief Builds a sort key of a string.
+ * @details The key consists of the first four
+ * characters of the string converted to lowercase,
+ * so keys of different strings compare the same way
+ * as winx_wcsicmp compares the strings themselves.
+ * Strings having equal keys need to be compared by
+ * winx_wcsicmp to figure out the order.
+ * @param[in] s the string.
+ * @return The key.
+ */
+ULONGLONG winx_wcsi_sort_key(const wchar_t *s)
+{
+    ULONGLONG key = 0;
+    int i;
+    
+    for(i = 0; i < 4; i++){
+        key <<= 16;
+        if(s && *s){
+            key |= (unsigned short)fast_towlower(*s);
+            s++;
+        }
+    }
+    return key;
+}
+
 /**
  * @brief Case insensitive version of wcsstr.
  * @details This routine doesn't depend
@@ -27,6 +27,17 @@
 #include "ntndk.h"
 #include "zenwinx.h"
 
+#if defined(_M_AMD64) || defined(__x86_64__)
+/* SSE2 is always available on x64 processors */
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if !defined(__GNUC__)
+#include <intrin.h>
+#pragma intrinsic(_BitScanForward)
+#endif
+
 /**
  * @internal
  * @brief Opens the root directory of a volume.
@@ -466,14 +477,191 @@ static int compare_regions(const void *prb_a, const void *prb_b, void *prb_param
     return 1;
 }
 
+/**
+ * @internal
+ * @brief Keeps the length of the largest
+ * region of each subtree in its root item.
+ */
+static void augment_region(struct prb_node *node, void *prb_param)
+{
+    winx_volume_region *rgn, *child;
+    int i;
+    
+    rgn = (winx_volume_region *)node->prb_data;
+    rgn->max_length = rgn->length;
+    for(i = 0; i < 2; i++){
+        if(node->prb_link[i]){
+            child = (winx_volume_region *)node->prb_link[i]->prb_data;
+            if(child->max_length > rgn->max_length)
+                rgn->max_length = child->max_length;
+        }
+    }
+}
+
 /**
  * @internal
  * @brief Releases memory allocated for a single tree item.
+ * @note The parameter of the tree is the arena
+ * the regions are allocated from.
  */
 static void free_item(void *prb_item, void *prb_param)
 {
-    winx_volume_region *rgn = (winx_volume_region *)prb_item;
-    winx_free(rgn);
+    winx_arena_free((winx_arena *)prb_param,prb_item,sizeof(winx_volume_region));
+}
+
+/**
+ * @internal
+ * @brief Allocates a region for the specified tree.
+ */
+static winx_volume_region *alloc_region(struct prb_table *regions)
+{
+    return winx_arena_alloc((winx_arena *)regions->prb_param,sizeof(winx_volume_region));
+}
+
+/**
+ * @internal
+ * @brief Releases a region of the specified tree.
+ */
+static void free_region(struct prb_table *regions,winx_volume_region *rgn)
+{
+    free_item(rgn,regions->prb_param);
+}
+
+/*
+* Regions found by winx_get_free_volume_regions
+* come in ascending order, so they get collected
+* into an array and linked into the tree at once.
+*/
+typedef struct _region_array {
+    void **items;   /* the regions found */
+    size_t count;   /* number of the regions */
+    size_t size;    /* capacity of the array */
+} region_array;
+
+/**
+ * @internal
+ * @brief Appends a region to the array
+ * of regions found on the volume.
+ * @note Inserts the region directly into
+ * the tree when the array cannot grow.
+ */
+static void append_region(struct prb_table *regions,
+    region_array *a,winx_volume_region *rgn)
+{
+    void **items;
+    size_t size;
+    
+    if(a->count == a->size){
+        size = a->size ? a->size * 2 : 1024;
+        items = winx_tmalloc(size * sizeof(void *));
+        if(items == NULL){
+            (void)prb_insert(regions,(void *)rgn);
+            return;
+        }
+        if(a->count) memcpy(items,a->items,a->count * sizeof(void *));
+        winx_free(a->items);
+        a->items = items;
+        a->size = size;
+    }
+    a->items[a->count ++] = rgn;
+}
+
+/**
+ * @internal
+ * @brief Links regions of the array into
+ * the tree of regions, in linear time.
+ */
+static void link_regions(struct prb_table *regions,region_array *a)
+{
+    size_t i;
+    int result;
+    
+    if(a->count){
+        if(regions->prb_root == NULL){
+            result = prb_build_from_sorted(regions,a->items,a->count);
+        } else {
+            result = prb_merge_sorted(regions,a->items,a->count);
+        }
+        if(result != 0){
+            /* insert them one by one; duplicates get ignored */
+            for(i = 0; i < a->count; i++)
+                (void)prb_insert(regions,a->items[i]);
+        }
+    }
+    winx_free(a->items);
+    a->items = NULL;
+    a->count = a->size = 0;
+}
+
+/**
+ * @internal
+ * @brief Returns index of the least
+ * significant bit set in a nonzero word.
+ */
+static int count_trailing_zeros(ULONGLONG word)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#else
+    unsigned long index;
+    
+    if(_BitScanForward(&index,(ULONG)word))
+        return (int)index;
+    (void)_BitScanForward(&index,(ULONG)(word >> 32));
+    return (int)index + 32;
+#endif
+}
+
+/**
+ * @internal
+ * @brief Searches the volume bitmap for the next
+ * cluster being either free or in use.
+ * @param[in] map the volume bitmap, one bit per cluster,
+ * the least significant bit of the first byte is
+ * responsible for the first cluster.
+ * @param[in] i index of the cluster to start from.
+ * @param[in] n total number of clusters in the bitmap.
+ * @param[in] used nonzero value forces to search
+ * for clusters in use, zero - for free clusters.
+ * @return Index of the cluster found; n indicates
+ * that there are no such clusters in the bitmap.
+ * @note The bitmap gets scanned 64 bits at a time,
+ * on x64 processors uniform 128-bit blocks are skipped
+ * by SSE2 instructions.
+ */
+static ULONGLONG find_next_cluster(const ULONGLONG *map,
+        ULONGLONG i,ULONGLONG n,int used)
+{
+    ULONGLONG inv = used ? 0 : (ULONGLONG)-1;
+    ULONGLONG k, words, word;
+#ifdef USE_SSE2
+    __m128i pattern = _mm_set1_epi32((int)inv);
+#endif
+    
+    if(i >= n) return n;
+    k = i / 64, words = (n + 63) / 64;
+    
+    /* the first word may be incomplete */
+    word = (map[k] ^ inv) & ((ULONGLONG)-1 << (i % 64));
+    while(word == 0){
+        if(++k >= words) return n;
+#ifdef USE_SSE2
+        if(!(k & 1)){
+            while(k + 2 <= words){
+                __m128i block = _mm_loadu_si128((const __m128i *)(map + k));
+                if(_mm_movemask_epi8(_mm_cmpeq_epi8(block,pattern)) != 0xffff)
+                    break;
+                k += 2;
+            }
+            if(k >= words) return n;
+        }
+#endif
+        word = map[k] ^ inv;
+    }
+    
+    /* bits beyond the end of the bitmap are meaningless */
+    i = k * 64 + count_trailing_zeros(word);
+    return min(i,n);
 }
 
 /**
@@ -488,6 +676,10 @@ static void free_item(void *prb_item, void *prb_param)
  * the scan terminates immediately.
  * @param[in] user_defined_data pointer to data
  * to be passed to the registered callback.
+ * @param[in] arena the arena the regions get
+ * allocated from; NULL forces to use the global
+ * heap. It becomes the parameter of the tree
+ * and must outlive it.
  * @return Binary tree of the free space
  * regions, NULL indicates failure.
  * @note
@@ -509,7 +701,7 @@ static void free_item(void *prb_item, void *prb_param)
  * if(winx_get_volume_information(volume_letter,&v) == 0){
  *     // enumerate all free regions on the volume
  *     free_regions = winx_get_free_volume_regions(
- *         volume_letter,0,v.total_clusters,0,NULL,NULL);
+ *         volume_letter,0,v.total_clusters,0,NULL,NULL,NULL);
  *     if(free_regions){
  *         // loop through the list of regions
  *         prb_t_init(&t,free_regions);
@@ -526,27 +718,41 @@ static void free_item(void *prb_item, void *prb_param)
  */
 struct prb_table *winx_get_free_volume_regions(char volume_letter,
         ULONGLONG start_lcn, ULONGLONG length, int flags,
-        volume_region_callback cb, void *user_defined_data)
+        volume_region_callback cb, void *user_defined_data,
+        winx_arena *arena)
 {
     struct prb_table *regions = NULL;
     winx_volume_region *rgn = NULL;
+    region_array found = { NULL, 0, 0 };
     BITMAP_DESCRIPTOR *bitmap;
     #define LLINVALID   ((ULONGLONG) -1)
-    #define BITMAPBYTES 4096
-    #define BITMAPSIZE  (BITMAPBYTES + 2 * sizeof(ULONGLONG))
-    /* bit shifting array for efficient processing of the bitmap */
-    unsigned char bitshift[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    /* up to 4 MB of the bitmap (32M clusters) per request */
+    #define MAX_BITMAPBYTES (4 * 1024 * 1024)
+    ULONGLONG bitmap_bytes;
+    size_t bitmap_size;
+    const ULONGLONG *map;
     WINX_FILE *f;
-    ULONGLONG i, n, start, next, free_rgn_start;
+    ULONGLONG i, j, n, start, next, free_rgn_start;
     IO_STATUS_BLOCK iosb;
     NTSTATUS status;
 
     /* ensure that it will work on w2k */
     volume_letter = winx_toupper(volume_letter);
     
+    /*
+    * The bitmap returned starts at LCN rounded down
+    * to a multiple of eight, so one more byte may be
+    * necessary; keep the size 16-byte aligned.
+    */
+    bitmap_bytes = length / 8 + 2;
+    if(bitmap_bytes > MAX_BITMAPBYTES) bitmap_bytes = MAX_BITMAPBYTES;
+    bitmap_bytes = (bitmap_bytes + 15) & ~(ULONGLONG)15;
+    bitmap_size = (size_t)bitmap_bytes + 2 * sizeof(ULONGLONG);
+    
     /* allocate memory */
-    bitmap = winx_malloc(BITMAPSIZE);
-    regions = prb_create(compare_regions,NULL,NULL);
+    bitmap = winx_malloc(bitmap_size);
+    map = (const ULONGLONG *)bitmap->Map;
+    regions = winx_create_volume_regions(arena);
     
     /* open the volume */
     f = winx_vopen(volume_letter);
@@ -560,10 +766,10 @@ struct prb_table *winx_get_free_volume_regions(char volume_letter,
     next = start_lcn, free_rgn_start = LLINVALID;
     do {
         /* get next portion of the bitmap */
-        memset(bitmap,0,BITMAPSIZE);
+        memset(bitmap,0,bitmap_size);
         status = NtFsControlFile(winx_fileno(f),NULL,NULL,0,&iosb,
             FSCTL_GET_VOLUME_BITMAP,&next,sizeof(ULONGLONG),bitmap,
-            BITMAPSIZE);
+            (ULONG)bitmap_size);
         if(NT_SUCCESS(status)){
             NtWaitForSingleObject(winx_fileno(f),FALSE,NULL);
             status = iosb.Status;
@@ -572,6 +778,7 @@ struct prb_table *winx_get_free_volume_regions(char volume_letter,
             strace(status,"cannot get volume bitmap");
             winx_fclose(f);
             winx_free(bitmap);
+            link_regions(regions,&found);
             if(flags & WINX_GVR_ALLOW_PARTIAL_SCAN){
                 return regions;
             } else {
@@ -582,21 +789,22 @@ struct prb_table *winx_get_free_volume_regions(char volume_letter,
         
         /* scan through the returned bitmap info */
         start = bitmap->StartLcn;
-        n = min(BITMAPBYTES * 8, bitmap->ClustersToEndOfVol);
+        n = min(bitmap_bytes * 8, bitmap->ClustersToEndOfVol);
         if(next - start + length < n) n = next - start + length;
-        for(i = next - start; i < n; i++){
-            if(!(bitmap->Map[ i/8 ] & bitshift[ i % 8 ])){
-                /* cluster is free */
-                if(free_rgn_start == LLINVALID)
-                    free_rgn_start = start + i;
+        for(i = next - start; i < n; i = j){
+            if(free_rgn_start == LLINVALID){
+                /* skip clusters in use */
+                j = find_next_cluster(map,i,n,0);
+                if(j < n) free_rgn_start = start + j;
             } else {
-                /* cluster isn't free */
-                if(free_rgn_start != LLINVALID){
+                /* skip free clusters */
+                j = find_next_cluster(map,i,n,1);
+                if(j < n){
                     /* add free region to the tree */
-                    rgn = winx_malloc(sizeof(winx_volume_region));
+                    rgn = alloc_region(regions);
                     rgn->lcn = free_rgn_start;
-                    rgn->length = start + i - free_rgn_start;
-                    (void)prb_insert(regions,(void *)rgn);
+                    rgn->length = start + j - free_rgn_start;
+                    append_region(regions,&found,rgn);
                     if(cb != NULL){
                         if(cb(rgn,user_defined_data))
                             goto done;
@@ -616,10 +824,10 @@ struct prb_table *winx_get_free_volume_regions(char volume_letter,
 
     if(free_rgn_start != LLINVALID){
         /* add free region to the tree */
-        rgn = winx_malloc(sizeof(winx_volume_region));
+        rgn = alloc_region(regions);
         rgn->lcn = free_rgn_start;
         rgn->length = start + i - free_rgn_start;
-        (void)prb_insert(regions,(void *)rgn);
+        append_region(regions,&found,rgn);
         if(cb != NULL){
             if(cb(rgn,user_defined_data))
                 goto done;
@@ -631,9 +839,24 @@ done:
     /* cleanup */
     winx_fclose(f);
     winx_free(bitmap);
+    link_regions(regions,&found);
     return regions;
 }
 
+/**
+ * @brief Creates an empty tree of regions.
+ * @param[in] arena the arena the regions
+ * get allocated from; NULL forces to use
+ * the global heap.
+ * @return The tree, NULL indicates failure.
+ * @note The tree must be released by
+ * winx_release_free_volume_regions.
+ */
+struct prb_table *winx_create_volume_regions(winx_arena *arena)
+{
+    return prb_create_augmented(compare_regions,arena,NULL,augment_region);
+}
+
 /**
  * @brief Adds a region to the
  * specified tree of regions.
@@ -655,7 +878,7 @@ winx_volume_region *winx_add_volume_region(struct prb_table *regions,
     if(regions == NULL || length == 0) return NULL;
     
     /* allocate memory */
-    rgn = winx_malloc(sizeof(winx_volume_region));
+    rgn = alloc_region(regions);
     
     /* try to insert the region */
     rgn->lcn = lcn, rgn->length = length;
@@ -663,9 +886,11 @@ winx_volume_region *winx_add_volume_region(struct prb_table *regions,
     
     if(item != rgn){
         /* a duplicate found */
-        winx_free(rgn); rgn = item;
-        if(rgn->length < length)
+        free_region(regions,rgn); rgn = item;
+        if(rgn->length < length){
             rgn->length = length;
+            prb_reaugment(regions,rgn);
+        }
     } else {
         /*
         * The region inserted successfully,
@@ -675,10 +900,12 @@ winx_volume_region *winx_add_volume_region(struct prb_table *regions,
         prev = prb_t_prev(&t);
         if(prev){
             if(lcn <= prev->lcn + prev->length){
-                if(lcn + length > prev->lcn + prev->length)
+                if(lcn + length > prev->lcn + prev->length){
                     prev->length = lcn + length - prev->lcn;
+                    prb_reaugment(regions,prev);
+                }
                 prb_delete(regions,rgn);
-                winx_free(rgn);
+                free_region(regions,rgn);
                 rgn = prev;
             }
         }
@@ -701,15 +928,16 @@ winx_volume_region *winx_add_volume_region(struct prb_table *regions,
         /* the region hits/overlaps the inserted one */
         if(next->lcn + next->length > rgn->lcn + rgn->length){
             rgn->length = next->lcn + next->length - rgn->lcn;
+            prb_reaugment(regions,rgn);
             prb_delete(regions,next);
-            winx_free(next);
+            free_region(regions,next);
             break;
         }
         
         /* the region is inside the inserted one */
         prb_t_prev(&t);
         prb_delete(regions,next);
-        winx_free(next);
+        free_region(regions,next);
     }
 
     return rgn;
@@ -749,24 +977,153 @@ void winx_sub_volume_region(struct prb_table *regions,
         if(lcn + length == rgn->lcn + rgn->length){
             /* cut off the end of the region */
             rgn->length -= length;
+            prb_reaugment(regions,rgn);
         } else {
             /* cut off middle part of the region */
-            add_rgn = winx_malloc(sizeof(winx_volume_region));
+            add_rgn = alloc_region(regions);
             add_rgn->lcn = lcn + length;
             add_rgn->length = rgn->lcn + rgn->length - add_rgn->lcn;
             (void)prb_insert(regions,(void *)add_rgn);
             rgn->length = lcn - rgn->lcn;
+            prb_reaugment(regions,rgn);
         }
     } else {
         if(lcn + length == rgn->lcn + rgn->length){
             /* remove the entire region */
             prb_delete(regions,rgn);
-            winx_free(rgn);
+            free_region(regions,rgn);
         } else {
             /* cut off the beginning of the region */
             rgn->lcn += length; rgn->length -= length;
+            prb_reaugment(regions,rgn);
+        }
+    }
+}
+
+/**
+ * @internal
+ * @brief winx_find_first_volume_region helper.
+ */
+static winx_volume_region *find_first_region(struct prb_node *node,
+        ULONGLONG min_lcn,ULONGLONG min_length)
+{
+    winx_volume_region *rgn, *found;
+    
+    while(node){
+        rgn = (winx_volume_region *)node->prb_data;
+        /* skip subtrees having no regions long enough */
+        if(rgn->max_length < min_length) return NULL;
+        if(rgn->lcn >= min_lcn){
+            found = find_first_region(node->prb_link[0],min_lcn,min_length);
+            if(found) return found;
+            if(rgn->length >= min_length) return rgn;
+        }
+        node = node->prb_link[1];
+    }
+    return NULL;
+}
+
+/**
+ * @internal
+ * @brief winx_find_last_volume_region helper.
+ */
+static winx_volume_region *find_last_region(struct prb_node *node,
+        ULONGLONG min_lcn,ULONGLONG max_lcn,ULONGLONG min_length)
+{
+    winx_volume_region *rgn, *found;
+    
+    while(node){
+        rgn = (winx_volume_region *)node->prb_data;
+        /* skip subtrees having no regions long enough */
+        if(rgn->max_length < min_length) return NULL;
+        if(rgn->lcn + rgn->length <= max_lcn){
+            found = find_last_region(node->prb_link[1],min_lcn,max_lcn,min_length);
+            if(found) return found;
+            /* all the preceding regions are before min_lcn as well */
+            if(rgn->lcn < min_lcn) return NULL;
+            if(rgn->length >= min_length) return rgn;
+        }
+        node = node->prb_link[0];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Searches for the first region
+ * long enough in the specified tree of regions.
+ * @param[in] regions the tree of regions
+ * produced by winx_get_free_volume_regions.
+ * @param[in] min_lcn minimum LCN of the region.
+ * @param[in] min_length minimum length
+ * of the region, in clusters.
+ * @return The region starting at or after
+ * min_lcn, NULL indicates that nothing found.
+ * @note Takes O(log n) time since each item
+ * of the tree keeps the length of the largest
+ * region of its subtree.
+ */
+winx_volume_region *winx_find_first_volume_region(struct prb_table *regions,
+        ULONGLONG min_lcn,ULONGLONG min_length)
+{
+    if(regions == NULL) return NULL;
+    return find_first_region(regions->prb_root,min_lcn,min_length);
+}
+
+/**
+ * @brief Searches for the last region
+ * long enough in the specified tree of regions.
+ * @param[in] regions the tree of regions
+ * produced by winx_get_free_volume_regions.
+ * @param[in] min_lcn minimum LCN of the region.
+ * @param[in] max_lcn the region must end
+ * at this LCN or before it.
+ * @param[in] min_length minimum length
+ * of the region, in clusters.
+ * @return The region found, NULL
+ * indicates that nothing found.
+ * @note Takes O(log n) time, as
+ * winx_find_first_volume_region does.
+ */
+winx_volume_region *winx_find_last_volume_region(struct prb_table *regions,
+        ULONGLONG min_lcn,ULONGLONG max_lcn,ULONGLONG min_length)
+{
+    if(regions == NULL) return NULL;
+    return find_last_region(regions->prb_root,min_lcn,max_lcn,min_length);
+}
+
+/**
+ * @brief Searches for the largest
+ * region in the specified tree of regions.
+ * @param[in] regions the tree of regions
+ * produced by winx_get_free_volume_regions.
+ * @return The largest region, NULL
+ * indicates that the tree is empty.
+ * If there are a few regions of the
+ * same length, the first one is returned.
+ * @note Takes O(log n) time; the length of the
+ * largest region is available in the root item.
+ */
+winx_volume_region *winx_find_largest_volume_region(struct prb_table *regions)
+{
+    struct prb_node *node;
+    winx_volume_region *rgn, *child;
+    
+    if(regions == NULL) return NULL;
+    
+    node = regions->prb_root;
+    while(node){
+        rgn = (winx_volume_region *)node->prb_data;
+        if(node->prb_link[0]){
+            child = (winx_volume_region *)node->prb_link[0]->prb_data;
+            if(child->max_length == rgn->max_length){
+                node = node->prb_link[0];
+                continue;
+            }
         }
+        if(rgn->length == rgn->max_length) return rgn;
+        node = node->prb_link[1];
     }
+    return NULL;
 }
 
 /**
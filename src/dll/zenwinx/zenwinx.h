@@ -143,12 +143,21 @@ int winx_delete_file(const wchar_t *filename);
 void *winx_get_file_contents(const wchar_t *filename,size_t *bytes_read);
 void winx_release_file_contents(void *contents);
 
+/* see the mem.c section below */
+struct _winx_arena;
+
 /* ftw.c */
 /* winx_ftw flags */
 #define WINX_FTW_RECURSIVE              0x1 /* scan all subdirectories recursively */
 #define WINX_FTW_DUMP_FILES             0x2 /* fill winx_file_disposition structures */
 #define WINX_FTW_ALLOW_PARTIAL_SCAN     0x4 /* admit partially gathered information */
 #define WINX_FTW_SKIP_RESIDENT_STREAMS  0x8 /* skip files of zero length and files located inside MFT */
+#define WINX_FTW_COMPACT_PATHS          0x10 /* keep references to parent directories instead of full paths */
+#define WINX_FTW_MFT_QUEUE_DEPTH_MASK   0xf00 /* number of MFT chunks being read/analyzed simultaneously, NTFS only */
+#define WINX_FTW_MFT_QUEUE_DEPTH(n)     (((n) << 8) & WINX_FTW_MFT_QUEUE_DEPTH_MASK)
+#define WINX_FTW_THREADS_MASK           0xf000 /* number of threads listing directories in advance, general purpose API only */
+#define WINX_FTW_THREADS(n)             (((n) << 12) & WINX_FTW_THREADS_MASK)
+#define WINX_FTW_MAX_THREADS            15
 
 #define is_readonly(f)            ((f)->flags & FILE_ATTRIBUTE_READONLY)
 #define is_hidden(f)              ((f)->flags & FILE_ATTRIBUTE_HIDDEN)
@@ -192,14 +201,28 @@ typedef struct _winx_file_internal_info {
 * All the file access times are in the standard time format.
 * That is the number of 100-nanosecond intervals since January 1, 1601.
 */
+/*
+* A directory of the compact path storage,
+* see WINX_FTW_COMPACT_PATHS. Nodes and names
+* are shared by all the files of the list.
+*/
+typedef struct _winx_path_node {
+    struct _winx_path_node *parent;    /* the parent directory; NULL for the top directory */
+    void *store;                       /* the storage the node belongs to */
+    wchar_t *name;                     /* the interned name; the full path for the top directory */
+    unsigned long length;              /* length of the full path, in characters */
+} winx_path_node;
+
 typedef struct _winx_file_info {
     struct _winx_file_info *next;      /* pointer to the next item */
     struct _winx_file_info *prev;      /* pointer to the previous item */
     wchar_t *name;                     /* the name of the file */
-    wchar_t *path;                     /* the full native path */
+    wchar_t *path;                     /* the full native path; NULL for compact paths until requested */
+    winx_path_node *parent;            /* the parent directory for compact paths, NULL otherwise */
     unsigned long flags;               /* a combination of FILE_ATTRIBUTE_xxx flags defined in winnt.h */
     winx_file_disposition disp;        /* information about file fragments and their disposition */
     unsigned long user_defined_flags;  /* a combination of flags defined by the caller */
+    void *user_defined_data;           /* pointer to data defined by the caller */
     winx_file_internal_info internal;  /* internal information used by ftw_scan_disk support routines */
     ULONGLONG creation_time;           /* the file creation time */
     ULONGLONG last_modification_time;  /* the time of the last file modification */
@@ -211,15 +234,21 @@ typedef void (*ftw_progress_callback)(winx_file_info *f,void *user_defined_data)
 typedef int  (*ftw_terminator)(void *user_defined_data);
 
 winx_file_info *winx_ftw(wchar_t *path, int flags,
-        ftw_filter_callback fcb, ftw_progress_callback pcb, ftw_terminator t,void *user_defined_data);
+        ftw_filter_callback fcb, ftw_progress_callback pcb, ftw_terminator t,void *user_defined_data,
+        struct _winx_arena *arena);
 
 winx_file_info *winx_scan_disk(char volume_letter, int flags,
-        ftw_filter_callback fcb,ftw_progress_callback pcb, ftw_terminator t,void *user_defined_data);
+        ftw_filter_callback fcb,ftw_progress_callback pcb, ftw_terminator t,void *user_defined_data,
+        struct _winx_arena *arena);
 
-void winx_ftw_release(winx_file_info *filelist);
-#define winx_scan_disk_release(f) winx_ftw_release(f)
+void winx_ftw_release(winx_file_info *filelist,struct _winx_arena *arena);
 
-int winx_ftw_dump_file(winx_file_info *f,ftw_terminator t,void *user_defined_data);
+int winx_get_file_path_length(winx_file_info *f);
+int winx_get_file_path(winx_file_info *f,wchar_t *buffer,int length);
+wchar_t *winx_file_path(winx_file_info *f);
+#define winx_scan_disk_release(f,a) winx_ftw_release(f,a)
+
+int winx_ftw_dump_file(winx_file_info *f,ftw_terminator t,void *user_defined_data,struct _winx_arena *arena);
 
 #define WINX_OPEN_FOR_DUMP       0x1 /* open for FSCTL_GET_RETRIEVAL_POINTERS */
 #define WINX_OPEN_FOR_BASIC_INFO 0x2 /* open for NtQueryInformationFile(FILE_BASIC_INFORMATION) */
@@ -230,6 +259,85 @@ NTSTATUS winx_defrag_fopen(winx_file_info *f,int action,HANDLE *phandle);
 void winx_defrag_fclose(HANDLE h);
 #endif
 
+/* blockmap.c */
+typedef struct _winx_extent {
+    ULONGLONG vcn;               /* the virtual cluster number */
+    ULONGLONG lcn;               /* the logical cluster number */
+    ULONGLONG length;            /* size of the extent, in clusters */
+    winx_blockmap *block;        /* the block of the list the extent corresponds to */
+} winx_extent;
+
+typedef struct _winx_extent_map {
+    winx_extent *extents;        /* extents in the order of VCNs */
+    unsigned long *lcn_order;    /* indices of the extents in the order of LCNs */
+    unsigned long count;         /* number of extents */
+    unsigned long size;          /* number of extents the arrays can hold */
+    ULONGLONG clusters;          /* total number of clusters */
+    ULONGLONG fragments;         /* total number of fragments */
+} winx_extent_map;
+
+int winx_build_extent_map(winx_blockmap *blockmap,winx_extent_map *map);
+unsigned long winx_find_extent_by_vcn(winx_extent_map *map,ULONGLONG vcn);
+unsigned long winx_find_extent_by_lcn(winx_extent_map *map,ULONGLONG lcn);
+winx_blockmap *winx_get_block_by_vcn(winx_extent_map *map,ULONGLONG vcn);
+void winx_release_extent_map(winx_extent_map *map);
+
+/* bptree.c */
+#define WINX_BPT_LEAF_SIZE  64  /* number of entries a leaf can hold */
+#define WINX_BPT_FANOUT     64  /* number of children an inner node can hold */
+#define WINX_BPT_MAX_HEIGHT 16  /* maximum number of levels of inner nodes */
+
+typedef struct _winx_bpt_entry {
+    ULONGLONG key;               /* the key, usually LCN */
+    void *item;                  /* the item */
+    void *context;               /* data associated with the item */
+    int marked;                  /* nonzero for marked entries */
+} winx_bpt_entry;
+
+typedef struct _winx_bpt_leaf {
+    struct _winx_bpt_leaf *next; /* the next leaf, in the order of keys */
+    struct _winx_bpt_leaf *prev; /* the previous leaf */
+    int count;                   /* number of entries */
+    int marked;                  /* number of marked entries */
+    winx_bpt_entry entries[WINX_BPT_LEAF_SIZE];
+} winx_bpt_leaf;
+
+typedef struct _winx_bpt_node {
+    int count;                   /* number of children */
+    ULONGLONG keys[WINX_BPT_FANOUT];  /* the lowest keys of the children */
+    void *children[WINX_BPT_FANOUT];  /* either inner nodes or leaves */
+    ULONGLONG marked[WINX_BPT_FANOUT];/* number of marked entries of the children */
+} winx_bpt_node;
+
+typedef struct _winx_bptree {
+    void *root;                  /* the root node, NULL for empty trees */
+    int height;                  /* number of levels of inner nodes */
+    ULONGLONG count;             /* number of entries */
+    winx_bpt_leaf *first;        /* the leftmost leaf */
+    winx_bpt_leaf *last;         /* the rightmost leaf */
+} winx_bptree;
+
+typedef struct _winx_bpt_iterator {
+    winx_bpt_leaf *leaf;         /* the current leaf, NULL beyond the tree */
+    int index;                   /* index of the current entry in the leaf */
+} winx_bpt_iterator;
+
+winx_bptree *winx_bpt_create(void);
+int winx_bpt_insert(winx_bptree *tree,ULONGLONG key,void *item,void *context);
+void *winx_bpt_erase(winx_bptree *tree,ULONGLONG key);
+int winx_bpt_build(winx_bptree *tree,winx_bpt_entry *entries,ULONGLONG n);
+winx_bpt_entry *winx_bpt_lower_bound(winx_bptree *tree,ULONGLONG key,winx_bpt_iterator *it);
+winx_bpt_entry *winx_bpt_upper_bound(winx_bptree *tree,ULONGLONG key,winx_bpt_iterator *it);
+int winx_bpt_mark(winx_bptree *tree,ULONGLONG key,int marked);
+winx_bpt_entry *winx_bpt_lower_bound_marked(winx_bptree *tree,ULONGLONG key,winx_bpt_iterator *it);
+winx_bpt_entry *winx_bpt_first(winx_bptree *tree,winx_bpt_iterator *it);
+winx_bpt_entry *winx_bpt_last(winx_bptree *tree,winx_bpt_iterator *it);
+winx_bpt_entry *winx_bpt_next(winx_bpt_iterator *it);
+winx_bpt_entry *winx_bpt_prev(winx_bpt_iterator *it);
+void winx_bpt_destroy(winx_bptree *tree);
+
+/* ftw_exfat.c */
+/* ftw_fat.c */
 /* ftw_ntfs.c */
 /* int64.c */
 /* keyboard.c */
@@ -251,6 +359,9 @@ typedef struct _list_entry {
 list_entry *winx_list_insert(list_entry **phead,list_entry *prev,long size);
 void winx_list_remove(list_entry **phead,list_entry *item);
 void winx_list_destroy(list_entry **phead);
+list_entry *winx_list_insert_ex(list_entry **phead,list_entry *prev,long size,struct _winx_arena *arena);
+void winx_list_remove_ex(list_entry **phead,list_entry *item,long size,struct _winx_arena *arena);
+void winx_list_destroy_ex(list_entry **phead,long size,struct _winx_arena *arena);
 
 /* lock.c */
 int winx_create_lock(wchar_t *name,HANDLE *phandle);
@@ -289,6 +400,33 @@ void winx_heap_free(void *addr);
 typedef int (*winx_killer)(size_t n);
 void winx_set_killer(winx_killer k);
 
+/* arenas serve blocks of up to 256 bytes */
+#define WINX_ARENA_GRANULARITY  16
+#define WINX_ARENA_SIZE_CLASSES 16
+
+/**
+ * @brief A pool of small blocks of memory
+ * released all at once; not thread safe.
+ */
+typedef struct _winx_arena {
+    void *chunks;                               /* list of chunks allocated from the heap */
+    char *top;                                  /* free space of the current chunk */
+    size_t available;                           /* size of the free space, in bytes */
+    void *free_blocks[WINX_ARENA_SIZE_CLASSES]; /* lists of released blocks of each size class */
+    ULONGLONG allocations;                      /* number of blocks allocated */
+    ULONGLONG releases;                         /* number of blocks released */
+    ULONGLONG heap_allocations;                 /* number of calls to the heap */
+    ULONGLONG bytes_in_use;                     /* size of the blocks in use, in bytes */
+    ULONGLONG peak_bytes_in_use;                /* maximum size of the blocks in use, in bytes */
+    ULONGLONG bytes_reserved;                   /* size of the chunks, in bytes */
+} winx_arena;
+
+winx_arena *winx_arena_create(void);
+void *winx_arena_alloc(winx_arena *arena,size_t size);
+void winx_arena_free(winx_arena *arena,void *block,size_t size);
+void winx_arena_merge(winx_arena *arena,winx_arena *src);
+void winx_arena_destroy(winx_arena *arena);
+
 /* misc.c */
 void winx_sleep(int msec);
 
@@ -394,6 +532,14 @@ int winx_print_strings(char **strings,int line_width,
     int max_rows,char *prompt,int divide_to_pages);
 #endif /* _NTNDK_H_ */
 
+/* sort.c */
+#define WINX_SORT_MAX_THREADS 16
+
+typedef int (*winx_sort_compare)(const void *a,const void *b,void *param);
+
+int winx_sort(void *base,ULONGLONG n,size_t size,
+    winx_sort_compare cmp,void **params,int threads);
+
 /* string.c */
 /* reliable _toupper and _tolower analogs */
 char winx_toupper(char c);
@@ -408,6 +554,7 @@ wchar_t *winx_wcslwr(wchar_t *s);
 char *winx_strdup(const char *s);
 wchar_t *winx_wcsdup(const wchar_t *s);
 int winx_wcsicmp(const wchar_t *s1, const wchar_t *s2);
+ULONGLONG winx_wcsi_sort_key(const wchar_t *s);
 wchar_t *winx_wcsistr(const wchar_t *s1, const wchar_t *s2);
 char *winx_stristr(const char *s1, const char *s2);
 int winx_wcsmatch(wchar_t *string, wchar_t *mask, int flags);
@@ -516,16 +663,24 @@ int winx_vflush(char volume_letter);
 #define WINX_GVR_ALLOW_PARTIAL_SCAN  0x1
 
 typedef struct _winx_volume_region {
-    ULONGLONG lcn;    /* the logical cluster number */
-    ULONGLONG length; /* size of the region, in clusters */
+    ULONGLONG lcn;        /* the logical cluster number */
+    ULONGLONG length;     /* size of the region, in clusters */
+    ULONGLONG max_length; /* length of the largest region in the subtree; maintained by the tree */
 } winx_volume_region;
 
 typedef int (*volume_region_callback)(winx_volume_region *rgn,void *user_defined_data);
 
 struct prb_table *winx_get_free_volume_regions(char volume_letter,
-        ULONGLONG start_lcn,ULONGLONG length,int flags,volume_region_callback cb,void *user_defined_data);
+        ULONGLONG start_lcn,ULONGLONG length,int flags,volume_region_callback cb,void *user_defined_data,
+        winx_arena *arena);
+struct prb_table *winx_create_volume_regions(winx_arena *arena);
 winx_volume_region *winx_add_volume_region(struct prb_table *regions,ULONGLONG lcn,ULONGLONG length);
 void winx_sub_volume_region(struct prb_table *regions,ULONGLONG lcn,ULONGLONG length);
+winx_volume_region *winx_find_first_volume_region(struct prb_table *regions,
+        ULONGLONG min_lcn,ULONGLONG min_length);
+winx_volume_region *winx_find_last_volume_region(struct prb_table *regions,
+        ULONGLONG min_lcn,ULONGLONG max_lcn,ULONGLONG min_length);
+winx_volume_region *winx_find_largest_volume_region(struct prb_table *regions);
 void winx_release_free_volume_regions(struct prb_table *regions);
 
 /* zenwinx.c */
@@ -539,6 +694,13 @@ void winx_shutdown(void);
 /* Red-black binary trees with parent pointers */
 #include "prb.h"
 
+/* mem.c: pooled binary trees */
+struct prb_table *winx_prb_create_pooled(prb_comparison_func *compare,
+    void *param,size_t item_size);
+void *winx_prb_alloc_item(struct prb_table *tree);
+void winx_prb_free_item(struct prb_table *tree,void *item);
+void winx_prb_destroy_pooled(struct prb_table *tree);
+
 #if defined(__cplusplus)
 }
 #endif
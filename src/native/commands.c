@@ -120,7 +120,7 @@ static int list_installed_man_pages(int argc,wchar_t **argv,wchar_t **envp)
     /* try to get the list of installed man pages through winx_ftw call */
     _snwprintf(path,MAX_PATH,L"\\??\\%ws\\man",instdir);
     path[MAX_PATH] = 0;
-    filelist = winx_ftw(path,0,NULL,NULL,man_listing_terminator,NULL);
+    filelist = winx_ftw(path,0,NULL,NULL,man_listing_terminator,NULL,NULL);
     if(filelist){
         winx_printf("Available Manual Pages:\n");
         for(file = filelist->prev, column = 0; file; file = file->prev){
@@ -137,7 +137,7 @@ static int list_installed_man_pages(int argc,wchar_t **argv,wchar_t **envp)
             if(file->prev == filelist->prev) break;
         }
         winx_printf("\n");
-        winx_ftw_release(filelist);
+        winx_ftw_release(filelist,NULL);
     } else {
         winx_printf("Available Command Manuals:\n");
         /* cycle through names of existing commands */